@@ -0,0 +1,234 @@
+# The virtio-blk device at 0x10001000 on the image runelf -disk attaches,
+# 64 KiB where byte i is (i + i / 512) & 0xff: the identification and config
+# registers, the status handshake and queue setup, then reads, a write that
+# reads back, a request past the end, a malformed one, flush, get-id and an
+# unknown type, and a reset. It writes sector 5, so run-tests.sh gives it a
+# scratch image. Exits with exit_group 0, or the number of the check that
+# failed, 90 when the device did not complete a request.
+  .globl _start
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+.macro WREG off, val
+  li t1, \val
+  sw t1, \off(s0)
+.endm
+.equ DESC, 0x300000
+.equ AVAIL, 0x301000
+.equ USED, 0x302000
+.equ HDR, 0x303000
+.equ BUF, 0x304000
+.equ STATUS, 0x305000
+# request type a0, sector a1, data len a2 (0 for none), data flags a3; returns status in a0, used len in a1
+req:
+  li t1, HDR
+  sw a0, 0(t1)
+  sw zero, 4(t1)
+  sw a1, 8(t1)
+  sw zero, 12(t1)
+  li t2, DESC
+  sw t1, 0(t2)
+  sw zero, 4(t2)
+  li t3, 16
+  sw t3, 8(t2)
+  li t3, 1
+  sh t3, 12(t2)
+  li t3, 1
+  beqz a2, 1f
+  sh t3, 14(t2)
+  li t1, BUF
+  sw t1, 16(t2)
+  sw zero, 20(t2)
+  sw a2, 24(t2)
+  ori t4, a3, 1
+  sh t4, 28(t2)
+  li t3, 2
+  sh t3, 30(t2)
+1: slli t4, t3, 4
+  add t4, t4, t2
+  li t1, STATUS
+  li t5, 0xff
+  sb t5, 0(t1)
+  sw t1, 0(t4)
+  sw zero, 4(t4)
+  li t5, 1
+  sw t5, 8(t4)
+  li t5, 2
+  sh t5, 12(t4)
+  # avail ring[idx % 8] = 0, idx++
+  li t1, AVAIL
+  lhu t2, 2(t1)
+  andi t3, t2, 7
+  slli t3, t3, 1
+  add t3, t3, t1
+  sh zero, 4(t3)
+  addi t2, t2, 1
+  sh t2, 2(t1)
+  sw zero, 0x50(s0)
+  # used idx follows
+  li t1, USED
+  lhu t3, 2(t1)
+  sub t0, t3, t2
+  li t6, 90
+  bnez t0, fail
+  addi t2, t2, -1
+  andi t2, t2, 7
+  slli t2, t2, 3
+  add t2, t2, t1
+  lw a1, 8(t2)
+  li t1, STATUS
+  lbu a0, 0(t1)
+  ret
+_start:
+  li s0, 0x10001000
+  lw t1, 0(s0)
+  li t2, 0x74726976
+  sub t0, t1, t2
+  CHECK 1
+  lw t1, 4(s0)
+  addi t0, t1, -2
+  CHECK 2
+  lw t1, 8(s0)
+  addi t0, t1, -2
+  CHECK 3
+  # capacity 128 sectors, blk_size 512
+  lw t1, 0x100(s0)
+  addi t0, t1, -128
+  CHECK 4
+  lw t0, 0x104(s0)
+  CHECK 5
+  lw t1, 0x114(s0)
+  addi t0, t1, -512
+  CHECK 6
+  WREG 0x70, 3
+  WREG 0x14, 1
+  lw t1, 0x10(s0)
+  addi t0, t1, -1
+  CHECK 7
+  WREG 0x24, 1
+  WREG 0x20, 1
+  WREG 0x70, 11
+  WREG 0x30, 0
+  lw t1, 0x34(s0)
+  sltiu t0, t1, 8
+  CHECK 8
+  WREG 0x38, 8
+  WREG 0x80, DESC
+  WREG 0x90, AVAIL
+  WREG 0xa0, USED
+  WREG 0x44, 1
+  WREG 0x70, 15
+  # read sectors 3 and 4
+  li a0, 0
+  li a1, 3
+  li a2, 1024
+  li a3, 2
+  call req
+  mv t0, a0
+  CHECK 9
+  li t1, 1025
+  sub t0, a1, t1
+  CHECK 10
+  # image byte i is (i + i / 512) & 0xff
+  li t1, BUF
+  lbu t2, 0(t1)
+  li t3, (1536 + 3) & 0xff
+  sub t0, t2, t3
+  CHECK 11
+  lbu t2, 1023(t1)
+  li t3, (2559 + 4) & 0xff
+  sub t0, t2, t3
+  CHECK 12
+  lw t1, 0x60(s0)
+  addi t0, t1, -1
+  CHECK 13
+  WREG 0x64, 1
+  lw t0, 0x60(s0)
+  CHECK 14
+  # write 0x5a to sector 5
+  li t1, BUF
+  li t2, 512
+  li t3, 0x5a
+1: sb t3, 0(t1)
+  addi t1, t1, 1
+  addi t2, t2, -1
+  bnez t2, 1b
+  li a0, 1
+  li a1, 5
+  li a2, 512
+  li a3, 0
+  call req
+  mv t0, a0
+  CHECK 15
+  addi t0, a1, -1
+  CHECK 16
+  # reads back
+  li t1, BUF
+  sb zero, 0(t1)
+  sb zero, 511(t1)
+  li a0, 0
+  li a1, 5
+  li a2, 512
+  li a3, 2
+  call req
+  mv t0, a0
+  CHECK 17
+  li t1, BUF
+  lbu t2, 511(t1)
+  addi t0, t2, -0x5a
+  CHECK 18
+  # past the end
+  li a0, 0
+  li a1, 127
+  li a2, 1024
+  li a3, 2
+  call req
+  addi t0, a0, -1
+  CHECK 19
+  # write with a device-writable buffer is malformed
+  li a0, 1
+  li a1, 5
+  li a2, 512
+  li a3, 2
+  call req
+  addi t0, a0, -1
+  CHECK 20
+  li a0, 4
+  li a1, 0
+  li a2, 0
+  call req
+  mv t0, a0
+  CHECK 21
+  li a0, 8
+  li a1, 0
+  li a2, 20
+  li a3, 2
+  call req
+  mv t0, a0
+  CHECK 22
+  addi t0, a1, -21
+  CHECK 23
+  li t1, BUF
+  lbu t2, 0(t1)
+  addi t0, t2, -'r'
+  CHECK 24
+  li a0, 99
+  li a1, 0
+  li a2, 0
+  call req
+  addi t0, a0, -2
+  CHECK 25
+  # reset
+  WREG 0x70, 0
+  lw t0, 0x70(s0)
+  CHECK 26
+  lw t0, 0x44(s0)
+  CHECK 27
+  li a0, 0
+  li a7, 94
+  ecall
+fail:
+  mv a0, t6
+  li a7, 94
+  ecall
@@ -0,0 +1,218 @@
+# F and D: arithmetic, fused multiply-add, conversions and their rounding
+# modes, fflags, frm and fcsr, min/max and signaling NaNs, fclass, NaN
+# boxing of singles, the loads and stores the C extension compresses and a
+# loop. Prints the guest's assembly, which exits 0, or the number of the
+# check that failed. Expected values come from the host's IEEE arithmetic.
+import struct
+def d(x): return struct.unpack('<Q', struct.pack('<d', x))[0]
+def s(x): return struct.unpack('<I', struct.pack('<f', x))[0]
+NAN_D=0x7ff8000000000000; NAN_S=0x7fc00000
+SNAN_D=0x7ff4000000000000; INF=d(float('inf')); NINF=d(float('-inf'))
+out=[]
+A=out.append
+A('''# generated by rvvm-fd.py
+  .text
+  .globl _start
+.macro LD_D freg, hi, lo
+  li t0, \\lo
+  sw t0, 0(sp)
+  li t0, \\hi
+  sw t0, 4(sp)
+  fld \\freg, 0(sp)
+.endm
+.macro LD_S freg, bits
+  li t0, \\bits
+  fmv.w.x \\freg, t0
+.endm
+.macro FLAGS f
+  frflags t1
+  li t0, \\f
+  beq t0, t1, 1f
+  j fail
+1:
+.endm
+.macro CHECK_D freg, hi, lo, f
+  fsd \\freg, 8(sp)
+  lw t1, 8(sp)
+  li t0, \\lo
+  beq t0, t1, 1f
+  j fail
+1:
+  lw t1, 12(sp)
+  li t0, \\hi
+  beq t0, t1, 1f
+  j fail
+1:
+  FLAGS \\f
+.endm
+.macro CHECK_S freg, bits, f
+  fsd \\freg, 8(sp)
+  lw t1, 8(sp)
+  li t0, \\bits
+  beq t0, t1, 1f
+  j fail
+1:
+  lw t1, 12(sp)
+  li t0, -1
+  beq t0, t1, 1f
+  j fail
+1:
+  FLAGS \\f
+.endm
+.macro CHECK_X reg, val, f
+  li t0, \\val
+  beq t0, \\reg, 1f
+  j fail
+1:
+  FLAGS \\f
+.endm
+_start:
+  addi sp, sp, -64
+''')
+n=[0]
+def test():
+    n[0]+=1
+    A(f'  li s11, {n[0]}\n  fsflags x0')
+def ldd(r,b): A(f'  LD_D {r}, {b>>32:#x}, {b&0xffffffff:#x}')
+def lds(r,b): A(f'  LD_S {r}, {b:#x}')
+def chkd(r,b,f): A(f'  CHECK_D {r}, {b>>32:#x}, {b&0xffffffff:#x}, {f}')
+def chks(r,b,f): A(f'  CHECK_S {r}, {b:#x}, {f}')
+def chkx(r,v,f): A(f'  CHECK_X {r}, {v & 0xffffffff:#x}, {f}')
+def op2d(ins, a, b, res, f, rm=''):
+    test(); ldd('f1',d(a) if isinstance(a,float) else a); ldd('f2',d(b) if isinstance(b,float) else b)
+    A(f'  {ins} f3, f1, f2{rm}'); chkd('f3', d(res) if isinstance(res,float) else res, f)
+def op3d(ins, a, b, c, res, f):
+    test(); ldd('f1',d(a)); ldd('f2',d(b)); ldd('f4', d(c))
+    A(f'  {ins} f3, f1, f2, f4'); chkd('f3', d(res), f)
+def op2s(ins, a, b, res, f, rm=''):
+    test(); lds('f1',s(a) if isinstance(a,float) else a); lds('f2',s(b) if isinstance(b,float) else b)
+    A(f'  {ins} f3, f1, f2{rm}'); chks('f3', s(res) if isinstance(res,float) else res, f)
+def cvtx(ins, src, val, f, rm=''):
+    test(); ldd('f1', d(src) if isinstance(src,float) else src)
+    A(f'  {ins} a1, f1{rm}'); chkx('a1', val, f)
+def cmpd(ins, a, b, val, f):
+    test(); ldd('f1', d(a) if isinstance(a,float) else a); ldd('f2', d(b) if isinstance(b,float) else b)
+    A(f'  {ins} a1, f1, f2'); chkx('a1', val, f)
+
+op2d('fadd.d', 2.5, 1.0, 3.5, 0)
+op2d('fadd.d', -1235.1, 1.1, -1234.0, 1)
+op2d('fadd.d', 3.14159265, 0.00000001, 3.14159266, 1)
+op2d('fsub.d', INF, INF, NAN_D, 0x10)
+op2d('fmul.d', 2.5, 10.0, 25.0, 0)
+op2d('fdiv.d', 1.0, 0.0, INF, 0x08)
+op2d('fdiv.d', 1.0, 3.0, 1.0/3.0, 1)
+op2d('fdiv.d', 1.0, 3.0, d(1.0/3.0)+1, 1, ', rup')
+op2d('fdiv.d', 1.0, 3.0, 1.0/3.0, 1, ', rdn')
+op2d('fmul.d', 1e308, 10.0, INF, 0x05)
+op2d('fmul.d', 1e308, 10.0, d(1.7976931348623157e308), 0x05, ', rtz')
+op2d('fmin.d', -0.0, 0.0, -0.0, 0)
+op2d('fmax.d', -0.0, 0.0, 0.0, 0)
+op2d('fmin.d', NAN_D, 1.0, 1.0, 0)
+op2d('fmin.d', SNAN_D, 1.0, 1.0, 0x10)
+op2d('fmax.d', NAN_D, SNAN_D, NAN_D, 0x10)
+op2d('fsgnjn.d', 1.0, 1.0, -1.0, 0)
+op2d('fsgnjx.d', -2.0, -1.0, 2.0, 0)
+op2d('fsgnj.d', SNAN_D, -1.0, SNAN_D | (1<<63), 0)
+op3d('fmadd.d', 1.0, 2.5, 1.0, 3.5, 0)
+op3d('fmsub.d', 1.0, 2.5, 1.0, 1.5, 0)
+op3d('fnmadd.d', 1.0, 2.5, 1.0, -3.5, 0)
+op3d('fnmsub.d', 1.0, 2.5, 1.0, -1.5, 0)
+# fma rounds once: (1+2^-52)(1-2^-52) - 1 = -2^-104
+op3d('fmsub.d', 1.0 + 2.0**-52, 1.0 - 2.0**-52, 1.0, -2.0**-104, 0)
+test(); ldd('f1', d(-1.0)); A('  fsqrt.d f3, f1'); chkd('f3', NAN_D, 0x10)
+test(); ldd('f1', d(171.0)); A('  fsqrt.d f3, f1'); chkd('f3', d(171.0**0.5), 1)
+cvtx('fcvt.w.d', -1.1, -1, 1, ', rtz')
+cvtx('fcvt.w.d', 0.9, 0, 1, ', rtz')
+cvtx('fcvt.w.d', 1.1, 1, 1)
+cvtx('fcvt.wu.d', -3e9, 0, 0x10, ', rtz')
+cvtx('fcvt.w.d', 3e9, 0x7fffffff, 0x10, ', rtz')
+cvtx('fcvt.w.d', -3e9, 0x80000000, 0x10, ', rtz')
+cvtx('fcvt.w.d', NAN_D, 0x7fffffff, 0x10, ', rtz')
+cvtx('fcvt.wu.d', NAN_D, 0xffffffff, 0x10, ', rtz')
+cvtx('fcvt.wu.d', -0.9, 0, 1, ', rtz')
+cvtx('fcvt.wu.d', 4294967295.0, 0xffffffff, 0, ', rtz')
+cvtx('fcvt.w.d', 2.5, 2, 1, ', rne')
+cvtx('fcvt.w.d', 3.5, 4, 1, ', rne')
+cvtx('fcvt.w.d', -2.5, -2, 1, ', rne')
+cvtx('fcvt.w.d', 2.5, 3, 1, ', rmm')
+cvtx('fcvt.w.d', -2.5, -3, 1, ', rdn')
+cvtx('fcvt.w.d', -2.5, -2, 1, ', rup')
+cvtx('fcvt.w.d', -2147483648.0, 0x80000000, 0, ', rtz')
+cvtx('fclass.d', NINF, 1, 0)
+cvtx('fclass.d', INF, 0x80, 0)
+cvtx('fclass.d', NAN_D, 0x200, 0)
+cvtx('fclass.d', SNAN_D, 0x100, 0)
+cvtx('fclass.d', -0.0, 8, 0)
+cvtx('fclass.d', 1, 0x20, 0)
+cvtx('fclass.d', -1.5, 2, 0)
+cmpd('feq.d', NAN_D, 1.0, 0, 0)
+cmpd('feq.d', SNAN_D, 1.0, 0, 0x10)
+cmpd('flt.d', NAN_D, 1.0, 0, 0x10)
+cmpd('fle.d', -0.0, 0.0, 1, 0)
+cmpd('flt.d', -0.0, 0.0, 0, 0)
+cmpd('flt.d', -1.0, 0.0, 1, 0)
+# conversions between integers and floats
+test(); A('  li a1, -2\n  fcvt.d.w f3, a1'); chkd('f3', d(-2.0), 0)
+test(); A('  li a1, -2\n  fcvt.d.wu f3, a1'); chkd('f3', d(4294967294.0), 0)
+test(); A('  li a1, 16777217\n  fcvt.s.w f3, a1, rtz'); chks('f3', 0x4b800000, 1)
+test(); A('  li a1, 16777217\n  fcvt.s.w f3, a1, rup'); chks('f3', 0x4b800001, 1)
+test(); A('  li a1, -1\n  fcvt.s.wu f3, a1'); chks('f3', s(4294967296.0), 1)
+test(); ldd('f1', d(1.1)); A('  fcvt.s.d f3, f1'); chks('f3', 0x3f8ccccd, 1)
+test(); ldd('f1', d(1.1)); A('  fcvt.s.d f3, f1, rtz'); chks('f3', 0x3f8ccccc, 1)
+test(); lds('f1', s(1.5)); A('  fcvt.d.s f3, f1'); chkd('f3', d(1.5), 0)
+# singles
+op2s('fadd.s', 2.5, 1.0, 3.5, 0)
+op2s('fadd.s', -1235.1, 1.1, -1234.0, 1)
+op2s('fdiv.s', 1.0, 3.0, 0x3eaaaaab, 1)
+op2s('fdiv.s', 1.0, 3.0, 0x3eaaaaaa, 1, ', rdn')
+op2s('fmin.s', -0.0, 0.0, -0.0, 0)
+op2s('fmax.s', 0x7f800001, 1.0, 1.0, 0x10)
+op2s('fsub.s', s(float('inf')), s(float('inf')), NAN_S, 0x10)
+op2s('fsgnjn.s', 1.0, 1.0, -1.0, 0)
+# frm is the dynamic mode
+test(); A('  fsrmi 3'); lds('f1', s(1.0)); lds('f2', s(3.0)); A('  fdiv.s f3, f1, f2'); chks('f3', 0x3eaaaaab, 1)
+test(); A('  fsrmi a2, 2'); chkx('a2', 3, 0); lds('f1', s(1.0)); lds('f2', s(3.0)); A('  fdiv.s f3, f1, f2'); chks('f3', 0x3eaaaaaa, 1)
+test(); lds('f1', s(1.0)); lds('f2', s(3.0)); A('  fdiv.s f3, f1, f2, rne'); chks('f3', 0x3eaaaaab, 1)
+test(); ldd('f1', d(2.5)); A('  fcvt.w.d a1, f1'); chkx('a1', 2, 1)
+test(); A('  fsrmi 0'); A('  frrm a1'); chkx('a1', 0, 0)
+# NaN boxing: a double in a register is not a boxed single
+test(); ldd('f1', d(1.0)); lds('f2', s(1.0)); A('  fadd.s f3, f1, f2'); chks('f3', NAN_S, 0)
+test(); ldd('f1', d(1.0)); lds('f2', s(-1.0)); A('  fsgnj.s f3, f1, f2'); chks('f3', 0xffc00000, 0)
+test(); ldd('f1', 0x123456789abcdef0); A('  fmv.x.w a1, f1'); chkx('a1', 0x9abcdef0, 0)
+test(); ldd('f1', d(1.0)); A('  fclass.s a1, f1'); chkx('a1', 0x200, 0)
+test(); ldd('f1', 0x123456789abcdef0); A('  fsw f1, 16(sp)\n  lw a1, 16(sp)'); chkx('a1', 0x9abcdef0, 0)
+test(); A('  li a1, 0x7f800001\n  sw a1, 16(sp)\n  flw f3, 16(sp)'); chks('f3', 0x7f800001, 0)
+# fcsr
+test(); A('  li a1, 0xff\n  fscsr a2, a1\n  frrm a3\n  frflags a4'); chkx('a3', 7, 0x1f); A('  li t0, 0x1f\n  beq a4, t0, 2f\n  j fail\n2:\n  fsflags x0\n  fsrmi 0')
+test(); A('  fsflagsi 0x3\n  csrrc a1, fflags, 1\n  frflags a2'); chkx('a1', 3, 2)
+test(); A('  fsflags x0\n  csrrs a1, fflags, x0'); chkx('a1', 0, 0)
+# sp forms and 3 bit register forms, compressible with +c
+test(); ldd('f8', d(6.25)); A('  fsd f8, 24(sp)\n  fld f9, 24(sp)'); chkd('f9', d(6.25), 0)
+test(); lds('f8', s(6.25)); A('  fsw f8, 32(sp)\n  flw f9, 32(sp)'); chks('f9', s(6.25), 0)
+test(); A('  mv s0, sp'); ldd('f10', d(7.5)); A('  fsd f10, 40(s0)\n  fld f11, 40(s0)'); chkd('f11', d(7.5), 0)
+test(); A('  mv s0, sp'); lds('f10', s(7.5)); A('  fsw f10, 48(s0)\n  flw f11, 48(s0)'); chks('f11', s(7.5), 0)
+# a loop, sum of 1/i for i = 1..100
+test()
+A('''  li a1, 1
+  li a2, 101
+  fcvt.d.w f5, x0
+1:
+  fcvt.d.w f1, a1
+  li t0, 1
+  fcvt.d.w f2, t0
+  fdiv.d f1, f2, f1
+  fadd.d f5, f5, f1
+  addi a1, a1, 1
+  bne a1, a2, 1b''')
+h=0.0
+for i in range(1,101): h += 1.0/i
+chkd('f5', d(h), 1)
+A('''  li a0, 0
+  li a7, 93
+  ecall
+fail:
+  slli a0, s11, 1
+  li a7, 93
+  ecall
+''')
+print('\n'.join(out))
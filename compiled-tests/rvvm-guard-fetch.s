@@ -0,0 +1,13 @@
+# A jump to 64 MiB, past guest RAM, after a load that did not fault. The
+# VM has to stop the guest with ERR_INVALID_MEMORY_ACCESS (122) at the
+# fetch, with the jump target as the faulting pc, not the pc of the load;
+# getting past it exits 1.
+.globl _start
+_start:
+  la t0, _start
+  lw t1, 0(t0)
+  li t0, 0x4000000
+  jalr zero, 0(t0)
+  li a0, 2
+  li a7, 93
+  ecall
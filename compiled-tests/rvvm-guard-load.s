@@ -0,0 +1,11 @@
+# A word load across the end of 32 MiB of guest RAM: its first two bytes
+# are RAM, the last two are not (all four are past the 16 MiB of -opt to
+# -opt3). The VM has to stop the guest with ERR_INVALID_MEMORY_ACCESS
+# (122) at the load; getting past it exits 1.
+.globl _start
+_start:
+  li t0, 0x1FFFFFE
+  lw t1, 0(t0)
+  li a0, 2
+  li a7, 93
+  ecall
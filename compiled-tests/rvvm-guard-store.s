@@ -0,0 +1,11 @@
+# A word store to the top of the address space, far past guest RAM and
+# with bit 31 set. The VM has to stop the guest with
+# ERR_INVALID_MEMORY_ACCESS (122) at the store; getting past it exits 1.
+.globl _start
+_start:
+  li t0, 0xFFFFFFFC
+  li t1, 0x12345678
+  sw t1, 0(t0)
+  li a0, 2
+  li a7, 93
+  ecall
@@ -0,0 +1,174 @@
+# The guest I/O queue (SYS_ioqueue_setup 110, SYS_ioqueue_enter 111): setup
+# errors, a batch of writes behind one doorbell, a doorbell that stops at a
+# full completion ring and goes on once it is reaped, then the same rings
+# polled, with the poller going to sleep when idle and a doorbell waking it.
+# Every queued write puts "queued" on stdout. Exits with exit_group 0, or
+# the number of the check that failed, 100 and 101 for a completion with
+# the wrong user_data or result.
+  .globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+# ring of 8 at 0x200000: header 32 bytes, sq 8*32, cq 8*8
+.equ RING, 0x200000
+.equ SQ, RING + 32
+.equ msglen, 7
+.equ CQ, SQ + 256
+# posts write(1, msg, msglen) with user_data s1 into slot s1 & 7, s1++
+post:
+  andi t1, s1, 7
+  slli t1, t1, 5
+  li t2, SQ
+  add t1, t1, t2
+  li t2, 64
+  sw t2, 0(t1)
+  li t2, 1
+  sw t2, 4(t1)
+  la t2, msg
+  sw t2, 8(t1)
+  li t2, msglen
+  sw t2, 12(t1)
+  sw s1, 28(t1)
+  addi s1, s1, 1
+  li t2, RING
+  sw s1, 4(t2)
+  ret
+# checks completion s2: user_data s2, res msglen, s2++
+reap:
+  li t2, RING
+  lw t3, 12(t2)
+  beq t3, s2, reap
+  andi t1, s2, 7
+  slli t1, t1, 3
+  li t3, CQ
+  add t1, t1, t3
+  lw t3, 0(t1)
+  sub t0, t3, s2
+  li t6, 100
+  bnez t0, fail
+  lw t3, 4(t1)
+  addi t0, t3, -msglen
+  li t6, 101
+  bnez t0, fail
+  addi s2, s2, 1
+  sw s2, 8(t2)
+  ret
+_start:
+  # enter before setup fails
+  SYS 111
+  addi t0, a0, 22
+  CHECK 1
+  # 6 entries is no power of two
+  li a0, RING
+  li a1, 6
+  li a2, 0
+  SYS 110
+  addi t0, a0, 22
+  CHECK 2
+  li a0, RING
+  li a1, 8
+  li a2, 0
+  SYS 110
+  mv t0, a0
+  CHECK 3
+  li a0, RING
+  li a1, 8
+  li a2, 0
+  SYS 110
+  addi t0, a0, 16
+  CHECK 4
+  # five writes, one doorbell
+  li s1, 0
+  li s2, 0
+  call post
+  call post
+  call post
+  call post
+  call post
+  SYS 111
+  addi t0, a0, -5
+  CHECK 5
+  call reap
+  call reap
+  call reap
+  call reap
+  call reap
+  # 3 more left unreaped, then 8 with room for 5 completions: the doorbell stops at a full cq
+  li s3, 3
+1: call post
+  addi s3, s3, -1
+  bnez s3, 1b
+  SYS 111
+  addi t0, a0, -3
+  CHECK 6
+  li s3, 8
+1: call post
+  addi s3, s3, -1
+  bnez s3, 1b
+  SYS 111
+  addi t0, a0, -5
+  CHECK 7
+  li s3, 8
+1: call reap
+  addi s3, s3, -1
+  bnez s3, 1b
+  SYS 111
+  addi t0, a0, -3
+  CHECK 8
+  li s3, 3
+1: call reap
+  addi s3, s3, -1
+  bnez s3, 1b
+  # down and up again polled
+  li a0, 0
+  SYS 110
+  mv t0, a0
+  CHECK 9
+  li a0, RING
+  li a1, 8
+  li a2, 1
+  SYS 110
+  mv t0, a0
+  CHECK 10
+  li s1, 0
+  li s2, 0
+  li s4, 0
+  li s3, 200
+1: call post
+  fence rw, rw
+  li t2, RING
+  lw t3, 16(t2)
+  andi t3, t3, 1
+  beqz t3, 2f
+  addi s4, s4, 1
+  SYS 111
+2: call reap
+  addi s3, s3, -1
+  bnez s3, 1b
+  # idle until the poller sleeps, the doorbell wakes it
+  li t1, 2000000000
+  li t2, RING
+1: lw t3, 16(t2)
+  andi t3, t3, 1
+  bnez t3, 2f
+  addi t1, t1, -1
+  bnez t1, 1b
+2: seqz t0, t3
+  CHECK 11
+  call post
+  SYS 111
+  call reap
+  call post
+  call reap
+  li a0, 0
+  SYS 94
+fail:
+  mv a0, t6
+  SYS 94
+.data
+msg: .ascii "queued\n"
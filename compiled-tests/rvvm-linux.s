@@ -0,0 +1,235 @@
+# The RV32 Linux user ABI: the initial stack with argc, argv and the
+# auxiliary vector, brk, anonymous mmap and munmap, openat, fstat, llseek,
+# read, statx and close on rvvm-linux.txt (opened relative to src, where
+# run-tests.sh runs), writev to stdout, clock_gettime64, ENOSYS and EFAULT,
+# and the guest's own fds: the first it opens is 3, write and close of one
+# it has not opened are EBADF, closing its stdio leaves the host's open.
+# Exits with exit_group 0, or the number of the check that failed.
+.globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+_start:
+  # argc 1, argv[0] a string, envp empty, AT_PAGESZ 4096 in auxv
+  lw t1, 0(sp)
+  addi t0, t1, -1
+  CHECK 1
+  lw t1, 4(sp)
+  lbu t1, 0(t1)
+  addi t0, t1, -'r'
+  CHECK 2
+  lw t0, 12(sp)
+  CHECK 3
+  addi t1, sp, 16
+1: lw t2, 0(t1)
+  li t6, 4
+  beqz t2, fail
+  addi t1, t1, 8
+  li t3, 6
+  bne t2, t3, 1b
+  lw t2, -4(t1)
+  addi t0, t2, -2048
+  addi t0, t0, -2048
+  CHECK 5
+  # brk: current, grow by 8 KiB, store at the end, shrink back
+  li a0, 0
+  SYS 214
+  mv s0, a0
+  li t1, 8192
+  add a0, s0, t1
+  SYS 214
+  sub t0, a0, s0
+  addi t0, t0, -2048
+  addi t0, t0, -2048
+  addi t0, t0, -2048
+  addi t0, t0, -2048
+  CHECK 6
+  sw t1, -4(a0)
+  # a brk into the stack is refused
+  li a0, 0x7fff000
+  SYS 214
+  sub t0, a0, s0
+  li t1, 8192
+  sub t0, t0, t1
+  CHECK 7
+  # mmap 3 anonymous pages, zeroed, writable
+  li a0, 0
+  li a1, 12288
+  li a2, 3
+  li a3, 0x22
+  li a4, -1
+  li a5, 0
+  SYS 222
+  mv s1, a0
+  srli t0, a0, 31
+  CHECK 8
+  li t2, 8192
+  add t2, t2, s1
+  lw t0, 0(t2)
+  CHECK 9
+  li t1, 77
+  sw t1, 0(t2)
+  # munmap and map again gives zeroed pages
+  mv a0, s1
+  li a1, 12288
+  SYS 215
+  mv t0, a0
+  CHECK 10
+  li a0, 0
+  li a1, 12288
+  li a2, 3
+  li a3, 0x22
+  li a4, -1
+  li a5, 0
+  SYS 222
+  sub t0, a0, s1
+  CHECK 11
+  li t2, 8192
+  add t2, t2, a0
+  lw t0, 0(t2)
+  CHECK 12
+  # openat, fstat size, llseek to 6, read 5 bytes
+  li a0, -100
+  la a1, path
+  li a2, 0
+  li a3, 0
+  SYS 56
+  mv s2, a0
+  srli t0, a0, 31
+  CHECK 13
+  mv a0, s2
+  la a1, statbuf
+  SYS 80
+  mv t0, a0
+  CHECK 14
+  la t1, statbuf
+  lw t2, 48(t1)
+  addi t0, t2, -16
+  CHECK 15
+  mv a0, s2
+  li a1, 0
+  li a2, 6
+  la a3, result
+  li a4, 0
+  SYS 62
+  mv t0, a0
+  CHECK 16
+  la t1, result
+  lw t2, 0(t1)
+  addi t0, t2, -6
+  CHECK 17
+  mv a0, s2
+  la a1, buf
+  li a2, 5
+  SYS 63
+  addi t0, a0, -5
+  CHECK 18
+  # statx with AT_EMPTY_PATH on the fd
+  mv a0, s2
+  la a1, empty
+  li a2, 0x1000
+  li a3, 0x7ff
+  la a4, statxbuf
+  SYS 291
+  mv t0, a0
+  CHECK 19
+  la t1, statxbuf
+  lw t2, 40(t1)
+  addi t0, t2, -16
+  CHECK 20
+  mv a0, s2
+  SYS 57
+  mv t0, a0
+  CHECK 21
+  # reading a closed fd is EBADF
+  mv a0, s2
+  la a1, buf
+  li a2, 1
+  SYS 63
+  addi t0, a0, 9
+  CHECK 22
+  # writev "linux" + "\n" to stdout
+  la a0, iov
+  la t1, buf
+  sw t1, 0(a0)
+  li t1, 5
+  sw t1, 4(a0)
+  la t1, nl
+  sw t1, 8(a0)
+  li t1, 1
+  sw t1, 12(a0)
+  li a0, 1
+  la a1, iov
+  li a2, 2
+  SYS 66
+  addi t0, a0, -6
+  CHECK 23
+  # clock_gettime64 monotonic, some seconds or nanoseconds
+  li a0, 1
+  la a1, ts
+  SYS 403
+  mv t0, a0
+  CHECK 24
+  la t1, ts
+  lw t2, 0(t1)
+  lw t3, 8(t1)
+  or t2, t2, t3
+  seqz t0, t2
+  CHECK 25
+  # an unknown call is ENOSYS, a buffer outside of memory EFAULT
+  SYS 1000
+  addi t0, a0, 38
+  CHECK 26
+  li a0, 1
+  li a1, 0x7ffffff0
+  li a2, 64
+  SYS 64
+  addi t0, a0, 14
+  CHECK 27
+  # the guest's first fd is 3, whatever the host has open
+  addi t0, s2, -3
+  CHECK 28
+  # fd 5 was never opened, the host's fd 5 is not the guest's
+  li a0, 5
+  la a1, buf
+  li a2, 1
+  SYS 64
+  addi t0, a0, 9
+  CHECK 29
+  li a0, 5
+  SYS 57
+  addi t0, a0, 9
+  CHECK 30
+  # closing stdout keeps writing to it
+  li a0, 1
+  SYS 57
+  mv t0, a0
+  CHECK 31
+  li a0, 1
+  la a1, nl
+  li a2, 1
+  SYS 64
+  addi t0, a0, -1
+  CHECK 32
+  li a0, 0
+  SYS 94
+fail:
+  mv a0, t6
+  SYS 94
+
+.data
+path: .asciz "../compiled-tests/rvvm-linux.txt"
+empty: .byte 0
+nl: .byte 10
+.balign 8
+statbuf: .space 128
+statxbuf: .space 256
+result: .space 8
+ts: .space 16
+iov: .space 16
+buf: .space 16
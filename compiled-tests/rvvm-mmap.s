@@ -0,0 +1,164 @@
+# mmap of a host file: a private mapping of rvvm-mmap.bin (14000 bytes,
+# byte i is ((i * 7 + 3) ^ (i >> 8)) & 0xff, opened relative to src) reads
+# the file, zeros past its end, keeps its writes to itself, and munmap
+# with an anonymous MAP_FIXED puts zero pages back. Once the guest closes
+# the fd, mmap of it and openat relative to it are EBADF. Exits with
+# exit_group 0, or the number of the check that failed.
+.globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+_start:
+  # open through the custom SYS_open
+  la a0, path
+  li a1, 0
+  li a2, 0
+  SYS 105
+  mv s2, a0
+  srli t0, a0, 31
+  CHECK 1
+  # 4 pages private from offset 0
+  li a0, 0
+  li a1, 16384
+  li a2, 3
+  li a3, 2
+  mv a4, s2
+  li a5, 0
+  SYS 222
+  mv s1, a0
+  srli t0, a0, 31
+  CHECK 2
+  li t1, 0
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -3
+  CHECK 3
+  li t1, 1
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -10
+  CHECK 4
+  li t1, 4095
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -243
+  CHECK 5
+  li t1, 4096
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -19
+  CHECK 6
+  li t1, 8191
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -227
+  CHECK 7
+  li t1, 12287
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -211
+  CHECK 8
+  li t1, 12288
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -51
+  CHECK 9
+  li t1, 13999
+  add t1, t1, s1
+  lbu t2, 0(t1)
+  addi t0, t2, -250
+  CHECK 10
+  # past EOF inside the mapping reads zero
+  li t1, 14000
+  add t1, t1, s1
+  lbu t0, 0(t1)
+  CHECK 11
+  li t1, 16383
+  add t1, t1, s1
+  lbu t0, 0(t1)
+  CHECK 12
+  # writes are private
+  li t1, 0x55
+  sb t1, 0(s1)
+  lbu t2, 0(s1)
+  addi t0, t2, -0x55
+  CHECK 13
+  # a second mapping at page offset 1 sees the file, not the write
+  li a0, 0
+  li a1, 4096
+  li a2, 1
+  li a3, 2
+  mv a4, s2
+  li a5, 1
+  SYS 222
+  mv s3, a0
+  srli t0, a0, 31
+  CHECK 14
+  lbu t2, 0(s3)
+  addi t0, t2, -19
+  CHECK 15
+  # unmap the first, an anonymous MAP_FIXED there is zero
+  mv a0, s1
+  li a1, 16384
+  SYS 215
+  mv t0, a0
+  CHECK 16
+  mv a0, s1
+  li a1, 16384
+  li a2, 3
+  li a3, 0x32
+  li a4, -1
+  li a5, 0
+  SYS 222
+  sub t0, a0, s1
+  CHECK 17
+  lbu t0, 0(s1)
+  CHECK 18
+  li t1, 4096
+  add t1, t1, s1
+  lw t0, 0(t1)
+  CHECK 19
+  # a bad fd is EBADF
+  li a0, 0
+  li a1, 4096
+  li a2, 1
+  li a3, 2
+  li a4, 1000
+  li a5, 0
+  SYS 222
+  addi t0, a0, 9
+  CHECK 20
+  # close the fd, it is no longer the guest's to map or open relative to
+  mv a0, s2
+  SYS 57
+  mv t0, a0
+  CHECK 21
+  li a0, 0
+  li a1, 4096
+  li a2, 1
+  li a3, 2
+  mv a4, s2
+  li a5, 0
+  SYS 222
+  addi t0, a0, 9
+  CHECK 22
+  mv a0, s2
+  la a1, name
+  li a2, 0
+  li a3, 0
+  SYS 56
+  addi t0, a0, 9
+  CHECK 23
+  li a0, 0
+  SYS 94
+fail:
+  mv a0, t6
+  SYS 94
+.data
+path: .asciz "../compiled-tests/rvvm-mmap.bin"
+name: .asciz "rvvm-mmap.bin"
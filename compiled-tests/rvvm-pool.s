@@ -0,0 +1,150 @@
+# A pooled VM is reset to the snapshot between jobs: whatever the last job
+# wrote, to .data, .bss, the heap, the stack or an anonymous mapping, is
+# gone for the next one. That includes a host file it mapped over a page the
+# snapshot has data in, whether it left the file there or munmap'd it.
+# Run it as more jobs than threads (runelf -j 1 with -inputs) so contexts
+# get reused. Exits 0, or the number of the check that failed.
+  .globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+_start:
+  li a0, 0
+  SYS 214
+  mv s3, a0
+  li t1, 8192
+  add a0, s3, t1
+  SYS 214
+  li t1, 0x600d
+  sw t1, 0(s3)
+  # two anonymous pages with data in the snapshot, and a file to map over them
+  li a0, 0
+  li a1, 8192
+  li a2, 3
+  li a3, 0x22
+  li a4, -1
+  li a5, 0
+  SYS 222
+  mv s7, a0
+  li t1, 0x5a
+  sw t1, 0(s7)
+  li t2, 4096
+  add s8, s7, t2
+  sw t1, 0(s8)
+  la a0, path
+  li a1, 0
+  li a2, 0
+  SYS 105
+  mv s9, a0
+  SYS 2049
+  # as the snapshot left them
+  la s2, counter
+  lw t0, 0(s2)
+  CHECK 1
+  la s4, untouched
+  lw t0, 0(s4)
+  CHECK 2
+  li t1, 4096 * 3
+  add t1, t1, s4
+  lw t0, 0(t1)
+  CHECK 3
+  lw t1, 0(s3)
+  li t2, 0x600d
+  sub t0, t1, t2
+  CHECK 4
+  lw t0, 4(s3)
+  CHECK 5
+  lw t0, -64(sp)
+  CHECK 6
+  li a0, 0
+  SYS 214
+  li t1, 8192
+  add t1, t1, s3
+  sub t0, a0, t1
+  CHECK 7
+  # a new mapping is zero
+  li a0, 0
+  li a1, 8192
+  li a2, 3
+  li a3, 0x22
+  li a4, -1
+  li a5, 0
+  SYS 222
+  mv s5, a0
+  srli t0, a0, 31
+  CHECK 8
+  li t1, 4096
+  add s6, s5, t1
+  lw t0, 0(s6)
+  CHECK 9
+  # the file over the first page, then munmap'd: zeros
+  lw t1, 0(s7)
+  addi t0, t1, -0x5a
+  CHECK 10
+  lw t1, 0(s8)
+  addi t0, t1, -0x5a
+  CHECK 11
+  mv a0, s7
+  li a1, 4096
+  li a2, 3
+  li a3, 0x12
+  mv a4, s9
+  li a5, 0
+  SYS 222
+  sub t0, a0, s7
+  CHECK 12
+  lbu t1, 0(s7)
+  addi t0, t1, -3
+  CHECK 13
+  mv a0, s7
+  li a1, 4096
+  SYS 215
+  lw t0, 0(s7)
+  CHECK 14
+  # and over the second one, left there
+  mv a0, s8
+  li a1, 4096
+  li a2, 3
+  li a3, 0x12
+  mv a4, s9
+  li a5, 0
+  SYS 222
+  sub t0, a0, s8
+  CHECK 15
+  # dirty all of it for the next job
+  li t1, 1
+  sw t1, 0(s2)
+  sw t1, 0(s4)
+  li t2, 4096 * 3
+  add t2, t2, s4
+  sw t1, 0(t2)
+  sw t1, 0(s3)
+  sw t1, 4(s3)
+  sw t1, -64(sp)
+  sw t1, 0(s6)
+  li a0, 0
+  li t1, 16384
+  add a0, s3, t1
+  SYS 214
+  li a0, 0
+  SYS 93
+fail:
+  # exit's status is a0 >> 1, like tohost's
+  slli a0, t6, 1
+  SYS 93
+
+  .data
+  .p2align 2
+counter:
+  .word 0
+path:
+  .asciz "../compiled-tests/rvvm-mmap.bin"
+  .bss
+  .p2align 12
+untouched:
+  .space 4096 * 4
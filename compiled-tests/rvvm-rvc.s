@@ -0,0 +1,186 @@
+# RVC: the compressed instructions of RV32IC, then a loop of calls built
+# with +c, where the assembler compresses what it can and 32-bit
+# instructions end up on 2-byte boundaries. The loop's checksum is what the
+# same code gives without C. Exits 0, or the number of the check that
+# failed.
+  .globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+_start:
+  c.li a0, 5
+  c.addi a0, 3
+  c.slli a0, 2
+  addi t0, a0, -32
+  CHECK 1
+  c.li a1, -16
+  c.srai a1, 2
+  addi t0, a1, 4
+  CHECK 2
+  c.li a1, -16
+  c.srli a1, 28
+  addi t0, a1, -15
+  CHECK 3
+  c.li a2, 0x1d
+  c.andi a2, 0xc
+  addi t0, a2, -12
+  CHECK 4
+  c.mv a3, a0
+  c.add a3, a2
+  c.sub a3, a1
+  addi t0, a3, -29
+  CHECK 5
+  c.li a4, 6
+  c.li a5, 3
+  c.xor a4, a5
+  addi t0, a4, -5
+  CHECK 6
+  c.or a4, a5
+  addi t0, a4, -7
+  CHECK 7
+  c.and a4, a5
+  addi t0, a4, -3
+  CHECK 8
+  c.lui a5, 0x12
+  li t1, 0x12000
+  sub t0, a5, t1
+  CHECK 9
+  c.lui a5, 0xfffff
+  li t1, -4096
+  sub t0, a5, t1
+  CHECK 10
+  # the stack ones
+  mv s1, sp
+  c.addi16sp sp, -64
+  sub t0, s1, sp
+  addi t0, t0, -64
+  CHECK 11
+  c.addi4spn a0, sp, 8
+  addi t1, sp, 8
+  sub t0, a0, t1
+  CHECK 12
+  li a1, 0x12345678
+  c.swsp a1, 12(sp)
+  c.lwsp a2, 12(sp)
+  sub t0, a2, a1
+  CHECK 13
+  c.sw a1, 4(a0)
+  c.lw a3, 4(a0)
+  sub t0, a3, a1
+  CHECK 14
+  lw a3, 12(sp)
+  sub t0, a3, a1
+  CHECK 15
+  c.addi16sp sp, 64
+  sub t0, sp, s1
+  CHECK 16
+  # control transfers
+  c.li a0, 0
+  c.beqz a0, 1f
+  li t0, 1
+  CHECK 17
+1:
+  c.li a0, 1
+  c.bnez a0, 1f
+  li t0, 1
+  CHECK 18
+1:
+  c.j 1f
+  li t0, 1
+  CHECK 19
+1:
+  c.jal func
+  addi t0, a0, -77
+  CHECK 20
+  la t1, func
+  c.jalr t1
+  addi t0, a0, -77
+  CHECK 21
+  c.nop
+  # a 32-bit instruction on a 2-byte boundary
+  c.nop
+  li t1, 0x7654321
+  addi t0, t1, 0
+  sub t0, t0, t1
+  CHECK 22
+
+  # the loop
+  li s0, 0
+  li s1, 100
+  addi a0, sp, 64
+outer:
+  mv a1, s1
+  jal mix
+  add s0, s0, a0
+  xor s0, s0, a1
+  addi s1, s1, -1
+  bnez s1, outer
+  addi sp, sp, -32
+  sw s0, 4(sp)
+  lw a2, 4(sp)
+  addi sp, sp, 32
+  la a3, table
+  li a4, 5
+1:
+  lw a5, 0(a3)
+  add s0, s0, a5
+  slli a5, a5, 3
+  sw a5, 0(a3)
+  addi a3, a3, 4
+  addi a4, a4, -1
+  bnez a4, 1b
+  la a3, table
+  lw a5, 8(a3)
+  add s0, s0, a5
+  la t0, fn2
+  jalr t0
+  add s0, s0, a0
+  li t1, 0x00c40ede
+  sub t0, s0, t1
+  CHECK 23
+  li a0, 0
+  SYS 93
+fail:
+  # exit's status is a0 >> 1, like tohost's
+  slli a0, t6, 1
+  SYS 93
+
+func:
+  li a0, 77
+  c.jr ra
+
+# a0 = f(a1)
+mix:
+  mv a0, a1
+  slli a0, a0, 5
+  srli a2, a0, 2
+  srai a3, a0, 1
+  sub a0, a0, a2
+  xor a0, a0, a3
+  or a0, a0, a1
+  and a3, a0, a2
+  add a0, a0, a3
+  andi a0, a0, -17
+  lui a4, 0x1f
+  add a0, a0, a4
+  li a5, -7
+  add a0, a0, a5
+  beqz a1, 1f
+  addi a0, a0, 3
+1:
+  ret
+
+fn2:
+  li a0, 31
+  nop
+  ret
+
+  .data
+  .p2align 2
+table:
+  .word 1, 2, 3, 4, 5
@@ -0,0 +1,68 @@
+# A long loop with every result in registers and a syscall in it. Run
+# with a small timeslice (runelf -j 1 -slice) next to another copy of
+# itself, each guest is preempted thousands of times and has to come back
+# with its registers and pc as it left them. Exits 0, or the number of the
+# check that failed.
+  .globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+_start:
+  li s0, 1
+  li s1, 0
+  li s2, 0
+  li s3, 0
+  li s4, 200000
+  li s5, 1664525
+  li s6, 1013904223
+  li a0, 0
+  SYS 214
+  mv s7, a0
+1:
+  mul s0, s0, s5
+  add s0, s0, s6
+  srli t1, s0, 16
+  add s1, s1, t1
+  xor s2, s2, s1
+  andi t1, s0, 1
+  beqz t1, 2f
+  slli t2, s2, 1
+  add t2, t2, s2
+  add s3, s3, t2
+  j 3f
+2:
+  sub s3, s3, s1
+3:
+  # every 4096th turn brk(0), which stays the same
+  slli t1, s4, 20
+  bnez t1, 4f
+  li a0, 0
+  SYS 214
+  sub t0, a0, s7
+  CHECK 1
+4:
+  addi s4, s4, -1
+  bnez s4, 1b
+  li t1, 0xe1888f41
+  sub t0, s0, t1
+  CHECK 2
+  li t1, 0x8670f34a
+  sub t0, s1, t1
+  CHECK 3
+  li t1, 0x5532bcea
+  sub t0, s2, t1
+  CHECK 4
+  li t1, 0xc5a02557
+  sub t0, s3, t1
+  CHECK 5
+  li a0, 0
+  SYS 93
+fail:
+  # exit's status is a0 >> 1, like tohost's
+  slli a0, t6, 1
+  SYS 93
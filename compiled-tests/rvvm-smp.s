@@ -0,0 +1,96 @@
+# Two harts (runelf -opt4 -harts 2) count into shared words, one with
+# amoadd.w and one with lr.w/sc.w loops; no increment may get lost. Hart 0
+# then wakes hart 1 from wfi through its CLINT msip word and waits for it
+# to answer. Hart 1 moves brk up a page before it answers, and hart 0 has to
+# see it there: the harts share one heap. Exits 0, or the number of the
+# check that failed.
+  .globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+.equ CLINT, 0x02000000
+.equ TURNS, 100000
+_start:
+  la a1, counter
+  la a2, counter_lrsc
+  la a3, answer
+  li s0, CLINT
+  li t1, TURNS
+1:
+  li t2, 1
+  amoadd.w x0, t2, (a1)
+  addi t1, t1, -1
+  bnez t1, 1b
+  li t1, TURNS
+2:
+  lr.w t2, (a2)
+  addi t2, t2, 1
+  sc.w t3, t2, (a2)
+  bnez t3, 2b
+  addi t1, t1, -1
+  bnez t1, 2b
+  csrr t0, mhartid
+  bnez t0, hart1
+  # both harts are done counting
+  li t4, 2 * TURNS
+1:
+  lw t3, 0(a1)
+  bne t3, t4, 1b
+1:
+  lw t3, 0(a2)
+  bne t3, t4, 1b
+  li t1, 1
+  sw t1, 4(s0)
+1:
+  lw t2, 0(a3)
+  beqz t2, 1b
+  # hart 1 cleared its msip, a byte load of a register works too
+  lw t0, 4(s0)
+  CHECK 1
+  lb t0, 0(s0)
+  CHECK 2
+  li a0, 0
+  SYS 214
+  la t1, hart1_brk
+  lw t1, 0(t1)
+  sub t0, a0, t1
+  CHECK 3
+  li a0, 0
+  SYS 93
+fail:
+  # exit's status is a0 >> 1, like tohost's
+  slli a0, t6, 1
+  SYS 93
+hart1:
+  wfi
+  lw t1, 4(s0)
+  beqz t1, hart1
+  sw zero, 4(s0)
+  li a0, 0
+  SYS 214
+  li t1, 4096
+  add a0, a0, t1
+  SYS 214
+  la t1, hart1_brk
+  sw a0, 0(t1)
+  li t1, 1
+  sw t1, 0(a3)
+1:
+  wfi
+  j 1b
+
+  .data
+  .p2align 2
+counter:
+  .word 0
+counter_lrsc:
+  .word 0
+answer:
+  .word 0
+hart1_brk:
+  .word 0
@@ -0,0 +1,109 @@
+# SYS_snapshot (2049): the guest goes on after the ecall with a0 = 0 and its
+# registers and memory as they were, in the VM that made it and in every
+# clone of the snapshot (runelf -j with -inputs). A file open at the
+# snapshot reads on from the same offset in each of them. run-tests.sh runs
+# it from src, where the path below is this source. Exits 0, or the number
+# of the check that failed.
+  .globl _start
+.macro SYS n
+  li a7, \n
+  ecall
+.endm
+.macro CHECK step
+  li t6, \step
+  bnez t0, fail
+.endm
+_start:
+  # state to keep: saved registers, a table in .data and a word on the heap
+  li s0, 0x13579bdf
+  li s1, 0x2468ace0
+  la s2, table
+  li t1, 0
+  li t2, 256
+1:
+  slli t3, t1, 2
+  add t3, t3, s2
+  mul t4, t1, t1
+  sw t4, 0(t3)
+  addi t1, t1, 1
+  bne t1, t2, 1b
+  li a0, 0
+  SYS 214
+  mv s3, a0
+  li t1, 8192
+  add a0, s3, t1
+  SYS 214
+  li t1, 0x5a5a
+  sw t1, 0(s3)
+  # the first 2 bytes of the file, "# "
+  la a0, path
+  li a1, 0
+  li a2, 0
+  SYS 105
+  mv s4, a0
+  la a1, buf
+  li a2, 2
+  SYS 107
+  li a0, 77
+  SYS 2049
+  mv t0, a0
+  CHECK 1
+  li t1, 0x13579bdf
+  sub t0, s0, t1
+  CHECK 2
+  li t1, 0x2468ace0
+  sub t0, s1, t1
+  CHECK 3
+  # the sum of i * i for i < 256
+  li t1, 0
+  li t2, 0
+  mv t3, s2
+  addi t4, s2, 1024
+1:
+  lw t5, 0(t3)
+  add t1, t1, t5
+  addi t3, t3, 4
+  bne t3, t4, 1b
+  li t2, 5559680
+  sub t0, t1, t2
+  CHECK 4
+  lw t1, 0(s3)
+  li t2, 0x5a5a
+  sub t0, t1, t2
+  CHECK 5
+  li a0, 0
+  SYS 214
+  li t1, 8192
+  add t1, t1, s3
+  sub t0, a0, t1
+  CHECK 6
+  # the next 4, "SYS_", not where an earlier clone left off
+  mv a0, s4
+  la a1, buf
+  li a2, 4
+  SYS 107
+  addi t0, a0, -4
+  CHECK 7
+  la t1, buf
+  lw t1, 0(t1)
+  li t2, 0x5f535953
+  sub t0, t1, t2
+  CHECK 8
+  # what a job changes after the snapshot is its own
+  sw zero, 0(s2)
+  sw zero, 0(s3)
+  li a0, 0
+  SYS 93
+fail:
+  # exit's status is a0 >> 1, like tohost's
+  slli a0, t6, 1
+  SYS 93
+
+  .data
+  .p2align 2
+table:
+  .space 1024
+buf:
+  .space 4
+path:
+  .asciz "../compiled-tests/rvvm-snapshot.s"
@@ -0,0 +1,216 @@
+# The vector extension as far as the engines have it (Zve32x): every integer
+# arithmetic, compare and reduction instruction in its vv, vx and vi forms,
+# masked and not, at random SEW, LMUL and vl, merges and moves, unit-stride
+# and strided loads and stores, vsetvl* and the vector CSRs. A Python model
+# of the register file gives the expected results. Prints the guest's
+# assembly, which exits 0, or 128 plus the number of the check that failed
+# modulo 128.
+import random
+random.seed(11)
+import os
+# RV_VLEN / 8 of the build the guest runs on
+VLENB=int(os.environ.get('VLENB','16'))
+G=8*VLENB
+M32=0xffffffff
+regs=bytearray(32*VLENB)
+def rd(reg,i,sew):
+    o=reg*VLENB+i*sew//8
+    return int.from_bytes(regs[o:o+sew//8],'little')
+def wr(reg,i,sew,v):
+    o=reg*VLENB+i*sew//8
+    regs[o:o+sew//8]=(v&((1<<sew)-1)).to_bytes(sew//8,'little')
+def sg(v,sew):
+    v&=(1<<sew)-1
+    return v-(1<<sew) if v>>(sew-1) else v
+def mbit(i): return (regs[i>>3]>>(i&7))&1
+def tdiv(a,b):
+    q=abs(a)//abs(b)
+    return q if (a<0)==(b<0) else -q
+def trem(a,b): return a-b*tdiv(a,b)
+def binop(op,a,b,d,sew):
+    m=(1<<sew)-1; sa,sb=sg(a,sew),sg(b,sew)
+    return {
+     'vadd':a+b,'vsub':a-b,'vrsub':b-a,'vminu':min(a,b),'vmin':a if sa<sb else b,'vmaxu':max(a,b),'vmax':a if sa>sb else b,
+     'vand':a&b,'vor':a|b,'vxor':a^b,'vsll':a<<(b&(sew-1)),'vsrl':a>>(b&(sew-1)),'vsra':sa>>(b&(sew-1)),
+     'vmul':a*b,'vmulhu':(a*b)>>sew,'vmulh':(sa*sb)>>sew,'vmulhsu':(sa*b)>>sew,
+     'vdivu':a//b if b else m,'vdiv':(m if b==0 else (sa if sb==-1 and sa==-(1<<(sew-1)) else tdiv(sa,sb))),
+     'vremu':a%b if b else a,'vrem':(a if b==0 else (0 if sb==-1 else trem(sa,sb))),
+     'vmacc':b*a+d,'vnmsac':d-b*a,'vmadd':b*d+a,'vnmsub':a-b*d,
+    }[op]&m
+cmps={'vmseq':lambda a,b,sa,sb:a==b,'vmsne':lambda a,b,sa,sb:a!=b,'vmsltu':lambda a,b,sa,sb:a<b,'vmslt':lambda a,b,sa,sb:sa<sb,
+      'vmsleu':lambda a,b,sa,sb:a<=b,'vmsle':lambda a,b,sa,sb:sa<=sb,'vmsgtu':lambda a,b,sa,sb:a>b,'vmsgt':lambda a,b,sa,sb:sa>sb}
+forms={'vadd':'vxi','vsub':'vx','vrsub':'xi','vminu':'vx','vmin':'vx','vmaxu':'vx','vmax':'vx','vand':'vxi','vor':'vxi','vxor':'vxi',
+ 'vsll':'vxi','vsrl':'vxi','vsra':'vxi','vmul':'vx','vmulhu':'vx','vmulh':'vx','vmulhsu':'vx','vdivu':'vx','vdiv':'vx','vremu':'vx','vrem':'vx',
+ 'vmacc':'vx','vnmsac':'vx','vmadd':'vx','vnmsub':'vx',
+ 'vmseq':'vxi','vmsne':'vxi','vmsltu':'vx','vmslt':'vx','vmsleu':'vxi','vmsle':'vxi','vmsgtu':'xi','vmsgt':'xi'}
+reds=['vredsum','vredand','vredor','vredxor','vredminu','vredmin','vredmaxu','vredmax']
+lmuls={'mf4':0.25,'mf2':0.5,'m1':1,'m2':2,'m4':4,'m8':8}
+def rb(n):
+    # values that hit the edges
+    return bytes(random.choice([0,0xff,0x80,0x7f,1,random.randrange(256)]) for _ in range(n))
+A=rb(G);B=rb(G);D=rb(G);MK=rb(VLENB)
+out=['# generated by rvvm-v.py','  .text','  .globl _start','_start:']
+data=['  .data','  .balign 16','init_a:']+[f'  .byte {",".join(str(x) for x in A[i:i+16])}' for i in range(0,G,16)]
+data+=['init_b:']+[f'  .byte {",".join(str(x) for x in B[i:i+16])}' for i in range(0,G,16)]
+data+=['init_d:']+[f'  .byte {",".join(str(x) for x in D[i:i+16])}' for i in range(0,G,16)]
+data+=['init_m:',f'  .byte {",".join(str(x) for x in MK)}','  .balign 16','outbuf:',f'  .zero {2*G}']
+n=0
+def reset():
+    regs[8*VLENB:16*VLENB]=A; regs[16*VLENB:24*VLENB]=B; regs[24*VLENB:32*VLENB]=D; regs[0:VLENB]=MK
+    out.extend(['  vsetvli t0, zero, e8, m8, ta, ma','  la a1, init_a','  vle8.v v8, (a1)','  la a1, init_b','  vle8.v v16, (a1)',
+                '  la a1, init_d','  vle8.v v24, (a1)',f'  li t1, {VLENB}','  vsetvli zero, t1, e8, m1, ta, ma','  la a1, init_m','  vle8.v v0, (a1)'])
+def check_regs():
+    global n
+    n+=1
+    out.extend([f'  li s11, {n}','  vsetvli t0, zero, e8, m8, ta, ma','  la a1, outbuf','  vse8.v v24, (a1)',f'  la a5, exp_{n}','  call cmp128'])
+    data.extend([f'exp_{n}:']+[f'  .byte {",".join(str(x) for x in regs[24*VLENB+i:24*VLENB+i+16])}' for i in range(0,G,16)])
+def check_mem():
+    global n
+    n+=1
+    out.extend([f'  li s11, {n}',f'  la a5, exp_{n}','  call cmp128'])
+    data.extend([f'exp_{n}:']+[f'  .byte {",".join(str(x) for x in mem[i:i+16])}' for i in range(0,G,16)])
+def check_x(v):
+    global n
+    n+=1
+    out.extend([f'  li s11, {n}',f'  li a4, {v:#x}','  beq a3, a4, 1f','  j fail','1:'])
+def setvl(sew,lm,vl):
+    vlmax=int(VLENB*8*lmuls[lm]//sew)
+    out.append(f'  li t1, {vl}')
+    out.append(f'  vsetvli t0, t1, e{sew}, {lm}, ta, mu')
+    return min(vl,vlmax)
+def pick():
+    sew=random.choice([8,16,32])
+    lm=random.choice([l for l in lmuls if sew<=lmuls[l]*32])
+    vlmax=int(VLENB*8*lmuls[lm]//sew)
+    vl=random.choice([vlmax,random.randrange(vlmax+1),vlmax+5,1])
+    return sew,lm,vl
+for op,fs in forms.items():
+    for form in fs:
+        for rep in range(4):
+            masked=rep&1
+            sew,lm,vl=pick()
+            reset()
+            vl=setvl(sew,lm,vl)
+            x=random.choice([0,1,M32,0x80000000,0x7f,random.getrandbits(32)])
+            imm=random.randrange(-16,16) if op not in('vsll','vsrl','vsra') else random.randrange(32)
+            src1={'v':'v16','x':'a2','i':str(imm)}[form]
+            sfx={'v':'vv','x':'vx','i':'vi'}[form]
+            if op in ('vmacc','vnmsac','vmadd','vnmsub'):
+                asm=f'  {op}.{sfx} v24, {src1}, v8'
+            else:
+                asm=f'  {op}.{sfx} v24, v8, {src1}'
+            if masked: asm+=', v0.t'
+            out.append(f'  li a2, {x:#x}'); out.append(asm)
+            if op.startswith('vms'):
+                bits=[]
+                for i in range(vl):
+                    a=rd(8,i,sew); b=rd(16,i,sew) if form=='v' else ((x if form=='x' else imm)&((1<<sew)-1))
+                    bits.append(cmps[op](a,b,sg(a,sew),sg(b,sew)))
+                for i in range(vl):
+                    if masked and not mbit(i): continue
+                    o=24*VLENB+(i>>3); regs[o]=(regs[o]&~(1<<(i&7)))|(int(bits[i])<<(i&7))
+            else:
+                res=[]
+                for i in range(vl):
+                    a=rd(8,i,sew); d=rd(24,i,sew)
+                    b=rd(16,i,sew) if form=='v' else ((x if form=='x' else imm)&((1<<sew)-1))
+                    res.append(binop(op,a,b,d,sew))
+                for i in range(vl):
+                    if masked and not mbit(i): continue
+                    wr(24,i,sew,res[i])
+            check_regs()
+# reductions
+for op in reds:
+    for rep in range(4):
+        masked=rep&1
+        sew,lm,vl=pick()
+        reset(); vl=setvl(sew,lm,vl)
+        out.append(f'  {op}.vs v24, v8, v16'+(', v0.t' if masked else ''))
+        acc=rd(16,0,sew); m=(1<<sew)-1
+        for i in range(vl):
+            if masked and not mbit(i): continue
+            e=rd(8,i,sew)
+            acc={'vredsum':(acc+e)&m,'vredand':acc&e,'vredor':acc|e,'vredxor':acc^e,'vredminu':min(acc,e),'vredmaxu':max(acc,e),
+                 'vredmin':acc if sg(acc,sew)<=sg(e,sew) else e,'vredmax':acc if sg(acc,sew)>=sg(e,sew) else e}[op]
+        if vl: wr(24,0,sew,acc)
+        check_regs()
+# merge and moves
+for form in 'vxi':
+    for masked in (0,1):
+        for rep in range(2):
+            sew,lm,vl=pick(); reset(); vl=setvl(sew,lm,vl)
+            x=random.getrandbits(32); imm=random.randrange(-16,16)
+            src1={'v':'v16','x':'a2','i':str(imm)}[form]; sfx={'v':'vv','x':'vx','i':'vi'}[form]
+            out.append(f'  li a2, {x:#x}')
+            out.append(f'  vmerge.{sfx}m v24, v8, {src1}, v0' if masked else f'  vmv.v.{form} v24, {src1}')
+            for i in range(vl):
+                b=rd(16,i,sew) if form=='v' else ((x if form=='x' else imm)&((1<<sew)-1))
+                wr(24,i,sew,b if (not masked or mbit(i)) else rd(8,i,sew))
+            check_regs()
+for sew in (8,16,32):
+    reset(); setvl(sew,'m1',3); x=random.getrandbits(32)
+    out+= [f'  li a2, {x:#x}','  vmv.s.x v24, a2']; wr(24,0,sew,x); check_regs()
+    setvl(sew,'m1',3); out+= ['  vmv.x.s a3, v8']; a=rd(8,0,sew); check_x(sg(a,sew)&M32)
+    reset(); setvl(sew,'m1',0); out+= ['  vmv.s.x v24, a2']; check_regs()
+# loads
+for eew in (8,16,32):
+    for masked in (0,1):
+        for strided in (0,1):
+            for rep in range(2):
+                sew,lm,vl=pick()
+                emul=lmuls[lm]*eew/sew
+                if emul>8: continue
+                reset(); vl=setvl(sew,lm,vl)
+                stride=random.choice([eew//8*2,-eew//8,0,eew//8*3]) if strided else eew//8
+                off=G//2 if stride<0 else random.randrange(0,8)
+                if off+stride*max(vl-1,0)+eew//8>G or off+stride*max(vl-1,0)<0: continue
+                base=f'init_b+{off}'
+                out.append(f'  la a1, {base}')
+                m=', v0.t' if masked else ''
+                if strided: out+= [f'  li a2, {stride}', f'  vlse{eew}.v v24, (a1), a2{m}']
+                else: out.append(f'  vle{eew}.v v24, (a1){m}')
+                for i in range(vl):
+                    if masked and not mbit(i): continue
+                    a=off+i*stride
+                    wr(24,i,eew,int.from_bytes(B[a:a+eew//8],'little'))
+                check_regs()
+# stores, into outbuf after filling it with init_d
+for eew in (8,16,32):
+    for masked in (0,1):
+        for strided in (0,1):
+            for rep in range(2):
+                sew,lm,vl=pick()
+                if lmuls[lm]*eew/sew>8: continue
+                stride=random.choice([eew//8*2,-eew//8,eew//8*3]) if strided else eew//8
+                off=G//2 if stride<0 else random.randrange(0,8)
+                if off+stride*max(vl-1,0)+eew//8>G or off+stride*max(vl-1,0)<0: continue
+                reset()
+                out+= ['  vsetvli t0, zero, e8, m8, ta, ma','  la a1, outbuf','  vse8.v v24, (a1)']
+                mem=bytearray(D)
+                vl=setvl(sew,lm,vl)
+                out.append(f'  la a1, outbuf+{off}')
+                m=', v0.t' if masked else ''
+                if strided: out+= [f'  li a2, {stride}', f'  vsse{eew}.v v8, (a1), a2{m}']
+                else: out.append(f'  vse{eew}.v v8, (a1){m}')
+                for i in range(vl):
+                    if masked and not mbit(i): continue
+                    a=off+i*stride
+                    mem[a:a+eew//8]=regs[8*VLENB+i*eew//8:8*VLENB+(i+1)*eew//8]
+                check_mem()
+# vsetvl forms and the csrs
+out+= ['  li t1, 1000','  vsetvli a3, t1, e16, m2, ta, ma']; check_x(VLENB)
+out+= ['  csrr a3, vl']; check_x(VLENB)
+out+= ['  csrr a3, vtype']; check_x(0xC9)
+out+= ['  csrr a3, vlenb']; check_x(VLENB)
+out+= ['  vsetvli a3, zero, e8, m4, ta, ma']; check_x(VLENB*4)
+out+= ['  li t1, 5','  vsetvli a3, t1, e32, m1, ta, ma','  vsetvli zero, zero, e32, m1, ta, ma','  csrr a3, vl']; check_x(min(5, VLENB // 4))
+out+= ['  vsetivli a3, 3, e8, mf2, ta, ma']; check_x(3)
+out+= ['  li t1, 100','  li t2, 0x12','  vsetvl a3, t1, t2']; check_x(VLENB)
+out+= ['  li t2, 0x18','  vsetvl a3, t1, t2']; check_x(0)   # e64 is vill
+out+= ['  csrr a3, vtype']; check_x(0x80000000)
+out+= ['  vsetivli a3, 8, e16, mf4, ta, ma']; check_x(0)    # sew above lmul * elen
+out+= ['  li a0, 0','  li a7, 93','  ecall',
+ 'cmp128:','  la a1, outbuf',f'  li t2, {G//4}','2:','  lw t3, 0(a1)','  lw t4, 0(a5)','  beq t3, t4, 3f','  j fail','3:',
+ '  addi a1, a1, 4','  addi a5, a5, 4','  addi t2, t2, -1','  bnez t2, 2b','  ret',
+ 'fail:','  andi a0, s11, 0x7f','  ori a0, a0, 0x80','  slli a0, a0, 1','  li a7, 93','  ecall']
+print('\n'.join(out+data))
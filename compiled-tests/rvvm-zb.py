@@ -0,0 +1,48 @@
+# Zba, Zbb and Zbs: every instruction on edge values and random ones, with
+# shift amounts past 31 for the register forms, clz/ctz of 0 and a clz to
+# x0. Prints the guest's assembly, which exits 0, or 128 plus the number of
+# the check that failed modulo 128, there are more than 255 of them.
+import random
+random.seed(7)
+M=0xffffffff
+def s32(x): x&=M; return x-(1<<32) if x>>31 else x
+def rol(v,s): s&=31; return ((v<<s)|(v>>((32-s)&31)))&M if s else v
+def ror(v,s): s&=31; return ((v>>s)|(v<<((32-s)&31)))&M if s else v
+def clz(v): return 32-v.bit_length()
+def ctz(v): return 32 if v==0 else (v&-v).bit_length()-1
+def sx(v,b): v&=(1<<b)-1; return (v-(1<<b) if v>>(b-1) else v)&M
+r2={
+ 'sh1add':lambda a,b:((a<<1)+b)&M,'sh2add':lambda a,b:((a<<2)+b)&M,'sh3add':lambda a,b:((a<<3)+b)&M,
+ 'andn':lambda a,b:a&~b&M,'orn':lambda a,b:(a|~b)&M,'xnor':lambda a,b:~(a^b)&M,
+ 'min':lambda a,b:a if s32(a)<s32(b) else b,'minu':min,'max':lambda a,b:a if s32(a)>s32(b) else b,'maxu':max,
+ 'rol':lambda a,b:rol(a,b),'ror':lambda a,b:ror(a,b),
+ 'bclr':lambda a,b:a&~(1<<(b&31))&M,'bext':lambda a,b:(a>>(b&31))&1,'binv':lambda a,b:a^(1<<(b&31)),'bset':lambda a,b:a|(1<<(b&31)),
+ 'add':lambda a,b:(a+b)&M,'sub':lambda a,b:(a-b)&M,'sra':lambda a,b:(s32(a)>>(b&31))&M,'mul':lambda a,b:(a*b)&M,
+}
+r1={'clz':clz,'ctz':ctz,'cpop':lambda v:bin(v).count('1'),'sext.b':lambda v:sx(v,8),'sext.h':lambda v:sx(v,16),'zext.h':lambda v:v&0xffff,
+ 'orc.b':lambda v:sum((0xff<<(8*i)) for i in range(4) if (v>>(8*i))&0xff),'rev8':lambda v:int.from_bytes(v.to_bytes(4,'little'),'big')}
+ri={'rori':lambda a,s:ror(a,s),'bclri':lambda a,s:a&~(1<<s)&M,'bexti':lambda a,s:(a>>s)&1,'binvi':lambda a,s:a^(1<<s),'bseti':lambda a,s:a|(1<<s),
+ 'slli':lambda a,s:(a<<s)&M,'srli':lambda a,s:a>>s,'srai':lambda a,s:(s32(a)>>s)&M}
+vals=[0,1,M,0x80000000,0x7fffffff,0xff,0xff00,0x00ff0000,0x12345678,0x80,0x8000]+[random.getrandbits(32) for _ in range(6)]
+out=['# generated by rvvm-zb.py','  .text','  .globl _start','_start:']
+n=0
+def check():
+    global n
+    n+=1
+    out.extend([f'  li s11, {n}', '  beq a3, a4, 1f', '  j fail', '1:'])
+for op,f in r2.items():
+    for a in vals[:8]+random.sample(vals,4):
+        b=random.choice(vals+[3,31,32,33,17])
+        out+= [f'  li a1, {a:#x}', f'  li a2, {b:#x}', f'  {op} a3, a1, a2', f'  li a4, {f(a,b):#x}']; check()
+for op,f in r1.items():
+    for a in vals:
+        out+= [f'  li a1, {a:#x}', f'  {op} a3, a1', f'  li a4, {f(a):#x}']; check()
+for op,f in ri.items():
+    for a in vals:
+        s=random.randrange(32)
+        for sh in (s,0,31):
+            out+= [f'  li a1, {a:#x}', f'  {op} a3, a1, {sh}', f'  li a4, {f(a,sh):#x}']; check()
+# x0 destination is a nop
+out+= ['  li a3, 5','  clz x0, a3','  mv a4, x0','  li a3, 0']; check()
+out+= ['  li a0, 0','  li a7, 93','  ecall','fail:','  andi a0, s11, 0x7f','  ori a0, a0, 0x80','  slli a0, a0, 1','  li a7, 93','  ecall']
+print('\n'.join(out))
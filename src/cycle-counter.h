@@ -6,10 +6,10 @@
 #include <x86intrin.h>
 #include <time.h>
 
-static struct timespec ts;
 static uint64_t __start_time;
 
 static inline uint64_t get_cycles(void) {
+  struct timespec ts;
   // Notes:
   // - RDTSC reads the time stamp counter
   // - _mm_lfence() prevents out-of-order execution
@@ -21,7 +21,12 @@ static inline uint64_t get_cycles(void) {
   return nanoseconds - __start_time;
 }
 
+// the origin is shared by every VM in the process, so it is only set once
 static inline void init_counter(void) {
+  if (__start_time) {
+    return;
+  }
+  struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
   uint64_t nanoseconds = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
   __start_time = nanoseconds;
@@ -0,0 +1,371 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cycle-counter.h"
+#include "riscv-vm-aot.h"
+#include "riscv-vm-decode.h"
+
+void aot_stop(aot_state_t *s, uint32_t pc, uint32_t uncount, int code) {
+  s->instret -= uncount;
+  s->pc = pc;
+  s->exit_code = code;
+  longjmp(s->stop, 1);
+}
+
+void aot_bad_load(aot_state_t *s, uint32_t pc, uint32_t uncount, uint32_t addr) {
+#if USE_PRINT
+  fprintf(stderr, "load went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", pc, addr, *(uint32_t *)(s->wmem + pc));
+#endif
+  aot_stop(s, pc, uncount, ERR_INVALID_MEMORY_ACCESS);
+}
+
+void aot_store_slow(aot_state_t *s, uint32_t addr, uint32_t v2, int width, uint32_t pc, uint32_t uncount) {
+  uint8_t *wmem = s->wmem;
+  if (s->mem_write_intercept && addr == s->mem_write_intercept) {
+    printf("MEM_INTERCEPT: op_store addr 0x%x v2 %d (0x%x) PC 0x%x\n", addr, v2, v2, pc);
+  }
+#if EMULATE_UART_OUT
+  if (addr == UART_OUT_REGISTER) {
+    if (width == 1) {
+#if USE_PRINT
+      vm_console_putc(vm_files_console(&s->files), (uint8_t)v2);
+#endif
+    }
+    return;
+  }
+#endif
+  addr &= 0x7FFFFFFF;
+  if (addr > AOT_MEM_SIZE - width) {
+#if USE_PRINT
+    fprintf(stderr, "store went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", pc, addr, *(uint32_t *)(wmem + pc));
+#endif
+    aot_stop(s, pc, uncount, ERR_INVALID_MEMORY_ACCESS);
+  }
+#if USE_TOHOST_SYSCALL
+  if (addr == tohost) {
+    uint32_t from_virt = v2;
+    if (from_virt & 1) {
+      aot_stop(s, pc, uncount, from_virt >> 1);
+    }
+    from_virt = vm_tohost_syscall(vm_files_console(&s->files), wmem, s->files.layout.mem_size, v2);
+    if (from_virt != SYS_write) {
+#if USE_PRINT
+      fprintf(stderr, "unimplemented magic syscall %d\n", from_virt);
+#endif
+      aot_stop(s, pc, uncount, ERR_UNIMPLEMENTED_MAGIC_SYSCALL);
+    }
+    wmem[fromhost] = 1;
+    return;
+  }
+#endif
+  if (width == 1) {
+    wmem[addr] = (uint8_t)v2;
+  } else if (width == 2) {
+    *(uint16_t *)(wmem + addr) = (uint16_t)v2;
+  } else {
+    *(uint32_t *)(wmem + addr) = v2;
+  }
+}
+
+void aot_ecall(aot_state_t *s, uint32_t pc, uint32_t uncount) {
+  uint32_t *registers = s->regs;
+  uint32_t a0 = registers[10]; // argument
+  uint32_t a7 = registers[17]; // function
+  switch (a7) {
+  case SYS_print_mem_access:
+    s->mem_write_intercept = a0;
+    break;
+  case 93: {
+    // exit
+    uint8_t is_test = a0 & 1;
+    uint32_t code = a0 >> 1;
+    if (is_test && a0) {
+#if USE_PRINT
+      fprintf(stderr, "*** FAILED *** (tohost = %d)\n", code);
+#endif
+    }
+    vm_console_flush(s->files.console);
+#if USE_PRINT
+    printf("exit code %d\n", code);
+#endif
+    aot_stop(s, pc, uncount, code);
+  }
+  case 94:
+    // exit_group of a Linux program, the status as it is
+    vm_console_flush(s->files.console);
+#if USE_PRINT
+    printf("exit code %d\n", a0 & 0xFF);
+#endif
+    aot_stop(s, pc, uncount, a0 & 0xFF);
+  default:
+    break;
+  }
+  registers[10] = syscall_handler(&s->files, a7, registers[10], registers[11], registers[12], registers[13], registers[14],
+                                  registers[15], registers[16], s->wmem);
+}
+
+uint32_t aot_csrrs(aot_state_t *s, uint32_t csr, uint32_t old) {
+  switch (csr) {
+  case 0xc01: // time
+    return get_cycles() - s->start_time;
+  case 0xc81: // timeh
+    return (get_cycles() - s->start_time) >> 32;
+  case 0xF14: // mhartid (Hardware thread ID.)
+  case 0x300: // mstatus (Machine status register.)
+  case 0x305: // mtvec (Machine trap-handler base address.)
+    return 0;
+  case 0xb00: // mcycle (Machine cycle counter.)
+    return get_cycles();
+  case 0xB80: // mcycleh
+    return get_cycles() >> 32;
+  case 0xb02: // minstret (Machine instructions-retired counter.)
+    return s->instret;
+  case 0xB82: // minstreth
+    return s->instret >> 32;
+  default:
+    return old;
+  }
+}
+
+// Runs guest code that has no translated block, one instruction at a time,
+// until it reaches the start of a block. Returns that block's pc.
+static uint32_t aot_interpret(aot_state_t *s, uint32_t pc) {
+  uint32_t *r = s->regs;
+  uint8_t *m = s->wmem;
+  for (;;) {
+    if (pc >= s->image_bytes || (pc & 3)) {
+#if USE_PRINT
+      fprintf(stderr, "pc 0x%X is misaligned or beyond the program (image size %d)\n", pc, s->image_bytes);
+#endif
+      aot_stop(s, pc, 0, (pc & 3) ? ERR_MISALIGNED_MEMORY_ACCESS : ERR_INVALID_MEMORY_ACCESS);
+    }
+    if (s->blocks[pc >> 2]) {
+      return pc;
+    }
+    const uint32_t instruction = *(uint32_t *)(m + pc);
+    rv_insn_t in;
+    rv_decode(instruction, &in);
+    s->instret++;
+    const uint32_t v1 = r[in.rs1], v2 = r[in.rs2];
+    const uint32_t imm = in.imm;
+    uint32_t next = pc + 4;
+    switch (in.op) {
+    case RV_OP_NOP:
+      break;
+    case RV_OP_LB:
+      r[in.rd] = aot_lb(s, m, v1 + imm, pc, 0);
+      break;
+    case RV_OP_LH:
+      r[in.rd] = aot_lh(s, m, v1 + imm, pc, 0);
+      break;
+    case RV_OP_LW:
+      r[in.rd] = aot_lw(s, m, v1 + imm, pc, 0);
+      break;
+    case RV_OP_LBU:
+      r[in.rd] = aot_lbu(s, m, v1 + imm, pc, 0);
+      break;
+    case RV_OP_LHU:
+      r[in.rd] = aot_lhu(s, m, v1 + imm, pc, 0);
+      break;
+    case RV_OP_SB:
+      aot_sb(s, m, v1 + imm, v2, pc, 0);
+      break;
+    case RV_OP_SH:
+      aot_sh(s, m, v1 + imm, v2, pc, 0);
+      break;
+    case RV_OP_SW:
+      aot_sw(s, m, v1 + imm, v2, pc, 0);
+      break;
+    case RV_OP_ADDI:
+      r[in.rd] = v1 + imm;
+      break;
+    case RV_OP_SLTI:
+      r[in.rd] = (int32_t)v1 < (int32_t)imm;
+      break;
+    case RV_OP_SLTIU:
+      r[in.rd] = v1 < imm;
+      break;
+    case RV_OP_XORI:
+      r[in.rd] = v1 ^ imm;
+      break;
+    case RV_OP_ORI:
+      r[in.rd] = v1 | imm;
+      break;
+    case RV_OP_ANDI:
+      r[in.rd] = v1 & imm;
+      break;
+    case RV_OP_SLLI:
+      r[in.rd] = v1 << imm;
+      break;
+    case RV_OP_SRLI:
+      r[in.rd] = v1 >> imm;
+      break;
+    case RV_OP_SRAI:
+      r[in.rd] = (int32_t)v1 >> imm;
+      break;
+    case RV_OP_LUI:
+      r[in.rd] = imm;
+      break;
+    case RV_OP_AUIPC:
+      r[in.rd] = pc + imm;
+      break;
+    case RV_OP_ADD:
+      r[in.rd] = v1 + v2;
+      break;
+    case RV_OP_SUB:
+      r[in.rd] = v1 - v2;
+      break;
+    case RV_OP_SLL:
+      r[in.rd] = v1 << (v2 & 0x1F);
+      break;
+    case RV_OP_SLT:
+      r[in.rd] = (int32_t)v1 < (int32_t)v2;
+      break;
+    case RV_OP_SLTU:
+      r[in.rd] = v1 < v2;
+      break;
+    case RV_OP_XOR:
+      r[in.rd] = v1 ^ v2;
+      break;
+    case RV_OP_SRL:
+      r[in.rd] = v1 >> (v2 & 0x1F);
+      break;
+    case RV_OP_SRA:
+      r[in.rd] = (int32_t)v1 >> (v2 & 0x1F);
+      break;
+    case RV_OP_OR:
+      r[in.rd] = v1 | v2;
+      break;
+    case RV_OP_AND:
+      r[in.rd] = v1 & v2;
+      break;
+    case RV_OP_MUL:
+      r[in.rd] = v1 * v2;
+      break;
+    case RV_OP_MULH:
+      r[in.rd] = ((int64_t)(int32_t)v1 * (int64_t)(int32_t)v2) >> 32;
+      break;
+    case RV_OP_MULHSU:
+      r[in.rd] = ((uint64_t)((int64_t)(int32_t)v1 * (uint64_t)v2)) >> 32;
+      break;
+    case RV_OP_MULHU:
+      r[in.rd] = ((uint64_t)v1 * (uint64_t)v2) >> 32;
+      break;
+    case RV_OP_DIV:
+      r[in.rd] = aot_div(v1, v2);
+      break;
+    case RV_OP_DIVU:
+      r[in.rd] = aot_divu(v1, v2);
+      break;
+    case RV_OP_REM:
+      r[in.rd] = aot_rem(v1, v2);
+      break;
+    case RV_OP_REMU:
+      r[in.rd] = aot_remu(v1, v2);
+      break;
+    case RV_OP_BEQ:
+      next = v1 == v2 ? pc + imm : next;
+      break;
+    case RV_OP_BNE:
+      next = v1 != v2 ? pc + imm : next;
+      break;
+    case RV_OP_BLT:
+      next = (int32_t)v1 < (int32_t)v2 ? pc + imm : next;
+      break;
+    case RV_OP_BGE:
+      next = (int32_t)v1 >= (int32_t)v2 ? pc + imm : next;
+      break;
+    case RV_OP_BLTU:
+      next = v1 < v2 ? pc + imm : next;
+      break;
+    case RV_OP_BGEU:
+      next = v1 >= v2 ? pc + imm : next;
+      break;
+    case RV_OP_JAL:
+      if (in.rd) {
+        r[in.rd] = pc + 4;
+      }
+      next = pc + imm;
+      break;
+    case RV_OP_JALR:
+      if (in.rd) {
+        r[in.rd] = pc + 4;
+      }
+      next = (v1 + imm) & 0xFFFFFFFE;
+      break;
+    case RV_OP_ECALL:
+      aot_ecall(s, pc, 0);
+      break;
+    case RV_OP_EBREAK:
+#if USE_PRINT
+      fprintf(stderr, "ebreak, exiting\n");
+#endif
+      aot_stop(s, pc, 0, ERR_EBREAK);
+    case RV_OP_WFI:
+#if USE_PRINT
+      fprintf(stderr, "wfi instruction, exiting\n");
+#endif
+      aot_stop(s, pc, 0, ERR_WFI);
+    case RV_OP_CSRRS:
+      r[in.rd] = aot_csrrs(s, imm, r[in.rd]);
+      break;
+    default:
+#if USE_PRINT
+      fprintf(stderr, "Unimplemented or invalid opcode 0x%02X at PC 0x%02X\n", instruction & 0x7F, pc);
+#endif
+      aot_stop(s, pc, 0, ERR_UNIMPLEMENTED_OPCODE);
+    }
+    pc = next;
+  }
+}
+
+int aot_main(const vm_image_t *image, const aot_block_t *blocks, uint32_t nblocks) {
+  init_counter();
+  aot_state_t *s = calloc(1, sizeof(aot_state_t));
+  if (s == NULL) {
+    return ERR_OUT_OF_MEM;
+  }
+  s->wmem = vm_mem_alloc(AOT_MEM_SIZE);
+  if (s->wmem == NULL) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+    free(s);
+    return ERR_OUT_OF_MEM;
+  }
+  const int loaded = vm_image_load(s->wmem, AOT_MEM_SIZE, image);
+  if (loaded) {
+    vm_mem_free(s->wmem, AOT_MEM_SIZE);
+    free(s);
+    return loaded;
+  }
+  s->regs[2] = vm_linux_init(&s->files, s->wmem, AOT_MEM_SIZE, image);
+  s->blocks = blocks;
+  s->nblocks = nblocks;
+  s->image_bytes = nblocks * 4;
+  s->start_time = get_cycles();
+  if (setjmp(s->stop) == 0) {
+    uint32_t pc = image->entry & 0x7FFFFFFF;
+    for (;;) {
+      const aot_block_t block = pc < s->image_bytes && !(pc & 3) ? blocks[pc >> 2] : NULL;
+      pc = block ? block(s) : aot_interpret(s, pc);
+    }
+  }
+  const int res = s->exit_code;
+  vm_console_flush(s->files.console);
+  const uint64_t mcycle_val = s->instret;
+  const uint64_t duration = get_cycles() - s->start_time;
+  const double speed = (double)mcycle_val / ((double)duration / 1e9);
+  printf("system exit mcycle=%" PRIu64 " dur %" PRIu64 " speed is %g ops/sec (%f "
+         "nanosec/inst)\n",
+         mcycle_val, duration, speed, ((double)duration / 1.0) / (double)mcycle_val);
+#if USE_PRINT
+  printf("Final PC: %04X\n", s->pc);
+#endif
+  vm_files_close(&s->files);
+  vm_mem_free(s->wmem, AOT_MEM_SIZE);
+  free(s);
+  return res;
+}
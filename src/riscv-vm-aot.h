@@ -0,0 +1,111 @@
+#pragma once
+
+#include <setjmp.h>
+#include <stdint.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-optimized-1.h"
+
+// Runtime for programs translated ahead of time by rv2c. The generated C has
+// one function per guest basic block; a block returns the next guest pc (or
+// tail calls the next block when it is known statically). The runtime owns
+// guest memory, the dispatch loop, syscalls and an interpreter for pcs that
+// rv2c did not find a block for (e.g. jalr into the middle of a block).
+// Guest code is assumed not to modify itself.
+
+#define AOT_MEM_SIZE (32 * 1048576)
+
+typedef struct aot_state aot_state_t;
+typedef uint32_t (*aot_block_t)(aot_state_t *s);
+
+struct aot_state {
+  uint32_t regs[32];
+  uint64_t instret;
+  uint8_t *wmem;
+  uint32_t mem_write_intercept;
+  uint32_t pc; // valid after the program stopped
+  uint64_t start_time;
+  const aot_block_t *blocks; // by guest word index, NULL where rv2c found no block
+  uint32_t nblocks;
+  uint32_t image_bytes;
+  int exit_code;
+  vm_files_t files;
+  jmp_buf stop;
+};
+
+// loads image like the interpreters and runs the translated program from its entry, returns the same exit
+// code as the interpreters. blocks has nblocks entries, one per word of guest memory from address 0
+int aot_main(const vm_image_t *image, const aot_block_t *blocks, uint32_t nblocks);
+
+// Slow paths. pc is the instruction's guest pc and uncount the number of
+// instructions after it in the block, which were counted in instret but did
+// not run if the program stops here.
+__attribute__((noreturn)) void aot_stop(aot_state_t *s, uint32_t pc, uint32_t uncount, int code);
+__attribute__((noreturn)) void aot_bad_load(aot_state_t *s, uint32_t pc, uint32_t uncount, uint32_t addr);
+void aot_store_slow(aot_state_t *s, uint32_t addr, uint32_t value, int width, uint32_t pc, uint32_t uncount);
+void aot_ecall(aot_state_t *s, uint32_t pc, uint32_t uncount);
+uint32_t aot_csrrs(aot_state_t *s, uint32_t csr, uint32_t old);
+
+// direct successor: a tail call to its block when optimizing, otherwise through the dispatcher
+#if defined(__OPTIMIZE__)
+#define AOT_GOTO(block, pc) return block(s)
+#else
+#define AOT_GOTO(block, pc) return (pc)
+#endif
+
+#define AOT_LOAD(name, type)                                                                                                               \
+  static inline uint32_t aot_##name(aot_state_t *s, uint8_t *m, uint32_t addr, uint32_t pc, uint32_t uncount) {                          \
+    addr &= 0x7FFFFFFF;                                                                                                                    \
+    if (__builtin_expect(addr > AOT_MEM_SIZE - sizeof(type), 0)) {                                                                         \
+      aot_bad_load(s, pc, uncount, addr);                                                                                                  \
+    }                                                                                                                                      \
+    return *(type *)(m + addr);                                                                                                            \
+  }
+
+AOT_LOAD(lb, int8_t)
+AOT_LOAD(lh, int16_t)
+AOT_LOAD(lw, uint32_t)
+AOT_LOAD(lbu, uint8_t)
+AOT_LOAD(lhu, uint16_t)
+
+// UART and out of range stores fail the bounds check, tohost and the write
+// intercept also go to the slow path
+#define AOT_STORE(name, type)                                                                                                              \
+  static inline void aot_##name(aot_state_t *s, uint8_t *m, uint32_t addr, uint32_t value, uint32_t pc, uint32_t uncount) {               \
+    const uint32_t a = addr & 0x7FFFFFFF;                                                                                                  \
+    if (__builtin_expect(a > AOT_MEM_SIZE - sizeof(type) || a == tohost || s->mem_write_intercept, 0)) {                                   \
+      aot_store_slow(s, addr, value, sizeof(type), pc, uncount);                                                                           \
+      return;                                                                                                                              \
+    }                                                                                                                                      \
+    *(type *)(m + a) = (type)value;                                                                                                        \
+  }
+
+AOT_STORE(sb, uint8_t)
+AOT_STORE(sh, uint16_t)
+AOT_STORE(sw, uint32_t)
+
+static inline uint32_t aot_div(uint32_t v1, uint32_t v2) {
+  if (v2 == 0) {
+    return 0xFFFFFFFF;
+  }
+  if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+    // integer overflow
+    return v1;
+  }
+  return (int32_t)v1 / (int32_t)v2;
+}
+
+static inline uint32_t aot_divu(uint32_t v1, uint32_t v2) { return v2 == 0 ? 0xFFFFFFFF : v1 / v2; }
+
+static inline uint32_t aot_rem(uint32_t v1, uint32_t v2) {
+  if (v2 == 0) {
+    return v1;
+  }
+  if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+    // integer overflow
+    return 0;
+  }
+  return (int32_t)v1 % (int32_t)v2;
+}
+
+static inline uint32_t aot_remu(uint32_t v1, uint32_t v2) { return v2 == 0 ? v1 : v1 % v2; }
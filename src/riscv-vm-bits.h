@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+// Zbb operations the host has single instructions for. rol/ror and bswap
+// are in every x86-64; lzcnt, tzcnt and popcnt are not in the baseline the
+// repo builds for, so they are used when cpuid has them at startup and the
+// compiler's sequences stand in otherwise.
+
+#if defined(__x86_64__)
+// set from cpuid before main, see riscv-vm-common.c
+extern int vm_host_lzcnt;
+extern int vm_host_tzcnt;
+extern int vm_host_popcnt;
+#endif
+
+static inline uint32_t rv_clz(uint32_t v) {
+#if defined(__x86_64__) && !defined(__LZCNT__)
+  if (__builtin_expect(vm_host_lzcnt, 1)) {
+    uint32_t r;
+    __asm__("lzcntl %1, %0" : "=r"(r) : "rm"(v) : "cc");
+    return r;
+  }
+#endif
+  return v ? (uint32_t)__builtin_clz(v) : 32;
+}
+
+static inline uint32_t rv_ctz(uint32_t v) {
+#if defined(__x86_64__) && !defined(__BMI__)
+  if (__builtin_expect(vm_host_tzcnt, 1)) {
+    uint32_t r;
+    __asm__("tzcntl %1, %0" : "=r"(r) : "rm"(v) : "cc");
+    return r;
+  }
+#endif
+  return v ? (uint32_t)__builtin_ctz(v) : 32;
+}
+
+static inline uint32_t rv_cpop(uint32_t v) {
+#if defined(__x86_64__) && !defined(__POPCNT__)
+  if (__builtin_expect(vm_host_popcnt, 1)) {
+    uint32_t r;
+    __asm__("popcntl %1, %0" : "=r"(r) : "rm"(v) : "cc");
+    return r;
+  }
+#endif
+  return (uint32_t)__builtin_popcount(v);
+}
+
+static inline uint32_t rv_rol(uint32_t v, uint32_t shift) {
+  return (v << (shift & 31)) | (v >> (-shift & 31));
+}
+
+static inline uint32_t rv_ror(uint32_t v, uint32_t shift) {
+  return (v >> (shift & 31)) | (v << (-shift & 31));
+}
+
+// orc.b, every byte that is not 0 becomes 0xFF
+static inline uint32_t rv_orc_b(uint32_t v) {
+  // bit 7 of a byte is set when the byte is not 0, the sums do not carry into the next byte
+  const uint32_t t = ((v & 0x7F7F7F7F) + 0x7F7F7F7F) | v;
+  return ((t >> 7) & 0x01010101) * 0xFF;
+}
+
+static inline uint32_t rv_rev8(uint32_t v) {
+  return __builtin_bswap32(v);
+}
@@ -0,0 +1,400 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "riscv-vm-blk.h"
+
+// virtio-mmio registers
+#define MMIO_MAGIC 0x000
+#define MMIO_VERSION 0x004
+#define MMIO_DEVICE_ID 0x008
+#define MMIO_VENDOR_ID 0x00c
+#define MMIO_DEVICE_FEATURES 0x010
+#define MMIO_DEVICE_FEATURES_SEL 0x014
+#define MMIO_DRIVER_FEATURES 0x020
+#define MMIO_DRIVER_FEATURES_SEL 0x024
+#define MMIO_QUEUE_SEL 0x030
+#define MMIO_QUEUE_NUM_MAX 0x034
+#define MMIO_QUEUE_NUM 0x038
+#define MMIO_QUEUE_READY 0x044
+#define MMIO_QUEUE_NOTIFY 0x050
+#define MMIO_INTERRUPT_STATUS 0x060
+#define MMIO_INTERRUPT_ACK 0x064
+#define MMIO_STATUS 0x070
+#define MMIO_QUEUE_DESC_LOW 0x080
+#define MMIO_QUEUE_DESC_HIGH 0x084
+#define MMIO_QUEUE_DRIVER_LOW 0x090
+#define MMIO_QUEUE_DRIVER_HIGH 0x094
+#define MMIO_QUEUE_DEVICE_LOW 0x0a0
+#define MMIO_QUEUE_DEVICE_HIGH 0x0a4
+#define MMIO_CONFIG_GENERATION 0x0fc
+#define MMIO_CONFIG 0x100
+
+#define VIRTIO_MAGIC 0x74726976 // "virt"
+#define VIRTIO_VENDOR 0x554d4551
+#define VIRTIO_ID_BLOCK 2
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+
+#define VIRTIO_BLK_F_RO (1u << 5)
+#define VIRTIO_BLK_F_BLK_SIZE (1u << 6)
+#define VIRTIO_BLK_F_FLUSH (1u << 9)
+#define VIRTIO_F_VERSION_1 1u // bit 32, in the high word
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_ID_BYTES 20
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} virtq_desc_t;
+
+typedef struct {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} virtio_blk_req_t;
+
+struct vm_blk {
+  pthread_mutex_t lock; // the harts of a machine share the device
+  int fd;
+  uint8_t *disk;
+  uint64_t size; // bytes mapped, the capacity in whole sectors
+  int read_only;
+  // transport state, back to 0 when the driver writes 0 to Status
+  uint32_t status;
+  uint32_t device_features_sel;
+  uint32_t driver_features_sel;
+  uint32_t driver_features[2];
+  uint32_t queue_sel;
+  uint32_t queue_num;
+  uint32_t queue_ready;
+  uint64_t queue_desc;
+  uint64_t queue_driver; // the available ring
+  uint64_t queue_device; // the used ring
+  uint16_t last_avail;
+  uint32_t interrupt_status;
+};
+
+static char *default_image;
+
+int vm_blk_set_default_image(const char *path) {
+  free(default_image);
+  default_image = NULL;
+  if (path == NULL) {
+    return 0;
+  }
+  vm_blk_t *blk = vm_blk_create(path);
+  if (blk == NULL) {
+    return -1;
+  }
+  vm_blk_destroy(blk);
+  default_image = strdup(path);
+  return default_image ? 0 : -1;
+}
+
+vm_blk_t *vm_blk_create_default(void) { return default_image ? vm_blk_create(default_image) : NULL; }
+
+vm_blk_t *vm_blk_create(const char *path) {
+  int read_only = 0;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    read_only = 1;
+    fd = open(path, O_RDONLY);
+  }
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  const uint64_t size = fstat(fd, &st) == 0 ? (uint64_t)st.st_size / VM_BLK_SECTOR * VM_BLK_SECTOR : 0;
+  vm_blk_t *blk = size ? calloc(1, sizeof(vm_blk_t)) : NULL;
+  if (blk == NULL) {
+    close(fd);
+    return NULL;
+  }
+  blk->disk = mmap(NULL, size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (blk->disk == MAP_FAILED) {
+    close(fd);
+    free(blk);
+    return NULL;
+  }
+  pthread_mutex_init(&blk->lock, NULL);
+  blk->fd = fd;
+  blk->size = size;
+  blk->read_only = read_only;
+  return blk;
+}
+
+void vm_blk_destroy(vm_blk_t *blk) {
+  if (blk == NULL) {
+    return;
+  }
+  munmap(blk->disk, blk->size);
+  close(blk->fd);
+  pthread_mutex_destroy(&blk->lock);
+  free(blk);
+}
+
+static void blk_reset(vm_blk_t *b) {
+  b->status = 0;
+  b->device_features_sel = 0;
+  b->driver_features_sel = 0;
+  b->driver_features[0] = b->driver_features[1] = 0;
+  b->queue_sel = 0;
+  b->queue_num = 0;
+  b->queue_ready = 0;
+  b->queue_desc = b->queue_driver = b->queue_device = 0;
+  b->last_avail = 0;
+  b->interrupt_status = 0;
+}
+
+// len bytes at guest address addr, NULL when they are not all guest memory
+static uint8_t *blk_guest(uint8_t *wmem, uint32_t mem_size, uint64_t addr, uint64_t len) {
+  const uint32_t a = (uint32_t)addr & 0x7FFFFFFF;
+  if (a > mem_size || len > mem_size - a) {
+    return NULL;
+  }
+  return wmem + a;
+}
+
+static uint32_t blk_config(const vm_blk_t *b, uint32_t offset) {
+  // struct virtio_blk_config up to blk_size
+  uint8_t config[24] = {0};
+  const uint64_t capacity = b->size / VM_BLK_SECTOR;
+  const uint32_t blk_size = VM_BLK_SECTOR;
+  memcpy(config, &capacity, sizeof(capacity));
+  memcpy(config + 20, &blk_size, sizeof(blk_size));
+  uint32_t v = 0;
+  if (offset < sizeof(config)) {
+    memcpy(&v, config + offset, sizeof(config) - offset < 4 ? sizeof(config) - offset : 4);
+  }
+  return v;
+}
+
+static uint32_t blk_load(vm_blk_t *b, uint32_t offset) {
+  switch (offset) {
+  case MMIO_MAGIC:
+    return VIRTIO_MAGIC;
+  case MMIO_VERSION:
+    return 2;
+  case MMIO_DEVICE_ID:
+    return VIRTIO_ID_BLOCK;
+  case MMIO_VENDOR_ID:
+    return VIRTIO_VENDOR;
+  case MMIO_DEVICE_FEATURES:
+    if (b->device_features_sel == 0) {
+      return VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | (b->read_only ? VIRTIO_BLK_F_RO : 0);
+    }
+    return b->device_features_sel == 1 ? VIRTIO_F_VERSION_1 : 0;
+  case MMIO_QUEUE_NUM_MAX:
+    return b->queue_sel == 0 ? VM_BLK_QUEUE_MAX : 0;
+  case MMIO_QUEUE_READY:
+    return b->queue_sel == 0 ? b->queue_ready : 0;
+  case MMIO_INTERRUPT_STATUS:
+    return b->interrupt_status;
+  case MMIO_STATUS:
+    return b->status;
+  case MMIO_CONFIG_GENERATION:
+    return 0;
+  default:
+    return offset >= MMIO_CONFIG ? blk_config(b, offset - MMIO_CONFIG) : 0;
+  }
+}
+
+// runs the request whose chain starts at head, returns the bytes it wrote into guest memory
+static uint32_t blk_request(vm_blk_t *b, uint8_t *wmem, uint32_t mem_size, const virtq_desc_t *desc, uint16_t head) {
+  const virtq_desc_t *chain[VM_BLK_QUEUE_MAX];
+  uint32_t n = 0;
+  for (uint16_t i = head;; i = desc[i].next) {
+    // a loop in the chain, or one into nowhere
+    if (i >= b->queue_num || n == b->queue_num) {
+      return 0;
+    }
+    chain[n++] = &desc[i];
+    if (!(desc[i].flags & VIRTQ_DESC_F_NEXT)) {
+      break;
+    }
+  }
+  const virtq_desc_t *last = chain[n - 1];
+  uint8_t *status = blk_guest(wmem, mem_size, last->addr, 1);
+  if (n < 2 || status == NULL || !(last->flags & VIRTQ_DESC_F_WRITE) || last->len < 1) {
+    return 0;
+  }
+  virtio_blk_req_t req;
+  const uint8_t *h = blk_guest(wmem, mem_size, chain[0]->addr, sizeof(req));
+  if (h == NULL || chain[0]->len < sizeof(req) || (chain[0]->flags & VIRTQ_DESC_F_WRITE)) {
+    *status = VIRTIO_BLK_S_IOERR;
+    return 1;
+  }
+  memcpy(&req, h, sizeof(req));
+
+  // the data descriptors are chain[1] to chain[n - 2]
+  uint64_t total = 0;
+  for (uint32_t i = 1; i + 1 < n; i++) {
+    total += chain[i]->len;
+    const int device_writes = (chain[i]->flags & VIRTQ_DESC_F_WRITE) != 0;
+    if (blk_guest(wmem, mem_size, chain[i]->addr, chain[i]->len) == NULL || device_writes != (req.type != VIRTIO_BLK_T_OUT)) {
+      *status = VIRTIO_BLK_S_IOERR;
+      return 1;
+    }
+  }
+  uint32_t written = 0;
+  switch (req.type) {
+  case VIRTIO_BLK_T_IN:
+  case VIRTIO_BLK_T_OUT: {
+    if (req.sector > b->size / VM_BLK_SECTOR || total > b->size - req.sector * VM_BLK_SECTOR ||
+        (req.type == VIRTIO_BLK_T_OUT && b->read_only)) {
+      *status = VIRTIO_BLK_S_IOERR;
+      return 1;
+    }
+    uint8_t *disk = b->disk + req.sector * VM_BLK_SECTOR;
+    for (uint32_t i = 1; i + 1 < n; i++) {
+      uint8_t *buf = wmem + ((uint32_t)chain[i]->addr & 0x7FFFFFFF);
+      if (req.type == VIRTIO_BLK_T_IN) {
+        memcpy(buf, disk, chain[i]->len);
+        written += chain[i]->len;
+      } else {
+        memcpy(disk, buf, chain[i]->len);
+      }
+      disk += chain[i]->len;
+    }
+    *status = VIRTIO_BLK_S_OK;
+    break;
+  }
+  case VIRTIO_BLK_T_FLUSH:
+    *status = b->read_only || msync(b->disk, b->size, MS_SYNC) == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+    break;
+  case VIRTIO_BLK_T_GET_ID: {
+    static const char id[VIRTIO_BLK_ID_BYTES] = "riscv-vm";
+    if (n < 3) {
+      *status = VIRTIO_BLK_S_IOERR;
+      return 1;
+    }
+    written = chain[1]->len < sizeof(id) ? chain[1]->len : sizeof(id);
+    memcpy(wmem + ((uint32_t)chain[1]->addr & 0x7FFFFFFF), id, written);
+    *status = VIRTIO_BLK_S_OK;
+    break;
+  }
+  default:
+    *status = VIRTIO_BLK_S_UNSUPP;
+    break;
+  }
+  return written + 1;
+}
+
+// QueueNotify: every request made available so far goes to the used ring
+static void blk_notify(vm_blk_t *b, uint8_t *wmem, uint32_t mem_size) {
+  const uint32_t num = b->queue_num;
+  if (!b->queue_ready || num == 0 || (b->status & VIRTIO_STATUS_NEEDS_RESET)) {
+    return;
+  }
+  const virtq_desc_t *desc = (const virtq_desc_t *)blk_guest(wmem, mem_size, b->queue_desc, num * sizeof(virtq_desc_t));
+  uint16_t *avail = (uint16_t *)blk_guest(wmem, mem_size, b->queue_driver, 4 + 2 * num); // flags, idx, ring
+  uint32_t *used = (uint32_t *)blk_guest(wmem, mem_size, b->queue_device, 4 + 8 * num);  // flags and idx, {id, len} ring
+  if (desc == NULL || avail == NULL || used == NULL) {
+    b->status |= VIRTIO_STATUS_NEEDS_RESET;
+    return;
+  }
+  const uint16_t avail_idx = __atomic_load_n(&avail[1], __ATOMIC_ACQUIRE);
+  uint16_t used_idx = ((uint16_t *)used)[1];
+  for (; b->last_avail != avail_idx; b->last_avail++, used_idx++) {
+    const uint16_t head = avail[2 + b->last_avail % num];
+    uint32_t *elem = &used[1 + 2 * (used_idx % num)];
+    elem[0] = head;
+    elem[1] = blk_request(b, wmem, mem_size, desc, head);
+  }
+  __atomic_store_n(&((uint16_t *)used)[1], used_idx, __ATOMIC_RELEASE);
+  b->interrupt_status |= 1;
+}
+
+static void blk_store(vm_blk_t *b, uint8_t *wmem, uint32_t mem_size, uint32_t offset, uint32_t value) {
+  switch (offset) {
+  case MMIO_DEVICE_FEATURES_SEL:
+    b->device_features_sel = value;
+    break;
+  case MMIO_DRIVER_FEATURES:
+    if (b->driver_features_sel < 2) {
+      b->driver_features[b->driver_features_sel] = value;
+    }
+    break;
+  case MMIO_DRIVER_FEATURES_SEL:
+    b->driver_features_sel = value;
+    break;
+  case MMIO_QUEUE_SEL:
+    b->queue_sel = value;
+    break;
+  case MMIO_QUEUE_NUM:
+    if (b->queue_sel == 0) {
+      b->queue_num = value <= VM_BLK_QUEUE_MAX ? value : 0;
+    }
+    break;
+  case MMIO_QUEUE_READY:
+    if (b->queue_sel == 0) {
+      b->queue_ready = value & 1;
+    }
+    break;
+  case MMIO_QUEUE_NOTIFY:
+    if (value == 0) {
+      blk_notify(b, wmem, mem_size);
+    }
+    break;
+  case MMIO_INTERRUPT_ACK:
+    b->interrupt_status &= ~value;
+    break;
+  case MMIO_STATUS:
+    if (value == 0) {
+      blk_reset(b);
+    } else {
+      b->status = value;
+    }
+    break;
+  case MMIO_QUEUE_DESC_LOW:
+    b->queue_desc = (b->queue_desc & ~0xFFFFFFFFull) | value;
+    break;
+  case MMIO_QUEUE_DESC_HIGH:
+    b->queue_desc = (b->queue_desc & 0xFFFFFFFFull) | (uint64_t)value << 32;
+    break;
+  case MMIO_QUEUE_DRIVER_LOW:
+    b->queue_driver = (b->queue_driver & ~0xFFFFFFFFull) | value;
+    break;
+  case MMIO_QUEUE_DRIVER_HIGH:
+    b->queue_driver = (b->queue_driver & 0xFFFFFFFFull) | (uint64_t)value << 32;
+    break;
+  case MMIO_QUEUE_DEVICE_LOW:
+    b->queue_device = (b->queue_device & ~0xFFFFFFFFull) | value;
+    break;
+  case MMIO_QUEUE_DEVICE_HIGH:
+    b->queue_device = (b->queue_device & 0xFFFFFFFFull) | (uint64_t)value << 32;
+    break;
+  default:
+    break;
+  }
+}
+
+uint32_t vm_blk_load(vm_blk_t *b, uint32_t offset) {
+  pthread_mutex_lock(&b->lock);
+  const uint32_t v = blk_load(b, offset);
+  pthread_mutex_unlock(&b->lock);
+  return v;
+}
+
+void vm_blk_store(vm_blk_t *b, uint8_t *wmem, uint32_t mem_size, uint32_t offset, uint32_t value) {
+  pthread_mutex_lock(&b->lock);
+  blk_store(b, wmem, mem_size, offset, value);
+  pthread_mutex_unlock(&b->lock);
+}
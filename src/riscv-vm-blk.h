@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Block device for guest storage, virtio-blk over the virtio-mmio transport
+// (version 2, one split virtqueue) at VM_BLK_BASE, where the QEMU virt board
+// has its first virtio-mmio slot. The disk is a host image file mapped into
+// the VM process with MAP_SHARED, so a sector read or write is a memcpy
+// between guest memory and the mapping and the data reaches the file through
+// the page cache; VIRTIO_BLK_T_FLUSH msyncs it. An image that can't be opened
+// for writing is a read-only disk (VIRTIO_BLK_F_RO).
+//
+// There are no interrupts: a write to QueueNotify runs every request the
+// driver made available before it returns, the driver then finds them in the
+// used ring and InterruptStatus bit 0 set. Registers are 32 bits wide;
+// narrower loads of the config space get the low bytes of the word from
+// their offset on. Descriptor addresses are guest addresses, the top bit is
+// dropped like for every guest access. -opt4 to -opt6 and the JITs have the
+// device; like the read syscall, its writes into guest RAM are not seen by
+// their decoded code caches. The harts of riscv_vm_execute_smp all drive the
+// boot hart's device.
+
+#define VM_BLK_BASE 0x10001000
+#define VM_BLK_SIZE 0x1000
+
+#define VM_BLK_SECTOR 512
+// most descriptors the virtqueue takes
+#define VM_BLK_QUEUE_MAX 256
+
+typedef struct vm_blk vm_blk_t;
+
+// the image vm_blk_create_default attaches, path NULL for none. Returns 0, or -1 when it can't be opened
+int vm_blk_set_default_image(const char *path);
+
+// a device on the default image, NULL when there is none or out of memory
+vm_blk_t *vm_blk_create_default(void);
+
+// a device on the image at path, NULL when it can't be opened or mapped or is empty
+vm_blk_t *vm_blk_create(const char *path);
+void vm_blk_destroy(vm_blk_t *blk);
+
+// register accesses, offset is from VM_BLK_BASE. wmem and mem_size are guest RAM for the virtqueue.
+// Accesses from different threads are serialized
+uint32_t vm_blk_load(vm_blk_t *blk, uint32_t offset);
+void vm_blk_store(vm_blk_t *blk, uint8_t *wmem, uint32_t mem_size, uint32_t offset, uint32_t value);
@@ -1,5 +1,26 @@
 
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv-vm-bits.h"
 #include "riscv-vm-common.h"
+#include "riscv-vm-optimized-1.h"
+
+#if defined(__x86_64__)
+int vm_host_lzcnt;
+int vm_host_tzcnt;
+int vm_host_popcnt;
+
+static __attribute__((constructor)) void vm_host_bits_init(void) {
+  __builtin_cpu_init();
+  vm_host_lzcnt = __builtin_cpu_supports("lzcnt");
+  vm_host_tzcnt = __builtin_cpu_supports("bmi");
+  vm_host_popcnt = __builtin_cpu_supports("popcnt");
+}
+#endif
 
 char *op_names[128] = {
   "unknown",
@@ -143,3 +164,66 @@ void dump_registers(uint8_t *registers __attribute__((unused))) {
   printf("\n");
 #endif
 }
+
+uint8_t *vm_mem_alloc(size_t size) {
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return mem == MAP_FAILED ? NULL : mem;
+}
+
+void vm_mem_free(uint8_t *mem, size_t size) {
+  if (mem) {
+    munmap(mem, size);
+  }
+}
+
+uint32_t vm_image_end(const vm_image_t *image) {
+  uint32_t end = 0;
+  for (uint32_t i = 0; i < image->nsegments; i++) {
+    const vm_segment_t *seg = &image->segments[i];
+    const uint32_t seg_end = (seg->vaddr & 0x7FFFFFFF) + seg->filesz;
+    end = seg_end > end ? seg_end : end;
+  }
+  return end;
+}
+
+int vm_image_load(uint8_t *wmem, size_t mem_size, const vm_image_t *image) {
+  const uint32_t page = sysconf(_SC_PAGESIZE);
+  for (uint32_t i = 0; i < image->nsegments; i++) {
+    const vm_segment_t *seg = &image->segments[i];
+    const uint32_t vaddr = seg->vaddr & 0x7FFFFFFF;
+    if (seg->filesz > seg->memsz || (uint64_t)vaddr + seg->memsz > mem_size) {
+#if USE_PRINT
+      fprintf(stderr, "segment at 0x%X size %u does not fit into memory size %zu\n", seg->vaddr, seg->memsz, mem_size);
+#endif
+      return ERR_OUT_OF_MEM;
+    }
+    // pages entirely inside the file part are mapped from the file, the partial ones at the ends are copied
+    // and the rest of memsz stays the zero pages the memory started as
+    const uint32_t from = (vaddr + page - 1) & ~(page - 1);
+    const uint32_t to = (vaddr + seg->filesz) & ~(page - 1);
+    if (image->fd >= 0 && to > from && ((vaddr - seg->offset) & (page - 1)) == 0 &&
+        mmap(wmem + from, to - from, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, seg->offset + (from - vaddr)) !=
+            MAP_FAILED) {
+      memcpy(wmem + vaddr, seg->data, from - vaddr);
+      memcpy(wmem + to, seg->data + (to - vaddr), vaddr + seg->filesz - to);
+    } else {
+      memcpy(wmem + vaddr, seg->data, seg->filesz);
+    }
+  }
+  const uint32_t entry = image->entry & 0x7FFFFFFF;
+  if ((entry & 3) || entry >= vm_image_end(image)) {
+#if USE_PRINT
+    fprintf(stderr, "entry point 0x%X is misaligned or outside the program\n", image->entry);
+#endif
+    return ERR_INVALID_MEMORY_ACCESS;
+  }
+  return 0;
+}
+
+uint64_t vm_started_ns = 0;
+
+void vm_mark_started(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  vm_started_ns = t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
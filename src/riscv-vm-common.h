@@ -4,7 +4,11 @@
 #include <stdlib.h>
 
 #define SYS_write 64
+#define SYS_open 105
+#define SYS_read 107
 #define SYS_print_mem_access 2048
+// the guest's initialization is done, see riscv_vm_snapshot
+#define SYS_snapshot 2049
 #define INT_MIN_HEX 0x80000000
 
 // 32 registers, 32 bits each
@@ -12,6 +16,9 @@ static const int REG_MEM_SIZE = 32 * 4;
 
 // io devices
 static const uint32_t UART_OUT_REGISTER = 0x10000000;
+// core local interruptor, only the msip words of riscv_vm_execute_smp, after guest RAM
+static const uint32_t CLINT_BASE = 0x02000000;
+static const uint32_t CLINT_SIZE = 0x10000;
 
 static const size_t alignment = 64;
 
@@ -32,3 +39,13 @@ static const char *reg_func_name[] __attribute__((unused)) = {
     "", "csrrw", "csrrs", "csrrc", "csrrwi", "csrrsi", "csrrci"};
 
 void dump_registers(uint8_t *registers) __attribute__((unused));
+
+// Guest RAM. Anonymous mappings start out as the kernel's shared zero page, so
+// nothing is cleared up front and only the pages the guest touches end up in RSS.
+uint8_t *vm_mem_alloc(size_t size);
+void vm_mem_free(uint8_t *mem, size_t size);
+
+// the engines call this right before the first guest instruction, runelf -stats
+// reports the time up to it as startup
+void vm_mark_started(void);
+extern uint64_t vm_started_ns;
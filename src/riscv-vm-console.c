@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv-vm-console.h"
+
+#define CONSOLE_RING_SIZE (1u << 16)
+
+static vm_console_config_t default_config = {VM_CONSOLE_FLUSH_LINE, 4096, 50};
+static int default_config_set; // else the policy is picked per fd as stdio does
+
+struct vm_console {
+  int fd;
+  vm_console_config_t config;
+  uint8_t *ring;
+  uint64_t head;    // bytes appended, moved by the appending thread
+  uint64_t tail;    // bytes in the fd, moved by the writer
+  uint64_t request; // head the writer was asked to drain to
+  uint64_t kicked;  // the last request a size policy made, appending thread only
+  int waiting;      // the writer is, or is about to be, in pthread_cond_wait for work
+  int stop;
+  int threaded; // 0 when the writer did not start, appends write themselves then
+  pthread_mutex_t lock;
+  pthread_cond_t work;    // to the writer, a request or stop
+  pthread_cond_t drained; // from the writer, tail moved
+  pthread_t writer;
+};
+
+void vm_console_set_default_config(const vm_console_config_t *config) {
+  default_config = *config;
+  default_config_set = 1;
+}
+
+int vm_console_parse_config(const char *s, vm_console_config_t *config) {
+  vm_console_config_t c = default_config;
+  char *end = NULL;
+  if (strcmp(s, "line") == 0) {
+    c.policy = VM_CONSOLE_FLUSH_LINE;
+  } else if (strncmp(s, "size:", 5) == 0) {
+    c.policy = VM_CONSOLE_FLUSH_SIZE;
+    c.size = (uint32_t)strtoul(s + 5, &end, 0);
+  } else if (strncmp(s, "time:", 5) == 0) {
+    c.policy = VM_CONSOLE_FLUSH_TIME;
+    c.interval_ms = (uint32_t)strtoul(s + 5, &end, 0);
+  } else {
+    return -1;
+  }
+  if (end != NULL && (*end != '\0' || end == s + 5 || (c.policy == VM_CONSOLE_FLUSH_SIZE ? c.size : c.interval_ms) == 0)) {
+    return -1;
+  }
+  *config = c;
+  return 0;
+}
+
+// everything of buf goes, a failing fd drops the rest rather than stall the guest
+static void write_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+// ring bytes [from, to) into the fd, at most two pieces as the ring wraps
+static void write_range(vm_console_t *c, uint64_t from, uint64_t to) {
+  const uint32_t start = (uint32_t)(from & (CONSOLE_RING_SIZE - 1));
+  const uint32_t len = (uint32_t)(to - from);
+  const uint32_t first = len < CONSOLE_RING_SIZE - start ? len : CONSOLE_RING_SIZE - start;
+  struct iovec iov[2] = {{c->ring + start, first}, {c->ring, len - first}};
+  write_all(c->fd, iov, len > first ? 2 : 1);
+}
+
+static void *console_writer(void *p) {
+  vm_console_t *c = p;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    // waiting is seen by kicks that come after the request is checked, see console_kick
+    __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+    while (!c->stop && __atomic_load_n(&c->request, __ATOMIC_SEQ_CST) <= c->tail) {
+      if (c->config.policy == VM_CONSOLE_FLUSH_TIME) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        const uint64_t ns = t.tv_nsec + (uint64_t)c->config.interval_ms * 1000000;
+        t.tv_sec += ns / 1000000000;
+        t.tv_nsec = ns % 1000000000;
+        if (pthread_cond_timedwait(&c->work, &c->lock, &t) == ETIMEDOUT) {
+          break;
+        }
+      } else {
+        pthread_cond_wait(&c->work, &c->lock);
+      }
+    }
+    __atomic_store_n(&c->waiting, 0, __ATOMIC_SEQ_CST);
+    const int stop = c->stop;
+    const uint64_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    const uint64_t tail = c->tail;
+    pthread_mutex_unlock(&c->lock);
+    if (head != tail) {
+      write_range(c, tail, head);
+    }
+    pthread_mutex_lock(&c->lock);
+    __atomic_store_n(&c->tail, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&c->drained);
+    if (stop && head == __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+vm_console_t *vm_console_create(int fd, const vm_console_config_t *config) {
+  vm_console_t *c = calloc(1, sizeof(vm_console_t));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->ring = malloc(CONSOLE_RING_SIZE);
+  if (c->ring == NULL) {
+    free(c);
+    return NULL;
+  }
+  c->fd = fd;
+  c->config = config ? *config : default_config;
+  if (config == NULL && !default_config_set && !isatty(fd)) {
+    c->config.policy = VM_CONSOLE_FLUSH_SIZE;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->work, NULL);
+  pthread_cond_init(&c->drained, NULL);
+  // what the host printed before goes out first
+  fflush(fd == STDERR_FILENO ? stderr : stdout);
+  c->threaded = pthread_create(&c->writer, NULL, console_writer, c) == 0;
+  return c;
+}
+
+void vm_console_destroy(vm_console_t *c) {
+  if (c == NULL) {
+    return;
+  }
+  if (c->threaded) {
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_signal(&c->work);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->writer, NULL);
+  }
+  pthread_cond_destroy(&c->drained);
+  pthread_cond_destroy(&c->work);
+  pthread_mutex_destroy(&c->lock);
+  free(c->ring);
+  free(c);
+}
+
+// asks the writer to drain to head, waking it only when it sleeps: a busy
+// writer sees the request before it goes to sleep
+static void console_kick(vm_console_t *c) {
+  __atomic_store_n(&c->request, c->head, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&c->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&c->lock);
+    pthread_cond_signal(&c->work);
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+// until the ring has room for len more bytes
+static void console_wait_room(vm_console_t *c, uint32_t len) {
+  pthread_mutex_lock(&c->lock);
+  __atomic_store_n(&c->request, c->head, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&c->work);
+  while (c->head - c->tail + len > CONSOLE_RING_SIZE) {
+    pthread_cond_wait(&c->drained, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void console_appended(vm_console_t *c, const uint8_t *data, uint32_t len) {
+  switch (c->config.policy) {
+  case VM_CONSOLE_FLUSH_LINE:
+    if (len == 1 ? data[0] == '\n' : memchr(data, '\n', len) != NULL) {
+      console_kick(c);
+    }
+    break;
+  case VM_CONSOLE_FLUSH_SIZE:
+    if (c->head - c->kicked >= c->config.size) {
+      c->kicked = c->head;
+      console_kick(c);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void vm_console_write(vm_console_t *c, const void *data, uint32_t len) {
+  if (c == NULL || !c->threaded) {
+    struct iovec iov = {(void *)data, len};
+    write_all(c ? c->fd : STDOUT_FILENO, &iov, 1);
+    return;
+  }
+  const uint8_t *p = data;
+  while (len > 0) {
+    const uint32_t n = len < CONSOLE_RING_SIZE / 2 ? len : CONSOLE_RING_SIZE / 2;
+    if (c->head - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) + n > CONSOLE_RING_SIZE) {
+      console_wait_room(c, n);
+    }
+    const uint32_t start = (uint32_t)(c->head & (CONSOLE_RING_SIZE - 1));
+    const uint32_t first = n < CONSOLE_RING_SIZE - start ? n : CONSOLE_RING_SIZE - start;
+    memcpy(c->ring + start, p, first);
+    memcpy(c->ring, p + first, n - first);
+    __atomic_store_n(&c->head, c->head + n, __ATOMIC_RELEASE);
+    console_appended(c, p, n);
+    p += n;
+    len -= n;
+  }
+}
+
+void vm_console_putc(vm_console_t *c, uint8_t ch) {
+  if (c == NULL || !c->threaded || c->head - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) == CONSOLE_RING_SIZE) {
+    vm_console_write(c, &ch, 1);
+    return;
+  }
+  c->ring[c->head & (CONSOLE_RING_SIZE - 1)] = ch;
+  __atomic_store_n(&c->head, c->head + 1, __ATOMIC_RELEASE);
+  console_appended(c, &ch, 1);
+}
+
+void vm_console_flush(vm_console_t *c) {
+  if (c == NULL || !c->threaded) {
+    return;
+  }
+  pthread_mutex_lock(&c->lock);
+  __atomic_store_n(&c->request, c->head, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&c->work);
+  while (c->tail != c->head) {
+    pthread_cond_wait(&c->drained, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+static vm_console_t *stdout_console;
+
+static void stdout_console_exit(void) {
+  vm_console_destroy(stdout_console);
+  stdout_console = NULL;
+}
+
+vm_console_t *vm_console_default(void) {
+  if (stdout_console == NULL) {
+    stdout_console = vm_console_create(STDOUT_FILENO, NULL);
+    if (stdout_console != NULL) {
+      atexit(stdout_console_exit);
+    }
+  }
+  return stdout_console;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// Guest console output. A console is a ring the VM appends its output to and
+// a writer thread of its own that drains the ring into a host fd with writev,
+// so printing costs the guest a copy instead of stdio calls and write(2)s.
+// When the writer runs is the flush policy; a full ring, vm_console_flush and
+// vm_console_destroy drain it whatever the policy. One thread at a time
+// appends to a console.
+
+typedef enum {
+  VM_CONSOLE_FLUSH_LINE, // at every newline
+  VM_CONSOLE_FLUSH_SIZE, // once size bytes are waiting
+  VM_CONSOLE_FLUSH_TIME, // every interval_ms
+} vm_console_policy_t;
+
+typedef struct {
+  vm_console_policy_t policy;
+  uint32_t size;
+  uint32_t interval_ms;
+} vm_console_config_t;
+
+typedef struct vm_console vm_console_t;
+
+// the config vm_console_create uses without one. Until set it is line based
+// on a terminal and size based otherwise, as stdio buffers
+void vm_console_set_default_config(const vm_console_config_t *config);
+
+// "line", "size:<bytes>" or "time:<ms>" into config, 0 or -1 when s is none of them
+int vm_console_parse_config(const char *s, vm_console_config_t *config);
+
+// a console on fd, config NULL for the default; NULL when out of memory
+vm_console_t *vm_console_create(int fd, const vm_console_config_t *config);
+
+// drains the ring and stops the writer
+void vm_console_destroy(vm_console_t *console);
+
+// a NULL console writes straight to stdout
+void vm_console_putc(vm_console_t *console, uint8_t c);
+void vm_console_write(vm_console_t *console, const void *data, uint32_t len);
+
+// returns once everything appended so far is in the fd
+void vm_console_flush(vm_console_t *console);
+
+// console on stdout for the engines that keep no per-VM state, drained at exit
+vm_console_t *vm_console_default(void);
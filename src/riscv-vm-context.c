@@ -0,0 +1,162 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // memfd_create
+#endif
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-context.h"
+#include "riscv-vm-guard-mem.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
+
+riscv_vm_t *riscv_vm_create(syscall_handler_t user_syscall_handler) {
+  riscv_vm_t *vm = calloc(1, sizeof(riscv_vm_t));
+  if (vm == NULL) {
+    return NULL;
+  }
+  vm->mem_size = VM_CONTEXT_MEM_SIZE;
+  vm->wmem = guard_mem_alloc(vm->mem_size);
+  if (vm->wmem == NULL) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+    free(vm);
+    return NULL;
+  }
+  vm->user_syscall_handler = user_syscall_handler;
+  vm->files.user_syscall_handler = user_syscall_handler;
+  vm->snapshot_fd = -1;
+  return vm;
+}
+
+int riscv_vm_load(riscv_vm_t *vm, const vm_image_t *image) {
+#if USE_PRINT
+  printf("Starting VM... work mem size %zu program len %d\n", vm->mem_size, vm_image_end(image));
+#endif
+  const int res = vm_image_load(vm->wmem, vm->mem_size, image);
+  if (res == 0) {
+    vm->pc = image->entry & 0x7FFFFFFF;
+    vm->registers[2] = vm_linux_init(&vm->files, vm->wmem, vm->mem_size, image);
+  }
+  return res;
+}
+
+void riscv_vm_destroy(riscv_vm_t *vm) {
+  if (vm == NULL) {
+    return;
+  }
+  vm_files_close(&vm->files);
+  if (vm->files.mem_fd) {
+    close(vm->files.mem_fd - 1);
+  }
+  if (vm->snapshot_fd >= 0) {
+    close(vm->snapshot_fd);
+  }
+  guard_mem_free(vm->wmem);
+  free(vm);
+}
+
+uint32_t *riscv_vm_registers(riscv_vm_t *vm) { return vm->registers; }
+
+uint32_t riscv_vm_pc(const riscv_vm_t *vm) { return vm->pc; }
+
+uint64_t riscv_vm_instret(const riscv_vm_t *vm) { return vm->instret; }
+
+void riscv_vm_set_input(riscv_vm_t *vm, int fd) { vm->files.fd_in = fd; }
+
+// an unlinked host file of size bytes, -1 on failure
+static int snapshot_file(size_t size) {
+#if defined(__linux__)
+  int fd = memfd_create("riscv-vm-snapshot", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/riscv-vm-snapshot-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+#endif
+  if (fd >= 0 && ftruncate(fd, size)) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static int page_is_zero(const uint8_t *page, size_t len) {
+  const uint64_t *w = (const uint64_t *)page;
+  for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+    if (w[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int riscv_vm_snapshot(riscv_vm_t *vm) {
+  if (vm->snapshot_fd >= 0) {
+    close(vm->snapshot_fd);
+  }
+  vm->snapshot_fd = snapshot_file(vm->mem_size);
+  if (vm->snapshot_fd < 0) {
+    return ERR_OUT_OF_MEM;
+  }
+  // zero pages stay holes in the file, they read back as zeros without taking memory
+  const size_t page = sysconf(_SC_PAGESIZE);
+  size_t run = 0;
+  for (size_t at = 0; at <= vm->mem_size; at += page) {
+    if (at < vm->mem_size && !page_is_zero(vm->wmem + at, page)) {
+      run += page;
+      continue;
+    }
+    if (run && pwrite(vm->snapshot_fd, vm->wmem + at - run, run, at - run) != (ssize_t)run) {
+      close(vm->snapshot_fd);
+      vm->snapshot_fd = -1;
+      return ERR_OUT_OF_MEM;
+    }
+    run = 0;
+  }
+#if USE_PRINT
+  printf("snapshot at pc %X after %" PRIu64 " instructions\n", vm->pc, vm->instret);
+#endif
+  return 0;
+}
+
+riscv_vm_t *riscv_vm_clone(const riscv_vm_t *vm) {
+  if (vm->snapshot_fd < 0) {
+    return NULL;
+  }
+  riscv_vm_t *clone = riscv_vm_create(vm->user_syscall_handler);
+  if (clone == NULL) {
+    return NULL;
+  }
+  if (mmap(clone->wmem, clone->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, vm->snapshot_fd, 0) == MAP_FAILED) {
+    riscv_vm_destroy(clone);
+    return NULL;
+  }
+  // its own handle, munmap and the pool map snapshot pages back from it and the clone may outlive vm
+  const int mem_fd = fcntl(vm->snapshot_fd, F_DUPFD_CLOEXEC, 0);
+  if (mem_fd < 0) {
+    riscv_vm_destroy(clone);
+    return NULL;
+  }
+  clone->files.mem_fd = mem_fd + 1;
+  memcpy(clone->registers, vm->registers, REG_MEM_SIZE);
+  clone->pc = vm->pc;
+  clone->instret = vm->instret;
+  clone->files.fd_in = vm->files.fd_in;
+  vm_files_reopen_fds(&clone->files, &vm->files);
+  clone->files.layout = vm->files.layout;
+  // the clone's pages come from the snapshot, files mapped into vm's memory are copies there
+  memset(clone->files.layout.from_file, 0, sizeof(clone->files.layout.from_file));
+  return clone;
+}
+
+void riscv_vm_set_budget(riscv_vm_t *vm, uint64_t instructions) { vm->budget = instructions; }
+
+uint64_t riscv_vm_cpu_ns(const riscv_vm_t *vm) { return vm->cpu_ns; }
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
+
+// riscv_vm_execute result under a riscv_vm_sched_t with async_syscalls: the
+// guest's read, open or file write (a7 and a0-a2 in registers) is for the
+// scheduler to make, the result goes to a0 and the pc is already past the ecall
+#define VM_EXIT_SYSCALL (-3)
+
+// riscv_vm_execute result on a hart of riscv_vm_execute_smp: the guest made
+// wfi, the pc is past it
+#define VM_EXIT_WFI (-4)
+
+// guest RAM of a context, behind the guard page reservation (riscv-vm-guard-mem.h)
+#define VM_CONTEXT_MEM_SIZE ((size_t)32 * 1048576)
+
+// State the harts of riscv_vm_execute_smp share
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // an msip was set, or stop
+  uint32_t nharts;
+  int stop; // a hart exited, with exit_code
+  int exit_code;
+  uint32_t msip[RISCV_VM_MAX_HARTS];
+  vm_blk_t *blk; // the boot hart's block device, every hart drives this one
+} vm_machine_t;
+
+// riscv_vm_t, see riscv-vm.h. Everything a run changes lives
+// here, the engine itself keeps no state between instructions of different
+// contexts.
+struct riscv_vm {
+  uint32_t registers[32];
+  uint32_t pc;
+  uint8_t *wmem;
+  size_t mem_size;
+  uint64_t instret;
+  uint64_t start_time;    // get_cycles() when riscv_vm_execute first ran, 0 before
+  uint64_t start_instret; // instret then, not 0 for a clone of a snapshot
+  uint64_t budget;        // instructions per riscv_vm_execute, 0 for no limit
+  uint64_t cpu_ns;        // host CPU time spent in riscv_vm_execute
+  syscall_handler_t user_syscall_handler;
+  vm_files_t files;
+  int snapshot_fd; // RAM as riscv_vm_snapshot froze it, -1 before
+  int async_syscalls; // set by riscv_vm_sched_t when it can make them
+  uint32_t hartid;
+  vm_machine_t *machine; // NULL unless running under riscv_vm_execute_smp
+};
+
+// the block device vm's loads and stores reach, NULL when there is no disk
+static inline vm_blk_t *vm_context_blk(riscv_vm_t *vm) { return vm->machine ? vm->machine->blk : vm_files_blk(&vm->files); }
+
+// CLINT accesses, addr is masked and in [CLINT_BASE, CLINT_BASE + CLINT_SIZE)
+uint32_t vm_clint_load(riscv_vm_t *vm, uint32_t addr);
+void vm_clint_store(riscv_vm_t *vm, uint32_t addr, uint32_t value);
@@ -0,0 +1,544 @@
+#include "riscv-vm-decode.h"
+
+#define GET_RD(inst) (((inst) >> 7) & 0x1F)
+#define GET_RS1(inst) (((inst) >> 15) & 0x1F)
+#define GET_RS2(inst) (((inst) >> 20) & 0x1F)
+#define GET_FUNCT3(inst) (((inst) >> 12) & 0x7)
+#define GET_FUNCT7(inst) (((inst) >> 25) & 0x7F)
+#define GET_IMM_I(inst) ((int32_t)(inst) >> 20)
+#define GET_IMM_U(inst) ((inst) & 0xFFFFF000)
+#define GET_IMM_S(inst) ((int32_t)((inst & 0xFE000000) | ((inst & 0xF80) << 13)) >> 20)
+#define GET_IMM_B(inst)                                                                                                                    \
+  (((int32_t)((inst & 0x80000000) | ((inst & (1 << 7)) << 23) | ((inst & 0x7E000000) >> 1) | ((inst & 0xF00) << 12))) >> 19)
+#define GET_IMM_J(inst)                                                                                                                    \
+  (((int32_t)(((inst << 11) & 0x7F800000) | ((inst << 2) & (1 << 22)) | ((inst >> 9) & 0x3FF000) | (inst & (1 << 31)))) >> 11)
+
+const char *rv_op_names[RV_OP_EXT_COUNT] = {
+    "invalid",  "nop",      "lb",       "lh",       "lw",       "lbu",      "lhu",     "sb",       "sh",      "sw",
+    "addi",     "slti",     "sltiu",    "xori",     "ori",      "andi",     "slli",    "srli",     "srai",    "lui",
+    "auipc",    "add",      "sub",      "sll",      "slt",      "sltu",     "xor",     "srl",      "sra",     "or",
+    "and",      "mul",      "mulh",     "mulhsu",   "mulhu",    "div",      "divu",    "rem",      "remu",    "beq",
+    "bne",      "blt",      "bge",      "bltu",     "bgeu",     "jal",      "jalr",    "ecall",    "ebreak",  "wfi",
+    "csrrs",    "flw",      "fld",      "fsw",      "fsd",      "fmadd.s",  "fmsub.s", "fnmsub.s", "fnmadd.s", "fmadd.d",
+    "fmsub.d",  "fnmsub.d", "fnmadd.d", "fadd.s",   "fsub.s",   "fmul.s",   "fdiv.s",  "fsqrt.s",  "fadd.d",  "fsub.d",
+    "fmul.d",   "fdiv.d",   "fsqrt.d",  "fcvt.w.s", "fcvt.wu.s", "fcvt.s.w", "fcvt.s.wu", "fcvt.w.d", "fcvt.wu.d", "fcvt.d.w",
+    "fcvt.d.wu", "fcvt.s.d", "fcvt.d.s", "fsgnj.s", "fsgnjn.s", "fsgnjx.s", "fmin.s",  "fmax.s",   "fsgnj.d", "fsgnjn.d",
+    "fsgnjx.d", "fmin.d",   "fmax.d",   "fmv.x.w",  "fmv.w.x",  "feq.s",    "flt.s",   "fle.s",    "fclass.s", "feq.d",
+    "flt.d",    "fle.d",    "fclass.d", "fcsr",     "sh1add",   "sh2add",   "sh3add",  "andn",     "orn",     "xnor",
+    "clz",      "ctz",      "cpop",     "sext.b",   "sext.h",   "zext.h",   "min",     "minu",     "max",     "maxu",
+    "rol",      "ror",      "rori",     "orc.b",    "rev8",     "bclr",     "bclri",   "bext",     "bexti",   "binv",
+    "binvi",    "bset",     "bseti",    "vsetvli",  "vsetivli", "vsetvl",   "vle",     "vlse",     "vse",     "vsse",
+    "vmv.x.s",  "vop"};
+
+static const uint8_t load_ops[8] = {RV_OP_LB, RV_OP_LH, RV_OP_LW, RV_OP_NOP, RV_OP_LBU, RV_OP_LHU, RV_OP_INVALID, RV_OP_INVALID};
+static const uint8_t store_ops[8] = {RV_OP_SB, RV_OP_SH, RV_OP_SW, RV_OP_NOP, RV_OP_NOP, RV_OP_NOP, RV_OP_NOP, RV_OP_NOP};
+static const uint8_t int_imm_ops[8] = {RV_OP_ADDI, RV_OP_SLLI, RV_OP_SLTI, RV_OP_SLTIU, RV_OP_XORI, RV_OP_SRLI, RV_OP_ORI, RV_OP_ANDI};
+static const uint8_t int_ops[8] = {RV_OP_ADD, RV_OP_SLL, RV_OP_SLT, RV_OP_SLTU, RV_OP_XOR, RV_OP_SRL, RV_OP_OR, RV_OP_AND};
+static const uint8_t mul_ops[8] = {RV_OP_MUL, RV_OP_MULH, RV_OP_MULHSU, RV_OP_MULHU, RV_OP_DIV, RV_OP_DIVU, RV_OP_REM, RV_OP_REMU};
+static const uint8_t branch_ops[8] = {RV_OP_BEQ, RV_OP_BNE, RV_OP_NOP, RV_OP_NOP, RV_OP_BLT, RV_OP_BGE, RV_OP_BLTU, RV_OP_BGEU};
+
+void rv_decode(uint32_t instruction, rv_insn_t *out) {
+  const uint8_t rd = GET_RD(instruction);
+  const uint8_t funct3 = GET_FUNCT3(instruction);
+  out->op = RV_OP_INVALID;
+  out->rd = rd;
+  out->rs1 = GET_RS1(instruction);
+  out->rs2 = GET_RS2(instruction);
+  out->imm = 0;
+
+  switch (instruction & 0x7F) {
+  case 0x03: // load
+    out->op = rd ? load_ops[funct3] : RV_OP_NOP;
+    out->imm = GET_IMM_I(instruction);
+    break;
+  case 0x0F: // fence, single hart so nothing to order
+    out->op = RV_OP_NOP;
+    break;
+  case 0x13: // op-imm
+    out->op = rd ? int_imm_ops[funct3] : RV_OP_NOP;
+    out->imm = GET_IMM_I(instruction);
+    if (funct3 == 1 || funct3 == 5) {
+      out->imm &= 0x1F;
+      if (funct3 == 5 && ((instruction >> 30) & 1)) {
+        out->op = rd ? RV_OP_SRAI : RV_OP_NOP;
+      }
+      // the other funct7 values are bit manipulation, which rv_decode_ext decodes
+      if (GET_FUNCT7(instruction) & ~0x20 || (funct3 == 1 && GET_FUNCT7(instruction))) {
+        out->op = RV_OP_INVALID;
+      }
+    }
+    break;
+  case 0x17: // auipc
+    out->op = rd ? RV_OP_AUIPC : RV_OP_NOP;
+    out->imm = GET_IMM_U(instruction);
+    break;
+  case 0x23: // store
+    out->op = store_ops[funct3];
+    out->imm = GET_IMM_S(instruction);
+    break;
+  case 0x33: // op
+    switch (GET_FUNCT7(instruction)) {
+    case 0x00:
+      out->op = int_ops[funct3];
+      break;
+    case 0x01:
+      out->op = mul_ops[funct3];
+      break;
+    case 0x20:
+      out->op = funct3 == 0 ? RV_OP_SUB : (funct3 == 5 ? RV_OP_SRA : RV_OP_INVALID);
+      break;
+    default:
+      break;
+    }
+    if (rd == 0 && out->op != RV_OP_INVALID) {
+      out->op = RV_OP_NOP;
+    }
+    break;
+  case 0x37: // lui
+    out->op = rd ? RV_OP_LUI : RV_OP_NOP;
+    out->imm = GET_IMM_U(instruction);
+    break;
+  case 0x63: // branch
+    out->op = branch_ops[funct3];
+    out->imm = GET_IMM_B(instruction);
+    break;
+  case 0x67: // jalr
+    out->op = RV_OP_JALR;
+    out->imm = GET_IMM_I(instruction);
+    break;
+  case 0x6F: // jal
+    out->op = RV_OP_JAL;
+    out->imm = GET_IMM_J(instruction);
+    break;
+  case 0x73: // system
+    if (funct3 == 0) {
+      switch (instruction >> 20) {
+      case 0x000:
+        out->op = RV_OP_ECALL;
+        break;
+      case 0x001:
+        out->op = RV_OP_EBREAK;
+        break;
+      case 0x105:
+        out->op = RV_OP_WFI;
+        break;
+      default: // mret and friends, no privilege modes here
+        out->op = RV_OP_NOP;
+        break;
+      }
+    } else if (funct3 == 2 && rd) {
+      out->op = RV_OP_CSRRS;
+      out->imm = instruction >> 20;
+    } else {
+      // csr writes are ignored, same as in the interpreters
+      out->op = RV_OP_NOP;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// fadd to fsqrt by funct7 >> 2, the low bits of funct7 are the format
+static const uint8_t fp_arith_ops[12][2] = {
+    {RV_OP_FADD_S, RV_OP_FADD_D}, {RV_OP_FSUB_S, RV_OP_FSUB_D}, {RV_OP_FMUL_S, RV_OP_FMUL_D}, {RV_OP_FDIV_S, RV_OP_FDIV_D},
+    {0, 0},                       {0, 0},                       {0, 0},                       {0, 0},
+    {0, 0},                       {0, 0},                       {0, 0},                       {RV_OP_FSQRT_S, RV_OP_FSQRT_D}};
+
+static int decode_fp(uint32_t instruction, rv_insn_t *out) {
+  const uint32_t opcode = instruction & 0x7F;
+  const uint8_t funct3 = GET_FUNCT3(instruction);
+  const uint32_t funct7 = GET_FUNCT7(instruction);
+  // the format of the op-fp and fused instructions, 0 single, 1 double
+  const int d = funct7 & 1;
+  uint8_t op = RV_OP_INVALID;
+  int32_t imm = funct3;
+
+  switch (opcode) {
+  case 0x07: // load-fp
+  case 0x27: // store-fp
+    if (funct3 != 2 && funct3 != 3) {
+      return 0; // vector loads and stores
+    }
+    if (opcode == 0x07) {
+      op = funct3 == 2 ? RV_OP_FLW : RV_OP_FLD;
+      imm = GET_IMM_I(instruction);
+    } else {
+      op = funct3 == 2 ? RV_OP_FSW : RV_OP_FSD;
+      imm = GET_IMM_S(instruction);
+    }
+    break;
+  case 0x43: // fmadd
+  case 0x47: // fmsub
+  case 0x4B: // fnmsub
+  case 0x4F: // fnmadd
+    if ((funct7 & 3) < 2) {
+      op = (d ? RV_OP_FMADD_D : RV_OP_FMADD_S) + ((opcode >> 2) & 3);
+      imm |= (instruction >> 27) << 8;
+    }
+    break;
+  case 0x53: // op-fp
+    if ((funct7 & 3) > 1) {
+      break; // half and quad precision
+    }
+    switch (funct7 >> 2) {
+    case 0x00:
+    case 0x01:
+    case 0x02:
+    case 0x03:
+      op = fp_arith_ops[funct7 >> 2][d];
+      break;
+    case 0x0B:
+      op = GET_RS2(instruction) == 0 ? fp_arith_ops[funct7 >> 2][d] : RV_OP_INVALID;
+      break;
+    case 0x04:
+      op = funct3 < 3 ? (d ? RV_OP_FSGNJ_D : RV_OP_FSGNJ_S) + funct3 : RV_OP_INVALID;
+      break;
+    case 0x05:
+      op = funct3 < 2 ? (d ? RV_OP_FMIN_D : RV_OP_FMIN_S) + funct3 : RV_OP_INVALID;
+      break;
+    case 0x08: // fcvt.s.d, fcvt.d.s
+      op = GET_RS2(instruction) == (uint32_t)!d ? (d ? RV_OP_FCVT_D_S : RV_OP_FCVT_S_D) : RV_OP_INVALID;
+      break;
+    case 0x14: { // feq, flt, fle
+      static const uint8_t cmp_ops[3] = {RV_OP_FLE_S, RV_OP_FLT_S, RV_OP_FEQ_S};
+      if (funct3 < 3) {
+        op = cmp_ops[funct3] + (d ? RV_OP_FEQ_D - RV_OP_FEQ_S : 0);
+      }
+      break;
+    }
+    case 0x18: // fcvt.w, fcvt.wu
+      if (GET_RS2(instruction) < 2) {
+        op = (d ? RV_OP_FCVT_W_D : RV_OP_FCVT_W_S) + GET_RS2(instruction);
+      }
+      break;
+    case 0x1A: // fcvt from w, wu
+      if (GET_RS2(instruction) < 2) {
+        op = (d ? RV_OP_FCVT_D_W : RV_OP_FCVT_S_W) + GET_RS2(instruction);
+      }
+      break;
+    case 0x1C: // fmv.x.w, fclass
+      if (GET_RS2(instruction) == 0 && funct3 == 1) {
+        op = d ? RV_OP_FCLASS_D : RV_OP_FCLASS_S;
+      } else if (GET_RS2(instruction) == 0 && funct3 == 0 && !d) {
+        op = RV_OP_FMV_X_W;
+      }
+      break;
+    case 0x1E: // fmv.w.x
+      op = GET_RS2(instruction) == 0 && funct3 == 0 && !d ? RV_OP_FMV_W_X : RV_OP_INVALID;
+      break;
+    default:
+      break;
+    }
+    break;
+  case 0x73: // system, the csr instructions on the fp csrs
+    if ((funct3 & 3) == 0 || (instruction >> 20) < 1 || (instruction >> 20) > 3) {
+      return 0;
+    }
+    op = RV_OP_FCSR;
+    imm = (instruction >> 20) | funct3 << 12;
+    break;
+  default:
+    return 0;
+  }
+  // the instructions that round have rm in funct3, 5 and 6 are reserved
+  if (op >= RV_OP_FMADD_S && op <= RV_OP_FCVT_D_S && (funct3 == 5 || funct3 == 6)) {
+    op = RV_OP_INVALID;
+  }
+  out->op = op;
+  out->rd = GET_RD(instruction);
+  out->rs1 = GET_RS1(instruction);
+  out->rs2 = GET_RS2(instruction);
+  out->imm = imm;
+  return 1;
+}
+
+// Zba, Zbb and Zbs are op and op-imm instructions with funct7 values the base ISA does not use
+static int decode_b(uint32_t instruction, rv_insn_t *out) {
+  const uint8_t funct3 = GET_FUNCT3(instruction);
+  const uint32_t funct7 = GET_FUNCT7(instruction);
+  const uint8_t rs2 = GET_RS2(instruction);
+  uint8_t op = RV_OP_INVALID;
+  int32_t imm = 0;
+
+  if ((instruction & 0x7F) == 0x33) {
+    switch (funct7) {
+    case 0x04:
+      op = funct3 == 4 && rs2 == 0 ? RV_OP_ZEXT_H : RV_OP_INVALID;
+      break;
+    case 0x05: // min, minu, max, maxu
+      op = funct3 >= 4 ? RV_OP_MIN + funct3 - 4 : RV_OP_INVALID;
+      break;
+    case 0x10: // sh1add, sh2add, sh3add
+      op = funct3 && !(funct3 & 1) ? RV_OP_SH1ADD + funct3 / 2 - 1 : RV_OP_INVALID;
+      break;
+    case 0x14:
+      op = funct3 == 1 ? RV_OP_BSET : RV_OP_INVALID;
+      break;
+    case 0x20:
+      if (funct3 == 0 || funct3 == 5) {
+        return 0; // sub, sra
+      }
+      op = funct3 == 4 ? RV_OP_XNOR : (funct3 == 6 ? RV_OP_ORN : (funct3 == 7 ? RV_OP_ANDN : RV_OP_INVALID));
+      break;
+    case 0x24:
+      op = funct3 == 1 ? RV_OP_BCLR : (funct3 == 5 ? RV_OP_BEXT : RV_OP_INVALID);
+      break;
+    case 0x30:
+      op = funct3 == 1 ? RV_OP_ROL : (funct3 == 5 ? RV_OP_ROR : RV_OP_INVALID);
+      break;
+    case 0x34:
+      op = funct3 == 1 ? RV_OP_BINV : RV_OP_INVALID;
+      break;
+    default:
+      return 0;
+    }
+  } else if ((instruction & 0x7F) == 0x13 && (funct3 == 1 || funct3 == 5)) {
+    imm = rs2; // shamt
+    if (funct3 == 1) {
+      static const uint8_t unary_ops[8] = {RV_OP_CLZ,    RV_OP_CTZ,    RV_OP_CPOP,   RV_OP_INVALID,
+                                           RV_OP_SEXT_B, RV_OP_SEXT_H, RV_OP_INVALID, RV_OP_INVALID};
+      switch (funct7) {
+      case 0x00:
+        return 0; // slli
+      case 0x14:
+        op = RV_OP_BSETI;
+        break;
+      case 0x24:
+        op = RV_OP_BCLRI;
+        break;
+      case 0x30:
+        op = rs2 < 8 ? unary_ops[rs2] : RV_OP_INVALID;
+        break;
+      case 0x34:
+        op = RV_OP_BINVI;
+        break;
+      default:
+        break;
+      }
+    } else {
+      switch (funct7) {
+      case 0x00:
+      case 0x20:
+        return 0; // srli, srai
+      case 0x14:
+        op = rs2 == 7 ? RV_OP_ORC_B : RV_OP_INVALID;
+        break;
+      case 0x24:
+        op = RV_OP_BEXTI;
+        break;
+      case 0x30:
+        op = RV_OP_RORI;
+        break;
+      case 0x34:
+        op = rs2 == 0x18 ? RV_OP_REV8 : RV_OP_INVALID;
+        break;
+      default:
+        break;
+      }
+    }
+  } else {
+    return 0;
+  }
+  out->op = op;
+  out->rd = GET_RD(instruction);
+  out->rs1 = GET_RS1(instruction);
+  out->rs2 = rs2;
+  out->imm = imm;
+  if (out->rd == 0 && op != RV_OP_INVALID) {
+    out->op = RV_OP_NOP;
+  }
+  return 1;
+}
+
+// V: op-v, and the vector loads and stores that share load-fp and store-fp.
+// Only what riscv-vm-vector.c executes decodes, the rest is invalid.
+static int decode_v(uint32_t instruction, rv_insn_t *out) {
+  const uint32_t opcode = instruction & 0x7F;
+  const uint8_t funct3 = GET_FUNCT3(instruction);
+  const uint32_t funct6 = instruction >> 26;
+  const uint32_t vm = (instruction >> 25) & 1;
+  uint8_t op = RV_OP_INVALID;
+  int32_t imm = 0;
+
+  switch (opcode) {
+  case 0x07:
+  case 0x27: {
+    // width 0, 5 and 6 are 8, 16 and 32 bit elements, 64 bit ones are above ELEN
+    static const uint8_t eew_bytes[8] = {1, 0, 0, 0, 0, 2, 4, 0};
+    const uint32_t mop = (instruction >> 26) & 3;
+    // no segments (nf), no mew, unit stride only as plain vle and vse
+    if (eew_bytes[funct3] && (instruction >> 28) == 0) {
+      if (mop == 0 && GET_RS2(instruction) == 0) {
+        op = opcode == 0x07 ? RV_OP_VLE : RV_OP_VSE;
+      } else if (mop == 2) {
+        op = opcode == 0x07 ? RV_OP_VLSE : RV_OP_VSSE;
+      }
+    }
+    imm = eew_bytes[funct3] | vm << 4;
+    break;
+  }
+  case 0x57:
+    if (funct3 == 7) {
+      if (!(instruction >> 31)) {
+        op = RV_OP_VSETVLI;
+        imm = (instruction >> 20) & 0x7FF;
+      } else if ((instruction >> 30) == 3) {
+        op = RV_OP_VSETIVLI;
+        imm = (instruction >> 20) & 0x3FF;
+      } else if ((instruction >> 25) == 0x40) {
+        op = RV_OP_VSETVL;
+      }
+    } else if (funct3 == 1 || funct3 == 5) {
+      op = RV_OP_INVALID; // floating point
+    } else if (funct3 == 2 && funct6 == 0x10 && GET_RS1(instruction) == 0) {
+      op = RV_OP_VMV_X_S;
+    } else {
+      op = RV_OP_VOP;
+      imm = funct6 | funct3 << 6 | vm << 9;
+    }
+    break;
+  default:
+    return 0;
+  }
+  out->op = op;
+  out->rd = GET_RD(instruction);
+  out->rs1 = GET_RS1(instruction);
+  out->rs2 = GET_RS2(instruction);
+  out->imm = imm;
+  return 1;
+}
+
+int rv_decode_ext(uint32_t instruction, rv_insn_t *out) {
+  return decode_fp(instruction, out) || decode_b(instruction, out) || decode_v(instruction, out);
+}
+
+// RVC: every 16 bit instruction is an existing 32 bit one with a shorter
+// encoding, so it is expanded and then decoded like any other.
+
+// bit hi..lo of c, at position to
+#define CBITS(c, hi, lo, to) ((((uint32_t)(c) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1)) << (to))
+// x8-x15 in the 3 bit register fields
+#define CREG(c, lo) (8 + (((c) >> (lo)) & 7))
+
+static uint32_t enc_i(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode) {
+  return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t enc_s(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t opcode) {
+  return (((uint32_t)imm >> 5 & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (((uint32_t)imm & 0x1F) << 7) | opcode;
+}
+
+static uint32_t enc_r(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd) {
+  return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | 0x33;
+}
+
+static uint32_t enc_b(int32_t imm, uint32_t rs1, uint32_t funct3) {
+  const uint32_t o = (uint32_t)imm;
+  return ((o >> 12 & 1) << 31) | ((o >> 5 & 0x3F) << 25) | (rs1 << 15) | (funct3 << 12) | ((o >> 1 & 0xF) << 8) | ((o >> 11 & 1) << 7) |
+         0x63;
+}
+
+static uint32_t enc_j(int32_t imm, uint32_t rd) {
+  const uint32_t o = (uint32_t)imm;
+  return ((o >> 20 & 1) << 31) | ((o >> 1 & 0x3FF) << 21) | ((o >> 11 & 1) << 20) | ((o >> 12 & 0xFF) << 12) | (rd << 7) | 0x6F;
+}
+
+// sign extends the low bits of v
+static int32_t sext(uint32_t v, int bits) {
+  return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+uint32_t rv_expand_compressed(uint16_t c) {
+  const uint32_t funct3 = c >> 13;
+  const uint32_t rd = (c >> 7) & 0x1F;
+  const uint32_t rs2 = (c >> 2) & 0x1F;
+  // ci immediate of c.addi, c.li, c.andi
+  const int32_t imm6 = sext(CBITS(c, 12, 12, 5) | CBITS(c, 6, 2, 0), 6);
+  // quadrant and funct3, in octal
+  switch ((c & 3) << 3 | funct3) {
+  case 000: { // c.addi4spn
+    const uint32_t imm = CBITS(c, 12, 11, 4) | CBITS(c, 10, 7, 6) | CBITS(c, 6, 6, 2) | CBITS(c, 5, 5, 3);
+    return imm ? enc_i(imm, 2, 0, CREG(c, 2), 0x13) : 0;
+  }
+  case 001: // c.fld
+    return enc_i(CBITS(c, 12, 10, 3) | CBITS(c, 6, 5, 6), CREG(c, 7), 3, CREG(c, 2), 0x07);
+  case 002: // c.lw
+  case 003: // c.flw
+    return enc_i(CBITS(c, 12, 10, 3) | CBITS(c, 6, 6, 2) | CBITS(c, 5, 5, 6), CREG(c, 7), 2, CREG(c, 2), funct3 == 2 ? 0x03 : 0x07);
+  case 005: // c.fsd
+    return enc_s(CBITS(c, 12, 10, 3) | CBITS(c, 6, 5, 6), CREG(c, 2), CREG(c, 7), 3, 0x27);
+  case 006: // c.sw
+  case 007: // c.fsw
+    return enc_s(CBITS(c, 12, 10, 3) | CBITS(c, 6, 6, 2) | CBITS(c, 5, 5, 6), CREG(c, 2), CREG(c, 7), 2, funct3 == 6 ? 0x23 : 0x27);
+  case 010: // c.addi, c.nop
+    return enc_i(imm6, rd, 0, rd, 0x13);
+  case 011: // c.jal
+  case 015: { // c.j
+    const int32_t imm = sext(CBITS(c, 12, 12, 11) | CBITS(c, 11, 11, 4) | CBITS(c, 10, 9, 8) | CBITS(c, 8, 8, 10) | CBITS(c, 7, 7, 6) |
+                                 CBITS(c, 6, 6, 7) | CBITS(c, 5, 3, 1) | CBITS(c, 2, 2, 5),
+                             12);
+    return enc_j(imm, funct3 == 1 ? 1 : 0);
+  }
+  case 012: // c.li
+    return enc_i(imm6, 0, 0, rd, 0x13);
+  case 013:
+    if (rd == 2) { // c.addi16sp
+      const int32_t imm =
+          sext(CBITS(c, 12, 12, 9) | CBITS(c, 6, 6, 4) | CBITS(c, 5, 5, 6) | CBITS(c, 4, 3, 7) | CBITS(c, 2, 2, 5), 10);
+      return imm ? enc_i(imm, 2, 0, 2, 0x13) : 0;
+    }
+    // c.lui
+    return imm6 ? ((uint32_t)imm6 << 12) | (rd << 7) | 0x37 : 0;
+  case 014: {
+    const uint32_t r = CREG(c, 7);
+    switch ((c >> 10) & 3) {
+    case 0: // c.srli, shamt[5] is reserved on RV32
+      return (c >> 12) & 1 ? 0 : enc_i(rs2, r, 5, r, 0x13);
+    case 1: // c.srai
+      return (c >> 12) & 1 ? 0 : enc_i(0x400 | rs2, r, 5, r, 0x13);
+    case 2: // c.andi
+      return enc_i(imm6, r, 7, r, 0x13);
+    default:
+      if ((c >> 12) & 1) {
+        return 0; // c.subw and c.addw are RV64
+      }
+      static const uint32_t ops[4][2] = {{0x20, 0}, {0, 4}, {0, 6}, {0, 7}}; // sub, xor, or, and
+      const uint32_t *op = ops[(c >> 5) & 3];
+      return enc_r(op[0], CREG(c, 2), r, op[1], r);
+    }
+  }
+  case 016: // c.beqz
+  case 017: { // c.bnez
+    const int32_t imm = sext(CBITS(c, 12, 12, 8) | CBITS(c, 11, 10, 3) | CBITS(c, 6, 5, 6) | CBITS(c, 4, 3, 1) | CBITS(c, 2, 2, 5), 9);
+    return enc_b(imm, CREG(c, 7), funct3 & 1);
+  }
+  case 020: // c.slli
+    return (c >> 12) & 1 ? 0 : enc_i(rs2, rd, 1, rd, 0x13);
+  case 021: // c.fldsp
+    return enc_i(CBITS(c, 12, 12, 5) | CBITS(c, 6, 5, 3) | CBITS(c, 4, 2, 6), 2, 3, rd, 0x07);
+  case 022: // c.lwsp
+    return rd ? enc_i(CBITS(c, 12, 12, 5) | CBITS(c, 6, 4, 2) | CBITS(c, 3, 2, 6), 2, 2, rd, 0x03) : 0;
+  case 023: // c.flwsp, f0 is a register like the others
+    return enc_i(CBITS(c, 12, 12, 5) | CBITS(c, 6, 4, 2) | CBITS(c, 3, 2, 6), 2, 2, rd, 0x07);
+  case 024:
+    if (!((c >> 12) & 1)) {
+      if (rs2 == 0) { // c.jr
+        return rd ? enc_i(0, rd, 0, 0, 0x67) : 0;
+      }
+      return enc_r(0, rs2, 0, 0, rd); // c.mv
+    }
+    if (rs2 == 0) {
+      // c.ebreak, c.jalr
+      return rd ? enc_i(0, rd, 0, 1, 0x67) : 0x00100073;
+    }
+    return enc_r(0, rs2, rd, 0, rd); // c.add
+  case 025: // c.fsdsp
+    return enc_s(CBITS(c, 12, 10, 3) | CBITS(c, 9, 7, 6), rs2, 2, 3, 0x27);
+  case 026: // c.swsp
+  case 027: // c.fswsp
+    return enc_s(CBITS(c, 12, 9, 2) | CBITS(c, 8, 7, 6), rs2, 2, 2, funct3 == 6 ? 0x23 : 0x27);
+  default: // reserved
+    return 0;
+  }
+}
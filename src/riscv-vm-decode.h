@@ -0,0 +1,217 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+  Shared RV32IM decoder used by the engines that decode every guest word once
+  and then execute from the decoded form.
+
+  Writes to x0 are folded into RV_OP_NOP (except jal/jalr, which still jump),
+  so executors never have to check rd against zero.
+ */
+enum {
+  RV_OP_INVALID = 0,
+  RV_OP_NOP,
+  // loads, imm is the sign-extended I immediate
+  RV_OP_LB,
+  RV_OP_LH,
+  RV_OP_LW,
+  RV_OP_LBU,
+  RV_OP_LHU,
+  // stores, imm is the sign-extended S immediate
+  RV_OP_SB,
+  RV_OP_SH,
+  RV_OP_SW,
+  // register-immediate, imm is the I immediate (shift amount for shifts)
+  RV_OP_ADDI,
+  RV_OP_SLTI,
+  RV_OP_SLTIU,
+  RV_OP_XORI,
+  RV_OP_ORI,
+  RV_OP_ANDI,
+  RV_OP_SLLI,
+  RV_OP_SRLI,
+  RV_OP_SRAI,
+  // imm is the U immediate
+  RV_OP_LUI,
+  RV_OP_AUIPC,
+  // register-register
+  RV_OP_ADD,
+  RV_OP_SUB,
+  RV_OP_SLL,
+  RV_OP_SLT,
+  RV_OP_SLTU,
+  RV_OP_XOR,
+  RV_OP_SRL,
+  RV_OP_SRA,
+  RV_OP_OR,
+  RV_OP_AND,
+  RV_OP_MUL,
+  RV_OP_MULH,
+  RV_OP_MULHSU,
+  RV_OP_MULHU,
+  RV_OP_DIV,
+  RV_OP_DIVU,
+  RV_OP_REM,
+  RV_OP_REMU,
+  // branches, imm is the byte offset from the branch pc
+  RV_OP_BEQ,
+  RV_OP_BNE,
+  RV_OP_BLT,
+  RV_OP_BGE,
+  RV_OP_BLTU,
+  RV_OP_BGEU,
+  // imm is the byte offset from the jal pc
+  RV_OP_JAL,
+  // imm is the I immediate
+  RV_OP_JALR,
+  // system, imm is the csr number for RV_OP_CSRRS
+  RV_OP_ECALL,
+  RV_OP_EBREAK,
+  RV_OP_WFI,
+  RV_OP_CSRRS,
+  RV_OP_COUNT
+};
+
+// extensions only some engines run, rv_decode_ext produces these so the
+// others keep tables of RV_OP_COUNT
+enum {
+  // F and D
+  // loads and stores, imm as for the integer ones
+  RV_OP_FLW = RV_OP_COUNT,
+  RV_OP_FLD,
+  RV_OP_FSW,
+  RV_OP_FSD,
+  // imm is the rounding mode, with rs3 in imm >> 8 for the fused ones
+  RV_OP_FMADD_S,
+  RV_OP_FMSUB_S,
+  RV_OP_FNMSUB_S,
+  RV_OP_FNMADD_S,
+  RV_OP_FMADD_D,
+  RV_OP_FMSUB_D,
+  RV_OP_FNMSUB_D,
+  RV_OP_FNMADD_D,
+  RV_OP_FADD_S,
+  RV_OP_FSUB_S,
+  RV_OP_FMUL_S,
+  RV_OP_FDIV_S,
+  RV_OP_FSQRT_S,
+  RV_OP_FADD_D,
+  RV_OP_FSUB_D,
+  RV_OP_FMUL_D,
+  RV_OP_FDIV_D,
+  RV_OP_FSQRT_D,
+  RV_OP_FCVT_W_S,
+  RV_OP_FCVT_WU_S,
+  RV_OP_FCVT_S_W,
+  RV_OP_FCVT_S_WU,
+  RV_OP_FCVT_W_D,
+  RV_OP_FCVT_WU_D,
+  RV_OP_FCVT_D_W,
+  RV_OP_FCVT_D_WU,
+  RV_OP_FCVT_S_D,
+  RV_OP_FCVT_D_S,
+  // no rounding
+  RV_OP_FSGNJ_S,
+  RV_OP_FSGNJN_S,
+  RV_OP_FSGNJX_S,
+  RV_OP_FMIN_S,
+  RV_OP_FMAX_S,
+  RV_OP_FSGNJ_D,
+  RV_OP_FSGNJN_D,
+  RV_OP_FSGNJX_D,
+  RV_OP_FMIN_D,
+  RV_OP_FMAX_D,
+  RV_OP_FMV_X_W,
+  RV_OP_FMV_W_X,
+  RV_OP_FEQ_S,
+  RV_OP_FLT_S,
+  RV_OP_FLE_S,
+  RV_OP_FCLASS_S,
+  RV_OP_FEQ_D,
+  RV_OP_FLT_D,
+  RV_OP_FLE_D,
+  RV_OP_FCLASS_D,
+  // csr instruction on fflags, frm or fcsr: imm is the csr | funct3 << 12, rs1 the register or the uimm
+  RV_OP_FCSR,
+  // Zba, Zbb and Zbs, imm is the shift amount or bit index for the immediate forms
+  RV_OP_SH1ADD,
+  RV_OP_SH2ADD,
+  RV_OP_SH3ADD,
+  RV_OP_ANDN,
+  RV_OP_ORN,
+  RV_OP_XNOR,
+  RV_OP_CLZ,
+  RV_OP_CTZ,
+  RV_OP_CPOP,
+  RV_OP_SEXT_B,
+  RV_OP_SEXT_H,
+  RV_OP_ZEXT_H,
+  RV_OP_MIN,
+  RV_OP_MINU,
+  RV_OP_MAX,
+  RV_OP_MAXU,
+  RV_OP_ROL,
+  RV_OP_ROR,
+  RV_OP_RORI,
+  RV_OP_ORC_B,
+  RV_OP_REV8,
+  RV_OP_BCLR,
+  RV_OP_BCLRI,
+  RV_OP_BEXT,
+  RV_OP_BEXTI,
+  RV_OP_BINV,
+  RV_OP_BINVI,
+  RV_OP_BSET,
+  RV_OP_BSETI,
+  // vector, rd is vd (vs3 for the stores), rs2 is vs2
+  // vsetvli and vsetivli: imm is the vtype, rs1 the uimm avl for vsetivli
+  RV_OP_VSETVLI,
+  RV_OP_VSETIVLI,
+  RV_OP_VSETVL,
+  // imm is the element width in bytes | vm << 4, rs2 the stride register for the strided ones
+  RV_OP_VLE,
+  RV_OP_VLSE,
+  RV_OP_VSE,
+  RV_OP_VSSE,
+  RV_OP_VMV_X_S,
+  // the other op-v instructions, imm is funct6 | funct3 << 6 | vm << 9, rs1 is vs1, rs1 or the imm
+  RV_OP_VOP,
+  RV_OP_EXT_COUNT
+};
+
+// rounding mode field of an instruction that uses frm
+#define RV_RM_DYN 7
+
+typedef struct {
+  uint8_t op;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  int32_t imm;
+} rv_insn_t;
+
+extern const char *rv_op_names[RV_OP_EXT_COUNT];
+
+void rv_decode(uint32_t instruction, rv_insn_t *out);
+
+// decodes F, D, Zba, Zbb, Zbs and V instructions, returns 0 and leaves out alone for the others
+int rv_decode_ext(uint32_t instruction, rv_insn_t *out);
+
+// the 32 bit instruction a 16 bit RVC one stands for, 0 (invalid) for reserved encodings
+uint32_t rv_expand_compressed(uint16_t instruction);
+
+// 1 if the instruction starting with this halfword is a 16 bit RVC one
+static inline int rv_is_compressed(uint32_t instruction) {
+  return (instruction & 3) != 3;
+}
+
+// 1 if the instruction transfers control or has to leave the VM (ends a basic block)
+static inline int rv_op_ends_block(uint8_t op) {
+  return op == RV_OP_INVALID || (op >= RV_OP_BEQ && op < RV_OP_COUNT);
+}
+
+// bytes a load or store accesses
+static inline uint32_t rv_mem_width(uint8_t op) {
+  return (op == RV_OP_LB || op == RV_OP_LBU || op == RV_OP_SB) ? 1 : (op == RV_OP_LH || op == RV_OP_LHU || op == RV_OP_SH) ? 2 : 4;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <fenv.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+  F and D for the engines that execute them. Guest arithmetic is done with
+  host doubles and floats (SSE2 on x86-64), so IEEE results and exception
+  flags come from the host FPU. The host rounding mode is kept at the
+  guest's frm, and the host exception flags accumulate the guest's fflags
+  between the guest's accesses to them.
+
+  What the host does differently is done here: a NaN result is the RISC-V
+  canonical NaN, fmin/fmax follow IEEE 754-2019 minimumNumber and
+  maximumNumber, and conversions to integers saturate. A single is held
+  NaN-boxed in a 64 bit register and reads as the canonical NaN if it is not.
+  The host has no round to nearest, ties to max magnitude: RMM arithmetic
+  rounds to nearest even, only the conversions to integers do RMM.
+ */
+
+// fflags bits
+#define FP_NX 0x01
+#define FP_UF 0x02
+#define FP_OF 0x04
+#define FP_DZ 0x08
+#define FP_NV 0x10
+
+#define FP_NAN_S 0x7FC00000u
+#define FP_NAN_D 0x7FF8000000000000ull
+#define FP_BOX 0xFFFFFFFF00000000ull
+
+static inline double fp_d(uint64_t bits) {
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static inline uint64_t fp_bits_d(double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+static inline uint32_t fp_bits_s(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+// the single in a register, the canonical NaN when it is not NaN-boxed
+static inline uint32_t fp_unbox(uint64_t reg) {
+  return (reg >> 32) == 0xFFFFFFFF ? (uint32_t)reg : FP_NAN_S;
+}
+
+static inline float fp_s(uint64_t reg) {
+  const uint32_t bits = fp_unbox(reg);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// arithmetic results, NaNs become the canonical one
+static inline uint64_t fp_result_d(double d) {
+  return d == d ? fp_bits_d(d) : FP_NAN_D;
+}
+
+static inline uint64_t fp_result_s(float f) {
+  return FP_BOX | (f == f ? fp_bits_s(f) : FP_NAN_S);
+}
+
+static inline int fp_is_snan_d(uint64_t bits) {
+  return ((bits >> 52) & 0x7FF) == 0x7FF && (bits & 0xFFFFFFFFFFFFFull) && !((bits >> 51) & 1);
+}
+
+static inline int fp_is_snan_s(uint32_t bits) {
+  return ((bits >> 23) & 0xFF) == 0xFF && (bits & 0x7FFFFF) && !((bits >> 22) & 1);
+}
+
+// fclass of a value with exp_bits of exponent and frac_bits of fraction
+static inline uint32_t fp_class(uint64_t bits, int exp_bits, int frac_bits) {
+  const int negative = (bits >> (exp_bits + frac_bits)) & 1;
+  const uint64_t exp = (bits >> frac_bits) & ((1ull << exp_bits) - 1);
+  const uint64_t frac = bits & ((1ull << frac_bits) - 1);
+  if (exp == (1ull << exp_bits) - 1) {
+    if (frac == 0) {
+      return negative ? 1 << 0 : 1 << 7; // infinity
+    }
+    return (frac >> (frac_bits - 1)) ? 1 << 9 : 1 << 8; // quiet, signaling NaN
+  }
+  if (exp == 0) {
+    if (frac == 0) {
+      return negative ? 1 << 3 : 1 << 4; // zero
+    }
+    return negative ? 1 << 2 : 1 << 5; // subnormal
+  }
+  return negative ? 1 << 1 : 1 << 6;
+}
+
+// fmin.d (is_max 0) and fmax.d: a NaN operand loses, -0 is below +0
+static inline uint64_t fp_min_max_d(uint64_t a, uint64_t b, int is_max, uint32_t *fflags) {
+  if (fp_is_snan_d(a) || fp_is_snan_d(b)) {
+    *fflags |= FP_NV;
+  }
+  const double x = fp_d(a);
+  const double y = fp_d(b);
+  if (x != x) {
+    return y != y ? FP_NAN_D : b;
+  }
+  if (y != y) {
+    return a;
+  }
+  if (x == y) {
+    // only differ for zeros
+    return is_max ? a & b : a | b;
+  }
+  return isless(x, y) != is_max ? a : b;
+}
+
+static inline uint64_t fp_min_max_s(uint64_t ra, uint64_t rb, int is_max, uint32_t *fflags) {
+  const uint32_t a = fp_unbox(ra);
+  const uint32_t b = fp_unbox(rb);
+  if (fp_is_snan_s(a) || fp_is_snan_s(b)) {
+    *fflags |= FP_NV;
+  }
+  const float x = fp_s(ra);
+  const float y = fp_s(rb);
+  if (x != x) {
+    return FP_BOX | (y != y ? FP_NAN_S : b);
+  }
+  if (y != y) {
+    return FP_BOX | a;
+  }
+  if (x == y) {
+    return FP_BOX | (is_max ? a & b : a | b);
+  }
+  return FP_BOX | (isless(x, y) != is_max ? a : b);
+}
+
+// fcvt.w and fcvt.wu, of a single widened to double or of a double
+static inline uint32_t fp_to_int(double x, uint32_t rm, int is_unsigned, uint32_t *fflags) {
+  if (x != x) {
+    *fflags |= FP_NV;
+    return is_unsigned ? 0xFFFFFFFF : 0x7FFFFFFF;
+  }
+  double r;
+  switch (rm) {
+  case 1: // rtz
+    r = trunc(x);
+    break;
+  case 2: // rdn
+    r = floor(x);
+    break;
+  case 3: // rup
+    r = ceil(x);
+    break;
+  case 4: // rmm
+    r = round(x);
+    break;
+  default: // rne, a tie goes to the even neighbour
+    r = round(x);
+    if (fabs(x - trunc(x)) == 0.5) {
+      r = 2.0 * round(x / 2.0);
+    }
+    break;
+  }
+  if (r < (is_unsigned ? 0.0 : -2147483648.0)) {
+    *fflags |= FP_NV;
+    return is_unsigned ? 0 : 0x80000000;
+  }
+  if (r > (is_unsigned ? 4294967295.0 : 2147483647.0)) {
+    *fflags |= FP_NV;
+    return is_unsigned ? 0xFFFFFFFF : 0x7FFFFFFF;
+  }
+  if (r != x) {
+    *fflags |= FP_NX;
+  }
+  return is_unsigned ? (uint32_t)(int64_t)r : (uint32_t)(int32_t)r;
+}
+
+// host rounding mode for a RISC-V one
+static inline int fp_host_round(uint32_t rm) {
+  switch (rm) {
+  case 1:
+    return FE_TOWARDZERO;
+  case 2:
+    return FE_DOWNWARD;
+  case 3:
+    return FE_UPWARD;
+  default:
+    return FE_TONEAREST;
+  }
+}
+
+// the host exception flags as fflags
+static inline uint32_t fp_host_flags(void) {
+  const int e = fetestexcept(FE_ALL_EXCEPT);
+  return (e & FE_INVALID ? FP_NV : 0) | (e & FE_DIVBYZERO ? FP_DZ : 0) | (e & FE_OVERFLOW ? FP_OF : 0) |
+         (e & FE_UNDERFLOW ? FP_UF : 0) | (e & FE_INEXACT ? FP_NX : 0);
+}
+
+// keeps x from being computed on the other side of a rounding mode change
+#define FP_FENCE(x) __asm__ volatile("" : "+m"(x) : : "memory")
@@ -0,0 +1,95 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-guard-mem.h"
+#include "riscv-vm-optimized-1.h"
+
+__thread uint32_t guard_mem_pc;
+__thread uint32_t guard_mem_access_addr;
+__thread uint32_t guard_mem_addr;
+
+typedef struct guard_mem {
+  uint8_t *mem;
+  struct guard_mem *prev; // VM running on this thread before, for nested runs
+  sigjmp_buf env;
+} guard_mem_t;
+
+static __thread guard_mem_t *guard_current;
+static struct sigaction guard_prev_action;
+static pthread_once_t guard_installed = PTHREAD_ONCE_INIT;
+
+static void guard_mem_handler(int sig, siginfo_t *info, void *ctx) {
+  guard_mem_t *g = guard_current;
+  const uint8_t *addr = info->si_addr;
+  if (g && addr >= g->mem && addr < g->mem + GUARD_MEM_RESERVE) {
+    guard_mem_addr = (uint32_t)(addr - g->mem);
+    siglongjmp(g->env, 1);
+  }
+  // not a guest access: whatever handled it before, the instruction faults again on return
+  if (guard_prev_action.sa_flags & SA_SIGINFO) {
+    guard_prev_action.sa_sigaction(sig, info, ctx);
+  } else {
+    sigaction(SIGSEGV, &guard_prev_action, NULL);
+  }
+}
+
+static void guard_mem_install(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = guard_mem_handler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &guard_prev_action);
+}
+
+uint8_t *guard_mem_alloc(size_t ram_size) {
+  uint8_t *mem = mmap(NULL, GUARD_MEM_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(mem, ram_size, PROT_READ | PROT_WRITE)) {
+    munmap(mem, GUARD_MEM_RESERVE);
+    return NULL;
+  }
+  return mem;
+}
+
+void guard_mem_free(uint8_t *mem) {
+  if (mem) {
+    munmap(mem, GUARD_MEM_RESERVE);
+  }
+}
+
+void *guard_mem_suspend(void) {
+  guard_mem_t *g = guard_current;
+  guard_current = NULL;
+  return g;
+}
+
+void guard_mem_resume(void *saved) { guard_current = saved; }
+
+int guard_mem_run(uint8_t *mem, uint32_t *pcp, guard_mem_fn_t fn, void *arg) {
+  // once per process, VMs on other threads may be running already
+  pthread_once(&guard_installed, guard_mem_install);
+  guard_mem_t guard;
+  guard.mem = mem;
+  guard.prev = guard_current;
+  guard_current = &guard;
+  // the last access on this thread may be another VM's
+  guard_mem_pc = 0;
+  guard_mem_access_addr = UINT32_MAX;
+  int res;
+  if (sigsetjmp(guard.env, 1) == 0) {
+    res = fn(arg);
+  } else {
+    // loads and stores of the engines are at most 4 bytes wide
+    const size_t access = guard_mem_access_addr;
+    *pcp = guard_mem_addr >= access && guard_mem_addr < access + 4 ? guard_mem_pc : guard_mem_addr;
+    res = ERR_INVALID_MEMORY_ACCESS;
+  }
+  guard_current = guard.prev;
+  return res;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Guest memory for the interpreters: the guest RAM is mapped at the start of
+// a reserved 4 GiB range and everything after it is inaccessible, so a load
+// or store with a (masked) 32 bit guest address either hits the RAM or
+// faults. The SIGSEGV handler turns a fault inside the range into
+// ERR_INVALID_MEMORY_ACCESS for the VM that is running on this thread,
+// which takes the bounds compare off every memory instruction.
+
+// 4 GiB plus room for the widest access at the last address
+#define GUARD_MEM_RESERVE (((size_t)1 << 32) + 65536)
+
+// guest pc and address of the load or store in progress, engines set them
+// before each access; a fault anywhere else is the fetch at the faulting pc
+extern __thread uint32_t guard_mem_pc;
+extern __thread uint32_t guard_mem_access_addr;
+
+#define GUARD_MEM_ACCESS(pc, addr) (guard_mem_pc = (pc), guard_mem_access_addr = (addr))
+
+// Host code that an engine calls with guest pointers (syscalls, the tohost
+// block) runs with the guard off. A fault there cannot be abandoned, libc
+// may hold the FILE or malloc lock at that moment, so it crashes instead.
+void *guard_mem_suspend(void);
+void guard_mem_resume(void *saved);
+
+#define GUARD_MEM_HOST_CALL(call)                                                                                                          \
+  ({                                                                                                                                       \
+    void *const guard_saved_ = guard_mem_suspend();                                                                                        \
+    __typeof__(call) guard_res_ = (call);                                                                                                  \
+    guard_mem_resume(guard_saved_);                                                                                                        \
+    guard_res_;                                                                                                                            \
+  })
+
+// guest address of the access that faulted last on this thread
+extern __thread uint32_t guard_mem_addr;
+
+typedef int (*guard_mem_fn_t)(void *arg);
+
+// zeroed guest RAM of ram_size bytes at the start of a 4 GiB reservation, NULL on failure
+uint8_t *guard_mem_alloc(size_t ram_size);
+void guard_mem_free(uint8_t *mem);
+
+// Returns fn(arg) with faults in mem's range caught; when the guest touches
+// memory outside its RAM fn is abandoned (it does not get to copy registers
+// back), *pcp is set to the faulting pc, guard_mem_addr to the address and
+// ERR_INVALID_MEMORY_ACCESS returned.
+int guard_mem_run(uint8_t *mem, uint32_t *pcp, guard_mem_fn_t fn, void *arg);
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+
+#include "riscv-vm-io.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct vm_io {
+  int fd;
+  pthread_mutex_t sq_lock;
+  struct io_uring_params p;
+  uint8_t *sq_ring;
+  size_t sq_ring_size;
+  uint8_t *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+  uint32_t *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  uint32_t in_flight; // submitted and not waited for, never more than fit in the CQ
+};
+
+static int io_uring_enter_(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+vm_io_t *vm_io_create(uint32_t entries, uint32_t in_flight) {
+  vm_io_t *io = calloc(1, sizeof(vm_io_t));
+  if (io == NULL) {
+    return NULL;
+  }
+  io->p.flags = IORING_SETUP_CQSIZE;
+  io->p.cq_entries = in_flight > entries ? in_flight : entries;
+  io->fd = (int)syscall(__NR_io_uring_setup, entries, &io->p);
+  // the file position reads and writes need came with 5.6, as did the ops themselves
+  if (io->fd < 0 || !(io->p.features & IORING_FEAT_RW_CUR_POS)) {
+    if (io->fd >= 0) {
+      close(io->fd);
+    }
+    free(io);
+    return NULL;
+  }
+  io->sq_ring_size = io->p.sq_off.array + io->p.sq_entries * sizeof(uint32_t);
+  io->cq_ring_size = io->p.cq_off.cqes + io->p.cq_entries * sizeof(struct io_uring_cqe);
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->fd, IORING_OFF_SQ_RING);
+  io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->fd, IORING_OFF_CQ_RING);
+  io->sqes = mmap(NULL, io->p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->fd,
+                  IORING_OFF_SQES);
+  if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+    if (io->sq_ring == MAP_FAILED) {
+      io->sq_ring = NULL;
+    }
+    if (io->cq_ring == MAP_FAILED) {
+      io->cq_ring = NULL;
+    }
+    if (io->sqes == MAP_FAILED) {
+      io->sqes = NULL;
+    }
+    vm_io_destroy(io);
+    return NULL;
+  }
+  io->sq_head = (uint32_t *)(io->sq_ring + io->p.sq_off.head);
+  io->sq_tail = (uint32_t *)(io->sq_ring + io->p.sq_off.tail);
+  io->sq_mask = (uint32_t *)(io->sq_ring + io->p.sq_off.ring_mask);
+  io->sq_array = (uint32_t *)(io->sq_ring + io->p.sq_off.array);
+  io->cq_head = (uint32_t *)(io->cq_ring + io->p.cq_off.head);
+  io->cq_tail = (uint32_t *)(io->cq_ring + io->p.cq_off.tail);
+  io->cq_mask = (uint32_t *)(io->cq_ring + io->p.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe *)(io->cq_ring + io->p.cq_off.cqes);
+  pthread_mutex_init(&io->sq_lock, NULL);
+  return io;
+}
+
+void vm_io_destroy(vm_io_t *io) {
+  if (io == NULL) {
+    return;
+  }
+  if (io->sqes) {
+    munmap(io->sqes, io->p.sq_entries * sizeof(struct io_uring_sqe));
+  }
+  if (io->cq_ring) {
+    munmap(io->cq_ring, io->cq_ring_size);
+  }
+  if (io->sq_ring) {
+    munmap(io->sq_ring, io->sq_ring_size);
+  }
+  close(io->fd);
+  pthread_mutex_destroy(&io->sq_lock);
+  free(io);
+}
+
+static int io_submit(vm_io_t *io, const struct io_uring_sqe *sqe) {
+  pthread_mutex_lock(&io->sq_lock);
+  const uint32_t tail = *io->sq_tail;
+  // a full CQ would make the kernel refuse more submissions with -EBUSY
+  if (tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE) == io->p.sq_entries ||
+      __atomic_load_n(&io->in_flight, __ATOMIC_ACQUIRE) == io->p.cq_entries) {
+    pthread_mutex_unlock(&io->sq_lock);
+    return -1;
+  }
+  const uint32_t index = tail & *io->sq_mask;
+  io->sqes[index] = *sqe;
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  int res;
+  do {
+    res = io_uring_enter_(io->fd, 1, 0, 0);
+  } while (res < 0 && errno == EINTR);
+  if (res == 1) {
+    __atomic_add_fetch(&io->in_flight, 1, __ATOMIC_RELEASE);
+  } else {
+    // not consumed, only io_uring_enter moves sq_head: take it back so the
+    // kernel does not start it after the caller made the call itself
+    __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&io->sq_lock);
+  return res == 1 ? 0 : -1;
+}
+
+static int io_rw(vm_io_t *io, uint8_t opcode, int fd, const void *buf, uint32_t len, uint64_t user_data) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sqe.off = (uint64_t)-1; // the file position
+  sqe.addr = (uintptr_t)buf;
+  sqe.len = len;
+  sqe.user_data = user_data;
+  return io_submit(io, &sqe);
+}
+
+int vm_io_read(vm_io_t *io, int fd, void *buf, uint32_t len, uint64_t user_data) {
+  return io_rw(io, IORING_OP_READ, fd, buf, len, user_data);
+}
+
+int vm_io_write(vm_io_t *io, int fd, const void *buf, uint32_t len, uint64_t user_data) {
+  return io_rw(io, IORING_OP_WRITE, fd, buf, len, user_data);
+}
+
+int vm_io_open(vm_io_t *io, const char *path, int flags, uint32_t mode, uint64_t user_data) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_OPENAT;
+  sqe.fd = AT_FDCWD;
+  sqe.addr = (uintptr_t)path;
+  sqe.len = mode;
+  sqe.open_flags = flags;
+  sqe.user_data = user_data;
+  return io_submit(io, &sqe);
+}
+
+int vm_io_nop(vm_io_t *io, uint64_t user_data) {
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_NOP;
+  sqe.user_data = user_data;
+  return io_submit(io, &sqe);
+}
+
+void vm_io_wait(vm_io_t *io, uint64_t *user_data, int32_t *res) {
+  for (;;) {
+    const uint32_t head = *io->cq_head;
+    if (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+      *user_data = cqe->user_data;
+      *res = cqe->res;
+      __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+      __atomic_sub_fetch(&io->in_flight, 1, __ATOMIC_RELEASE);
+      return;
+    }
+    io_uring_enter_(io->fd, 0, 1, IORING_ENTER_GETEVENTS);
+  }
+}
+
+#else
+
+// no io_uring: nothing is ever created, the rest is never called
+vm_io_t *vm_io_create(uint32_t entries __attribute__((unused)), uint32_t in_flight __attribute__((unused))) { return NULL; }
+
+void vm_io_destroy(vm_io_t *io __attribute__((unused))) {}
+
+int vm_io_read(vm_io_t *io __attribute__((unused)), int fd __attribute__((unused)), void *buf __attribute__((unused)),
+               uint32_t len __attribute__((unused)), uint64_t user_data __attribute__((unused))) {
+  return -1;
+}
+
+int vm_io_write(vm_io_t *io __attribute__((unused)), int fd __attribute__((unused)), const void *buf __attribute__((unused)),
+                uint32_t len __attribute__((unused)), uint64_t user_data __attribute__((unused))) {
+  return -1;
+}
+
+int vm_io_open(vm_io_t *io __attribute__((unused)), const char *path __attribute__((unused)), int flags __attribute__((unused)),
+               uint32_t mode __attribute__((unused)), uint64_t user_data __attribute__((unused))) {
+  return -1;
+}
+
+int vm_io_nop(vm_io_t *io __attribute__((unused)), uint64_t user_data __attribute__((unused))) { return -1; }
+
+void vm_io_wait(vm_io_t *io __attribute__((unused)), uint64_t *user_data __attribute__((unused)), int32_t *res __attribute__((unused))) {}
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+// Asynchronous host I/O for guest syscalls, on an io_uring set up through
+// the raw system calls. Any thread can submit; completions are collected by
+// one thread with vm_io_wait. Reads and writes go through the file's current
+// position, like read(2) and write(2), so they mix with lseek. Where there
+// is no io_uring (other hosts, old kernels, or it is disabled)
+// vm_io_create returns NULL and the caller makes the calls itself.
+
+typedef struct vm_io vm_io_t;
+
+// entries requests can be queued for the kernel at once, in_flight can be
+// started and not waited for; more are refused instead of overflowing the CQ
+vm_io_t *vm_io_create(uint32_t entries, uint32_t in_flight);
+void vm_io_destroy(vm_io_t *io);
+
+// queue a request, user_data comes back with its completion; 0 on success, -1 when the ring or the in_flight limit is full
+int vm_io_read(vm_io_t *io, int fd, void *buf, uint32_t len, uint64_t user_data);
+int vm_io_write(vm_io_t *io, int fd, const void *buf, uint32_t len, uint64_t user_data);
+int vm_io_open(vm_io_t *io, const char *path, int flags, uint32_t mode, uint64_t user_data);
+int vm_io_nop(vm_io_t *io, uint64_t user_data);
+
+// blocks for the next completion, res is what the call returned or -errno
+void vm_io_wait(vm_io_t *io, uint64_t *user_data, int32_t *res);
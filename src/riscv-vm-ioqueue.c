@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "riscv-vm-ioqueue.h"
+
+// the poller keeps polling this long after the last submission before it sleeps
+#define IOQUEUE_POLL_IDLE_NS 1000000
+// entries handed to the run callback at a time
+#define IOQUEUE_BATCH 64
+
+struct vm_ioqueue {
+  vm_ioqueue_header_t *header;
+  vm_ioqueue_sqe_t *sq;
+  vm_ioqueue_cqe_t *cq;
+  uint32_t mask;
+  vm_ioqueue_run_t run;
+  void *arg;
+  void *wmem;
+  int stop;
+  int polling;
+  pthread_mutex_t lock; // held while entries run, by the doorbell or the poller
+  pthread_cond_t wake;  // to the sleeping poller, a doorbell or stop
+  pthread_t poller;
+};
+
+uint32_t vm_ioqueue_size(uint32_t entries) {
+  return sizeof(vm_ioqueue_header_t) + entries * (sizeof(vm_ioqueue_sqe_t) + sizeof(vm_ioqueue_cqe_t));
+}
+
+static uint64_t ioqueue_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int ioqueue_pending(const vm_ioqueue_t *q) {
+  return __atomic_load_n(&q->header->sq_tail, __ATOMIC_SEQ_CST) != q->header->sq_head;
+}
+
+// runs the submitted entries while there is room for their completions, with q->lock held
+static uint32_t ioqueue_drain(vm_ioqueue_t *q) {
+  vm_ioqueue_header_t *h = q->header;
+  uint32_t head = h->sq_head;
+  uint32_t tail = __atomic_load_n(&h->sq_tail, __ATOMIC_ACQUIRE);
+  uint32_t cq_tail = h->cq_tail;
+  uint32_t n = 0;
+  // a tail further than the ring goes would run entries twice
+  if (tail - head > q->mask + 1) {
+    tail = head + q->mask + 1;
+  }
+  while (head != tail) {
+    const uint32_t room = q->mask + 1 - (cq_tail - __atomic_load_n(&h->cq_head, __ATOMIC_ACQUIRE));
+    uint32_t batch = tail - head < room ? tail - head : room;
+    if (batch == 0) {
+      break;
+    }
+    if (batch > IOQUEUE_BATCH) {
+      batch = IOQUEUE_BATCH;
+    }
+    // copies, the guest may rewrite a slot once sq_head passed it
+    vm_ioqueue_sqe_t sqes[IOQUEUE_BATCH];
+    uint32_t res[IOQUEUE_BATCH];
+    for (uint32_t i = 0; i < batch; i++) {
+      sqes[i] = q->sq[(head + i) & q->mask];
+    }
+    const uint32_t done = q->run(q->arg, q->wmem, sqes, batch, res);
+    for (uint32_t i = 0; i < done; i++) {
+      vm_ioqueue_cqe_t *c = &q->cq[(cq_tail + i) & q->mask];
+      c->user_data = sqes[i].user_data;
+      c->res = res[i];
+    }
+    cq_tail += done;
+    head += done;
+    n += done;
+    __atomic_store_n(&h->cq_tail, cq_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->sq_head, head, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static void *ioqueue_poller(void *p) {
+  vm_ioqueue_t *q = p;
+  uint64_t busy = ioqueue_ns();
+  pthread_mutex_lock(&q->lock);
+  while (!q->stop) {
+    if (ioqueue_drain(q)) {
+      busy = ioqueue_ns();
+      continue;
+    }
+    if (ioqueue_ns() - busy < IOQUEUE_POLL_IDLE_NS) {
+      pthread_mutex_unlock(&q->lock);
+      sched_yield();
+      pthread_mutex_lock(&q->lock);
+      continue;
+    }
+    // the guest sees the flag or the poller sees its tail, see vm_ioqueue_enter
+    __atomic_fetch_or(&q->header->flags, VM_IOQUEUE_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+    if (!ioqueue_pending(q)) {
+      pthread_cond_wait(&q->wake, &q->lock);
+    }
+    __atomic_fetch_and(&q->header->flags, ~VM_IOQUEUE_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+    busy = ioqueue_ns();
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+vm_ioqueue_t *vm_ioqueue_create(uint8_t *ring, uint32_t entries, int flags, vm_ioqueue_run_t run, void *arg, void *wmem) {
+  vm_ioqueue_t *q = calloc(1, sizeof(vm_ioqueue_t));
+  if (q == NULL) {
+    return NULL;
+  }
+  q->header = (vm_ioqueue_header_t *)ring;
+  q->sq = (vm_ioqueue_sqe_t *)(q->header + 1);
+  q->cq = (vm_ioqueue_cqe_t *)(q->sq + entries);
+  q->mask = entries - 1;
+  q->run = run;
+  q->arg = arg;
+  q->wmem = wmem;
+  // a fresh queue, whatever the guest left in the header
+  memset(q->header, 0, sizeof(vm_ioqueue_header_t));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  if (flags & VM_IOQUEUE_POLL) {
+    if (pthread_create(&q->poller, NULL, ioqueue_poller, q)) {
+      pthread_cond_destroy(&q->wake);
+      pthread_mutex_destroy(&q->lock);
+      free(q);
+      return NULL;
+    }
+    q->polling = 1;
+  }
+  return q;
+}
+
+void vm_ioqueue_destroy(vm_ioqueue_t *q) {
+  if (q == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+  if (q->polling) {
+    pthread_join(q->poller, NULL);
+  }
+  pthread_mutex_lock(&q->lock);
+  ioqueue_drain(q);
+  pthread_mutex_unlock(&q->lock);
+  pthread_cond_destroy(&q->wake);
+  pthread_mutex_destroy(&q->lock);
+  free(q);
+}
+
+uint32_t vm_ioqueue_enter(vm_ioqueue_t *q) {
+  pthread_mutex_lock(&q->lock);
+  const uint32_t n = ioqueue_drain(q);
+  if (q->polling && (__atomic_load_n(&q->header->flags, __ATOMIC_SEQ_CST) & VM_IOQUEUE_NEED_WAKEUP)) {
+    // polling again for what comes next
+    pthread_cond_signal(&q->wake);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+void vm_ioqueue_lock(vm_ioqueue_t *q) {
+  pthread_mutex_lock(&q->lock);
+  ioqueue_drain(q);
+}
+
+void vm_ioqueue_unlock(vm_ioqueue_t *q) { pthread_mutex_unlock(&q->lock); }
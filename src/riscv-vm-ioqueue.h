@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+// Guest I/O queue: a submission and a completion ring the guest sets up in
+// its own memory with the SYS_ioqueue_setup ecall. The guest fills
+// submission entries, each one a syscall as its ecall would make it, moves
+// sq_tail past them and rings the doorbell, the SYS_ioqueue_enter ecall,
+// once for the whole batch. The host runs them in order and puts a
+// completion with the entry's user_data and the syscall's result into the
+// completion ring for each. With VM_IOQUEUE_POLL a host thread of the queue
+// polls sq_tail instead, and the guest needs the doorbell only when the
+// poller went to sleep and set VM_IOQUEUE_NEED_WAKEUP.
+//
+// The rings are in guest memory right after the header: entries submission
+// entries, then entries completions. The guest owns sq_tail and cq_head, the
+// host sq_head, cq_tail and flags. All indices count up and wrap at 2^32,
+// the slot of index i is i & (entries - 1). A submission waits while the
+// completion ring is full.
+
+#define VM_IOQUEUE_MAX_ENTRIES 4096
+
+// SYS_ioqueue_setup flags
+#define VM_IOQUEUE_POLL 1
+
+// header flags
+#define VM_IOQUEUE_NEED_WAKEUP 1 // the poller sleeps until the next doorbell
+
+typedef struct {
+  uint32_t sq_head;
+  uint32_t sq_tail;
+  uint32_t cq_head;
+  uint32_t cq_tail;
+  uint32_t flags;
+  uint32_t reserved[3];
+} vm_ioqueue_header_t;
+
+// a syscall: nr is a7 of its ecall, args a0 to a5
+typedef struct {
+  uint32_t nr;
+  uint32_t args[6];
+  uint32_t user_data;
+} vm_ioqueue_sqe_t;
+
+typedef struct {
+  uint32_t user_data;
+  uint32_t res; // what the ecall would return in a0
+} vm_ioqueue_cqe_t;
+
+// makes the first of n submitted syscalls, or more of them at once, and puts their results into res;
+// returns how many it made. arg and wmem are the ones given to vm_ioqueue_create
+typedef uint32_t (*vm_ioqueue_run_t)(void *arg, void *wmem, const vm_ioqueue_sqe_t *sqes, uint32_t n, uint32_t *res);
+
+typedef struct vm_ioqueue vm_ioqueue_t;
+
+// bytes of guest memory a queue of entries takes, header included
+uint32_t vm_ioqueue_size(uint32_t entries);
+
+// a queue on the rings at ring, entries a power of two; NULL when out of memory or the poller did not start
+vm_ioqueue_t *vm_ioqueue_create(uint8_t *ring, uint32_t entries, int flags, vm_ioqueue_run_t run, void *arg, void *wmem);
+
+// runs what is still submitted and stops the poller
+void vm_ioqueue_destroy(vm_ioqueue_t *queue);
+
+// the doorbell: runs the submitted entries on the calling thread, returns how many
+uint32_t vm_ioqueue_enter(vm_ioqueue_t *queue);
+
+// for syscalls on what the queue's entries use: runs the submitted entries, which a busy caller would
+// keep the poller from getting to, and holds the queue until vm_ioqueue_unlock
+void vm_ioqueue_lock(vm_ioqueue_t *queue);
+void vm_ioqueue_unlock(vm_ioqueue_t *queue);
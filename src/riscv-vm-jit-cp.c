@@ -0,0 +1,267 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-optimized-1.h"
+
+#if defined(__x86_64__)
+
+#include "riscv-vm-decode.h"
+#include "riscv-vm-jit.h"
+
+// Copy-and-patch JIT. Instead of emitting instructions one by one, the
+// translator copies the machine code gcc produced for each instruction's C
+// stencil (riscv-vm-jit-stencils.c) and patches the holes: register numbers
+// and immediates into the magic movs, jump holes into jumps to the next
+// stencil or to exit stubs. Block chaining, exits and the C side slow path
+// are shared with the hand written JIT.
+
+#define MAX_HOLES 16
+
+typedef struct {
+  const uint8_t *code;
+  uint32_t len;
+  uint32_t nholes;
+  struct {
+    uint16_t offset; // of the imm32 or rel32 to patch
+    uint8_t kind;
+  } holes[MAX_HOLES];
+} cp_stencil_t;
+
+typedef struct {
+  uint8_t *site;
+  uint8_t kind;
+  uint32_t pc; // slow path pc, or the branch target for JIT_HOLE_TAKEN
+  uint32_t uncount;
+} cp_fixup_t;
+
+static cp_stencil_t stencils[RV_OP_COUNT];
+static cp_stencil_t stencil_prologue;
+static cp_stencil_t stencil_jr;
+static int stencils_ready = 0;
+
+// Stencils jump to these by tail call, the jumps get redirected when a
+// stencil is copied. They are never reached from native code.
+void jit_hole_next(void) { abort(); }
+void jit_hole_taken(void) { abort(); }
+void jit_hole_slow(void) { abort(); }
+void jit_hole_dispatch(void) { abort(); }
+
+static int cp_jump_hole(const uint8_t *target) {
+  if (target == (const uint8_t *)jit_hole_next) {
+    return JIT_HOLE_NEXT;
+  }
+  if (target == (const uint8_t *)jit_hole_taken) {
+    return JIT_HOLE_TAKEN;
+  }
+  if (target == (const uint8_t *)jit_hole_slow) {
+    return JIT_HOLE_SLOW;
+  }
+  if (target == (const uint8_t *)jit_hole_dispatch) {
+    return JIT_HOLE_DISPATCH;
+  }
+  return -1;
+}
+
+// finds the holes: mov r32, imm32 with a magic immediate, jmp/jcc rel32 to a jit_hole_* function
+static int cp_parse_stencil(const jit_stencil_t *src, cp_stencil_t *out) {
+  const uint8_t *code = src->start;
+  const uint32_t len = src->end - src->start;
+  out->code = code;
+  out->len = len;
+  out->nholes = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    int kind = -1;
+    uint32_t at = 0;
+    if (code[i] >= 0xB8 && code[i] <= 0xBF && i + 5 <= len) {
+      uint32_t v;
+      memcpy(&v, code + i + 1, 4);
+      if (v - JIT_HOLE_MAGIC < JIT_HOLE_VALUES) {
+        kind = v - JIT_HOLE_MAGIC;
+        at = i + 1;
+      }
+    } else if ((code[i] == 0xE9 && i + 5 <= len) || (code[i] == 0x0F && (code[i + 1] & 0xF0) == 0x80 && i + 6 <= len)) {
+      at = i + (code[i] == 0xE9 ? 1 : 2);
+      int32_t rel;
+      memcpy(&rel, code + at, 4);
+      kind = cp_jump_hole(code + at + 4 + rel);
+    }
+    if (kind < 0) {
+      continue;
+    }
+    if (out->nholes == MAX_HOLES) {
+      return -1;
+    }
+    out->holes[out->nholes].offset = at;
+    out->holes[out->nholes++].kind = kind;
+    i = at + 3;
+  }
+  // a trailing jump to the next stencil is dropped, the next one is copied right after
+  if (out->nholes && out->holes[out->nholes - 1].kind == JIT_HOLE_NEXT && out->holes[out->nholes - 1].offset + 4u == len &&
+      code[len - 5] == 0xE9) {
+    out->len -= 5;
+    out->nholes--;
+  }
+  return 0;
+}
+
+static int cp_parse_named(const jit_stencil_t *src, cp_stencil_t *out, const char *name) {
+  if (cp_parse_stencil(src, out) == 0) {
+    return 0;
+  }
+#if USE_PRINT
+  fprintf(stderr, "jit-cp: the %s stencil has more than %d holes\n", name, MAX_HOLES);
+#endif
+  return 1;
+}
+
+int riscv_vm_jit_cp_check(void) {
+  if (stencils_ready) {
+    return 0;
+  }
+  int failed = cp_parse_named(&jit_stencil_prologue, &stencil_prologue, "prologue");
+  failed += cp_parse_named(&jit_stencil_jr, &stencil_jr, "jr");
+  for (int op = 0; op < RV_OP_COUNT; op++) {
+    if (jit_stencils[op].start) {
+      failed += cp_parse_named(&jit_stencils[op], &stencils[op], rv_op_names[op]);
+    }
+  }
+  stencils_ready = failed == 0;
+  return failed;
+}
+
+// copies the stencil to b, fills the value holes and collects the exits
+static void cp_copy(x64_buf_t *b, const cp_stencil_t *s, const uint32_t *values, cp_fixup_t *fixups, int *nfixups, uint32_t pc,
+                    uint32_t uncount) {
+  uint8_t *const dst = b->p;
+  memcpy(dst + b->w, s->code, s->len);
+  b->p += s->len;
+  for (uint32_t i = 0; i < s->nholes; i++) {
+    uint8_t *site = dst + s->holes[i].offset;
+    const uint8_t kind = s->holes[i].kind;
+    if (kind < JIT_HOLE_VALUES) {
+      memcpy(site + b->w, &values[kind], 4);
+    } else if (kind == JIT_HOLE_NEXT) {
+      x64_patch32(b, site, b->p);
+    } else {
+      cp_fixup_t *f = &fixups[(*nfixups)++];
+      f->site = site;
+      f->kind = kind;
+      f->pc = pc;
+      f->uncount = uncount;
+    }
+  }
+}
+
+static uint8_t *jit_cp_translate(jit_t *jit, uint32_t pc) {
+  rv_insn_t d[MAX_BLOCK_LEN];
+  const uint32_t n = jit_decode_block(jit, pc, d);
+  cp_fixup_t fixups[MAX_BLOCK_LEN * MAX_HOLES];
+  int nfixups = 0;
+  uint8_t *const start = jit->code_ptr;
+  x64_buf_t bb = jit_buf(jit, start);
+  x64_buf_t *b = &bb;
+  uint32_t values[JIT_HOLE_VALUES] = {0};
+  values[JIT_HOLE_MARK_BYTES] = jit->mark_bytes;
+  values[JIT_HOLE_IMAGE_BYTES] = jit->image_bytes;
+  values[JIT_HOLE_IMM] = n;
+  cp_copy(b, &stencil_prologue, values, fixups, &nfixups, pc, n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    const rv_insn_t *in = &d[i];
+    const uint32_t ipc = pc + (i << 2);
+    const uint32_t rest = n - 1 - i;
+    values[JIT_HOLE_RD] = in->rd;
+    values[JIT_HOLE_RS1] = in->rs1;
+    values[JIT_HOLE_RS2] = in->rs2;
+    values[JIT_HOLE_IMM] = in->imm;
+    values[JIT_HOLE_LINK] = ipc + 4;
+    const cp_stencil_t *s = &stencils[in->op];
+    if (in->op == RV_OP_NOP) {
+      continue;
+    }
+    if (s->code == NULL || (jit->mem_write_intercept && in->op >= RV_OP_SB && in->op <= RV_OP_SW)) {
+      // system instructions, invalid opcodes and intercepted stores end the block and run on the C side
+      x64_store_imm32(b, X64_RBX, ST_UNCOUNT, 0);
+      jit_emit_exit(jit, b, ipc, JIT_EXIT_SLOW);
+      continue;
+    }
+    switch (in->op) {
+    case RV_OP_AUIPC:
+      values[JIT_HOLE_IMM] = ipc + in->imm;
+      cp_copy(b, s, values, fixups, &nfixups, ipc, rest);
+      break;
+    case RV_OP_JAL:
+      if (in->rd) {
+        values[JIT_HOLE_IMM] = ipc + 4;
+        cp_copy(b, s, values, fixups, &nfixups, ipc, rest);
+      }
+      jit_emit_chain_exit(jit, b, ipc + in->imm);
+      break;
+    case RV_OP_JALR:
+      cp_copy(b, in->rd ? s : &stencil_jr, values, fixups, &nfixups, ipc, rest);
+      break;
+    case RV_OP_BEQ:
+    case RV_OP_BNE:
+    case RV_OP_BLT:
+    case RV_OP_BGE:
+    case RV_OP_BLTU:
+    case RV_OP_BGEU:
+      cp_copy(b, s, values, fixups, &nfixups, ipc + in->imm, rest);
+      jit_emit_chain_exit(jit, b, ipc + 4);
+      break;
+    default:
+      cp_copy(b, s, values, fixups, &nfixups, ipc, rest);
+      break;
+    }
+  }
+  if (!jit_ends_block(jit, d[n - 1].op)) {
+    jit_emit_chain_exit(jit, b, pc + (n << 2));
+  }
+  for (int i = 0; i < nfixups; i++) {
+    const cp_fixup_t *f = &fixups[i];
+    x64_patch32(b, f->site, b->p);
+    switch (f->kind) {
+    case JIT_HOLE_TAKEN:
+      jit_emit_chain_exit(jit, b, f->pc);
+      break;
+    case JIT_HOLE_SLOW:
+      x64_store_imm32(b, X64_RBX, ST_UNCOUNT, f->uncount);
+      jit_emit_exit(jit, b, f->pc, JIT_EXIT_SLOW);
+      break;
+    default:
+      // the stencil already stored st->pc
+      x64_mov_imm32(b, X64_RAX, JIT_EXIT_DISPATCH);
+      x64_patch32(b, x64_jmp32(b), jit->exit_code);
+      break;
+    }
+  }
+  jit->code_ptr = (uint8_t *)(((uintptr_t)b->p + 15) & ~(uintptr_t)15);
+  jit->st.block_map[pc >> 2] = start;
+#if LOG_TRACE
+  printf("translated block 0x%X, %d instructions, %d bytes\n", pc, n, (int)(b->p - start));
+#endif
+  return start;
+}
+
+int riscv_vm_run_jit_cp(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  if (riscv_vm_jit_cp_check()) {
+#if USE_PRINT
+    fprintf(stderr, "jit-cp: unexpected stencil code, running the JIT instead\n");
+#endif
+    return riscv_vm_run_jit(registers, image, user_syscall_handler);
+  }
+  return riscv_vm_jit_run(registers, image, user_syscall_handler, jit_cp_translate, 0);
+}
+
+#else
+
+int riscv_vm_jit_cp_check(void) { return 0; }
+
+int riscv_vm_run_jit_cp(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  return riscv_vm_run_jit(registers, image, user_syscall_handler);
+}
+
+#endif
@@ -0,0 +1,214 @@
+#if defined(__x86_64__)
+
+#include <stdint.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-jit.h"
+
+// Instruction semantics for the copy-and-patch JIT. Nothing here is ever
+// called: every function is a stencil whose machine code gets copied into
+// the code cache and patched (see riscv-vm-jit-cp.c). Stencils must not call
+// other functions, use the stack or reference data, only the pinned
+// registers below, value holes and tail calls to the jump holes.
+
+register jit_state_t *st asm("rbx");
+register uint8_t *mem asm("r12");
+register uint8_t *code_mark asm("r13");
+register uint8_t **block_map asm("r14");
+
+// the asm keeps gcc from folding the value into the code around it
+#define HOLE(kind)                                                                                                                         \
+  ({                                                                                                                                       \
+    uint32_t hole_;                                                                                                                        \
+    __asm__("movl %1, %k0" : "=r"(hole_) : "i"(JIT_HOLE_MAGIC + (kind)));                                                                 \
+    hole_;                                                                                                                                 \
+  })
+
+#define RD st->regs[HOLE(JIT_HOLE_RD)]
+#define V1 st->regs[HOLE(JIT_HOLE_RS1)]
+#define V2 st->regs[HOLE(JIT_HOLE_RS2)]
+#define IMM HOLE(JIT_HOLE_IMM)
+
+#define NEXT() jit_hole_next()
+#define EXIT(hole)                                                                                                                         \
+  do {                                                                                                                                     \
+    hole();                                                                                                                                \
+    return;                                                                                                                                \
+  } while (0)
+
+// one section per stencil, the linker provides __start_ and __stop_ symbols
+// for sections named like C identifiers, which gives the exact stencil bytes
+#define STENCIL(name)                                                                                                                      \
+  extern const uint8_t __start_jitst_##name[], __stop_jitst_##name[];                                                          \
+  __attribute__((section("jitst_" #name), used, optimize("no-reorder-blocks-and-partition"))) static void stencil_##name(void)
+
+#define STENCIL_REF(name)                                                                                                                  \
+  { __start_jitst_##name, __stop_jitst_##name }
+
+STENCIL(prologue) {
+  st->instret += IMM;
+  NEXT();
+}
+
+#define LOAD(name, type)                                                                                                                   \
+  STENCIL(name) {                                                                                                                          \
+    const uint32_t addr = (V1 + IMM) & 0x7FFFFFFF;                                                                                        \
+    if (addr > work_mem_size - sizeof(type)) {                                                                                             \
+      EXIT(jit_hole_slow);                                                                                                                 \
+    }                                                                                                                                      \
+    RD = *(type *)(mem + addr);                                                                                                            \
+    NEXT();                                                                                                                                \
+  }
+
+LOAD(lb, int8_t)
+LOAD(lh, int16_t)
+LOAD(lw, uint32_t)
+LOAD(lbu, uint8_t)
+LOAD(lhu, uint16_t)
+
+// UART and out of range stores fail the bounds check (UART is above guest
+// memory), stores into translated code or tohost hit a code mark
+#define STORE(name, type)                                                                                                                  \
+  STENCIL(name) {                                                                                                                          \
+    const uint32_t addr = (V1 + IMM) & 0x7FFFFFFF;                                                                                        \
+    if (addr > work_mem_size - sizeof(type) ||                                                                                             \
+        (addr < HOLE(JIT_HOLE_MARK_BYTES) && (code_mark[addr >> 2] | code_mark[(addr + 3) >> 2]))) {                                       \
+      EXIT(jit_hole_slow);                                                                                                                 \
+    }                                                                                                                                      \
+    *(type *)(mem + addr) = (type)V2;                                                                                                      \
+    NEXT();                                                                                                                                \
+  }
+
+STORE(sb, uint8_t)
+STORE(sh, uint16_t)
+STORE(sw, uint32_t)
+
+#define ALU(name, expr)                                                                                                                    \
+  STENCIL(name) {                                                                                                                          \
+    RD = (expr);                                                                                                                           \
+    NEXT();                                                                                                                                \
+  }
+
+ALU(addi, V1 + IMM)
+ALU(slti, (int32_t)V1 < (int32_t)IMM)
+ALU(sltiu, V1 < IMM)
+ALU(xori, V1 ^ IMM)
+ALU(ori, V1 | IMM)
+ALU(andi, V1 & IMM)
+ALU(slli, V1 << IMM)
+ALU(srli, V1 >> IMM)
+ALU(srai, (int32_t)V1 >> IMM)
+// lui, auipc, jal: the translator puts the final value in the hole
+ALU(set, IMM)
+
+ALU(add, V1 + V2)
+ALU(sub, V1 - V2)
+ALU(sll, V1 << (V2 & 0x1F))
+ALU(slt, (int32_t)V1 < (int32_t)V2)
+ALU(sltu, V1 < V2)
+ALU(xor, V1 ^ V2)
+ALU(srl, V1 >> (V2 & 0x1F))
+ALU(sra, (int32_t)V1 >> (V2 & 0x1F))
+ALU(or, V1 | V2)
+ALU(and, V1 & V2)
+ALU(mul, V1 * V2)
+ALU(mulh, ((int64_t)(int32_t)V1 * (int64_t)(int32_t)V2) >> 32)
+ALU(mulhsu, ((uint64_t)((int64_t)(int32_t)V1 * (uint64_t)V2)) >> 32)
+ALU(mulhu, ((uint64_t)V1 * (uint64_t)V2) >> 32)
+
+STENCIL(div) {
+  const uint32_t v1 = V1, v2 = V2;
+  if (v2 == 0) {
+    RD = 0xFFFFFFFF;
+  } else if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+    // integer overflow
+    RD = v1;
+  } else {
+    RD = (int32_t)v1 / (int32_t)v2;
+  }
+  NEXT();
+}
+
+STENCIL(divu) {
+  const uint32_t v1 = V1, v2 = V2;
+  RD = v2 == 0 ? 0xFFFFFFFF : v1 / v2;
+  NEXT();
+}
+
+STENCIL(rem) {
+  const uint32_t v1 = V1, v2 = V2;
+  if (v2 == 0) {
+    RD = v1;
+  } else if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+    // integer overflow
+    RD = 0;
+  } else {
+    RD = (int32_t)v1 % (int32_t)v2;
+  }
+  NEXT();
+}
+
+STENCIL(remu) {
+  const uint32_t v1 = V1, v2 = V2;
+  RD = v2 == 0 ? v1 : v1 % v2;
+  NEXT();
+}
+
+// the translator puts the fall through exit right after a branch
+#define BRANCH(name, cond)                                                                                                                 \
+  STENCIL(name) {                                                                                                                          \
+    if (cond) {                                                                                                                            \
+      EXIT(jit_hole_taken);                                                                                                                \
+    }                                                                                                                                      \
+    NEXT();                                                                                                                                \
+  }
+
+BRANCH(beq, V1 == V2)
+BRANCH(bne, V1 != V2)
+BRANCH(blt, (int32_t)V1 < (int32_t)V2)
+BRANCH(bge, (int32_t)V1 >= (int32_t)V2)
+BRANCH(bltu, V1 < V2)
+BRANCH(bgeu, V1 >= V2)
+
+// indirect jump: inline block map lookup, the dispatcher handles misses and bad targets
+#define JALR_TAIL(target)                                                                                                                  \
+  st->pc = target;                                                                                                                         \
+  if (target < HOLE(JIT_HOLE_IMAGE_BYTES) && !(target & 3) && block_map[target >> 2]) {                                                    \
+    ((void (*)(void))block_map[target >> 2])();                                                                                            \
+    return;                                                                                                                                \
+  }                                                                                                                                        \
+  EXIT(jit_hole_dispatch)
+
+STENCIL(jalr) {
+  const uint32_t target = (V1 + IMM) & 0xFFFFFFFE;
+  RD = HOLE(JIT_HOLE_LINK);
+  JALR_TAIL(target);
+}
+
+STENCIL(jr) {
+  const uint32_t target = (V1 + IMM) & 0xFFFFFFFE;
+  JALR_TAIL(target);
+}
+
+const jit_stencil_t jit_stencil_prologue = STENCIL_REF(prologue);
+const jit_stencil_t jit_stencil_jr = STENCIL_REF(jr);
+
+const jit_stencil_t jit_stencils[RV_OP_COUNT] = {
+    [RV_OP_LB] = STENCIL_REF(lb),         [RV_OP_LH] = STENCIL_REF(lh),         [RV_OP_LW] = STENCIL_REF(lw),
+    [RV_OP_LBU] = STENCIL_REF(lbu),       [RV_OP_LHU] = STENCIL_REF(lhu),       [RV_OP_SB] = STENCIL_REF(sb),
+    [RV_OP_SH] = STENCIL_REF(sh),         [RV_OP_SW] = STENCIL_REF(sw),         [RV_OP_ADDI] = STENCIL_REF(addi),
+    [RV_OP_SLTI] = STENCIL_REF(slti),     [RV_OP_SLTIU] = STENCIL_REF(sltiu),   [RV_OP_XORI] = STENCIL_REF(xori),
+    [RV_OP_ORI] = STENCIL_REF(ori),       [RV_OP_ANDI] = STENCIL_REF(andi),     [RV_OP_SLLI] = STENCIL_REF(slli),
+    [RV_OP_SRLI] = STENCIL_REF(srli),     [RV_OP_SRAI] = STENCIL_REF(srai),     [RV_OP_LUI] = STENCIL_REF(set),
+    [RV_OP_AUIPC] = STENCIL_REF(set),     [RV_OP_ADD] = STENCIL_REF(add),       [RV_OP_SUB] = STENCIL_REF(sub),
+    [RV_OP_SLL] = STENCIL_REF(sll),       [RV_OP_SLT] = STENCIL_REF(slt),       [RV_OP_SLTU] = STENCIL_REF(sltu),
+    [RV_OP_XOR] = STENCIL_REF(xor),       [RV_OP_SRL] = STENCIL_REF(srl),       [RV_OP_SRA] = STENCIL_REF(sra),
+    [RV_OP_OR] = STENCIL_REF(or),         [RV_OP_AND] = STENCIL_REF(and),       [RV_OP_MUL] = STENCIL_REF(mul),
+    [RV_OP_MULH] = STENCIL_REF(mulh),     [RV_OP_MULHSU] = STENCIL_REF(mulhsu), [RV_OP_MULHU] = STENCIL_REF(mulhu),
+    [RV_OP_DIV] = STENCIL_REF(div),       [RV_OP_DIVU] = STENCIL_REF(divu),     [RV_OP_REM] = STENCIL_REF(rem),
+    [RV_OP_REMU] = STENCIL_REF(remu),     [RV_OP_BEQ] = STENCIL_REF(beq),       [RV_OP_BNE] = STENCIL_REF(bne),
+    [RV_OP_BLT] = STENCIL_REF(blt),       [RV_OP_BGE] = STENCIL_REF(bge),       [RV_OP_BLTU] = STENCIL_REF(bltu),
+    [RV_OP_BGEU] = STENCIL_REF(bgeu),     [RV_OP_JAL] = STENCIL_REF(set),       [RV_OP_JALR] = STENCIL_REF(jalr),
+};
+
+#endif
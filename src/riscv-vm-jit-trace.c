@@ -0,0 +1,1035 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-optimized-1.h"
+
+#if defined(__x86_64__)
+
+#include "riscv-vm-decode.h"
+#include "riscv-vm-jit.h"
+
+// Tier 2 of the JIT. Tier 1 blocks count their executions, a hot block
+// becomes the head of a trace: a path through the guest code that follows
+// the likely direction of each branch (back to the head, otherwise backward
+// taken and forward not taken) across jal and statically known jalr. The
+// trace is recorded into an SSA IR, one value per definition, with constants
+// folded on the fly. Then
+//  - dead values are removed,
+//  - loads and stores off the same base value share one bounds check, and
+//    accesses to constant addresses inside guest memory need none,
+//  - values get host registers by linear scan, guest registers stay in them
+//    across iterations when the trace loops back to its head,
+//  - native code is emitted; a branch that leaves the path or a failed check
+//    is a side exit that writes the guest registers back and continues in
+//    tier 1 (or on the C side for the instruction that failed the check).
+
+#define TRACE_MAX_INSNS 128
+#define TRACE_MAX_EXITS TRACE_MAX_INSNS
+#define TRACE_MAX_IR (32 + TRACE_MAX_INSNS * 4)
+// worst case native code for one trace, checked before compiling
+#define TRACE_MAX_CODE (128 * 1024)
+
+enum {
+  IR_NOP = 0, // removed by dead code elimination
+  IR_ARG,     // guest register imm at the trace head
+  IR_CONST,   // imm
+  // a <op> b, in the order of RV_OP_ADD..RV_OP_REMU
+  IR_ADD,
+  IR_SUB,
+  IR_SLL,
+  IR_SLT,
+  IR_SLTU,
+  IR_XOR,
+  IR_SRL,
+  IR_SRA,
+  IR_OR,
+  IR_AND,
+  IR_MUL,
+  IR_MULH,
+  IR_MULHSU,
+  IR_MULHU,
+  IR_DIV,
+  IR_DIVU,
+  IR_REM,
+  IR_REMU,
+  IR_LOAD,  // sub is the RV_OP_ load, address a + imm
+  IR_STORE, // sub is the RV_OP_ store, address a + imm, value b
+  IR_GUARD, // side exit when the flags of a - b match x86 condition sub
+};
+
+// bounds check of a load or store
+enum { CHECK_OWN = 0, CHECK_NONE, CHECK_GROUP };
+
+typedef struct {
+  uint8_t op;
+  uint8_t sub;
+  uint8_t check;
+  uint16_t a, b;
+  uint16_t exit;
+  uint32_t imm;
+  int32_t lo, hi; // CHECK_GROUP: offsets of all the accesses sharing the check
+} ir_t;
+
+typedef struct {
+  uint32_t pc;
+  uint8_t slow;      // run the instruction at pc on the C side, otherwise continue at pc
+  uint32_t executed; // guest instructions of the iteration that ran, the rest is taken off instret
+  uint16_t regs[32]; // guest register values
+} trace_exit_t;
+
+enum { END_LOOP, END_CHAIN, END_DISPATCH };
+
+enum { LOC_REG, LOC_MEM, LOC_IMM };
+
+typedef struct {
+  uint8_t kind;
+  int8_t reg;
+  int32_t disp; // from rbx
+  uint32_t imm;
+} loc_t;
+
+typedef struct {
+  jit_t *jit;
+  uint32_t head;
+  int failed;
+  ir_t ir[TRACE_MAX_IR];
+  uint32_t nir;
+  uint16_t regs[32]; // current value of every guest register while recording
+  trace_exit_t exits[TRACE_MAX_EXITS];
+  uint32_t nexits;
+  uint32_t ninsns;
+  uint32_t nbranches; // branches and jumps the trace crosses
+  int end;
+  uint32_t end_pc;     // END_CHAIN
+  uint16_t end_target; // END_DISPATCH
+  // register allocation
+  uint8_t live[TRACE_MAX_IR];
+  int16_t last_use[TRACE_MAX_IR];
+  int8_t reg[TRACE_MAX_IR]; // -1 when in memory
+  int32_t disp[TRACE_MAX_IR];
+  uint32_t nspills;
+} trace_t;
+
+static const int8_t trace_regs[] = {X64_RSI, X64_RDI, X64_R8, X64_R9, X64_R10, X64_R11, X64_R15, X64_RBP};
+#define TRACE_NREGS ((int)sizeof(trace_regs))
+
+static uint16_t tr_emit(trace_t *t, uint8_t op, uint16_t a, uint16_t b, uint32_t imm) {
+  if (t->nir == TRACE_MAX_IR) {
+    t->failed = 1;
+    return 0;
+  }
+  ir_t *x = &t->ir[t->nir];
+  memset(x, 0, sizeof(*x));
+  x->op = op;
+  x->a = a;
+  x->b = b;
+  x->imm = imm;
+  return t->nir++;
+}
+
+static uint16_t tr_const(trace_t *t, uint32_t imm) {
+  for (uint32_t i = 32; i < t->nir; i++) {
+    if (t->ir[i].op == IR_CONST && t->ir[i].imm == imm) {
+      return i;
+    }
+  }
+  return tr_emit(t, IR_CONST, 0, 0, imm);
+}
+
+static uint32_t tr_eval(uint8_t op, uint32_t v1, uint32_t v2) {
+  switch (op) {
+  case IR_ADD:
+    return v1 + v2;
+  case IR_SUB:
+    return v1 - v2;
+  case IR_SLL:
+    return v1 << (v2 & 0x1F);
+  case IR_SLT:
+    return (int32_t)v1 < (int32_t)v2;
+  case IR_SLTU:
+    return v1 < v2;
+  case IR_XOR:
+    return v1 ^ v2;
+  case IR_SRL:
+    return v1 >> (v2 & 0x1F);
+  case IR_SRA:
+    return (int32_t)v1 >> (v2 & 0x1F);
+  case IR_OR:
+    return v1 | v2;
+  case IR_AND:
+    return v1 & v2;
+  case IR_MUL:
+    return v1 * v2;
+  case IR_MULH:
+    return ((int64_t)(int32_t)v1 * (int64_t)(int32_t)v2) >> 32;
+  case IR_MULHSU:
+    return ((uint64_t)((int64_t)(int32_t)v1 * (uint64_t)v2)) >> 32;
+  case IR_MULHU:
+    return ((uint64_t)v1 * (uint64_t)v2) >> 32;
+  case IR_DIV:
+    if (v2 == 0) {
+      return 0xFFFFFFFF;
+    }
+    if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+      return v1;
+    }
+    return (int32_t)v1 / (int32_t)v2;
+  case IR_DIVU:
+    return v2 == 0 ? 0xFFFFFFFF : v1 / v2;
+  case IR_REM:
+    if (v2 == 0) {
+      return v1;
+    }
+    if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+      return 0;
+    }
+    return (int32_t)v1 % (int32_t)v2;
+  default:
+    return v2 == 0 ? v1 : v1 % v2;
+  }
+}
+
+// a <op> b with constant folding and the trivial identities
+static uint16_t tr_binop(trace_t *t, uint8_t op, uint16_t a, uint16_t b) {
+  const ir_t *x = &t->ir[a], *y = &t->ir[b];
+  if (x->op == IR_CONST && y->op == IR_CONST) {
+    return tr_const(t, tr_eval(op, x->imm, y->imm));
+  }
+  if (y->op == IR_CONST) {
+    switch (op) {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_OR:
+    case IR_XOR:
+      if (y->imm == 0) {
+        return a;
+      }
+      break;
+    case IR_SLL:
+    case IR_SRL:
+    case IR_SRA:
+      if ((y->imm & 0x1F) == 0) {
+        return a;
+      }
+      break;
+    case IR_AND:
+      if (y->imm == 0 || y->imm == 0xFFFFFFFF) {
+        return y->imm ? a : b;
+      }
+      break;
+    case IR_MUL:
+      if (y->imm == 1) {
+        return a;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if (x->op == IR_CONST && x->imm == 0 && (op == IR_ADD || op == IR_OR || op == IR_XOR)) {
+    return b;
+  }
+  return tr_emit(t, op, a, b, 0);
+}
+
+// snapshot of the guest registers for a side exit
+static uint16_t tr_exit(trace_t *t, uint32_t pc, int slow, uint32_t executed) {
+  if (t->nexits == TRACE_MAX_EXITS) {
+    t->failed = 1;
+    return 0;
+  }
+  trace_exit_t *e = &t->exits[t->nexits];
+  e->pc = pc;
+  e->slow = slow;
+  e->executed = executed;
+  memcpy(e->regs, t->regs, sizeof(t->regs));
+  return t->nexits++;
+}
+
+static int tr_visited(const trace_t *t, const uint32_t *pcs, uint32_t pc) {
+  for (uint32_t i = 0; i < t->ninsns; i++) {
+    if (pcs[i] == pc) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// follows the guest code from the head and builds the IR
+static void tr_record(trace_t *t) {
+  jit_t *jit = t->jit;
+  uint32_t pcs[TRACE_MAX_INSNS];
+  for (int r = 0; r < 32; r++) {
+    tr_emit(t, IR_ARG, 0, 0, r);
+    t->regs[r] = r;
+  }
+  t->regs[0] = tr_const(t, 0);
+  uint32_t pc = t->head;
+  for (;;) {
+    if (pc == t->head && t->ninsns) {
+      t->end = END_LOOP;
+      return;
+    }
+    if (t->failed || t->ninsns == TRACE_MAX_INSNS || pc >= jit->image_bytes || (pc & 3) || tr_visited(t, pcs, pc)) {
+      t->end = END_CHAIN;
+      t->end_pc = pc;
+      return;
+    }
+    rv_insn_t in;
+    rv_decode(*(uint32_t *)(jit->st.wmem + pc), &in);
+    const uint32_t k = t->ninsns;
+    uint32_t next = pc + 4;
+    uint16_t *regs = t->regs;
+    switch (in.op) {
+    case RV_OP_NOP:
+      break;
+    case RV_OP_LB:
+    case RV_OP_LH:
+    case RV_OP_LW:
+    case RV_OP_LBU:
+    case RV_OP_LHU: {
+      const uint16_t e = tr_exit(t, pc, 1, k + 1);
+      const uint16_t v = tr_emit(t, IR_LOAD, regs[in.rs1], 0, in.imm);
+      t->ir[v].sub = in.op;
+      t->ir[v].exit = e;
+      regs[in.rd] = v;
+    } break;
+    case RV_OP_SB:
+    case RV_OP_SH:
+    case RV_OP_SW: {
+      const uint16_t e = tr_exit(t, pc, 1, k + 1);
+      const uint16_t v = tr_emit(t, IR_STORE, regs[in.rs1], regs[in.rs2], in.imm);
+      t->ir[v].sub = in.op;
+      t->ir[v].exit = e;
+    } break;
+    case RV_OP_ADDI:
+    case RV_OP_SLTI:
+    case RV_OP_SLTIU:
+    case RV_OP_XORI:
+    case RV_OP_ORI:
+    case RV_OP_ANDI:
+    case RV_OP_SLLI:
+    case RV_OP_SRLI:
+    case RV_OP_SRAI: {
+      static const uint8_t ops[] = {[RV_OP_ADDI] = IR_ADD, [RV_OP_SLTI] = IR_SLT,  [RV_OP_SLTIU] = IR_SLTU,
+                                    [RV_OP_XORI] = IR_XOR, [RV_OP_ORI] = IR_OR,    [RV_OP_ANDI] = IR_AND,
+                                    [RV_OP_SLLI] = IR_SLL, [RV_OP_SRLI] = IR_SRL, [RV_OP_SRAI] = IR_SRA};
+      regs[in.rd] = tr_binop(t, ops[in.op], regs[in.rs1], tr_const(t, in.imm));
+    } break;
+    case RV_OP_LUI:
+      regs[in.rd] = tr_const(t, in.imm);
+      break;
+    case RV_OP_AUIPC:
+      regs[in.rd] = tr_const(t, pc + in.imm);
+      break;
+    case RV_OP_BEQ:
+    case RV_OP_BNE:
+    case RV_OP_BLT:
+    case RV_OP_BGE:
+    case RV_OP_BLTU:
+    case RV_OP_BGEU: {
+      static const uint8_t cc[] = {[RV_OP_BEQ] = X64_CC_E, [RV_OP_BNE] = X64_CC_NE, [RV_OP_BLT] = X64_CC_L,
+                                   [RV_OP_BGE] = X64_CC_GE, [RV_OP_BLTU] = X64_CC_B, [RV_OP_BGEU] = X64_CC_AE};
+      const uint32_t target = pc + in.imm;
+      const uint16_t a = regs[in.rs1], b = regs[in.rs2];
+      int taken;
+      if (t->ir[a].op == IR_CONST && t->ir[b].op == IR_CONST) {
+        static const uint8_t ops[] = {[RV_OP_BEQ] = IR_SUB, [RV_OP_BNE] = IR_SUB, [RV_OP_BLT] = IR_SLT,
+                                      [RV_OP_BGE] = IR_SLT, [RV_OP_BLTU] = IR_SLTU, [RV_OP_BGEU] = IR_SLTU};
+        const uint32_t r = tr_eval(ops[in.op], t->ir[a].imm, t->ir[b].imm);
+        // beq/bge/bgeu hold when the sub/slt/sltu result is 0
+        taken = (in.op == RV_OP_BEQ || in.op == RV_OP_BGE || in.op == RV_OP_BGEU) ? r == 0 : r != 0;
+      } else {
+        taken = target == t->head || (next != t->head && target <= pc);
+        // x86 condition codes come in pairs that differ in the low bit
+        const uint16_t e = tr_exit(t, taken ? next : target, 0, k + 1);
+        const uint16_t g = tr_emit(t, IR_GUARD, a, b, 0);
+        t->ir[g].sub = taken ? cc[in.op] ^ 1 : cc[in.op];
+        t->ir[g].exit = e;
+      }
+      t->nbranches++;
+      if (taken) {
+        next = target;
+      }
+    } break;
+    case RV_OP_JAL:
+      if (in.rd) {
+        regs[in.rd] = tr_const(t, pc + 4);
+      }
+      next = pc + in.imm;
+      t->nbranches++;
+      break;
+    case RV_OP_JALR: {
+      const uint16_t target = tr_binop(t, IR_AND, tr_binop(t, IR_ADD, regs[in.rs1], tr_const(t, in.imm)), tr_const(t, 0xFFFFFFFE));
+      if (in.rd) {
+        regs[in.rd] = tr_const(t, pc + 4);
+      }
+      pcs[t->ninsns++] = pc;
+      jit->st.code_mark[pc >> 2] = 1;
+      t->nbranches++;
+      if (t->ir[target].op != IR_CONST) {
+        t->end = END_DISPATCH;
+        t->end_target = target;
+        return;
+      }
+      pc = t->ir[target].imm;
+      continue;
+    }
+    default:
+      // register-register ops, in the same order in both enums
+      if (in.op >= RV_OP_ADD && in.op <= RV_OP_REMU) {
+        regs[in.rd] = tr_binop(t, IR_ADD + (in.op - RV_OP_ADD), regs[in.rs1], regs[in.rs2]);
+        break;
+      }
+      // system instructions run in tier 1 / on the C side
+      t->end = END_CHAIN;
+      t->end_pc = pc;
+      return;
+    }
+    pcs[t->ninsns++] = pc;
+    jit->st.code_mark[pc >> 2] = 1;
+    pc = next;
+  }
+}
+
+static int tr_has_operands(uint8_t op) { return op >= IR_ADD; }
+
+static void tr_mark(trace_t *t, uint16_t v) {
+  if (t->ir[v].op != IR_CONST) {
+    t->live[v] = 1;
+  }
+}
+
+// dead code elimination: loads, stores and guards are always kept (a load
+// can fail), the rest only when an exit or a kept instruction needs it
+static void tr_dce(trace_t *t) {
+  memset(t->live, 0, sizeof(t->live));
+  for (uint32_t i = 0; i < t->nexits; i++) {
+    for (int r = 1; r < 32; r++) {
+      tr_mark(t, t->exits[i].regs[r]);
+    }
+  }
+  for (uint32_t i = 32; i < t->nir; i++) {
+    if (t->ir[i].op >= IR_LOAD) {
+      t->live[i] = 1;
+    }
+  }
+  if (t->end == END_DISPATCH) {
+    tr_mark(t, t->end_target);
+  }
+  if (t->end != END_LOOP) {
+    for (int r = 1; r < 32; r++) {
+      tr_mark(t, t->regs[r]);
+    }
+  }
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (uint32_t i = t->nir; i-- > 32;) {
+      if (t->live[i] && tr_has_operands(t->ir[i].op)) {
+        tr_mark(t, t->ir[i].a);
+        tr_mark(t, t->ir[i].b);
+      }
+    }
+    // a loop needs the value of a register at the end of an iteration if the next one reads it
+    if (t->end == END_LOOP) {
+      for (int r = 1; r < 32; r++) {
+        const uint16_t v = t->regs[r];
+        if (t->live[r] && t->ir[v].op != IR_CONST && !t->live[v]) {
+          t->live[v] = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
+  for (uint32_t i = 32; i < t->nir; i++) {
+    if (!t->live[i] && t->ir[i].op != IR_CONST) {
+      t->ir[i].op = IR_NOP;
+    }
+  }
+}
+
+// bounds check elimination: the first access off a base value checks the
+// whole range of offsets used with that base in the trace, the later ones
+// need no check; constant addresses are checked here
+static void tr_bounds(trace_t *t) {
+  for (uint32_t i = 32; i < t->nir; i++) {
+    ir_t *x = &t->ir[i];
+    x->check = CHECK_OWN;
+  }
+  for (uint32_t i = 32; i < t->nir; i++) {
+    ir_t *x = &t->ir[i];
+    if ((x->op != IR_LOAD && x->op != IR_STORE) || x->check != CHECK_OWN) {
+      continue;
+    }
+    if (t->ir[x->a].op == IR_CONST) {
+      const uint32_t addr = (t->ir[x->a].imm + x->imm) & 0x7FFFFFFF;
+      x->check = addr <= work_mem_size - rv_mem_width(x->sub) ? CHECK_NONE : CHECK_OWN;
+      continue;
+    }
+    int32_t lo = (int32_t)x->imm, hi = (int32_t)x->imm;
+    int n = 0;
+    for (uint32_t j = i + 1; j < t->nir; j++) {
+      const ir_t *y = &t->ir[j];
+      if ((y->op == IR_LOAD || y->op == IR_STORE) && y->a == x->a) {
+        lo = (int32_t)y->imm < lo ? (int32_t)y->imm : lo;
+        hi = (int32_t)y->imm > hi ? (int32_t)y->imm : hi;
+        n++;
+      }
+    }
+    if (n == 0) {
+      continue;
+    }
+    x->check = CHECK_GROUP;
+    x->lo = lo;
+    x->hi = hi;
+    for (uint32_t j = i + 1; j < t->nir; j++) {
+      ir_t *y = &t->ir[j];
+      if ((y->op == IR_LOAD || y->op == IR_STORE) && y->a == x->a) {
+        y->check = CHECK_NONE;
+      }
+    }
+  }
+}
+
+static void tr_use(trace_t *t, uint16_t v, int pos) {
+  if (t->ir[v].op != IR_CONST && t->last_use[v] < pos) {
+    t->last_use[v] = pos;
+  }
+}
+
+// Linear scan over the live ranges, in IR order (all IR_ARG values start at
+// the trace head). When the registers run out the value that lives longest
+// goes to memory: a guest register at the head stays in its jit_state_t slot,
+// anything else gets a spill slot.
+static int tr_regalloc(trace_t *t) {
+  const int end = t->nir;
+  for (uint32_t i = 0; i < t->nir; i++) {
+    t->last_use[i] = -1;
+    t->reg[i] = -1;
+    t->disp[i] = i < 32 ? ST_REG(i) : 0;
+  }
+  for (uint32_t i = 32; i < t->nir; i++) {
+    const ir_t *x = &t->ir[i];
+    if (x->op == IR_NOP || x->op == IR_CONST) {
+      continue;
+    }
+    if (tr_has_operands(x->op)) {
+      tr_use(t, x->a, i);
+      if (x->op != IR_LOAD) {
+        tr_use(t, x->b, i);
+      }
+    }
+    if (x->op >= IR_LOAD) {
+      for (int r = 1; r < 32; r++) {
+        tr_use(t, t->exits[x->exit].regs[r], i);
+      }
+    }
+  }
+  for (int r = 1; r < 32; r++) {
+    if (t->end != END_LOOP) {
+      tr_use(t, t->regs[r], end);
+    } else if (t->live[r]) {
+      // the register's value at the head has to be in place for the next iteration,
+      // unchanged registers keep it in the IR_ARG value for the whole trace
+      tr_use(t, t->regs[r], end);
+    }
+  }
+  if (t->end == END_DISPATCH) {
+    tr_use(t, t->end_target, end);
+  }
+
+  uint16_t active[TRACE_NREGS];
+  int nactive = 0;
+  uint8_t used[TRACE_NREGS] = {0};
+  for (uint32_t i = 1; i < t->nir; i++) {
+    const ir_t *x = &t->ir[i];
+    if (x->op == IR_NOP || x->op == IR_CONST || x->op == IR_STORE || x->op == IR_GUARD || t->last_use[i] < 0) {
+      continue;
+    }
+    const int start = i < 32 ? 0 : (int)i;
+    // a value last used by the instruction that defines the new one can share its register
+    for (int j = 0; j < nactive;) {
+      if (t->last_use[active[j]] <= start && start > 0) {
+        for (int k = 0; k < TRACE_NREGS; k++) {
+          if (trace_regs[k] == t->reg[active[j]]) {
+            used[k] = 0;
+          }
+        }
+        active[j] = active[--nactive];
+      } else {
+        j++;
+      }
+    }
+    uint16_t cur = i;
+    if (nactive == TRACE_NREGS) {
+      int furthest = 0;
+      for (int j = 1; j < nactive; j++) {
+        if (t->last_use[active[j]] > t->last_use[active[furthest]]) {
+          furthest = j;
+        }
+      }
+      if (t->last_use[active[furthest]] > t->last_use[i]) {
+        // steal the register of the value that lives longest
+        const uint16_t victim = active[furthest];
+        t->reg[i] = t->reg[victim];
+        t->reg[victim] = -1;
+        active[furthest] = i;
+        cur = victim;
+      }
+      if (cur >= 32) {
+        if (t->nspills == JIT_SPILL_SLOTS) {
+          return -1;
+        }
+        t->disp[cur] = ST_SPILL(t->nspills++);
+      }
+      continue;
+    }
+    for (int k = 0; k < TRACE_NREGS; k++) {
+      if (!used[k]) {
+        used[k] = 1;
+        t->reg[i] = trace_regs[k];
+        active[nactive++] = i;
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+static loc_t tr_loc(const trace_t *t, uint16_t v) {
+  loc_t l = {0};
+  if (t->ir[v].op == IR_CONST) {
+    l.kind = LOC_IMM;
+    l.imm = t->ir[v].imm;
+  } else if (t->reg[v] >= 0) {
+    l.kind = LOC_REG;
+    l.reg = t->reg[v];
+  } else {
+    l.kind = LOC_MEM;
+    l.disp = t->disp[v];
+  }
+  return l;
+}
+
+static loc_t tr_reg_loc(int reg) {
+  loc_t l = {0};
+  l.kind = LOC_REG;
+  l.reg = reg;
+  return l;
+}
+
+static int tr_loc_eq(loc_t a, loc_t b) {
+  return a.kind == b.kind && (a.kind == LOC_REG ? a.reg == b.reg : a.kind == LOC_MEM ? a.disp == b.disp : a.imm == b.imm);
+}
+
+// dst = src, memory to memory goes through eax
+static void tr_move(x64_buf_t *b, loc_t dst, loc_t src) {
+  if (tr_loc_eq(dst, src)) {
+    return;
+  }
+  if (dst.kind == LOC_REG) {
+    if (src.kind == LOC_REG) {
+      x64_mov_reg32(b, dst.reg, src.reg);
+    } else if (src.kind == LOC_MEM) {
+      x64_load32(b, dst.reg, X64_RBX, src.disp);
+    } else {
+      x64_mov_imm32(b, dst.reg, src.imm);
+    }
+  } else if (src.kind == LOC_REG) {
+    x64_store32(b, X64_RBX, dst.disp, src.reg);
+  } else if (src.kind == LOC_MEM) {
+    x64_load32(b, X64_RAX, X64_RBX, src.disp);
+    x64_store32(b, X64_RBX, dst.disp, X64_RAX);
+  } else {
+    x64_store_imm32(b, X64_RBX, dst.disp, src.imm);
+  }
+}
+
+// all dst[i] = src[i] at once; a cycle is broken by saving one destination in ecx
+static void tr_parallel_move(x64_buf_t *b, loc_t *dst, loc_t *src, int n) {
+  uint8_t pending[64];
+  for (int i = 0; i < n; i++) {
+    pending[i] = !tr_loc_eq(dst[i], src[i]);
+  }
+  for (;;) {
+    int progress = 1, left = 0;
+    while (progress) {
+      progress = 0;
+      left = 0;
+      for (int i = 0; i < n; i++) {
+        if (!pending[i]) {
+          continue;
+        }
+        int blocked = 0;
+        for (int j = 0; j < n && !blocked; j++) {
+          blocked = j != i && pending[j] && tr_loc_eq(src[j], dst[i]);
+        }
+        if (blocked) {
+          left++;
+          continue;
+        }
+        tr_move(b, dst[i], src[i]);
+        pending[i] = 0;
+        progress = 1;
+      }
+    }
+    if (!left) {
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      if (pending[i]) {
+        const loc_t saved = dst[i];
+        tr_move(b, tr_reg_loc(X64_RCX), saved);
+        for (int j = 0; j < n; j++) {
+          if (pending[j] && tr_loc_eq(src[j], saved)) {
+            src[j] = tr_reg_loc(X64_RCX);
+          }
+        }
+        break;
+      }
+    }
+  }
+}
+
+// stores the guest register values in regs to jit_state_t
+static void tr_writeback(const trace_t *t, x64_buf_t *b, const uint16_t *regs) {
+  loc_t dst[32], src[32];
+  int n = 0;
+  for (int r = 1; r < 32; r++) {
+    loc_t home = {0};
+    home.kind = LOC_MEM;
+    home.disp = ST_REG(r);
+    dst[n] = home;
+    src[n++] = tr_loc(t, regs[r]);
+  }
+  tr_parallel_move(b, dst, src, n);
+}
+
+static void tr_to_reg(const trace_t *t, x64_buf_t *b, int reg, uint16_t v) { tr_move(b, tr_reg_loc(reg), tr_loc(t, v)); }
+
+// <alu> reg, v
+static void tr_alu(const trace_t *t, x64_buf_t *b, int alu, int reg, uint16_t v) {
+  const loc_t l = tr_loc(t, v);
+  if (l.kind == LOC_IMM) {
+    x64_alu_imm32(b, alu, reg, l.imm);
+  } else if (l.kind == LOC_REG) {
+    x64_alu_reg32(b, alu, reg, l.reg);
+  } else {
+    x64_alu_load32(b, alu, reg, X64_RBX, l.disp);
+  }
+}
+
+// rax/rcx = v sign or zero extended to 64 bits
+static void tr_to_reg64(const trace_t *t, x64_buf_t *b, int reg, uint16_t v, int sx) {
+  const loc_t l = tr_loc(t, v);
+  if (!sx) {
+    tr_to_reg(t, b, reg, v);
+  } else if (l.kind == LOC_IMM) {
+    x64_mov_imm64(b, reg, (uint64_t)(int64_t)(int32_t)l.imm);
+  } else if (l.kind == LOC_REG) {
+    x64_movsx64_reg32(b, reg, l.reg);
+  } else {
+    x64_load32_sx64(b, reg, X64_RBX, l.disp);
+  }
+}
+
+// the value's register, or eax when it lives in memory or is the register of avoid
+static int tr_dst(const trace_t *t, uint16_t v, uint16_t avoid) {
+  return t->reg[v] >= 0 && t->reg[v] != t->reg[avoid] ? t->reg[v] : X64_RAX;
+}
+
+static void tr_set(const trace_t *t, x64_buf_t *b, uint16_t v, int reg) { tr_move(b, tr_loc(t, v), tr_reg_loc(reg)); }
+
+static void tr_emit_insn(trace_t *t, x64_buf_t *b, uint32_t i, uint8_t **site_list, int *nsites, uint16_t *site_exit) {
+  const ir_t *x = &t->ir[i];
+  const uint16_t v = i;
+#define EXIT_JCC(cc)                                                                                                                       \
+  do {                                                                                                                                     \
+    site_list[*nsites] = x64_jcc32(b, cc);                                                                                                 \
+    site_exit[(*nsites)++] = x->exit;                                                                                                      \
+  } while (0)
+  switch (x->op) {
+  case IR_ADD:
+  case IR_SUB:
+  case IR_XOR:
+  case IR_OR:
+  case IR_AND: {
+    static const uint8_t alu[] = {[IR_ADD] = X64_ADD, [IR_SUB] = X64_SUB, [IR_XOR] = X64_XOR, [IR_OR] = X64_OR, [IR_AND] = X64_AND};
+    const int dst = tr_dst(t, v, x->b);
+    tr_to_reg(t, b, dst, x->a);
+    tr_alu(t, b, alu[x->op], dst, x->b);
+    tr_set(t, b, v, dst);
+  } break;
+  case IR_SLL:
+  case IR_SRL:
+  case IR_SRA: {
+    const int ext = x->op == IR_SLL ? 4 : (x->op == IR_SRL ? 5 : 7);
+    const int dst = t->reg[v] >= 0 ? t->reg[v] : X64_RAX;
+    if (t->ir[x->b].op == IR_CONST) {
+      tr_to_reg(t, b, dst, x->a);
+      x64_shift_imm(b, ext, dst, t->ir[x->b].imm & 0x1F);
+    } else {
+      tr_to_reg(t, b, X64_RCX, x->b);
+      tr_to_reg(t, b, dst, x->a);
+      x64_shift_cl(b, ext, dst);
+    }
+    tr_set(t, b, v, dst);
+  } break;
+  case IR_SLT:
+  case IR_SLTU:
+    tr_to_reg(t, b, X64_RAX, x->a);
+    tr_alu(t, b, X64_CMP, X64_RAX, x->b);
+    x64_setcc_zx(b, x->op == IR_SLT ? X64_CC_L : X64_CC_B, X64_RAX);
+    tr_set(t, b, v, X64_RAX);
+    break;
+  case IR_MUL: {
+    const int dst = tr_dst(t, v, x->b);
+    tr_to_reg(t, b, dst, x->a);
+    if (t->reg[x->b] >= 0 && t->ir[x->b].op != IR_CONST) {
+      x64_imul_reg32(b, dst, t->reg[x->b]);
+    } else {
+      tr_to_reg(t, b, X64_RCX, x->b);
+      x64_imul_reg32(b, dst, X64_RCX);
+    }
+    tr_set(t, b, v, dst);
+  } break;
+  case IR_MULH:
+  case IR_MULHSU:
+  case IR_MULHU:
+    tr_to_reg64(t, b, X64_RAX, x->a, x->op != IR_MULHU);
+    tr_to_reg64(t, b, X64_RCX, x->b, x->op == IR_MULH);
+    x64_imul_reg64(b, X64_RAX, X64_RCX);
+    x64_shift64_imm(b, 5, X64_RAX, 32);
+    tr_set(t, b, v, X64_RAX);
+    break;
+  case IR_DIV:
+  case IR_REM: {
+    // by zero: div gives -1, rem the dividend; INT_MIN / -1: div gives INT_MIN, rem 0
+    const int is_div = x->op == IR_DIV;
+    tr_to_reg(t, b, X64_RAX, x->a);
+    tr_to_reg(t, b, X64_RCX, x->b);
+    x64_test_reg32(b, X64_RCX, X64_RCX);
+    uint8_t *by_zero = x64_jcc8(b, X64_CC_E);
+    x64_alu_imm32(b, X64_CMP, X64_RCX, 0xFFFFFFFF);
+    uint8_t *normal = x64_jcc8(b, X64_CC_NE);
+    x64_alu_imm32(b, X64_CMP, X64_RAX, INT_MIN_HEX);
+    uint8_t *overflow = x64_jcc8(b, X64_CC_E);
+    x64_patch8(b, normal, b->p);
+    x64_idiv32(b, X64_RCX);
+    if (!is_div) {
+      x64_mov_reg32(b, X64_RAX, X64_RDX);
+    }
+    uint8_t *done = x64_jmp8(b);
+    x64_patch8(b, by_zero, b->p);
+    if (is_div) {
+      x64_mov_imm32(b, X64_RAX, 0xFFFFFFFF);
+    }
+    uint8_t *done2 = x64_jmp8(b);
+    x64_patch8(b, overflow, b->p);
+    if (!is_div) {
+      x64_alu_reg32(b, X64_XOR, X64_RAX, X64_RAX);
+    }
+    x64_patch8(b, done, b->p);
+    x64_patch8(b, done2, b->p);
+    tr_set(t, b, v, X64_RAX);
+  } break;
+  case IR_DIVU:
+  case IR_REMU: {
+    const int is_div = x->op == IR_DIVU;
+    tr_to_reg(t, b, X64_RAX, x->a);
+    tr_to_reg(t, b, X64_RCX, x->b);
+    x64_test_reg32(b, X64_RCX, X64_RCX);
+    uint8_t *by_zero = x64_jcc8(b, X64_CC_E);
+    x64_div32(b, X64_RCX);
+    if (!is_div) {
+      x64_mov_reg32(b, X64_RAX, X64_RDX);
+    }
+    uint8_t *done = x64_jmp8(b);
+    x64_patch8(b, by_zero, b->p);
+    if (is_div) {
+      x64_mov_imm32(b, X64_RAX, 0xFFFFFFFF);
+    }
+    x64_patch8(b, done, b->p);
+    tr_set(t, b, v, X64_RAX);
+  } break;
+  case IR_LOAD:
+  case IR_STORE: {
+    const int width = rv_mem_width(x->sub);
+    const ir_t *base = &t->ir[x->a];
+    if (x->check == CHECK_GROUP) {
+      // every access off this base starts in [base + lo, base + hi] and is at most 4 bytes wide
+      tr_to_reg(t, b, X64_RAX, x->a);
+      if (x->lo) {
+        x64_alu_imm32(b, X64_ADD, X64_RAX, x->lo);
+      }
+      x64_alu_imm32(b, X64_AND, X64_RAX, 0x7FFFFFFF);
+      x64_alu_imm32(b, X64_CMP, X64_RAX, work_mem_size - (uint32_t)(x->hi - x->lo) - 3);
+      EXIT_JCC(X64_CC_AE);
+    }
+    if (base->op == IR_CONST) {
+      x64_mov_imm32(b, X64_RAX, (base->imm + x->imm) & 0x7FFFFFFF);
+    } else {
+      tr_to_reg(t, b, X64_RAX, x->a);
+      if (x->imm) {
+        x64_alu_imm32(b, X64_ADD, X64_RAX, x->imm);
+      }
+      x64_alu_imm32(b, X64_AND, X64_RAX, 0x7FFFFFFF);
+    }
+    if (x->check == CHECK_OWN) {
+      x64_alu_imm32(b, X64_CMP, X64_RAX, work_mem_size - width + 1);
+      EXIT_JCC(X64_CC_AE);
+    }
+    if (x->op == IR_LOAD) {
+      const int dst = t->reg[v] >= 0 ? t->reg[v] : X64_RCX;
+      x64_load_mem_idx(b, dst, X64_R12, X64_RAX, width, x->sub == RV_OP_LB || x->sub == RV_OP_LH);
+      if (t->last_use[v] >= 0) {
+        tr_set(t, b, v, dst);
+      }
+      break;
+    }
+    // stores into translated code or tohost go to the C side
+    const int const_addr = base->op == IR_CONST;
+    const uint32_t addr = (base->imm + x->imm) & 0x7FFFFFFF;
+    if (!const_addr || addr < t->jit->mark_bytes) {
+      uint8_t *not_image = NULL;
+      if (!const_addr) {
+        x64_alu_imm32(b, X64_CMP, X64_RAX, t->jit->mark_bytes);
+        not_image = x64_jcc8(b, X64_CC_AE);
+      }
+      x64_mov_reg32(b, X64_RDX, X64_RAX);
+      x64_shift_imm(b, 5, X64_RDX, 2);
+      x64_load16_zx_idx(b, X64_RCX, X64_R13, X64_RDX);
+      x64_test_reg32(b, X64_RCX, X64_RCX);
+      EXIT_JCC(X64_CC_NE);
+      if (not_image) {
+        x64_patch8(b, not_image, b->p);
+      }
+    }
+    tr_to_reg(t, b, X64_RCX, x->b);
+    x64_store_mem_idx(b, X64_R12, X64_RAX, X64_RCX, width);
+  } break;
+  case IR_GUARD:
+    if (t->reg[x->a] >= 0 && t->ir[x->a].op != IR_CONST) {
+      tr_alu(t, b, X64_CMP, t->reg[x->a], x->b);
+    } else {
+      tr_to_reg(t, b, X64_RAX, x->a);
+      tr_alu(t, b, X64_CMP, X64_RAX, x->b);
+    }
+    EXIT_JCC(x->sub);
+    break;
+  default:
+    break;
+  }
+#undef EXIT_JCC
+}
+
+static uint8_t *tr_compile(trace_t *t) {
+  jit_t *jit = t->jit;
+  uint8_t *const start = jit->code_ptr;
+  x64_buf_t bb = jit_buf(jit, start);
+  x64_buf_t *b = &bb;
+  uint8_t *sites[TRACE_MAX_EXITS * 2];
+  uint16_t site_exit[TRACE_MAX_EXITS * 2];
+  int nsites = 0;
+
+  // guest registers that live in host registers are loaded once
+  for (int r = 1; r < 32; r++) {
+    if (t->reg[r] >= 0) {
+      x64_load32(b, t->reg[r], X64_RBX, ST_REG(r));
+    }
+  }
+  uint8_t *const top = b->p;
+  x64_add_mem64_imm32(b, X64_RBX, ST_INSTRET, t->ninsns);
+  for (uint32_t i = 32; i < t->nir; i++) {
+    tr_emit_insn(t, b, i, sites, &nsites, site_exit);
+  }
+
+  if (t->end == END_LOOP) {
+    loc_t dst[32], src[32];
+    int n = 0;
+    for (int r = 1; r < 32; r++) {
+      if (t->live[r] && t->regs[r] != r) {
+        dst[n] = tr_loc(t, r);
+        src[n++] = tr_loc(t, t->regs[r]);
+      }
+    }
+    tr_parallel_move(b, dst, src, n);
+    x64_patch32(b, x64_jmp32(b), top);
+  } else {
+    tr_writeback(t, b, t->regs);
+    if (t->end == END_CHAIN) {
+      jit_emit_chain_exit(jit, b, t->end_pc);
+    } else {
+      tr_to_reg(t, b, X64_RAX, t->end_target);
+      x64_store32(b, X64_RBX, ST_PC, X64_RAX);
+      jit_emit_indirect(jit, b);
+    }
+  }
+
+  for (uint32_t e = 0; e < t->nexits; e++) {
+    const trace_exit_t *x = &t->exits[e];
+    int used = 0;
+    for (int i = 0; i < nsites; i++) {
+      if (site_exit[i] == e) {
+        x64_patch32(b, sites[i], b->p);
+        used = 1;
+      }
+    }
+    if (!used) {
+      continue;
+    }
+    tr_writeback(t, b, x->regs);
+    const uint32_t uncount = t->ninsns - x->executed;
+    if (x->slow) {
+      x64_store_imm32(b, X64_RBX, ST_UNCOUNT, uncount);
+      jit_emit_exit(jit, b, x->pc, JIT_EXIT_SLOW);
+    } else {
+      if (uncount) {
+        x64_sub_mem64_imm32(b, X64_RBX, ST_INSTRET, uncount);
+      }
+      jit_emit_chain_exit(jit, b, x->pc);
+    }
+  }
+  jit->code_ptr = (uint8_t *)(((uintptr_t)b->p + 15) & ~(uintptr_t)15);
+#if LOG_TRACE
+  printf("trace 0x%X: %d instructions, %d IR, %d exits, %d spills, %s, %d bytes\n", t->head, t->ninsns, t->nir, t->nexits, t->nspills,
+         t->end == END_LOOP ? "loop" : "no loop", (int)(b->p - start));
+#endif
+  return start;
+}
+
+void jit_trace_hot(jit_t *jit, uint32_t pc) {
+  uint8_t *const block = jit->st.block_map[pc >> 2];
+  uint8_t *entry = NULL;
+  if (!jit->mem_write_intercept && (size_t)(jit->code + CODE_CACHE_SIZE - jit->code_ptr) >= TRACE_MAX_CODE) {
+    trace_t *t = calloc(1, sizeof(trace_t));
+    if (t) {
+      t->jit = jit;
+      t->head = pc;
+      tr_record(t);
+      // a trace that neither loops nor crosses a branch is just the tier 1 block
+      if (!t->failed && t->ninsns && (t->end == END_LOOP || t->nbranches)) {
+        tr_dce(t);
+        tr_bounds(t);
+        if (tr_regalloc(t) == 0) {
+          entry = tr_compile(t);
+        }
+      }
+      free(t);
+    }
+  }
+  x64_buf_t b = jit_buf(jit, block);
+  if (entry == NULL) {
+    // stays in tier 1
+    memset(block - 4 + b.w, 0xFF, 4);
+    return;
+  }
+  // chained jumps into the tier 1 block continue in the trace
+  x64_patch32(&b, x64_jmp32(&b), entry);
+  jit->st.block_map[pc >> 2] = entry;
+}
+
+#endif
@@ -0,0 +1,807 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // memfd_create
+#endif
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-optimized-1.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cycle-counter.h"
+#include "riscv-vm-decode.h"
+#include "riscv-vm-jit.h"
+
+// x86-64 JIT. Guest basic blocks are translated to native code in an mmap'd
+// code cache the first time they run. The cache is never writable and
+// executable at once, the translators write it through a second mapping.
+// Blocks with a static successor jump to it directly once the successor is
+// translated (the exit jump gets patched), jalr looks the target up in the
+// block map from native code. Everything the native code does not handle
+// (system instructions, syscalls, tohost/UART stores, stores into translated
+// code and memory errors) exits to the C side, which runs that one
+// instruction with the optimized 4 semantics and resumes. With tier 2
+// (riscv_vm_run_jit2) every block also counts its executions and
+// hot ones get replaced by traces (riscv-vm-jit-trace.c).
+
+static int riscv_vm_jit_loop(jit_t *jit, uint32_t *pcp_out);
+
+// Maps the code cache from one host file twice, next to each other so native
+// code reaches its tier 2 counters in code_rw with rip relative addressing:
+// code_rw read-write and code read-execute. Returns 0 on success.
+static int jit_map_code(jit_t *jit) {
+#if defined(__linux__)
+  int fd = memfd_create("riscv-vm-jit", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/riscv-vm-jit-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+#endif
+  if (fd < 0) {
+    return -1;
+  }
+  uint8_t *views = MAP_FAILED;
+  if (ftruncate(fd, CODE_CACHE_SIZE) == 0) {
+    views = mmap(NULL, 2 * CODE_CACHE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (views != MAP_FAILED &&
+      (mmap(views, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(views + CODE_CACHE_SIZE, CODE_CACHE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    munmap(views, 2 * CODE_CACHE_SIZE);
+    views = MAP_FAILED;
+  }
+  close(fd);
+  if (views == MAP_FAILED) {
+    return -1;
+  }
+  jit->code_rw = views;
+  jit->code = views + CODE_CACHE_SIZE;
+  return 0;
+}
+
+static uint8_t *jit_translate(jit_t *jit, uint32_t pc);
+
+int riscv_vm_run_jit(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  return riscv_vm_jit_run(registers, image, user_syscall_handler, jit_translate, 0);
+}
+
+int riscv_vm_run_jit2(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  return riscv_vm_jit_run(registers, image, user_syscall_handler, jit_translate, JIT_HOT_THRESHOLD);
+}
+
+int riscv_vm_jit_run(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler,
+                     jit_translate_t translate, uint32_t hot_threshold) {
+  const uint32_t program_len = vm_image_end(image);
+#if USE_PRINT
+  printf("Starting VM... work mem size %zu program len %d\n", work_mem_size, program_len);
+#endif
+  if (program_len > work_mem_size) {
+#if USE_PRINT
+    fprintf(stderr, "Program too long for memory, program size %d memory size %zu\n", program_len, work_mem_size);
+#endif
+    return ERR_OUT_OF_MEM;
+  }
+  init_counter();
+  jit_t *jit = calloc(1, sizeof(jit_t));
+  if (jit == NULL) {
+    return ERR_OUT_OF_MEM;
+  }
+  jit->start_time = get_cycles();
+  jit->user_syscall_handler = user_syscall_handler;
+  jit->files.user_syscall_handler = user_syscall_handler;
+  jit->translate = translate;
+  jit->hot_threshold = hot_threshold;
+  jit->image_bytes = (program_len + 3) & ~3u;
+  jit->mark_bytes = jit->image_bytes > tohost + 4 ? jit->image_bytes : tohost + 4;
+  jit->st.wmem = vm_mem_alloc(work_mem_size);
+  jit->st.code_mark = calloc(jit->mark_bytes / 4 + 2, 1);
+  jit->st.block_map = calloc(jit->image_bytes / 4 + 1, sizeof(uint8_t *));
+  int res = ERR_OUT_OF_MEM;
+  if (jit->st.wmem == NULL || jit->st.code_mark == NULL || jit->st.block_map == NULL || jit_map_code(jit)) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+  } else if ((res = vm_image_load(jit->st.wmem, work_mem_size, image)) == 0) {
+    const uint32_t sp = vm_linux_init(&jit->files, jit->st.wmem, work_mem_size, image);
+    if (registers) {
+      memcpy(jit->st.regs, registers, REG_MEM_SIZE);
+    } else {
+      jit->st.regs[2] = sp;
+    }
+    jit->st.regs[0] = 0;
+    uint32_t pcp = image->entry & 0x7FFFFFFF;
+    vm_mark_started();
+    res = riscv_vm_jit_loop(jit, &pcp);
+    if (registers) {
+      memcpy(registers, jit->st.regs, REG_MEM_SIZE);
+    }
+#if USE_PRINT
+    printf("Final PC: %04X\n", pcp);
+#endif
+  }
+  if (jit->code_rw != NULL) {
+    munmap(jit->code_rw, 2 * CODE_CACHE_SIZE);
+  }
+  vm_files_close(&jit->files);
+  free(jit->st.block_map);
+  free(jit->st.code_mark);
+  vm_mem_free(jit->st.wmem, work_mem_size);
+  free(jit);
+  return res;
+}
+
+// entry: enter(st, block) saves the callee saved registers, loads the pinned ones
+// rbx = state, r12 = guest memory, r13 = code marks, r14 = block map
+// and jumps to the block; exit_code restores them and returns eax
+static void jit_emit_trampolines(jit_t *jit) {
+  x64_buf_t b = jit_buf(jit, jit->code);
+  jit->enter = (int (*)(jit_state_t *, uint8_t *))(void *)b.p;
+  x64_push(&b, X64_RBP);
+  x64_push(&b, X64_RBX);
+  x64_push(&b, X64_R12);
+  x64_push(&b, X64_R13);
+  x64_push(&b, X64_R14);
+  x64_push(&b, X64_R15);
+  x64_alu_imm64(&b, X64_SUB, X64_RSP, 8); // keep calls out of native code 16 byte aligned
+  x64_mov_reg64(&b, X64_RBX, X64_RDI);
+  x64_load64(&b, X64_R12, X64_RBX, offsetof(jit_state_t, wmem));
+  x64_load64(&b, X64_R13, X64_RBX, offsetof(jit_state_t, code_mark));
+  x64_load64(&b, X64_R14, X64_RBX, offsetof(jit_state_t, block_map));
+  x64_jmp_reg(&b, X64_RSI);
+
+  jit->exit_code = b.p;
+  x64_alu_imm64(&b, X64_ADD, X64_RSP, 8);
+  x64_pop(&b, X64_R15);
+  x64_pop(&b, X64_R14);
+  x64_pop(&b, X64_R13);
+  x64_pop(&b, X64_R12);
+  x64_pop(&b, X64_RBX);
+  x64_pop(&b, X64_RBP);
+  x64_ret(&b);
+  jit->code_blocks = (uint8_t *)(((uintptr_t)b.p + 63) & ~(uintptr_t)63);
+  jit->code_ptr = jit->code_blocks;
+}
+
+static void jit_flush(jit_t *jit) {
+  jit->code_ptr = jit->code_blocks;
+  memset(jit->st.block_map, 0, (jit->image_bytes / 4 + 1) * sizeof(uint8_t *));
+  memset(jit->st.code_mark, 0, jit->mark_bytes / 4 + 2);
+  // tohost stores always go to the C side
+  jit->st.code_mark[tohost >> 2] = 1;
+  jit->generation++;
+}
+
+// mov dword [pc], pc; mov eax, reason; jmp exit_code
+void jit_emit_exit(jit_t *jit, x64_buf_t *b, uint32_t pc, int reason) {
+  x64_store_imm32(b, X64_RBX, ST_PC, pc);
+  x64_mov_imm32(b, X64_RAX, reason);
+  x64_patch32(b, x64_jmp32(b), jit->exit_code);
+}
+
+// exit to a static successor: a jmp that is patched to the translated successor
+// followed by the stub it initially points at
+void jit_emit_chain_exit(jit_t *jit, x64_buf_t *b, uint32_t target) {
+  if (target < jit->image_bytes && !(target & 3) && jit->st.block_map[target >> 2]) {
+    x64_patch32(b, x64_jmp32(b), jit->st.block_map[target >> 2]);
+    return;
+  }
+  if (target >= jit->image_bytes || (target & 3)) {
+    // the dispatcher reports the bad pc
+    jit_emit_exit(jit, b, target, JIT_EXIT_DISPATCH);
+    return;
+  }
+  uint8_t *site = x64_jmp32(b);
+  x64_patch32(b, site, b->p);
+  x64_store_imm32(b, X64_RBX, ST_PC, target);
+  // lea rax, [rip + site - next]; mov [rbx + patch_site], rax
+  x64_u8(b, 0x48);
+  x64_u8(b, 0x8D);
+  x64_u8(b, 0x05);
+  x64_u32(b, (uint32_t)(int32_t)(site - (b->p + 4)));
+  x64_store64(b, X64_RBX, ST_PATCH_SITE, X64_RAX);
+  x64_mov_imm32(b, X64_RAX, JIT_EXIT_CHAIN);
+  x64_patch32(b, x64_jmp32(b), jit->exit_code);
+}
+
+void jit_emit_indirect(jit_t *jit, x64_buf_t *b) {
+  // inline lookup in the block map, the dispatcher handles misses and bad targets
+  x64_alu_imm32(b, X64_CMP, X64_RAX, jit->image_bytes);
+  uint8_t *miss1 = x64_jcc8(b, X64_CC_AE);
+  x64_test_imm32(b, X64_RAX, 3);
+  uint8_t *miss2 = x64_jcc8(b, X64_CC_NE);
+  x64_load64_idx2(b, X64_RCX, X64_R14, X64_RAX);
+  x64_test_reg64(b, X64_RCX, X64_RCX);
+  uint8_t *miss3 = x64_jcc8(b, X64_CC_E);
+  x64_jmp_reg(b, X64_RCX);
+  x64_patch8(b, miss1, b->p);
+  x64_patch8(b, miss2, b->p);
+  x64_patch8(b, miss3, b->p);
+  x64_mov_imm32(b, X64_RAX, JIT_EXIT_DISPATCH);
+  x64_patch32(b, x64_jmp32(b), jit->exit_code);
+}
+
+typedef struct {
+  uint8_t *site;
+  uint32_t pc;
+  uint32_t uncount;
+} slow_stub_t;
+
+// eax = (rs1 + imm) & 0x7FFFFFFF, jumps to a slow stub when the width bytes there are not all in guest memory
+static void jit_emit_addr(x64_buf_t *b, const rv_insn_t *d, uint32_t width, slow_stub_t *stub) {
+  x64_load32(b, X64_RAX, X64_RBX, ST_REG(d->rs1));
+  if (d->imm) {
+    x64_alu_imm32(b, X64_ADD, X64_RAX, d->imm);
+  }
+  x64_alu_imm32(b, X64_AND, X64_RAX, 0x7FFFFFFF);
+  x64_alu_imm32(b, X64_CMP, X64_RAX, work_mem_size - width + 1);
+  stub->site = x64_jcc32(b, X64_CC_AE);
+}
+
+uint32_t jit_decode_block(jit_t *jit, uint32_t pc, rv_insn_t *d) {
+  uint32_t n = 0;
+  while (n < MAX_BLOCK_LEN && pc + (n << 2) < jit->image_bytes) {
+    rv_decode(*(uint32_t *)(jit->st.wmem + pc + (n << 2)), &d[n]);
+    jit->st.code_mark[(pc >> 2) + n] = 1;
+    if (jit_ends_block(jit, d[n].op)) {
+      n++;
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+static uint8_t *jit_translate(jit_t *jit, uint32_t pc) {
+  rv_insn_t d[MAX_BLOCK_LEN];
+  const uint32_t n = jit_decode_block(jit, pc, d);
+  slow_stub_t stubs[MAX_BLOCK_LEN * 2];
+  int nstubs = 0;
+  uint8_t *start = jit->code_ptr;
+  uint8_t *hot_site = NULL;
+  x64_buf_t bb = jit_buf(jit, start);
+  x64_buf_t *b = &bb;
+  if (jit->hot_threshold) {
+    // execution counter for tier 2 right before the block, jit_trace_hot finds it there
+    x64_u32(b, jit->hot_threshold);
+    start = b->p;
+    x64_sub_rip32_imm8(b, start - 4 + b->w, 1);
+    hot_site = x64_jcc32(b, X64_CC_E);
+  }
+  x64_add_mem64_imm32(b, X64_RBX, ST_INSTRET, n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    const rv_insn_t *in = &d[i];
+    const uint32_t ipc = pc + (i << 2);
+    const uint32_t rest = n - 1 - i;
+    switch (in->op) {
+    case RV_OP_NOP:
+      break;
+    case RV_OP_LB:
+    case RV_OP_LH:
+    case RV_OP_LW:
+    case RV_OP_LBU:
+    case RV_OP_LHU: {
+      static const uint8_t width[] = {[RV_OP_LB] = 1, [RV_OP_LH] = 2, [RV_OP_LW] = 4, [RV_OP_LBU] = 1, [RV_OP_LHU] = 2};
+      jit_emit_addr(b, in, width[in->op], &stubs[nstubs]);
+      stubs[nstubs].pc = ipc;
+      stubs[nstubs++].uncount = rest;
+      x64_load_mem_idx(b, X64_RCX, X64_R12, X64_RAX, width[in->op], in->op == RV_OP_LB || in->op == RV_OP_LH);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RCX);
+    } break;
+    case RV_OP_SB:
+    case RV_OP_SH:
+    case RV_OP_SW: {
+      if (jit->mem_write_intercept) {
+        // always the last instruction of the block in this mode
+        x64_store_imm32(b, X64_RBX, ST_UNCOUNT, 0);
+        jit_emit_exit(jit, b, ipc, JIT_EXIT_SLOW);
+        break;
+      }
+      const uint32_t width = in->op == RV_OP_SB ? 1 : (in->op == RV_OP_SH ? 2 : 4);
+      jit_emit_addr(b, in, width, &stubs[nstubs]);
+      stubs[nstubs].pc = ipc;
+      stubs[nstubs++].uncount = rest;
+      // stores into translated code or tohost go to the C side
+      x64_alu_imm32(b, X64_CMP, X64_RAX, jit->mark_bytes);
+      uint8_t *not_image = x64_jcc8(b, X64_CC_AE);
+      x64_mov_reg32(b, X64_RDX, X64_RAX);
+      x64_shift_imm(b, 5, X64_RDX, 2);
+      x64_load16_zx_idx(b, X64_RCX, X64_R13, X64_RDX);
+      x64_test_reg32(b, X64_RCX, X64_RCX);
+      stubs[nstubs].site = x64_jcc32(b, X64_CC_NE);
+      stubs[nstubs].pc = ipc;
+      stubs[nstubs++].uncount = rest;
+      x64_patch8(b, not_image, b->p);
+      x64_load32(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      x64_store_mem_idx(b, X64_R12, X64_RAX, X64_RCX, width);
+    } break;
+    case RV_OP_ADDI:
+    case RV_OP_XORI:
+    case RV_OP_ORI:
+    case RV_OP_ANDI: {
+      static const uint8_t alu[] = {[RV_OP_ADDI] = X64_ADD, [RV_OP_XORI] = X64_XOR, [RV_OP_ORI] = X64_OR, [RV_OP_ANDI] = X64_AND};
+      if (in->rs1 == 0) {
+        x64_store_imm32(b, X64_RBX, ST_REG(in->rd), in->op == RV_OP_ANDI ? 0 : in->imm);
+        break;
+      }
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_alu_imm32(b, alu[in->op], X64_RAX, in->imm);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+    } break;
+    case RV_OP_SLTI:
+    case RV_OP_SLTIU:
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_alu_imm32(b, X64_CMP, X64_RAX, in->imm);
+      x64_setcc_zx(b, in->op == RV_OP_SLTI ? X64_CC_L : X64_CC_B, X64_RAX);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      break;
+    case RV_OP_SLLI:
+    case RV_OP_SRLI:
+    case RV_OP_SRAI:
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_shift_imm(b, in->op == RV_OP_SLLI ? 4 : (in->op == RV_OP_SRLI ? 5 : 7), X64_RAX, in->imm);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      break;
+    case RV_OP_LUI:
+      x64_store_imm32(b, X64_RBX, ST_REG(in->rd), in->imm);
+      break;
+    case RV_OP_AUIPC:
+      x64_store_imm32(b, X64_RBX, ST_REG(in->rd), ipc + in->imm);
+      break;
+    case RV_OP_ADD:
+    case RV_OP_SUB:
+    case RV_OP_XOR:
+    case RV_OP_OR:
+    case RV_OP_AND: {
+      static const uint8_t alu[] = {[RV_OP_ADD] = X64_ADD, [RV_OP_SUB] = X64_SUB, [RV_OP_XOR] = X64_XOR, [RV_OP_OR] = X64_OR, [RV_OP_AND] = X64_AND};
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_alu_load32(b, alu[in->op], X64_RAX, X64_RBX, ST_REG(in->rs2));
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+    } break;
+    case RV_OP_SLL:
+    case RV_OP_SRL:
+    case RV_OP_SRA:
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_load32(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      x64_shift_cl(b, in->op == RV_OP_SLL ? 4 : (in->op == RV_OP_SRL ? 5 : 7), X64_RAX);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      break;
+    case RV_OP_SLT:
+    case RV_OP_SLTU:
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_alu_load32(b, X64_CMP, X64_RAX, X64_RBX, ST_REG(in->rs2));
+      x64_setcc_zx(b, in->op == RV_OP_SLT ? X64_CC_L : X64_CC_B, X64_RAX);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      break;
+    case RV_OP_MUL:
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_load32(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      x64_imul_reg32(b, X64_RAX, X64_RCX);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      break;
+    case RV_OP_MULH:
+    case RV_OP_MULHSU:
+    case RV_OP_MULHU:
+      if (in->op == RV_OP_MULHU) {
+        x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      } else {
+        x64_load32_sx64(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      }
+      if (in->op == RV_OP_MULH) {
+        x64_load32_sx64(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      } else {
+        x64_load32(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      }
+      x64_imul_reg64(b, X64_RAX, X64_RCX);
+      x64_shift64_imm(b, 5, X64_RAX, 32);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      break;
+    case RV_OP_DIV:
+    case RV_OP_REM: {
+      const int is_div = in->op == RV_OP_DIV;
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_load32(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      x64_test_reg32(b, X64_RCX, X64_RCX);
+      uint8_t *by_zero = x64_jcc8(b, X64_CC_E);
+      x64_alu_imm32(b, X64_CMP, X64_RCX, 0xFFFFFFFF);
+      uint8_t *normal = x64_jcc8(b, X64_CC_NE);
+      x64_alu_imm32(b, X64_CMP, X64_RAX, INT_MIN_HEX);
+      uint8_t *overflow = x64_jcc8(b, X64_CC_E);
+      x64_patch8(b, normal, b->p);
+      x64_idiv32(b, X64_RCX);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), is_div ? X64_RAX : X64_RDX);
+      uint8_t *done = x64_jmp8(b);
+      x64_patch8(b, by_zero, b->p);
+      // div by zero gives -1, rem by zero gives the dividend
+      if (is_div) {
+        x64_store_imm32(b, X64_RBX, ST_REG(in->rd), 0xFFFFFFFF);
+      } else {
+        x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      }
+      uint8_t *done2 = x64_jmp8(b);
+      x64_patch8(b, overflow, b->p);
+      // INT_MIN / -1 gives INT_MIN, the remainder is 0
+      if (is_div) {
+        x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      } else {
+        x64_store_imm32(b, X64_RBX, ST_REG(in->rd), 0);
+      }
+      x64_patch8(b, done, b->p);
+      x64_patch8(b, done2, b->p);
+    } break;
+    case RV_OP_DIVU:
+    case RV_OP_REMU: {
+      const int is_div = in->op == RV_OP_DIVU;
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_load32(b, X64_RCX, X64_RBX, ST_REG(in->rs2));
+      x64_test_reg32(b, X64_RCX, X64_RCX);
+      uint8_t *by_zero = x64_jcc8(b, X64_CC_E);
+      x64_div32(b, X64_RCX);
+      x64_store32(b, X64_RBX, ST_REG(in->rd), is_div ? X64_RAX : X64_RDX);
+      uint8_t *done = x64_jmp8(b);
+      x64_patch8(b, by_zero, b->p);
+      if (is_div) {
+        x64_store_imm32(b, X64_RBX, ST_REG(in->rd), 0xFFFFFFFF);
+      } else {
+        x64_store32(b, X64_RBX, ST_REG(in->rd), X64_RAX);
+      }
+      x64_patch8(b, done, b->p);
+    } break;
+    case RV_OP_BEQ:
+    case RV_OP_BNE:
+    case RV_OP_BLT:
+    case RV_OP_BGE:
+    case RV_OP_BLTU:
+    case RV_OP_BGEU: {
+      static const uint8_t cc[] = {[RV_OP_BEQ] = X64_CC_E, [RV_OP_BNE] = X64_CC_NE, [RV_OP_BLT] = X64_CC_L,
+                                   [RV_OP_BGE] = X64_CC_GE, [RV_OP_BLTU] = X64_CC_B, [RV_OP_BGEU] = X64_CC_AE};
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      x64_alu_load32(b, X64_CMP, X64_RAX, X64_RBX, ST_REG(in->rs2));
+      uint8_t *taken = x64_jcc32(b, cc[in->op]);
+      jit_emit_chain_exit(jit, b, ipc + 4);
+      x64_patch32(b, taken, b->p);
+      jit_emit_chain_exit(jit, b, ipc + in->imm);
+    } break;
+    case RV_OP_JAL:
+      if (in->rd) {
+        x64_store_imm32(b, X64_RBX, ST_REG(in->rd), ipc + 4);
+      }
+      jit_emit_chain_exit(jit, b, ipc + in->imm);
+      break;
+    case RV_OP_JALR: {
+      x64_load32(b, X64_RAX, X64_RBX, ST_REG(in->rs1));
+      if (in->imm) {
+        x64_alu_imm32(b, X64_ADD, X64_RAX, in->imm);
+      }
+      x64_alu_imm32(b, X64_AND, X64_RAX, 0xFFFFFFFE);
+      if (in->rd) {
+        x64_store_imm32(b, X64_RBX, ST_REG(in->rd), ipc + 4);
+      }
+      x64_store32(b, X64_RBX, ST_PC, X64_RAX);
+      jit_emit_indirect(jit, b);
+    } break;
+    default:
+      // system instructions and invalid opcodes end the block and run on the C side
+      x64_store_imm32(b, X64_RBX, ST_UNCOUNT, 0);
+      jit_emit_exit(jit, b, ipc, JIT_EXIT_SLOW);
+      break;
+    }
+  }
+  if (!jit_ends_block(jit, d[n - 1].op)) {
+    jit_emit_chain_exit(jit, b, pc + (n << 2));
+  }
+  for (int i = 0; i < nstubs; i++) {
+    x64_patch32(b, stubs[i].site, b->p);
+    x64_store_imm32(b, X64_RBX, ST_UNCOUNT, stubs[i].uncount);
+    jit_emit_exit(jit, b, stubs[i].pc, JIT_EXIT_SLOW);
+  }
+  if (hot_site) {
+    x64_patch32(b, hot_site, b->p);
+    jit_emit_exit(jit, b, pc, JIT_EXIT_HOT);
+  }
+  jit->code_ptr = (uint8_t *)(((uintptr_t)b->p + 15) & ~(uintptr_t)15);
+  jit->st.block_map[pc >> 2] = start;
+#if LOG_TRACE
+  printf("translated block 0x%X, %d instructions, %d bytes\n", pc, n, (int)(b->p - start));
+#endif
+  return start;
+}
+
+#define exit_loop(ec)                                                                                                                      \
+  do {                                                                                                                                     \
+    *exit_code = (ec);                                                                                                                     \
+    return 1;                                                                                                                              \
+  } while (0)
+
+// Runs the instruction at st->pc the way optimized 4 does. Returns 1 when the
+// VM has to stop (exit code in *exit_code), 0 to continue at st->pc.
+static int jit_interpret_one(jit_t *jit, int *exit_code) {
+  jit_state_t *st = &jit->st;
+  uint32_t *registers = st->regs;
+  uint8_t *wmem = st->wmem;
+  const uint32_t pc = st->pc;
+  const uint32_t instruction = *(uint32_t *)(wmem + pc);
+  rv_insn_t in;
+  rv_decode(instruction, &in);
+  switch (in.op) {
+  case RV_OP_LB:
+  case RV_OP_LH:
+  case RV_OP_LW:
+  case RV_OP_LBU:
+  case RV_OP_LHU: {
+    const uint32_t addr = (registers[in.rs1] + in.imm) & 0x7FFFFFFF;
+    if (addr - VM_BLK_BASE < VM_BLK_SIZE && vm_files_blk(&jit->files)) {
+      registers[in.rd] = vm_blk_load(jit->files.blk, addr - VM_BLK_BASE);
+      break;
+    }
+    if (addr > work_mem_size - rv_mem_width(in.op)) {
+#if USE_PRINT
+      fprintf(stderr, "load went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", pc, addr, instruction);
+#endif
+      exit_loop(ERR_INVALID_MEMORY_ACCESS);
+    }
+    switch (in.op) {
+    case RV_OP_LB:
+      registers[in.rd] = (int8_t)wmem[addr];
+      break;
+    case RV_OP_LH:
+      registers[in.rd] = *(int16_t *)(wmem + addr);
+      break;
+    case RV_OP_LW:
+      registers[in.rd] = *(uint32_t *)(wmem + addr);
+      break;
+    case RV_OP_LBU:
+      registers[in.rd] = wmem[addr];
+      break;
+    default:
+      registers[in.rd] = *(uint16_t *)(wmem + addr);
+      break;
+    }
+    break;
+  }
+  case RV_OP_SB:
+  case RV_OP_SH:
+  case RV_OP_SW: {
+    const uint32_t v2 = registers[in.rs2];
+    uint32_t addr = registers[in.rs1] + in.imm;
+    if (jit->mem_write_intercept && addr == jit->mem_write_intercept) {
+      printf("MEM_INTERCEPT: op_store addr 0x%x v2 %d (0x%x) PC 0x%x\n", addr, v2, v2, pc);
+    }
+#if EMULATE_UART_OUT
+    if (addr == UART_OUT_REGISTER) {
+      if (in.op == RV_OP_SB) {
+#if USE_PRINT
+        vm_console_putc(vm_files_console(&jit->files), (uint8_t)v2);
+#endif
+      }
+      break;
+    }
+#endif
+    addr &= 0x7FFFFFFF;
+    if (addr - VM_BLK_BASE < VM_BLK_SIZE && vm_files_blk(&jit->files)) {
+      vm_blk_store(jit->files.blk, wmem, work_mem_size, addr - VM_BLK_BASE, v2);
+      break;
+    }
+    if (addr > work_mem_size - rv_mem_width(in.op)) {
+#if USE_PRINT
+      fprintf(stderr, "store went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", pc, addr, instruction);
+#endif
+      exit_loop(ERR_INVALID_MEMORY_ACCESS);
+    }
+#if USE_TOHOST_SYSCALL
+    if (addr == tohost) {
+      uint32_t from_virt = v2;
+      if (from_virt & 1) {
+        exit_loop(from_virt >> 1);
+      }
+      from_virt = vm_tohost_syscall(vm_files_console(&jit->files), wmem, jit->files.layout.mem_size, v2);
+      if (from_virt != SYS_write) {
+#if USE_PRINT
+        fprintf(stderr, "unimplemented magic syscall %d\n", from_virt);
+#endif
+        exit_loop(ERR_UNIMPLEMENTED_MAGIC_SYSCALL);
+      }
+      wmem[fromhost] = 1;
+      break;
+    }
+#endif
+    if (in.op == RV_OP_SB) {
+      wmem[addr] = (uint8_t)v2;
+    } else if (in.op == RV_OP_SH) {
+      *(uint16_t *)(wmem + addr) = (uint16_t)v2;
+    } else {
+      *(uint32_t *)(wmem + addr) = v2;
+    }
+    if (addr < jit->mark_bytes && (st->code_mark[addr >> 2] | st->code_mark[(addr + 3) >> 2])) {
+      // self modifying code, no native code is running at this point
+      jit_flush(jit);
+    }
+    break;
+  }
+  case RV_OP_ECALL: {
+    uint32_t a0 = registers[10]; // argument
+    uint32_t a7 = registers[17]; // function
+    switch (a7) {
+    case SYS_print_mem_access:
+      // stores have to come through here from now on
+      jit->mem_write_intercept = a0;
+      jit_flush(jit);
+      break;
+    case 93: {
+      // exit
+      uint8_t is_test = a0 & 1;
+      uint32_t code = a0 >> 1;
+      if (is_test && a0) {
+#if USE_PRINT
+        fprintf(stderr, "*** FAILED *** (tohost = %d)\n", code);
+#endif
+      }
+      vm_console_flush(jit->files.console);
+#if USE_PRINT
+      printf("exit code %d\n", code);
+#endif
+      exit_loop(code);
+    } break;
+    case 94: {
+      // exit_group of a Linux program, the status as it is
+      vm_console_flush(jit->files.console);
+#if USE_PRINT
+      printf("exit code %d\n", a0 & 0xFF);
+#endif
+      exit_loop(a0 & 0xFF);
+    } break;
+    default:
+      break;
+    }
+    uint32_t user_handled = 0;
+    if (jit->user_syscall_handler) {
+      uint32_t sres = jit->user_syscall_handler(&user_handled, a7, registers[10], registers[11], registers[12], registers[13],
+                                                registers[14], registers[15], registers[16], wmem);
+      if (user_handled == 1) {
+        registers[10] = sres;
+      } else if (user_handled == 2) {
+        exit_loop(0);
+      }
+    }
+    if (user_handled == 0) {
+      registers[10] = syscall_handler(&jit->files, a7, registers[10], registers[11], registers[12], registers[13], registers[14],
+                                      registers[15], registers[16], wmem);
+    }
+    break;
+  }
+  case RV_OP_EBREAK:
+#if USE_PRINT
+    fprintf(stderr, "ebreak, exiting\n");
+#endif
+    exit_loop(ERR_EBREAK);
+  case RV_OP_WFI:
+#if USE_PRINT
+    fprintf(stderr, "wfi instruction, exiting\n");
+#endif
+    exit_loop(ERR_WFI);
+  case RV_OP_CSRRS: {
+    uint32_t val = registers[in.rd];
+    switch (in.imm) {
+    case 0xc01: // time
+      val = get_cycles() - jit->start_time;
+      break;
+    case 0xc81: // timeh
+      val = (get_cycles() - jit->start_time) >> 32;
+      break;
+    case 0xF14: // mhartid (Hardware thread ID.)
+    case 0x300: // mstatus (Machine status register.)
+    case 0x305: // mtvec (Machine trap-handler base address.)
+      val = 0;
+      break;
+    case 0xb00: // mcycle (Machine cycle counter.)
+      val = get_cycles();
+      break;
+    case 0xB80: // mcycleh
+      val = get_cycles() >> 32;
+      break;
+    case 0xb02: // minstret (Machine instructions-retired counter.)
+      val = st->instret;
+      break;
+    case 0xB82: // minstreth
+      val = st->instret >> 32;
+      break;
+    default:
+      break;
+    }
+    registers[in.rd] = val;
+    break;
+  }
+  default:
+#if USE_PRINT
+    fprintf(stderr, "Unimplemented or invalid opcode 0x%02X at PC 0x%02X\n", instruction & 0x7F, pc);
+#endif
+    exit_loop(ERR_UNIMPLEMENTED_OPCODE);
+  }
+  st->pc = pc + 4;
+  return 0;
+}
+
+static uint8_t *jit_translate_block(jit_t *jit, uint32_t pc) {
+  if ((size_t)(jit->code + CODE_CACHE_SIZE - jit->code_ptr) < MAX_BLOCK_CODE) {
+    jit_flush(jit);
+  }
+  return jit->translate(jit, pc);
+}
+
+static int riscv_vm_jit_loop(jit_t *jit, uint32_t *pcp_out) {
+  jit_state_t *st = &jit->st;
+  int res = 0;
+  jit_emit_trampolines(jit);
+  jit_flush(jit);
+  st->pc = *pcp_out;
+  for (;;) {
+    const uint32_t pc = st->pc;
+    if (pc >= jit->image_bytes || (pc & 3)) {
+#if USE_PRINT
+      fprintf(stderr, "pc 0x%X is misaligned or beyond the program (image size %d)\n", pc, jit->image_bytes);
+#endif
+      res = (pc & 3) ? ERR_MISALIGNED_MEMORY_ACCESS : ERR_INVALID_MEMORY_ACCESS;
+      break;
+    }
+    uint8_t *block = st->block_map[pc >> 2];
+    if (block == NULL) {
+      block = jit_translate_block(jit, pc);
+    }
+    const int reason = jit->enter(st, block);
+    if (reason == JIT_EXIT_CHAIN) {
+      const uint32_t generation = jit->generation;
+      uint8_t *site = st->patch_site;
+      uint8_t *target = st->block_map[st->pc >> 2];
+      if (target == NULL) {
+        target = jit_translate_block(jit, st->pc);
+      }
+      if (generation == jit->generation) {
+        const x64_buf_t b = jit_buf(jit, site);
+        x64_patch32(&b, site, target);
+      }
+    } else if (reason == JIT_EXIT_SLOW) {
+      st->instret -= st->uncount;
+      int exit_code = 0;
+      if (jit_interpret_one(jit, &exit_code)) {
+        res = exit_code;
+        break;
+      }
+    } else if (reason == JIT_EXIT_HOT) {
+      jit_trace_hot(jit, st->pc);
+    }
+  }
+  *pcp_out = st->pc;
+  vm_console_flush(jit->files.console);
+  const uint64_t mcycle_val = st->instret;
+  const uint64_t duration = get_cycles() - jit->start_time;
+  const double speed = (double)mcycle_val / ((double)duration / 1e9);
+  printf("system exit mcycle=%" PRIu64 " dur %" PRIu64 " speed is %g ops/sec (%f "
+         "nanosec/inst)\n",
+         mcycle_val, duration, speed, ((double)duration / 1.0) / (double)mcycle_val);
+  return res;
+}
+
+#else
+
+int riscv_vm_run_jit(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+#if USE_PRINT
+  fprintf(stderr, "JIT is only available on x86-64, running optimized 4 instead\n");
+#endif
+  return riscv_vm_run_optimized_4(registers, image, user_syscall_handler);
+}
+
+int riscv_vm_run_jit2(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  return riscv_vm_run_jit(registers, image, user_syscall_handler);
+}
+
+#endif
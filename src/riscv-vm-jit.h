@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "riscv-vm-decode.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm-x86-64-emit.h"
+
+// Shared between the x86-64 JIT backends: the native code state, the code
+// cache and the runtime loop. A backend only provides the block translator,
+// everything else (dispatch, chaining, the C side slow path) is common.
+
+static const int VM_MEMORY = 1048576 * 32;
+
+static const size_t work_mem_size = VM_MEMORY * 1; // size of memory to allocate
+
+#define CODE_CACHE_SIZE (32 * 1048576)
+// worst case for one block, checked before translating
+#define MAX_BLOCK_CODE (32 * 1024)
+#define MAX_BLOCK_LEN 64
+// tier 1 block executions before a trace is compiled from it
+#define JIT_HOT_THRESHOLD 1000
+// spill slots for tier 2 values that did not get a host register
+#define JIT_SPILL_SLOTS 64
+
+// JIT_EXIT_HOT: the execution counter of the tier 1 block at st->pc ran out
+enum { JIT_EXIT_CHAIN = 1, JIT_EXIT_DISPATCH = 2, JIT_EXIT_SLOW = 3, JIT_EXIT_HOT = 4 };
+
+typedef struct {
+  uint32_t regs[32];
+  uint32_t pc;
+  uint32_t uncount; // instructions of the block that did not run when it exited early
+  uint64_t instret;
+  uint8_t *patch_site; // rel32 of the jmp to patch for JIT_EXIT_CHAIN
+  uint8_t *wmem;
+  uint8_t *code_mark;
+  uint8_t **block_map;
+  uint32_t spill[JIT_SPILL_SLOTS];
+} jit_state_t;
+
+#define ST_REG(r) ((int32_t)offsetof(jit_state_t, regs) + (r) * 4)
+#define ST_PC ((int32_t)offsetof(jit_state_t, pc))
+#define ST_UNCOUNT ((int32_t)offsetof(jit_state_t, uncount))
+#define ST_INSTRET ((int32_t)offsetof(jit_state_t, instret))
+#define ST_PATCH_SITE ((int32_t)offsetof(jit_state_t, patch_site))
+#define ST_SPILL(i) ((int32_t)offsetof(jit_state_t, spill) + (i) * 4)
+
+typedef struct jit jit_t;
+
+// translates the block at pc into jit->code_ptr, registers it in the block
+// map and returns its entry; there is always MAX_BLOCK_CODE room
+typedef uint8_t *(*jit_translate_t)(jit_t *jit, uint32_t pc);
+
+struct jit {
+  jit_state_t st;
+  uint8_t *code;        // code cache, where it runs; read and execute only
+  uint8_t *code_rw;     // the same pages, where the translators write them
+  uint8_t *code_ptr;    // first free byte
+  uint8_t *code_blocks; // first byte after the entry/exit trampolines
+  int (*enter)(jit_state_t *st, uint8_t *block);
+  uint8_t *exit_code;   // common epilogue, eax holds the exit reason
+  uint32_t image_bytes; // translatable guest range, block_map has one entry per word
+  uint32_t mark_bytes;  // code_mark covers the image and tohost
+  uint32_t generation;  // bumped on every flush
+  uint32_t mem_write_intercept;
+  uint64_t start_time;
+  syscall_handler_t user_syscall_handler;
+  vm_files_t files;
+  jit_translate_t translate;
+  uint32_t hot_threshold; // 0 without tier 2, tier 1 blocks then have no counter
+};
+
+// an emitter at p in the code cache, writing through code_rw
+static inline x64_buf_t jit_buf(const jit_t *jit, uint8_t *p) { return (x64_buf_t){p, jit->code_rw - jit->code}; }
+
+int riscv_vm_jit_run(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler,
+                     jit_translate_t translate, uint32_t hot_threshold);
+
+// exit to the runtime loop at pc with the given reason
+void jit_emit_exit(jit_t *jit, x64_buf_t *b, uint32_t pc, int reason);
+// exit to a static successor, patched into a direct jump once it is translated
+void jit_emit_chain_exit(jit_t *jit, x64_buf_t *b, uint32_t target);
+// indirect jump to the guest pc in eax, which is already stored in st->pc
+void jit_emit_indirect(jit_t *jit, x64_buf_t *b);
+
+// 1 if op has to be the last instruction of a block; with the write
+// intercept on every store goes through the C side
+static inline int jit_ends_block(const jit_t *jit, uint8_t op) {
+  return rv_op_ends_block(op) || (jit->mem_write_intercept && op >= RV_OP_SB && op <= RV_OP_SW);
+}
+
+// decodes the block at pc into d and marks its words as translated, returns the instruction count
+uint32_t jit_decode_block(jit_t *jit, uint32_t pc, rv_insn_t *d);
+
+// Tier 2 (riscv-vm-jit-trace.c): compiles a trace starting at the tier 1
+// block at pc whose counter ran out and makes it the entry for pc. When no
+// useful trace starts there the block's counter is disabled instead.
+void jit_trace_hot(jit_t *jit, uint32_t pc);
+
+// Copy-and-patch backend. Stencils are compiled by gcc from the C in
+// riscv-vm-jit-stencils.c with the JIT registers pinned (rbx = state,
+// r12 = guest memory, r13 = code marks, r14 = block map). A value hole is
+// a `mov reg, imm32` with a magic immediate, a jump hole is a tail call to
+// one of the jit_hole_* functions; the translator finds both by scanning
+// the stencil bytes.
+#define JIT_HOLE_MAGIC 0x7E5C0A00u
+
+enum {
+  JIT_HOLE_RD = 0,
+  JIT_HOLE_RS1,
+  JIT_HOLE_RS2,
+  JIT_HOLE_IMM,
+  JIT_HOLE_LINK,        // pc + 4 for jal/jalr
+  JIT_HOLE_MARK_BYTES,  // jit->mark_bytes
+  JIT_HOLE_IMAGE_BYTES, // jit->image_bytes
+  JIT_HOLE_VALUES,
+  // jump holes
+  JIT_HOLE_NEXT = JIT_HOLE_VALUES, // falls through to the next stencil
+  JIT_HOLE_TAKEN,                  // branch taken
+  JIT_HOLE_SLOW,                   // run this instruction on the C side
+  JIT_HOLE_DISPATCH,               // st->pc is set, go through the dispatcher
+  JIT_HOLE_COUNT
+};
+
+void jit_hole_next(void);
+void jit_hole_taken(void);
+void jit_hole_slow(void);
+void jit_hole_dispatch(void);
+
+typedef struct {
+  const uint8_t *start;
+  const uint8_t *end;
+} jit_stencil_t;
+
+// indexed by RV_OP_*, empty for the ops that always go to the C side
+extern const jit_stencil_t jit_stencils[RV_OP_COUNT];
+// st->instret += imm, starts every block
+extern const jit_stencil_t jit_stencil_prologue;
+// jalr with rd == x0
+extern const jit_stencil_t jit_stencil_jr;
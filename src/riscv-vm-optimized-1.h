@@ -1,6 +1,13 @@
 #pragma once
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include "riscv-vm-blk.h"
+#include "riscv-vm-console.h"
+#include "riscv-vm-ioqueue.h"
 
 #define LOG_TRACE 0
 #define LOG_DEBUG 0
@@ -13,24 +20,200 @@
 
 extern char *op_names[128];
 
+#define VM_MAX_SEGMENTS 16
+
+// bytes [0, filesz) of a segment come from data, [filesz, memsz) are zero
+typedef struct {
+  const uint8_t *data;
+  uint32_t offset; // of data in the image's file
+  uint32_t vaddr;  // guest address, the top bit is dropped like for every guest access
+  uint32_t filesz;
+  uint32_t memsz;
+} vm_segment_t;
+
+/**
+  Guest program: the segments to place in guest memory and the pc to start at.
+  When fd is an open file the segments' data lives in, their whole pages are
+  mapped copy-on-write from it instead of copied, fd -1 always copies.
+ */
+typedef struct {
+  int fd;
+  uint32_t entry;
+  uint32_t phdr;  // guest address of the ELF program headers, 0 when no segment loads them
+  uint32_t phnum; // and their count, for the auxiliary vector of a Linux program
+  uint32_t nsegments;
+  vm_segment_t segments[VM_MAX_SEGMENTS];
+} vm_image_t;
+
+// guest address past the last byte that came from the file, engines decode code up to it
+uint32_t vm_image_end(const vm_image_t *image);
+
+// places the image into zeroed, page aligned guest memory, returns 0 or an ERR_* code
+int vm_image_load(uint8_t *wmem, size_t mem_size, const vm_image_t *image);
+
 /**
   Implements RV32IM virtual machine
 
   registers - pointer to 31 32-bit registers. Can be NULL, then registers are
-  zeroed at the start. program - raw binary RISC-V program program_len - length
-  of the program
+  zeroed at the start. image - the program, see vm_image_t
 
  */
-int riscv_vm_run_optimized_1(uint8_t *registers, uint8_t *program, uint32_t program_len);
+int riscv_vm_run_optimized_1(uint8_t *registers, const vm_image_t *image);
+
+int riscv_vm_run_optimized_2(uint8_t *registers, const vm_image_t *image);
 
-int riscv_vm_run_optimized_2(uint8_t *registers, uint8_t *program, uint32_t program_len);
+int riscv_vm_run_optimized_3(uint8_t *registers, const vm_image_t *image);
 
-int riscv_vm_run_optimized_3(uint8_t *registers, uint8_t *program, uint32_t program_len);
+#define VM_MAX_FILES 128
+// guest fds, 0 to 2 are the host's stdio
+#define VM_MAX_FDS 64
 
-uint32_t syscall_handler(uint32_t syscall_number, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5, uint32_t arg6,
-                         uint32_t arg7, void *wmem);
+#define VM_LINUX_PAGE 4096
+#define VM_LINUX_STACK_SIZE (1024 * 1024)
+// pages mmap can hand out, the top 32 MiB below the stack at most
+#define VM_LINUX_MAP_PAGES 8192
+
+/**
+  Guest memory as the Linux syscalls see it, set up by vm_linux_init: the
+  image at the bottom, the heap brk moves from the end of it, mmap'd pages
+  taken downwards from the stack and the stack in the top
+  VM_LINUX_STACK_SIZE bytes. mem_size is 0 until then and the memory
+  syscalls fail with ENOMEM. Pages mmap'd from a file are host mappings of
+  it in wmem, copy-on-write, until munmap puts back what was under them: the
+  page of mem_fd (see vm_files_t) when wmem maps one, anonymous memory
+  otherwise.
+ */
+typedef struct {
+  uint32_t mem_size;
+  uint32_t brk_start;
+  uint32_t brk;
+  uint32_t map_end;                          // the stack starts here
+  uint32_t map_low;                          // lowest page mmap handed out, map_end when none
+  uint8_t mapped[VM_LINUX_MAP_PAGES / 8];    // bit i is the page i pages below map_end
+  uint8_t from_file[VM_LINUX_MAP_PAGES / 8]; // of those, the ones mapped from a host file
+} vm_linux_layout_t;
 
 typedef uint32_t (*syscall_handler_t)(uint32_t *handled, uint32_t syscall_number, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5,
                                       uint32_t arg6, uint32_t arg7, void *wmem);
 
-int riscv_vm_run_optimized_4(uint8_t *registers, uint8_t *program, uint32_t program_len, syscall_handler_t user_syscall_handler);
+// host files a guest opened through the fopen syscall, indexed by the handle it got back
+typedef struct {
+  FILE *fopened[VM_MAX_FILES];
+  int fd_in;                              // host fd the guest's reads from fd 0 go to, 0 (stdin) unless set
+  int fds[VM_MAX_FDS];                    // host fd + 1 of each guest fd from 3 on, 0 when the guest has not opened it
+  vm_console_t *console;                  // the guest's stdout, UART and tohost writes, made on the first of them
+  vm_linux_layout_t layout;               // for the Linux syscalls
+  int mem_fd;                             // host fd + 1 of the file wmem is a private mapping of at offset = guest address, 0 if none
+  vm_linux_layout_t *shared_layout;       // the one brk and mmap use instead, of the boot hart under riscv_vm_execute_smp
+  pthread_mutex_t *layout_lock;           // held around brk and mmap on shared_layout
+  vm_ioqueue_t *ioqueue;                  // set up by the guest with SYS_ioqueue_setup, NULL until then
+  vm_console_t *ioqueue_console;          // fd 1 of the syscalls a polling ioqueue makes, NULL unless it polls
+  syscall_handler_t user_syscall_handler; // the engine's, for the syscalls the guest queues
+  vm_blk_t *blk;                          // the block device on the default image, made on the first access to it
+} vm_files_t;
+
+// closes what the guest left open and drains its console
+void vm_files_close(vm_files_t *files);
+
+// the guest's console, created when it is first needed
+vm_console_t *vm_files_console(vm_files_t *files);
+
+// gives host_fd, which the guest opened, the lowest free guest fd and returns it; -1 with host_fd closed when all are taken
+int vm_files_add_fd(vm_files_t *files, int host_fd);
+
+// the host fd of guest fd fd, -1 when the guest has not opened it
+int vm_files_host_fd(const vm_files_t *files, uint32_t fd);
+
+// dups the host fds of from's guest fds into to, which has none open, as fork does for a clone of a snapshot
+void vm_files_dup_fds(vm_files_t *to, const vm_files_t *from);
+// opens the files of from's guest fds again into to, which has none open, at the same offsets: to's reads,
+// writes and seeks do not move from's. Files that cannot be opened again (sockets, other hosts) are dup'd
+void vm_files_reopen_fds(vm_files_t *to, const vm_files_t *from);
+
+// the guest's block device, created when it is first needed; NULL without a default image (runelf -disk)
+vm_blk_t *vm_files_blk(vm_files_t *files);
+
+/**
+  Lays out guest memory of mem_size bytes holding image for a Linux
+  program and builds the stack the kernel starts a process with: argc 1,
+  argv[0], an empty environment and the auxiliary vector. Returns the sp to
+  start with, which the engines use when they zero the registers. Programs
+  that set their own sp, like the riscv-tests ones, run the same with it.
+ */
+uint32_t vm_linux_init(vm_files_t *files, uint8_t *wmem, uint32_t mem_size, const vm_image_t *image);
+
+// maps the pages of files->mem_fd, or anonymous zero pages, back where files are mapped into wmem, for reusing the memory
+void vm_linux_unmap_files(vm_files_t *files, uint8_t *wmem);
+
+/**
+  The guest's ecalls: the custom ones below 2048 riscv-tests style programs
+  use (SYS_fopen 101 to SYS_lseek 109) and the RV32 Linux user ABI, with
+  brk, mmap (of host files too), openat, read(v), write(v), llseek, fstat, statx, clock_gettime
+  and the calls static musl and newlib binaries make at startup. Buffers are
+  used in place in wmem. Linux calls return -errno, unknown ones -ENOSYS.
+  exit and exit_group are up to the engines.
+
+  SYS_ioqueue_setup 110 (ring, entries, flags) sets up the guest I/O queue of
+  riscv-vm-ioqueue.h on the rings at ring, ring 0 takes it down again, and
+  SYS_ioqueue_enter 111 is its doorbell. Queued syscalls go to the
+  user_syscall_handler of files first, like ecalls, its exit requests are
+  not seen there. With VM_IOQUEUE_POLL they run on the queue's thread
+  instead, without the user handler; the guest's ecalls then wait for the
+  entries in progress, and the queue writes fd 1 through a console of its
+  own.
+ */
+uint32_t syscall_handler(vm_files_t *files, uint32_t syscall_number, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                         uint32_t arg5, uint32_t arg6, uint32_t arg7, void *wmem);
+
+// len bytes at guest address addr (top bit dropped) in wmem, NULL when they are not all guest memory
+uint8_t *vm_guest_buf(const vm_files_t *files, void *wmem, uint32_t addr, uint32_t len);
+
+// the NUL terminated string at guest address addr in wmem, NULL when it runs off the end
+const char *vm_guest_str(const vm_files_t *files, void *wmem, uint32_t addr);
+
+// the riscv-tests syscall block at guest address magic that a store to tohost points to: SYS_write puts
+// its string on console. A block or string outside the mem_size bytes of wmem is dropped. Returns the
+// syscall number
+uint32_t vm_tohost_syscall(vm_console_t *console, uint8_t *wmem, uint32_t mem_size, uint32_t magic);
+
+int riscv_vm_run_optimized_4(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler);
+
+/**
+  Same as riscv_vm_run_optimized_4, but every guest word is decoded only once
+  into a side array of pre-decoded records and executed from there.
+ */
+int riscv_vm_run_optimized_5(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler);
+
+/**
+  Basic block engine: guest code runs one cached basic block per dispatch,
+  instret and PC checks are done per block instead of per instruction.
+ */
+int riscv_vm_run_optimized_6(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler);
+
+/**
+  x86-64 JIT: guest basic blocks are translated to native code, system
+  instructions and syscalls run on the C side. Falls back to
+  riscv_vm_run_optimized_4 on other hosts.
+ */
+int riscv_vm_run_jit(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler);
+
+/**
+  Copy-and-patch JIT: same runtime as riscv_vm_run_jit, but native blocks are
+  stitched together from machine code gcc compiled for per-instruction C
+  stencils instead of a hand written emitter.
+ */
+int riscv_vm_run_jit_cp(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler);
+
+/**
+  Parses the copy-and-patch stencils and returns how many of them do not
+  parse, naming each on stderr. riscv_vm_run_jit_cp runs riscv_vm_run_jit
+  unless it is 0. Always 0 on hosts other than x86-64, which have none.
+ */
+int riscv_vm_jit_cp_check(void);
+
+/**
+  Tiered JIT: riscv_vm_run_jit plus a second tier that compiles hot loops
+  and paths through several blocks as traces, optimized in an SSA form and
+  kept in host registers.
+ */
+int riscv_vm_run_jit2(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler);
@@ -6,6 +6,7 @@
 
 #include "cycle-counter.h"
 #include "riscv-vm-common.h"
+#include "riscv-vm-guard-mem.h"
 #include "riscv-vm-optimized-1.h"
 
 #define USE_ZMM_REGISTERS 0
@@ -128,8 +129,20 @@ static uint64_t start_time = 0;
 static uint64_t duration = 0;
 static double speed = 0;
 
-int riscv_vm_run_optimized_3(uint8_t *registers, uint8_t *program,
-                             uint32_t program_len) {
+// the loop's arguments for guard_mem_run
+typedef struct {
+  uint8_t *registers;
+  uint8_t *wmem;
+  uint32_t *pcp;
+} loop_args_t;
+
+static int riscv_vm_main_loop_3_guarded(void *p) {
+  loop_args_t *a = p;
+  return riscv_vm_main_loop_3(a->registers, a->wmem, a->pcp);
+}
+
+int riscv_vm_run_optimized_3(uint8_t *registers, const vm_image_t *image) {
+  const uint32_t program_len = vm_image_end(image);
 
 #if USE_PRINT
   printf("Starting VM... work mem size %zu program len %d\n", work_mem_size,
@@ -146,7 +159,7 @@ int riscv_vm_run_optimized_3(uint8_t *registers, uint8_t *program,
   init_counter();
   start_time = get_cycles();
   printf("start time %" PRIu64 "\n", start_time);
-  uint8_t *wmem = aligned_alloc(alignment, work_mem_size);
+  uint8_t *wmem = guard_mem_alloc(work_mem_size);
   if (wmem == NULL) {
     // Handle allocation failure
 #if USE_PRINT
@@ -154,9 +167,12 @@ int riscv_vm_run_optimized_3(uint8_t *registers, uint8_t *program,
 #endif
     return ERR_OUT_OF_MEM;
   }
-  memset(wmem, 0, work_mem_size);
-  memcpy(wmem, program, program_len);
-  uint32_t pcp = 0;
+  int res = vm_image_load(wmem, work_mem_size, image);
+  if (res) {
+    guard_mem_free(wmem);
+    return res;
+  }
+  uint32_t pcp = image->entry & 0x7FFFFFFF;
   if (!registers) {
     registers = malloc(REG_MEM_SIZE);
     if (registers == NULL) {
@@ -171,14 +187,19 @@ int riscv_vm_run_optimized_3(uint8_t *registers, uint8_t *program,
 #if PRINT_REGISTERS
   dump_registers(registers);
 #endif
-  int res = riscv_vm_main_loop_3(registers, wmem, &pcp);
+  loop_args_t args = {registers, wmem, &pcp};
+  vm_mark_started();
+  res = guard_mem_run(wmem, &pcp, riscv_vm_main_loop_3_guarded, &args);
 #if PRINT_REGISTERS
   dump_registers(registers);
 #endif
 #if USE_PRINT
+  if (res == ERR_INVALID_MEMORY_ACCESS) {
+    fprintf(stderr, "memory access went beyond allocated memory pc %X (addr %0X)\n", pcp, guard_mem_addr);
+  }
   printf("Final PC: %04X\n", pcp);
 #endif
-  free(wmem);
+  guard_mem_free(wmem);
   return res;
 }
 
@@ -426,6 +447,7 @@ int riscv_vm_run_optimized_3(uint8_t *registers, uint8_t *program,
   *pcp_out = pc;                                                               \
   duration = get_cycles() - start_time;                                        \
   speed = (double)mcycle_val / ((double)duration / 1e9);                       \
+  vm_console_flush(vm_console_default());                                      \
   printf("system exit mcycle=%" PRIu64 " dur %" PRIu64                         \
          " speed is %g ops/sec (%f "                                           \
          "nanosec/inst)\n",                                                    \
@@ -437,7 +459,7 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
                                 uint32_t *pcp_out) {
   uint32_t registers[32];
   uint8_t *program = wmem;
-  uint32_t pc = 0;
+  uint32_t pc = *pcp_out;
   uint32_t instruction;
   int res = 0;
   memcpy(registers, initial_registers, REG_MEM_SIZE);
@@ -607,15 +629,8 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
     // hack to account for code that uses absoulte addresses and start
     // virtual memory from 0x80000000
     addr &= 0x7FFFFFFF;
-    if (__builtin_expect(addr >= work_mem_size, 0)) {
-#if USE_PRINT
-      fprintf(stderr,
-              "load went beyond allocated memory pc %X (addr %0X) (instruction "
-              "%X)\n",
-              pc, addr, instruction);
-#endif
-      exit_loop(ERR_INVALID_MEMORY_ACCESS);
-    }
+    // outside guest RAM faults, see riscv-vm-guard-mem.h
+    GUARD_MEM_ACCESS(pc, addr);
     switch (GET_FUNCT3(instruction)) {
     case 0: // lb
       SET_TO_REG(rd, (int8_t)wmem[addr]);
@@ -758,7 +773,7 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
       case 0: // sb
         byte = (uint8_t)v2;
 #if USE_PRINT
-        printf("%c", byte);
+        vm_console_putc(vm_console_default(), byte);
 #endif
         break;
       default:
@@ -771,16 +786,8 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
     // virtual memory from 0x80000000
     addr &= 0x7FFFFFFF;
 
-    if (__builtin_expect(addr >= work_mem_size, 0)) {
-#if USE_PRINT
-      fprintf(
-          stderr,
-          "store went beyond allocated memory pc %X (addr %0X) (instruction "
-          "%X)\n",
-          pc, addr, instruction);
-#endif
-      exit_loop(ERR_INVALID_MEMORY_ACCESS);
-    }
+    // outside guest RAM faults, see riscv-vm-guard-mem.h
+    GUARD_MEM_ACCESS(pc, addr);
 #if USE_TOHOST_SYSCALL
     // used by benchmarks in https://github.com/riscv-software-src/riscv-tests
     if (addr == tohost) {
@@ -789,15 +796,8 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
       if (is_exit) {
         exit_loop(from_virt >> 1);
       }
-      from_virt = *(uint32_t *)(wmem + v2);
-      if (from_virt == SYS_write) {
-        // uint32_t a0 = *(uint32_t *)(wmem + v2 + 8);
-        uint32_t str_ptr = *(uint32_t *)(wmem + v2 + 16);
-        uint32_t str_len = *(uint32_t *)(wmem + v2 + 24);
-        for (uint32_t i = 0; i < str_len; i++) {
-          printf("%c", wmem[str_ptr + i]);
-        }
-      } else {
+      from_virt = GUARD_MEM_HOST_CALL(vm_tohost_syscall(vm_console_default(), wmem, work_mem_size, v2));
+      if (from_virt != SYS_write) {
 #if USE_PRINT
         fprintf(stderr, "unimplemented magic syscall %d\n", from_virt);
 #endif
@@ -1107,6 +1107,7 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
         fprintf(stderr, "*** FAILED *** (tohost = %d)\n", exit_code);
 #endif
       }
+      vm_console_flush(vm_console_default());
 #if USE_PRINT
       printf("exit code %d\n", exit_code);
 #endif
@@ -1121,7 +1122,7 @@ static int riscv_vm_main_loop_3(uint8_t *initial_registers, uint8_t *wmem,
       // write
 //  printf("write %c\n", a0);
 #if USE_PRINT
-      putchar(a0);
+      vm_console_putc(vm_console_default(), (uint8_t)a0);
 #endif
       break;
     default:
@@ -4,79 +4,101 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "riscv-vm-bits.h"
 #include "riscv-vm-common.h"
+#include "riscv-vm-context.h"
+#include "riscv-vm-guard-mem.h"
 #include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
 
 #include "cycle-counter.h"
 
-// 1 MiB, memory available inside VM
-// static const int VM_MEMORY = 1048576;
-static const int VM_MEMORY = 1048576 * 32;
-
-static const size_t work_mem_size = VM_MEMORY * 1; // size of memory to allocate
-
 #if LOG_TRACE
 static void dbg_dump_registers_short(uint32_t *reg);
 #endif
 
-static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint32_t *pcp_out, syscall_handler_t user_syscall_handler);
-
-static uint64_t mcycle_val = 0;
-static uint64_t start_time = 0;
-static uint64_t duration = 0;
-static uint64_t cur_time = 0;
-static double speed = 0;
+static int riscv_vm_main_loop_4(riscv_vm_t *vm);
+static int mmio_access(riscv_vm_t *vm);
 
-int riscv_vm_run_optimized_4(uint8_t *registers, uint8_t *program, uint32_t program_len, syscall_handler_t user_syscall_handler) {
+static int riscv_vm_main_loop_4_guarded(void *p) { return riscv_vm_main_loop_4(p); }
 
-#if USE_PRINT
-  printf("Starting VM... work mem size %zu program len %d\n", work_mem_size, program_len);
-#endif
-  if (program_len > work_mem_size) {
-#if USE_PRINT
-    fprintf(stderr, "Program too long for memory, program size %d memory size %zu\n", program_len, work_mem_size);
-#endif
+int riscv_vm_run_optimized_4(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  riscv_vm_t *vm = riscv_vm_create(user_syscall_handler);
+  if (vm == NULL) {
     return ERR_OUT_OF_MEM;
   }
+  int res = riscv_vm_load(vm, image);
+  if (res == 0) {
+    if (registers) {
+      memcpy(vm->registers, registers, REG_MEM_SIZE);
+    }
+    do {
+      res = riscv_vm_execute(vm);
+    } while (res == RISCV_VM_SNAPSHOT);
+    if (registers) {
+      memcpy(registers, vm->registers, REG_MEM_SIZE);
+    }
+  }
+  riscv_vm_destroy(vm);
+  return res;
+}
+
+static uint64_t thread_cpu_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+int riscv_vm_execute(riscv_vm_t *vm) {
   init_counter();
-  start_time = get_cycles();
-  printf("start time %" PRIu64 "\n", start_time);
-  uint8_t *wmem = aligned_alloc(alignment, work_mem_size);
-  if (wmem == NULL) {
-    // Handle allocation failure
-#if USE_PRINT
-    fprintf(stderr, "Memory allocation failed\n");
-#endif
-    return ERR_OUT_OF_MEM;
+  // the time CSR counts from the first run, not from the current timeslice
+  if (vm->start_time == 0) {
+    vm->start_time = get_cycles();
+    vm->start_instret = vm->instret;
+    printf("start time %" PRIu64 "\n", vm->start_time);
   }
-  memset(wmem, 0, work_mem_size);
-  memcpy(wmem, program, program_len);
-  uint32_t pcp = 0;
-  if (!registers) {
-    registers = malloc(REG_MEM_SIZE);
-    if (registers == NULL) {
-      // Handle allocation failure
-#if USE_PRINT
-      fprintf(stderr, "Memory allocation failed\n");
+#if PRINT_REGISTERS
+  dump_registers((uint8_t *)vm->registers);
 #endif
-      return ERR_OUT_OF_MEM;
+  vm_mark_started();
+  const uint64_t cpu_start = thread_cpu_ns();
+  const uint64_t budget = vm->budget;
+  const uint64_t budget_end = vm->instret + budget;
+  int res;
+  while ((res = guard_mem_run(vm->wmem, &vm->pc, riscv_vm_main_loop_4_guarded, vm)) == ERR_INVALID_MEMORY_ACCESS && mmio_access(vm)) {
+    // the rest of the timeslice, a guest polling a device still yields
+    if (budget) {
+      if (vm->instret >= budget_end) {
+        res = RISCV_VM_YIELD;
+        break;
+      }
+      vm->budget = budget_end - vm->instret;
     }
-    memset(registers, 0, REG_MEM_SIZE);
   }
+  vm->budget = budget;
+  vm->cpu_ns += thread_cpu_ns() - cpu_start;
 #if PRINT_REGISTERS
-  dump_registers(registers);
-#endif
-  int res = riscv_vm_main_loop_4(registers, wmem, &pcp, user_syscall_handler);
-#if PRINT_REGISTERS
-  dump_registers(registers);
+  dump_registers((uint8_t *)vm->registers);
 #endif
 #if USE_PRINT
-  printf("Final PC: %04X\n", pcp);
+  if (res == ERR_INVALID_MEMORY_ACCESS) {
+    fprintf(stderr, "memory access went beyond allocated memory pc %X (addr %0X)\n", vm->pc, guard_mem_addr);
+  }
+  // not for a pause, a timeslice or a syscall
+  if (res >= 0) {
+    printf("Final PC: %04X\n", vm->pc);
+  }
 #endif
-  free(wmem);
   return res;
 }
 
+static void print_exit_stats(uint64_t instret, uint64_t duration) {
+  const double speed = (double)instret / ((double)duration / 1e9);
+  printf("system exit mcycle=%" PRIu64 " dur %" PRIu64 " speed is %g ops/sec (%f "
+         "nanosec/inst)\n",
+         instret, duration, speed, ((double)duration / 1.0) / (double)instret);
+}
+
 #define GET_FROM_REG_DIRECT(regnum) (registers[regnum])
 #define GET_FROM_REG(dest, regnum) (dest = registers[regnum])
 #define SET_TO_REG(regnum, val) (registers[regnum] = val)
@@ -90,52 +112,136 @@ int riscv_vm_run_optimized_4(uint8_t *registers, uint8_t *program, uint32_t prog
 #define GET_IMM_U(inst) ((inst) & 0xFFFFF000)
 #define GET_IMM_S(inst) ((int32_t)((inst & 0xFE000000) | ((inst & 0xF80) << 13)) >> 20)
 
+// The devices are past guest RAM, which ends where the CLINT starts, so
+// their registers fault like any access outside it and the fast paths do
+// not look at them. When the load or store at vm->pc that faulted was to the
+// CLINT or the block device this makes it, steps past it and returns 1.
+static int mmio_access(riscv_vm_t *vm) {
+  // a fetch fault leaves vm->pc past guest RAM
+  if (vm->pc > vm->mem_size - 4) {
+    return 0;
+  }
+  const uint32_t instruction = *(uint32_t *)(vm->wmem + vm->pc);
+  const uint32_t opcode = instruction & 0x7F;
+  uint32_t *const registers = vm->registers;
+  uint32_t addr = registers[GET_RS1(instruction)];
+  if (opcode == 0x03) {
+    addr += GET_IMM_I(instruction);
+  } else if (opcode == 0x23) {
+    addr += GET_IMM_S(instruction);
+  } else {
+    return 0;
+  }
+  addr &= 0x7FFFFFFF;
+  if (addr != guard_mem_addr) {
+    return 0;
+  }
+  vm_blk_t *const blk = addr - VM_BLK_BASE < VM_BLK_SIZE ? vm_context_blk(vm) : NULL;
+  if (addr - CLINT_BASE >= CLINT_SIZE && blk == NULL) {
+    return 0;
+  }
+  if (opcode == 0x03) {
+    // loads to x0 never get here
+    registers[GET_RD(instruction)] = blk ? vm_blk_load(blk, addr - VM_BLK_BASE) : vm_clint_load(vm, addr);
+  } else if (blk) {
+    vm_blk_store(blk, vm->wmem, vm->mem_size, addr - VM_BLK_BASE, registers[GET_RS2(instruction)]);
+  } else {
+    vm_clint_store(vm, addr, registers[GET_RS2(instruction)]);
+  }
+  vm->pc += 4;
+  return 1;
+}
+
 #define exit_loop(ec)                                                                                                                      \
-  memcpy(initial_registers, registers, REG_MEM_SIZE);                                                                                      \
-  *pcp_out = pc;                                                                                                                           \
-  duration = get_cycles() - start_time;                                                                                                    \
-  speed = (double)mcycle_val / ((double)duration / 1e9);                                                                                   \
-  printf("system exit mcycle=%" PRIu64 " dur %" PRIu64 " speed is %g ops/sec (%f "                                                         \
-         "nanosec/inst)\n",                                                                                                                \
-         mcycle_val, duration, speed, ((double)duration / 1.0) / (double)mcycle_val);                                                      \
+  vm->pc = pc;                                                                                                                             \
+  vm->instret = mcycle_val;                                                                                                                \
+  if ((int)(ec) >= 0) {                                                                                                                    \
+    vm_console_flush(vm->files.console);                                                                                                   \
+    print_exit_stats(mcycle_val - vm->start_instret, get_cycles() - vm->start_time);                                                       \
+  }                                                                                                                                        \
   return ec;
 
-static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint32_t *pcp_out, syscall_handler_t user_syscall_handler) {
-  uint32_t registers[32];
+// Timeslices end on backward branches and jumps, and on jalr whose direction
+// is not known, so every loop passes a check but straight line code does not
+// pay for it. The budget can be overrun by the length of a loop body.
+#define check_budget()                                                                                                                     \
+  if (__builtin_expect(mcycle_val >= budget_end, 0)) {                                                                                     \
+    exit_loop(RISCV_VM_YIELD);                                                                                                             \
+  }
+
+// amomin.w, amomax.w, amominu.w and amomaxu.w by funct5
+static inline uint32_t amo_min_max(uint32_t funct5, uint32_t v1, uint32_t v2) {
+  switch (funct5) {
+  case 0x10:
+    return (int32_t)v1 < (int32_t)v2 ? v1 : v2;
+  case 0x14:
+    return (int32_t)v1 > (int32_t)v2 ? v1 : v2;
+  case 0x18:
+    return v1 < v2 ? v1 : v2;
+  default:
+    return v1 > v2 ? v1 : v2;
+  }
+}
+
+static int riscv_vm_main_loop_4(riscv_vm_t *vm) {
+  // in vm, not copied: a fault abandons the loop and mmio_access goes on from there
+  uint32_t *const registers = vm->registers;
+  uint8_t *const wmem = vm->wmem;
   uint8_t *program = wmem;
-  uint32_t pc = 0;
+  const syscall_handler_t user_syscall_handler = vm->user_syscall_handler;
+  uint32_t pc = vm->pc;
+  uint64_t mcycle_val = vm->instret;
+  const uint64_t budget_end = vm->budget ? mcycle_val + vm->budget : UINT64_MAX;
   uint32_t instruction;
   int res = 0;
   uint8_t rd = 0;
   uint32_t mem_write_intercept = 0;
-  memcpy(registers, initial_registers, REG_MEM_SIZE);
+  // lr.w reservation, sc.w fails when the word no longer holds reserved_value
+  uint32_t reserved_addr = UINT32_MAX;
+  uint32_t reserved_value = 0;
 
-  static void *op_table[] = {&&uo, &&uo,        &&uo, &&op_load,  &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&normal_end, &&uo, &&uo, &&uo, &&op_int_imm_op,
-                             &&uo, &&uo,        &&uo, &&op_auipc, &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&op_store,   &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&op_int_op, &&uo, &&uo,       &&uo, &&op_lui,     &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,         &&uo, &&uo, &&uo, &&op_branch,
-                             &&uo, &&uo,        &&uo, &&op_jalr,  &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&op_jal,    &&uo, &&uo,       &&uo, &&op_system,  &&uo, &&uo, &&uo, &&uo,
-                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,         &&uo, &&uo, &&uo, &&uo,
+  static void *op_table[] = {&&uo, &&uo,        &&uo, &&op_load,  &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&op_fence,  &&uo, &&uo,     &&uo, &&op_int_imm_op,
+                             &&uo, &&uo,        &&uo, &&op_auipc, &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&op_store,  &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,        &&uo, &&op_amo, &&uo, &&uo,
+                             &&uo, &&op_int_op, &&uo, &&uo,       &&uo, &&op_lui,    &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,        &&uo, &&uo,     &&uo, &&op_branch,
+                             &&uo, &&uo,        &&uo, &&op_jalr,  &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&op_jal,    &&uo, &&uo,       &&uo, &&op_system, &&uo, &&uo,     &&uo, &&uo,
+                             &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo,        &&uo, &&uo,     &&uo, &&uo,
                              &&uo, &&uo,        &&uo, &&uo,       &&uo, &&uo};
   static void *op_load_switch[] = {&&op_load_lb, &&op_load_lh, &&op_load_lw, &&normal_end, &&op_load_lbu, &&op_load_lhu};
   static void *op_int_imm_op_switch[] = {&&op_int_imm_op_addi, &&op_int_imm_op_slli, &&op_int_imm_op_slti, &&op_int_imm_op_sltiu,
                                          &&op_int_imm_op_xori, &&op_int_imm_op_srli, &&op_int_imm_op_ori,  &&op_int_imm_op_andi};
-  static void *op_int_op_switch[] = {&&op_int_op_add,    &&op_int_op_add_sll, &&op_int_op_slt, &&op_int_op_sltu, &&op_int_op_xor,
-                                     &&op_int_op_srl,    &&op_int_op_or,      &&op_int_op_and, &&op_int_op_mul,  &&op_int_op_mulh,
-                                     &&op_int_op_mulhsu, &&op_int_op_mulhu,   &&op_int_op_div, &&op_int_op_divu, &&op_int_op_rem,
-                                     &&op_int_op_remu,   &&op_int_op_sub,     &&normal_end,    &&normal_end,     &&normal_end,
-                                     &&normal_end,       &&op_int_op_sra};
+  // by funct7 << 3 | funct3
+  static void *op_int_op_switch[1024] = {
+      [0x00 << 3] = &&op_int_op_add, &&op_int_op_add_sll, &&op_int_op_slt, &&op_int_op_sltu, &&op_int_op_xor, &&op_int_op_srl,
+      &&op_int_op_or, &&op_int_op_and,
+      [0x01 << 3] = &&op_int_op_mul, &&op_int_op_mulh, &&op_int_op_mulhsu, &&op_int_op_mulhu, &&op_int_op_div, &&op_int_op_divu,
+      &&op_int_op_rem, &&op_int_op_remu,
+      [0x02 << 3 ... (0x04 << 3) - 1] = &&uo,
+      [0x04 << 3] = &&uo, &&uo, &&uo, &&uo, &&op_int_op_zext_h, &&uo, &&uo, &&uo,
+      [0x05 << 3] = &&uo, &&uo, &&uo, &&uo, &&op_int_op_min, &&op_int_op_minu, &&op_int_op_max, &&op_int_op_maxu,
+      [0x06 << 3 ... (0x10 << 3) - 1] = &&uo,
+      [0x10 << 3] = &&uo, &&uo, &&op_int_op_sh1add, &&uo, &&op_int_op_sh2add, &&uo, &&op_int_op_sh3add, &&uo,
+      [0x11 << 3 ... (0x14 << 3) - 1] = &&uo,
+      [0x14 << 3] = &&uo, &&op_int_op_bset, &&uo, &&uo, &&uo, &&uo, &&uo, &&uo,
+      [0x15 << 3 ... (0x20 << 3) - 1] = &&uo,
+      [0x20 << 3] = &&op_int_op_sub, &&uo, &&uo, &&uo, &&op_int_op_xnor, &&op_int_op_sra, &&op_int_op_orn, &&op_int_op_andn,
+      [0x21 << 3 ... (0x24 << 3) - 1] = &&uo,
+      [0x24 << 3] = &&uo, &&op_int_op_bclr, &&uo, &&uo, &&uo, &&op_int_op_bext, &&uo, &&uo,
+      [0x25 << 3 ... (0x30 << 3) - 1] = &&uo,
+      [0x30 << 3] = &&uo, &&op_int_op_rol, &&uo, &&uo, &&uo, &&op_int_op_ror, &&uo, &&uo,
+      [0x31 << 3 ... (0x34 << 3) - 1] = &&uo,
+      [0x34 << 3] = &&uo, &&op_int_op_binv, &&uo, &&uo, &&uo, &&uo, &&uo, &&uo,
+      [0x35 << 3 ... 1023] = &&uo};
 
   while (res == 0) {
     mcycle_val++;
-    cur_time = get_cycles() - start_time;
     instruction = *(uint32_t *)(program + pc);
 #if LOG_TRACE
     uint8_t __op = instruction & 0x7F;
@@ -172,15 +278,9 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
     // hack to account for code that uses absoulte addresses and start
     // virtual memory from 0x80000000
     addr &= 0x7FFFFFFF;
-    if (__builtin_expect(addr >= work_mem_size, 0)) {
-#if USE_PRINT
-      fprintf(stderr,
-              "load went beyond allocated memory pc %X (addr %0X) (instruction "
-              "%X)\n",
-              pc, addr, instruction);
-#endif
-      exit_loop(ERR_INVALID_MEMORY_ACCESS);
-    }
+    // outside guest RAM faults, see riscv-vm-guard-mem.h; the devices too, see mmio_access
+    GUARD_MEM_ACCESS(pc, addr);
+    vm->instret = mcycle_val;
     goto *op_load_switch[GET_FUNCT3(instruction)];
     {
     op_load_lb:; // lb
@@ -260,10 +360,16 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       goto normal_end;
     op_int_imm_op_slli:; // slli
       shift = (instruction >> 20) & 0x1f;
+      if (__builtin_expect(instruction >> 25, 0)) {
+        goto op_int_imm_op_bitmanip_1;
+      }
       SET_TO_REG(rd, v1 << shift);
       goto normal_end;
     op_int_imm_op_srli:; // srli and srai
       shift = (instruction >> 20) & 0x1f;
+      if (__builtin_expect((instruction >> 25) & 0x5F, 0)) {
+        goto op_int_imm_op_bitmanip_5;
+      }
       if ((instruction >> 30) & 1) {
         // srai
         registers[rd] = (int32_t)v1 >> shift;
@@ -272,6 +378,64 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
         registers[rd] = v1 >> shift;
       }
       goto normal_end;
+    op_int_imm_op_bitmanip_1:; // funct3 1 with a funct7
+      switch (instruction >> 25) {
+      case 0x14: // bseti
+        SET_TO_REG(rd, v1 | (1u << shift));
+        goto normal_end;
+      case 0x24: // bclri
+        SET_TO_REG(rd, v1 & ~(1u << shift));
+        goto normal_end;
+      case 0x34: // binvi
+        SET_TO_REG(rd, v1 ^ (1u << shift));
+        goto normal_end;
+      case 0x30: // the rs2 field picks the operation
+        switch (shift) {
+        case 0: // clz
+          SET_TO_REG(rd, rv_clz(v1));
+          goto normal_end;
+        case 1: // ctz
+          SET_TO_REG(rd, rv_ctz(v1));
+          goto normal_end;
+        case 2: // cpop
+          SET_TO_REG(rd, rv_cpop(v1));
+          goto normal_end;
+        case 4: // sext.b
+          SET_TO_REG(rd, (int8_t)v1);
+          goto normal_end;
+        case 5: // sext.h
+          SET_TO_REG(rd, (int16_t)v1);
+          goto normal_end;
+        default:
+          break;
+        }
+        break;
+      default:
+        break;
+      }
+      goto uo;
+    op_int_imm_op_bitmanip_5:; // funct3 5 with a funct7 other than srli and srai
+      switch (instruction >> 20) {
+      case 0x287: // orc.b
+        SET_TO_REG(rd, rv_orc_b(v1));
+        goto normal_end;
+      case 0x698: // rev8
+        SET_TO_REG(rd, rv_rev8(v1));
+        goto normal_end;
+      default:
+        break;
+      }
+      switch (instruction >> 25) {
+      case 0x30: // rori
+        SET_TO_REG(rd, rv_ror(v1, shift));
+        goto normal_end;
+      case 0x24: // bexti
+        SET_TO_REG(rd, (v1 >> shift) & 1);
+        goto normal_end;
+      default:
+        break;
+      }
+      goto uo;
     }
   }
   {
@@ -306,7 +470,7 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       case 0: // sb
         byte = (uint8_t)v2;
 #if USE_PRINT
-        printf("%c", byte);
+        vm_console_putc(vm_files_console(&vm->files), byte);
 #endif
         break;
       default:
@@ -318,16 +482,9 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
     // hack to account for code that uses absoulte addresses and start
     // virtual memory from 0x80000000
     addr &= 0x7FFFFFFF;
-
-    if (__builtin_expect(addr >= work_mem_size, 0)) {
-#if USE_PRINT
-      fprintf(stderr,
-              "store went beyond allocated memory pc %X (addr %0X) (instruction "
-              "%X)\n",
-              pc, addr, instruction);
-#endif
-      exit_loop(ERR_INVALID_MEMORY_ACCESS);
-    }
+    // outside guest RAM faults, see riscv-vm-guard-mem.h; the devices too, see mmio_access
+    GUARD_MEM_ACCESS(pc, addr);
+    vm->instret = mcycle_val;
 #if USE_TOHOST_SYSCALL
     // used by benchmarks in https://github.com/riscv-software-src/riscv-tests
     if (addr == tohost) {
@@ -336,15 +493,8 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       if (is_exit) {
         exit_loop(from_virt >> 1);
       }
-      from_virt = *(uint32_t *)(wmem + v2);
-      if (from_virt == SYS_write) {
-        // uint32_t a0 = *(uint32_t *)(wmem + v2 + 8);
-        uint32_t str_ptr = *(uint32_t *)(wmem + v2 + 16);
-        uint32_t str_len = *(uint32_t *)(wmem + v2 + 24);
-        for (uint32_t i = 0; i < str_len; i++) {
-          printf("%c", wmem[str_ptr + i]);
-        }
-      } else {
+      from_virt = GUARD_MEM_HOST_CALL(vm_tohost_syscall(vm_files_console(&vm->files), wmem, vm->files.layout.mem_size, v2));
+      if (from_virt != SYS_write) {
 #if USE_PRINT
         fprintf(stderr, "unimplemented magic syscall %d\n", from_virt);
 #endif
@@ -401,7 +551,7 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
     const uint8_t funct7 = GET_FUNCT7(instruction);
     printf("int op funct3=%d funct7=%d rd=%d rs1=%d rs2=%d\n", funct3, funct7, rd, GET_RS1(instruction), GET_RS2(instruction));
 #endif
-    const uint8_t jump_point = funct3 | ((instruction >> 22) & 8) | ((instruction >> 26) & 0x10);
+    const uint32_t jump_point = funct3 | ((instruction >> 22) & 0x3F8);
 #if LOG_TRACE
     printf("jump_point=%d\n", jump_point);
 #endif
@@ -490,6 +640,60 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
     op_int_op_sra:; // sra
       SET_TO_REG(rd, ((int32_t)v1) >> (v2 & 0x1F));
       goto normal_end;
+    op_int_op_sh1add:; // sh1add
+      SET_TO_REG(rd, (v1 << 1) + v2);
+      goto normal_end;
+    op_int_op_sh2add:; // sh2add
+      SET_TO_REG(rd, (v1 << 2) + v2);
+      goto normal_end;
+    op_int_op_sh3add:; // sh3add
+      SET_TO_REG(rd, (v1 << 3) + v2);
+      goto normal_end;
+    op_int_op_andn:; // andn
+      SET_TO_REG(rd, v1 & ~v2);
+      goto normal_end;
+    op_int_op_orn:; // orn
+      SET_TO_REG(rd, v1 | ~v2);
+      goto normal_end;
+    op_int_op_xnor:; // xnor
+      SET_TO_REG(rd, ~(v1 ^ v2));
+      goto normal_end;
+    op_int_op_zext_h:; // zext.h, the same funct7 and funct3 with rs2 other than x0 is Zbkb pack
+      if (GET_RS2(instruction)) {
+        goto uo;
+      }
+      SET_TO_REG(rd, (uint16_t)v1);
+      goto normal_end;
+    op_int_op_min:; // min
+      SET_TO_REG(rd, (int32_t)v1 < (int32_t)v2 ? v1 : v2);
+      goto normal_end;
+    op_int_op_minu:; // minu
+      SET_TO_REG(rd, v1 < v2 ? v1 : v2);
+      goto normal_end;
+    op_int_op_max:; // max
+      SET_TO_REG(rd, (int32_t)v1 > (int32_t)v2 ? v1 : v2);
+      goto normal_end;
+    op_int_op_maxu:; // maxu
+      SET_TO_REG(rd, v1 > v2 ? v1 : v2);
+      goto normal_end;
+    op_int_op_rol:; // rol
+      SET_TO_REG(rd, rv_rol(v1, v2));
+      goto normal_end;
+    op_int_op_ror:; // ror
+      SET_TO_REG(rd, rv_ror(v1, v2));
+      goto normal_end;
+    op_int_op_bclr:; // bclr
+      SET_TO_REG(rd, v1 & ~(1u << (v2 & 0x1F)));
+      goto normal_end;
+    op_int_op_bext:; // bext
+      SET_TO_REG(rd, (v1 >> (v2 & 0x1F)) & 1);
+      goto normal_end;
+    op_int_op_binv:; // binv
+      SET_TO_REG(rd, v1 ^ (1u << (v2 & 0x1F)));
+      goto normal_end;
+    op_int_op_bset:; // bset
+      SET_TO_REG(rd, v1 | (1u << (v2 & 0x1F)));
+      goto normal_end;
     }
     goto normal_end;
   }
@@ -548,6 +752,9 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
         exit_loop(ERR_MISALIGNED_MEMORY_ACCESS);
       }
       pc += imms;
+      if (imms < 0) {
+        check_budget();
+      }
       goto jump_end;
     }
     goto normal_end;
@@ -576,6 +783,7 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       exit_loop(ERR_MISALIGNED_MEMORY_ACCESS);
     }
     pc = addr;
+    check_budget();
     goto jump_end;
   }
   {
@@ -595,6 +803,9 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       exit_loop(ERR_MISALIGNED_MEMORY_ACCESS);
     }
     pc += immi;
+    if (immi < 0) {
+      check_budget();
+    }
     goto jump_end;
   }
   {
@@ -610,10 +821,21 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
     GET_FROM_REG(a7, 17); // function
     uint8_t is_test;
     uint32_t exit_code;
+    // calls that can wait on the host go to the scheduler, console writes stay here to keep their order with ours;
+    // not with a polling ioqueue, whose entries every ecall waits for (syscall_handler) and whose fds the ring's would race
+    if (vm->async_syscalls && user_syscall_handler == NULL && vm->files.ioqueue_console == NULL &&
+        (a7 == SYS_read || a7 == SYS_open || (a7 == SYS_write && a0 > 2))) {
+      pc += 4;
+      exit_loop(VM_EXIT_SYSCALL);
+    }
     switch (a7) {
     case SYS_print_mem_access: {
       mem_write_intercept = GET_FROM_REG_DIRECT(10);
     } break;
+    case SYS_snapshot:
+      SET_TO_REG(10, 0);
+      pc += 4;
+      exit_loop(RISCV_VM_SNAPSHOT);
     case 93:
       // exit
       is_test = a0 & 1;
@@ -623,11 +845,20 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
         fprintf(stderr, "*** FAILED *** (tohost = %d)\n", exit_code);
 #endif
       }
+      vm_console_flush(vm->files.console);
 #if USE_PRINT
       printf("exit code %d\n", exit_code);
 #endif
       exit_loop(exit_code);
       break;
+    case 94:
+      // exit_group of a Linux program, the status as it is
+      vm_console_flush(vm->files.console);
+#if USE_PRINT
+      printf("exit code %d\n", a0 & 0xFF);
+#endif
+      exit_loop(a0 & 0xFF);
+      break;
     case 63:
       // read
       // printf("read\n");
@@ -647,9 +878,9 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       uint32_t user_handled = 0;
       if (user_syscall_handler) {
         // printf("------------> user syscall handler present syscall number %d\n", a7);
-        uint32_t res =
+        uint32_t res = GUARD_MEM_HOST_CALL(
             user_syscall_handler(&user_handled, a7, GET_FROM_REG_DIRECT(10), GET_FROM_REG_DIRECT(11), GET_FROM_REG_DIRECT(12),
-                                 GET_FROM_REG_DIRECT(13), GET_FROM_REG_DIRECT(14), GET_FROM_REG_DIRECT(15), GET_FROM_REG_DIRECT(16), wmem);
+                                 GET_FROM_REG_DIRECT(13), GET_FROM_REG_DIRECT(14), GET_FROM_REG_DIRECT(15), GET_FROM_REG_DIRECT(16), wmem));
         if (user_handled == 1) {
           SET_TO_REG(10, res);
         } else if (user_handled == 2) {
@@ -657,15 +888,102 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
         }
       }
       if (user_handled == 0) {
-        uint32_t res =
-            syscall_handler(a7, GET_FROM_REG_DIRECT(10), GET_FROM_REG_DIRECT(11), GET_FROM_REG_DIRECT(12), GET_FROM_REG_DIRECT(13),
-                            GET_FROM_REG_DIRECT(14), GET_FROM_REG_DIRECT(15), GET_FROM_REG_DIRECT(16), wmem);
+        uint32_t res = GUARD_MEM_HOST_CALL(
+            syscall_handler(&vm->files, a7, GET_FROM_REG_DIRECT(10), GET_FROM_REG_DIRECT(11), GET_FROM_REG_DIRECT(12),
+                            GET_FROM_REG_DIRECT(13), GET_FROM_REG_DIRECT(14), GET_FROM_REG_DIRECT(15), GET_FROM_REG_DIRECT(16), wmem));
         SET_TO_REG(10, res);
       }
     }
     goto normal_end;
   }
   {
+  op_amo:;
+    // RV32A on the host's atomics, so the harts of riscv_vm_execute_smp see
+    // each other's updates
+    const uint8_t funct3 = GET_FUNCT3(instruction);
+    if (funct3 != 2) {
+      goto uo;
+    }
+    uint32_t addr;
+    GET_FROM_REG(addr, GET_RS1(instruction));
+    addr &= 0x7FFFFFFF;
+    if (addr & 3) {
+#if USE_PRINT
+      fprintf(stderr, "misaligned atomic at pc 0x%X (addr 0x%0X) (instruction 0x%X)\n", pc, addr, instruction);
+#endif
+      exit_loop(ERR_MISALIGNED_MEMORY_ACCESS);
+    }
+    // outside guest RAM faults, see riscv-vm-guard-mem.h
+    GUARD_MEM_ACCESS(pc, addr);
+    vm->instret = mcycle_val;
+    uint32_t *const word = (uint32_t *)(wmem + addr);
+    const uint32_t funct5 = instruction >> 27;
+    uint32_t v2;
+    GET_FROM_REG(v2, GET_RS2(instruction));
+    uint32_t old;
+    switch (funct5) {
+    case 0x00: // amoadd.w
+      old = __atomic_fetch_add(word, v2, __ATOMIC_SEQ_CST);
+      break;
+    case 0x01: // amoswap.w
+      old = __atomic_exchange_n(word, v2, __ATOMIC_SEQ_CST);
+      break;
+    case 0x02: // lr.w
+      old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+      reserved_addr = addr;
+      reserved_value = old;
+      break;
+    case 0x03: // sc.w, rd is 0 when it stored
+      old = 1;
+      if (reserved_addr == addr) {
+        uint32_t expected = reserved_value;
+        old = !__atomic_compare_exchange_n(word, &expected, v2, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      }
+      reserved_addr = UINT32_MAX;
+      break;
+    case 0x04: // amoxor.w
+      old = __atomic_fetch_xor(word, v2, __ATOMIC_SEQ_CST);
+      break;
+    case 0x08: // amoor.w
+      old = __atomic_fetch_or(word, v2, __ATOMIC_SEQ_CST);
+      break;
+    case 0x0C: // amoand.w
+      old = __atomic_fetch_and(word, v2, __ATOMIC_SEQ_CST);
+      break;
+    case 0x10:
+    case 0x14:
+    case 0x18:
+    case 0x1C:
+      old = __atomic_load_n(word, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(word, &old, amo_min_max(funct5, old, v2), 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      }
+      break;
+    default:
+      goto uo;
+    }
+    rd = GET_RD(instruction);
+    if (rd) {
+      SET_TO_REG(rd, old);
+    }
+    goto normal_end;
+  }
+  {
+  op_fence:;
+    // fence.i has nothing to flush, every instruction is fetched from memory
+#if defined(__x86_64__) || defined(__i386__)
+    // x86 only lets a load pass an earlier store, the other orders need the
+    // compiler to keep the accesses in place
+    if (((instruction >> 24) & 1) && ((instruction >> 21) & 1)) { // pred w, succ r
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } else {
+      __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    }
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+    goto normal_end;
+  }
+  {
   op_system:;
     const uint8_t funct3 = GET_FUNCT3(instruction);
     const uint8_t funct7 = GET_FUNCT7(instruction);
@@ -683,6 +1001,11 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
         exit_loop(ERR_EBREAK);
         break;
       case 0x8: // wfi
+        if (vm->machine) {
+          // the hart sleeps in riscv_vm_execute_smp until its msip is set
+          pc += 4;
+          exit_loop(VM_EXIT_WFI);
+        }
         exit_loop(ERR_WFI);
 #if USE_PRINT
         fprintf(stderr, "wfi instruction, exiting\n");
@@ -715,19 +1038,19 @@ static int riscv_vm_main_loop_4(uint8_t *initial_registers, uint8_t *wmem, uint3
       case 0xc01: // time
       {
         if (rd) {
-          SET_TO_REG(rd, cur_time);
+          SET_TO_REG(rd, get_cycles() - vm->start_time);
         }
       } break;
       case 0xc81: // timeh
       {
         if (rd) {
-          SET_TO_REG(rd, cur_time >> 32);
+          SET_TO_REG(rd, (get_cycles() - vm->start_time) >> 32);
         }
       } break;
       case 0xF14: // mhartid (Hardware thread ID.)
       {
         if (rd) {
-          SET_TO_REG(rd, 0);
+          SET_TO_REG(rd, vm->hartid);
         }
       } break;
       case 0x300: // mstatus (Machine status register.)
@@ -0,0 +1,1138 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-vm-bits.h"
+#include "riscv-vm-common.h"
+#include "riscv-vm-decode.h"
+#include "riscv-vm-fp.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm-vector.h"
+
+#include "cycle-counter.h"
+
+// Same guest memory as optimized 4. On top of it there is a side array with one
+// pre-decoded record per 2 bytes of the loaded image, so every guest
+// instruction is decoded once (on first execution) instead of on every
+// execution. RVC instructions are expanded to their 32 bit form while
+// decoding. Their records enter the handler through a stub that sets the step
+// to the next record to 1 instead of 2, the handlers themselves are shared.
+// This is the engine that runs F and D, see riscv-vm-fp.h, and with optimized 4
+// the one that runs Zba, Zbb and Zbs.
+
+static const int VM_MEMORY = 1048576 * 32;
+
+static const size_t work_mem_size = VM_MEMORY * 1; // size of memory to allocate
+
+typedef struct {
+  void *handler; // label inside riscv_vm_main_loop_5
+  int32_t imm;   // ready to use: absolute target for branches/jal, pc + imm for auipc
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+} decoded_insn_t;
+
+static int riscv_vm_main_loop_5(uint8_t *initial_registers, uint8_t *wmem, uint32_t program_len, uint32_t *pcp_out,
+                                syscall_handler_t user_syscall_handler, vm_files_t *files);
+
+int riscv_vm_run_optimized_5(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  const uint32_t program_len = vm_image_end(image);
+
+#if USE_PRINT
+  printf("Starting VM... work mem size %zu program len %d\n", work_mem_size, program_len);
+#endif
+  if (program_len > work_mem_size) {
+#if USE_PRINT
+    fprintf(stderr, "Program too long for memory, program size %d memory size %zu\n", program_len, work_mem_size);
+#endif
+    return ERR_OUT_OF_MEM;
+  }
+  init_counter();
+  uint8_t *wmem = vm_mem_alloc(work_mem_size);
+  if (wmem == NULL) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+    return ERR_OUT_OF_MEM;
+  }
+  int res = vm_image_load(wmem, work_mem_size, image);
+  if (res) {
+    vm_mem_free(wmem, work_mem_size);
+    return res;
+  }
+  uint32_t pcp = image->entry & 0x7FFFFFFF;
+  vm_files_t files = {0};
+  files.user_syscall_handler = user_syscall_handler;
+  const uint32_t sp = vm_linux_init(&files, wmem, work_mem_size, image);
+  if (!registers) {
+    registers = malloc(REG_MEM_SIZE);
+    if (registers == NULL) {
+#if USE_PRINT
+      fprintf(stderr, "Memory allocation failed\n");
+#endif
+      vm_mem_free(wmem, work_mem_size);
+      return ERR_OUT_OF_MEM;
+    }
+    memset(registers, 0, REG_MEM_SIZE);
+    ((uint32_t *)registers)[2] = sp;
+  }
+#if PRINT_REGISTERS
+  dump_registers(registers);
+#endif
+  vm_mark_started();
+  res = riscv_vm_main_loop_5(registers, wmem, program_len, &pcp, user_syscall_handler, &files);
+  vm_files_close(&files);
+#if PRINT_REGISTERS
+  dump_registers(registers);
+#endif
+#if USE_PRINT
+  printf("Final PC: %04X\n", pcp);
+#endif
+  vm_mem_free(wmem, work_mem_size);
+  return res;
+}
+
+#define exit_loop(ec)                                                                                                                      \
+  do {                                                                                                                                     \
+    res = (ec);                                                                                                                            \
+    goto vm_exit;                                                                                                                          \
+  } while (0)
+
+#define CUR_PC ((uint32_t)(ins - cache) << 1)
+// pc of the instruction after the current one
+#define NEXT_PC (CUR_PC + (uint32_t)(step / sizeof(decoded_insn_t) * 2))
+
+// retire the current record and run the next one
+#define NEXT()                                                                                                                             \
+  do {                                                                                                                                     \
+    ins = (decoded_insn_t *)((char *)ins + step);                                                                                          \
+    step = 2 * sizeof(decoded_insn_t);                                                                                                     \
+    instret++;                                                                                                                             \
+    goto *ins->handler;                                                                                                                    \
+  } while (0)
+
+// target is known to be aligned and inside the cache
+#define JUMP(target)                                                                                                                       \
+  do {                                                                                                                                     \
+    ins = cache + ((target) >> 1);                                                                                                         \
+    step = 2 * sizeof(decoded_insn_t);                                                                                                     \
+    instret++;                                                                                                                             \
+    goto *ins->handler;                                                                                                                    \
+  } while (0)
+
+// stores into already decoded instructions drop the records so they are
+// decoded again: the ones for the (up to 3) halfwords written and the one
+// before, a 32 bit instruction starting there covers the first of them
+#define INVALIDATE(addr)                                                                                                                   \
+  if (__builtin_expect((addr) < cache_bytes, 0)) {                                                                                         \
+    decoded_insn_t *const first = cache + ((addr) >> 1);                                                                                   \
+    first[-1].handler = &&op_decode;                                                                                                       \
+    first[0].handler = &&op_decode;                                                                                                        \
+    first[1].handler = &&op_decode;                                                                                                        \
+    first[2].handler = &&op_decode;                                                                                                        \
+  }
+
+// every handler keeps its own dispatch jump, merged tails share one and predict worse
+__attribute__((optimize("no-crossjumping"))) static int riscv_vm_main_loop_5(uint8_t *initial_registers, uint8_t *wmem,
+                                                                             uint32_t program_len, uint32_t *pcp_out,
+                                                                             syscall_handler_t user_syscall_handler, vm_files_t *files) {
+  const uint64_t start_time = get_cycles();
+  uint32_t registers[32];
+  uint8_t *program = wmem;
+  uint64_t instret = 0;
+  int res = 0;
+  uint32_t mem_write_intercept = 0;
+  // bytes of records the current instruction takes, the RVC stubs halve it
+  size_t step = 2 * sizeof(decoded_insn_t);
+  memcpy(registers, initial_registers, REG_MEM_SIZE);
+  registers[0] = 0;
+  // F and D state, fflags also has the host exception flags raised since it was last read
+  uint64_t fregs[32] = {0};
+  uint32_t frm = 0;
+  uint32_t fflags = 0;
+  rv_vector_t vec;
+  rv_vector_init(&vec);
+
+  static void *op_table[RV_OP_EXT_COUNT] = {
+      [RV_OP_INVALID] = &&uo,        [RV_OP_NOP] = &&op_nop,       [RV_OP_LB] = &&op_load_lb,     [RV_OP_LH] = &&op_load_lh,
+      [RV_OP_LW] = &&op_load_lw,     [RV_OP_LBU] = &&op_load_lbu,  [RV_OP_LHU] = &&op_load_lhu,   [RV_OP_SB] = &&op_store_sb,
+      [RV_OP_SH] = &&op_store_sh,    [RV_OP_SW] = &&op_store_sw,   [RV_OP_ADDI] = &&op_addi,      [RV_OP_SLTI] = &&op_slti,
+      [RV_OP_SLTIU] = &&op_sltiu,    [RV_OP_XORI] = &&op_xori,     [RV_OP_ORI] = &&op_ori,        [RV_OP_ANDI] = &&op_andi,
+      [RV_OP_SLLI] = &&op_slli,      [RV_OP_SRLI] = &&op_srli,     [RV_OP_SRAI] = &&op_srai,      [RV_OP_LUI] = &&op_lui,
+      [RV_OP_AUIPC] = &&op_auipc,    [RV_OP_ADD] = &&op_add,       [RV_OP_SUB] = &&op_sub,        [RV_OP_SLL] = &&op_sll,
+      [RV_OP_SLT] = &&op_slt,        [RV_OP_SLTU] = &&op_sltu,     [RV_OP_XOR] = &&op_xor,        [RV_OP_SRL] = &&op_srl,
+      [RV_OP_SRA] = &&op_sra,        [RV_OP_OR] = &&op_or,         [RV_OP_AND] = &&op_and,        [RV_OP_MUL] = &&op_mul,
+      [RV_OP_MULH] = &&op_mulh,      [RV_OP_MULHSU] = &&op_mulhsu, [RV_OP_MULHU] = &&op_mulhu,    [RV_OP_DIV] = &&op_div,
+      [RV_OP_DIVU] = &&op_divu,      [RV_OP_REM] = &&op_rem,       [RV_OP_REMU] = &&op_remu,      [RV_OP_BEQ] = &&op_beq,
+      [RV_OP_BNE] = &&op_bne,        [RV_OP_BLT] = &&op_blt,       [RV_OP_BGE] = &&op_bge,        [RV_OP_BLTU] = &&op_bltu,
+      [RV_OP_BGEU] = &&op_bgeu,      [RV_OP_JAL] = &&op_jal,       [RV_OP_JALR] = &&op_jalr,      [RV_OP_ECALL] = &&op_ecall,
+      [RV_OP_EBREAK] = &&op_ebreak,  [RV_OP_WFI] = &&op_wfi,       [RV_OP_CSRRS] = &&op_csrrs,    [RV_OP_FLW] = &&op_flw,
+      [RV_OP_FLD] = &&op_fld,        [RV_OP_FSW] = &&op_fsw,       [RV_OP_FSD] = &&op_fsd,        [RV_OP_FMADD_S] = &&op_fmadd_s,
+      [RV_OP_FMSUB_S] = &&op_fmsub_s,       [RV_OP_FNMSUB_S] = &&op_fnmsub_s,   [RV_OP_FNMADD_S] = &&op_fnmadd_s,
+      [RV_OP_FMADD_D] = &&op_fmadd_d,       [RV_OP_FMSUB_D] = &&op_fmsub_d,     [RV_OP_FNMSUB_D] = &&op_fnmsub_d,
+      [RV_OP_FNMADD_D] = &&op_fnmadd_d,     [RV_OP_FADD_S] = &&op_fadd_s,       [RV_OP_FSUB_S] = &&op_fsub_s,
+      [RV_OP_FMUL_S] = &&op_fmul_s,         [RV_OP_FDIV_S] = &&op_fdiv_s,       [RV_OP_FSQRT_S] = &&op_fsqrt_s,
+      [RV_OP_FADD_D] = &&op_fadd_d,         [RV_OP_FSUB_D] = &&op_fsub_d,       [RV_OP_FMUL_D] = &&op_fmul_d,
+      [RV_OP_FDIV_D] = &&op_fdiv_d,         [RV_OP_FSQRT_D] = &&op_fsqrt_d,     [RV_OP_FCVT_W_S] = &&op_fcvt_w_s,
+      [RV_OP_FCVT_WU_S] = &&op_fcvt_wu_s,   [RV_OP_FCVT_S_W] = &&op_fcvt_s_w,   [RV_OP_FCVT_S_WU] = &&op_fcvt_s_wu,
+      [RV_OP_FCVT_W_D] = &&op_fcvt_w_d,     [RV_OP_FCVT_WU_D] = &&op_fcvt_wu_d, [RV_OP_FCVT_D_W] = &&op_fcvt_d_w,
+      [RV_OP_FCVT_D_WU] = &&op_fcvt_d_wu,   [RV_OP_FCVT_S_D] = &&op_fcvt_s_d,   [RV_OP_FCVT_D_S] = &&op_fcvt_d_s,
+      [RV_OP_FSGNJ_S] = &&op_fsgnj_s,       [RV_OP_FSGNJN_S] = &&op_fsgnjn_s,   [RV_OP_FSGNJX_S] = &&op_fsgnjx_s,
+      [RV_OP_FMIN_S] = &&op_fmin_s,         [RV_OP_FMAX_S] = &&op_fmax_s,       [RV_OP_FSGNJ_D] = &&op_fsgnj_d,
+      [RV_OP_FSGNJN_D] = &&op_fsgnjn_d,     [RV_OP_FSGNJX_D] = &&op_fsgnjx_d,   [RV_OP_FMIN_D] = &&op_fmin_d,
+      [RV_OP_FMAX_D] = &&op_fmax_d,         [RV_OP_FMV_X_W] = &&op_fmv_x_w,     [RV_OP_FMV_W_X] = &&op_fmv_w_x,
+      [RV_OP_FEQ_S] = &&op_feq_s,           [RV_OP_FLT_S] = &&op_flt_s,         [RV_OP_FLE_S] = &&op_fle_s,
+      [RV_OP_FCLASS_S] = &&op_fclass_s,     [RV_OP_FEQ_D] = &&op_feq_d,         [RV_OP_FLT_D] = &&op_flt_d,
+      [RV_OP_FLE_D] = &&op_fle_d,           [RV_OP_FCLASS_D] = &&op_fclass_d,   [RV_OP_FCSR] = &&op_fcsr,
+      [RV_OP_SH1ADD] = &&op_sh1add,         [RV_OP_SH2ADD] = &&op_sh2add,       [RV_OP_SH3ADD] = &&op_sh3add,
+      [RV_OP_ANDN] = &&op_andn,             [RV_OP_ORN] = &&op_orn,             [RV_OP_XNOR] = &&op_xnor,
+      [RV_OP_CLZ] = &&op_clz,               [RV_OP_CTZ] = &&op_ctz,             [RV_OP_CPOP] = &&op_cpop,
+      [RV_OP_SEXT_B] = &&op_sext_b,         [RV_OP_SEXT_H] = &&op_sext_h,       [RV_OP_ZEXT_H] = &&op_zext_h,
+      [RV_OP_MIN] = &&op_min,               [RV_OP_MINU] = &&op_minu,           [RV_OP_MAX] = &&op_max,
+      [RV_OP_MAXU] = &&op_maxu,             [RV_OP_ROL] = &&op_rol,             [RV_OP_ROR] = &&op_ror,
+      [RV_OP_RORI] = &&op_rori,             [RV_OP_ORC_B] = &&op_orc_b,         [RV_OP_REV8] = &&op_rev8,
+      [RV_OP_BCLR] = &&op_bclr,             [RV_OP_BCLRI] = &&op_bclri,         [RV_OP_BEXT] = &&op_bext,
+      [RV_OP_BEXTI] = &&op_bexti,           [RV_OP_BINV] = &&op_binv,           [RV_OP_BINVI] = &&op_binvi,
+      [RV_OP_BSET] = &&op_bset,             [RV_OP_BSETI] = &&op_bseti,         [RV_OP_VSETVLI] = &&op_vsetvli,
+      [RV_OP_VSETIVLI] = &&op_vsetivli,     [RV_OP_VSETVL] = &&op_vsetvl,       [RV_OP_VLE] = &&op_vle,
+      [RV_OP_VLSE] = &&op_vlse,             [RV_OP_VSE] = &&op_vse,             [RV_OP_VSSE] = &&op_vsse,
+      [RV_OP_VMV_X_S] = &&op_vmv_x_s,       [RV_OP_VOP] = &&op_vop};
+  // the operations rv_expand_compressed produces
+  static void *c_op_table[RV_OP_EXT_COUNT] = {
+      [RV_OP_INVALID] = &&uo,      [RV_OP_NOP] = &&c_op_nop,     [RV_OP_LW] = &&c_op_load_lw, [RV_OP_SW] = &&c_op_store_sw,
+      [RV_OP_ADDI] = &&c_op_addi,  [RV_OP_ANDI] = &&c_op_andi,   [RV_OP_SLLI] = &&c_op_slli,  [RV_OP_SRLI] = &&c_op_srli,
+      [RV_OP_SRAI] = &&c_op_srai,  [RV_OP_LUI] = &&c_op_lui,     [RV_OP_ADD] = &&c_op_add,    [RV_OP_SUB] = &&c_op_sub,
+      [RV_OP_XOR] = &&c_op_xor,    [RV_OP_OR] = &&c_op_or,       [RV_OP_AND] = &&c_op_and,    [RV_OP_BEQ] = &&c_op_beq,
+      [RV_OP_BNE] = &&c_op_bne,    [RV_OP_JAL] = &&c_op_jal,     [RV_OP_JALR] = &&c_op_jalr,  [RV_OP_EBREAK] = &&op_ebreak,
+      [RV_OP_FLW] = &&c_op_flw,    [RV_OP_FLD] = &&c_op_fld,     [RV_OP_FSW] = &&c_op_fsw,    [RV_OP_FSD] = &&c_op_fsd};
+
+  // one record per guest halfword, plus one before and two after that
+  // INVALIDATE may write; the ones after catch running off the end after a 16
+  // or a 32 bit instruction, op_decode does not decode them
+  const uint32_t cache_len = (program_len + 1) >> 1;
+  const uint32_t cache_bytes = cache_len << 1;
+  decoded_insn_t *const records = malloc((cache_len + 3) * sizeof(decoded_insn_t));
+  if (records == NULL) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+    return ERR_OUT_OF_MEM;
+  }
+  decoded_insn_t *const cache = records + 1;
+  for (uint32_t i = 0; i < cache_len + 3; i++) {
+    records[i].handler = &&op_decode;
+  }
+  // the host rounds by frm while the guest runs
+  fenv_t host_fenv;
+  fegetenv(&host_fenv);
+  fesetround(FE_TONEAREST);
+  feclearexcept(FE_ALL_EXCEPT);
+
+  decoded_insn_t *ins = cache + (*pcp_out >> 1);
+  if (cache_len == 0) {
+    goto out_of_cache;
+  }
+  instret++;
+  goto *ins->handler;
+
+  {
+  op_decode:;
+    const uint32_t pc = CUR_PC;
+    if (__builtin_expect(pc >= cache_bytes, 0)) {
+      goto out_of_cache;
+    }
+    uint32_t instruction = *(uint32_t *)(program + pc);
+    const int compressed = rv_is_compressed(instruction);
+    if (compressed) {
+      instruction = rv_expand_compressed(instruction);
+    }
+    rv_insn_t d;
+    if (!rv_decode_ext(instruction, &d)) {
+      rv_decode(instruction, &d);
+    }
+#if LOG_TRACE
+    printf("decode PC: 0x%04X inst 0x%08X %s\n", pc, instruction, rv_op_names[d.op]);
+#endif
+    ins->handler = compressed ? c_op_table[d.op] : op_table[d.op];
+    ins->rd = d.rd;
+    ins->rs1 = d.rs1;
+    ins->rs2 = d.rs2;
+    ins->imm = d.imm;
+    switch (d.op) {
+    case RV_OP_AUIPC:
+      ins->imm = pc + d.imm;
+      break;
+    case RV_OP_BEQ:
+    case RV_OP_BNE:
+    case RV_OP_BLT:
+    case RV_OP_BGE:
+    case RV_OP_BLTU:
+    case RV_OP_BGEU:
+    case RV_OP_JAL:
+      // out of range and odd targets fail the bounds check in the handler
+      ins->imm = pc + d.imm;
+      break;
+    default:
+      break;
+    }
+    goto *ins->handler;
+  }
+  {
+  out_of_cache:;
+#if USE_PRINT
+    fprintf(stderr, "pc 0x%X went beyond decoded program (program len %d)\n", CUR_PC, program_len);
+#endif
+    exit_loop(ERR_INVALID_MEMORY_ACCESS);
+  }
+  {
+  uo:;
+#if USE_PRINT
+    fprintf(stderr, "Unimplemented or invalid opcode 0x%02X at PC 0x%02X\n", *(uint32_t *)(program + CUR_PC) & 0x7F, CUR_PC);
+#endif
+    exit_loop(ERR_UNIMPLEMENTED_OPCODE);
+  }
+  {
+  op_nop:;
+    NEXT();
+  }
+  {
+#define RVC_STUB(label)                                                                                                                    \
+  c_##label:;                                                                                                                              \
+    step = sizeof(decoded_insn_t);                                                                                                         \
+    goto label;
+
+    RVC_STUB(op_nop)
+    RVC_STUB(op_load_lw)
+    RVC_STUB(op_store_sw)
+    RVC_STUB(op_addi)
+    RVC_STUB(op_andi)
+    RVC_STUB(op_slli)
+    RVC_STUB(op_srli)
+    RVC_STUB(op_srai)
+    RVC_STUB(op_lui)
+    RVC_STUB(op_add)
+    RVC_STUB(op_sub)
+    RVC_STUB(op_xor)
+    RVC_STUB(op_or)
+    RVC_STUB(op_and)
+    RVC_STUB(op_beq)
+    RVC_STUB(op_bne)
+    RVC_STUB(op_jal)
+    RVC_STUB(op_jalr)
+    RVC_STUB(op_flw)
+    RVC_STUB(op_fld)
+    RVC_STUB(op_fsw)
+    RVC_STUB(op_fsd)
+#undef RVC_STUB
+  }
+
+#define LOAD_ADDR(addr, width)                                                                                                             \
+  uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;                                                                           \
+  if (__builtin_expect(addr > work_mem_size - width, 0)) {                                                                                 \
+    goto mmio_load;                                                                                                                        \
+  }
+
+  {
+  op_load_lb:;
+    LOAD_ADDR(addr, 1);
+    registers[ins->rd] = (int8_t)wmem[addr];
+    NEXT();
+  }
+  {
+  op_load_lh:;
+    LOAD_ADDR(addr, 2);
+    registers[ins->rd] = *(int16_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  op_load_lw:;
+    LOAD_ADDR(addr, 4);
+    registers[ins->rd] = *(uint32_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  op_load_lbu:;
+    LOAD_ADDR(addr, 1);
+    registers[ins->rd] = wmem[addr];
+    NEXT();
+  }
+  {
+  op_load_lhu:;
+    LOAD_ADDR(addr, 2);
+    registers[ins->rd] = *(uint16_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  mmio_load:;
+    const uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;
+    if (addr - VM_BLK_BASE < VM_BLK_SIZE && vm_files_blk(files)) {
+      registers[ins->rd] = vm_blk_load(files->blk, addr - VM_BLK_BASE);
+      NEXT();
+    }
+  }
+  {
+  bad_load:;
+#if USE_PRINT
+    fprintf(stderr, "load went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", CUR_PC,
+            (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF, *(uint32_t *)(program + CUR_PC));
+#endif
+    exit_loop(ERR_INVALID_MEMORY_ACCESS);
+  }
+
+#if EMULATE_UART_OUT && USE_PRINT
+#define STORE_UART(addr, v2)                                                                                                               \
+  if (addr == UART_OUT_REGISTER) {                                                                                                         \
+    vm_console_putc(vm_files_console(files), (uint8_t)v2);                                                                                 \
+    NEXT();                                                                                                                                \
+  }
+#elif EMULATE_UART_OUT
+#define STORE_UART(addr, v2)                                                                                                               \
+  if (addr == UART_OUT_REGISTER) {                                                                                                         \
+    NEXT();                                                                                                                                \
+  }
+#else
+#define STORE_UART(addr, v2)
+#endif
+
+#if USE_TOHOST_SYSCALL
+#define STORE_TOHOST(addr, v2)                                                                                                             \
+  if (__builtin_expect(addr == tohost, 0)) {                                                                                               \
+    goto store_tohost;                                                                                                                     \
+  }
+#else
+#define STORE_TOHOST(addr, v2)
+#endif
+
+#define STORE_ADDR(addr, v2, width)                                                                                                        \
+  const uint32_t v2 = registers[ins->rs2];                                                                                                 \
+  uint32_t addr = registers[ins->rs1] + ins->imm;                                                                                          \
+  if (__builtin_expect(mem_write_intercept != 0, 0) && addr == mem_write_intercept) {                                                      \
+    printf("MEM_INTERCEPT: op_store addr 0x%x v2 %d (0x%x) PC 0x%x\n", addr, v2, v2, CUR_PC);                                              \
+  }                                                                                                                                        \
+  STORE_UART(addr, v2);                                                                                                                    \
+  addr &= 0x7FFFFFFF;                                                                                                                      \
+  if (__builtin_expect(addr > work_mem_size - width, 0)) {                                                                                 \
+    goto mmio_store;                                                                                                                       \
+  }                                                                                                                                        \
+  STORE_TOHOST(addr, v2);                                                                                                                  \
+  INVALIDATE(addr);
+
+  {
+  op_store_sb:;
+    STORE_ADDR(addr, v2, 1);
+    wmem[addr] = (uint8_t)v2;
+    NEXT();
+  }
+  {
+  op_store_sh:;
+    STORE_ADDR(addr, v2, 2);
+    *(uint16_t *)(wmem + addr) = (uint16_t)v2;
+    NEXT();
+  }
+  {
+  op_store_sw:;
+    STORE_ADDR(addr, v2, 4);
+    *(uint32_t *)(wmem + addr) = v2;
+    NEXT();
+  }
+  {
+  mmio_store:;
+    const uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;
+    if (addr - VM_BLK_BASE < VM_BLK_SIZE && vm_files_blk(files)) {
+      vm_blk_store(files->blk, wmem, work_mem_size, addr - VM_BLK_BASE, registers[ins->rs2]);
+      NEXT();
+    }
+  }
+  {
+  bad_store:;
+#if USE_PRINT
+    fprintf(stderr, "store went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", CUR_PC,
+            (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF, *(uint32_t *)(program + CUR_PC));
+#endif
+    exit_loop(ERR_INVALID_MEMORY_ACCESS);
+  }
+#if USE_TOHOST_SYSCALL
+  {
+  store_tohost:;
+    // used by benchmarks in https://github.com/riscv-software-src/riscv-tests
+    uint32_t from_virt = registers[ins->rs2];
+    const uint32_t v2 = from_virt;
+    uint8_t is_exit = from_virt & 1;
+    if (is_exit) {
+      exit_loop(from_virt >> 1);
+    }
+    from_virt = vm_tohost_syscall(vm_files_console(files), wmem, files->layout.mem_size, v2);
+    if (from_virt != SYS_write) {
+#if USE_PRINT
+      fprintf(stderr, "unimplemented magic syscall %d\n", from_virt);
+#endif
+      exit_loop(ERR_UNIMPLEMENTED_MAGIC_SYSCALL);
+    }
+    wmem[fromhost] = 1;
+    NEXT();
+  }
+#endif
+
+  {
+  op_addi:;
+    registers[ins->rd] = registers[ins->rs1] + ins->imm;
+    NEXT();
+  op_slti:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] < ins->imm ? 1 : 0;
+    NEXT();
+  op_sltiu:;
+    registers[ins->rd] = registers[ins->rs1] < (uint32_t)ins->imm ? 1 : 0;
+    NEXT();
+  op_xori:;
+    registers[ins->rd] = registers[ins->rs1] ^ ins->imm;
+    NEXT();
+  op_ori:;
+    registers[ins->rd] = registers[ins->rs1] | ins->imm;
+    NEXT();
+  op_andi:;
+    registers[ins->rd] = registers[ins->rs1] & ins->imm;
+    NEXT();
+  op_slli:;
+    registers[ins->rd] = registers[ins->rs1] << ins->imm;
+    NEXT();
+  op_srli:;
+    registers[ins->rd] = registers[ins->rs1] >> ins->imm;
+    NEXT();
+  op_srai:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] >> ins->imm;
+    NEXT();
+  op_lui:;
+    registers[ins->rd] = ins->imm;
+    NEXT();
+  op_auipc:;
+    registers[ins->rd] = ins->imm;
+    NEXT();
+  }
+  {
+  op_add:;
+    registers[ins->rd] = registers[ins->rs1] + registers[ins->rs2];
+    NEXT();
+  op_sub:;
+    registers[ins->rd] = registers[ins->rs1] - registers[ins->rs2];
+    NEXT();
+  op_sll:;
+    registers[ins->rd] = registers[ins->rs1] << (registers[ins->rs2] & 0x1F);
+    NEXT();
+  op_slt:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] < (int32_t)registers[ins->rs2] ? 1 : 0;
+    NEXT();
+  op_sltu:;
+    registers[ins->rd] = registers[ins->rs1] < registers[ins->rs2] ? 1 : 0;
+    NEXT();
+  op_xor:;
+    registers[ins->rd] = registers[ins->rs1] ^ registers[ins->rs2];
+    NEXT();
+  op_srl:;
+    registers[ins->rd] = registers[ins->rs1] >> (registers[ins->rs2] & 0x1F);
+    NEXT();
+  op_sra:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] >> (registers[ins->rs2] & 0x1F);
+    NEXT();
+  op_or:;
+    registers[ins->rd] = registers[ins->rs1] | registers[ins->rs2];
+    NEXT();
+  op_and:;
+    registers[ins->rd] = registers[ins->rs1] & registers[ins->rs2];
+    NEXT();
+  op_mul:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] * (int32_t)registers[ins->rs2];
+    NEXT();
+  op_mulh:;
+    registers[ins->rd] = ((int64_t)(int32_t)registers[ins->rs1] * (int64_t)(int32_t)registers[ins->rs2]) >> 32;
+    NEXT();
+  op_mulhsu:;
+    registers[ins->rd] = ((uint64_t)((int64_t)(int32_t)registers[ins->rs1] * (uint64_t)registers[ins->rs2])) >> 32;
+    NEXT();
+  op_mulhu:;
+    registers[ins->rd] = ((uint64_t)registers[ins->rs1] * (uint64_t)registers[ins->rs2]) >> 32;
+    NEXT();
+  }
+  {
+  op_div:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    if (v2 == 0) {
+      registers[ins->rd] = 0xFFFFFFFF;
+    } else if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+      // integer overflow
+      registers[ins->rd] = v1;
+    } else {
+      registers[ins->rd] = (int32_t)v1 / (int32_t)v2;
+    }
+    NEXT();
+  }
+  {
+  op_divu:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    registers[ins->rd] = v2 == 0 ? 0xFFFFFFFF : v1 / v2;
+    NEXT();
+  }
+  {
+  op_rem:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    if (v2 == 0) {
+      registers[ins->rd] = v1;
+    } else if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+      // integer overflow
+      registers[ins->rd] = 0;
+    } else {
+      registers[ins->rd] = (int32_t)v1 % (int32_t)v2;
+    }
+    NEXT();
+  }
+  {
+  op_remu:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    registers[ins->rd] = v2 == 0 ? v1 : v1 % v2;
+    NEXT();
+  }
+  {
+  op_sh1add:;
+    registers[ins->rd] = (registers[ins->rs1] << 1) + registers[ins->rs2];
+    NEXT();
+  op_sh2add:;
+    registers[ins->rd] = (registers[ins->rs1] << 2) + registers[ins->rs2];
+    NEXT();
+  op_sh3add:;
+    registers[ins->rd] = (registers[ins->rs1] << 3) + registers[ins->rs2];
+    NEXT();
+  op_andn:;
+    registers[ins->rd] = registers[ins->rs1] & ~registers[ins->rs2];
+    NEXT();
+  op_orn:;
+    registers[ins->rd] = registers[ins->rs1] | ~registers[ins->rs2];
+    NEXT();
+  op_xnor:;
+    registers[ins->rd] = ~(registers[ins->rs1] ^ registers[ins->rs2]);
+    NEXT();
+  op_clz:;
+    registers[ins->rd] = rv_clz(registers[ins->rs1]);
+    NEXT();
+  op_ctz:;
+    registers[ins->rd] = rv_ctz(registers[ins->rs1]);
+    NEXT();
+  op_cpop:;
+    registers[ins->rd] = rv_cpop(registers[ins->rs1]);
+    NEXT();
+  op_sext_b:;
+    registers[ins->rd] = (int8_t)registers[ins->rs1];
+    NEXT();
+  op_sext_h:;
+    registers[ins->rd] = (int16_t)registers[ins->rs1];
+    NEXT();
+  op_zext_h:;
+    registers[ins->rd] = (uint16_t)registers[ins->rs1];
+    NEXT();
+  op_min:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] < (int32_t)registers[ins->rs2] ? registers[ins->rs1] : registers[ins->rs2];
+    NEXT();
+  op_minu:;
+    registers[ins->rd] = registers[ins->rs1] < registers[ins->rs2] ? registers[ins->rs1] : registers[ins->rs2];
+    NEXT();
+  op_max:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] > (int32_t)registers[ins->rs2] ? registers[ins->rs1] : registers[ins->rs2];
+    NEXT();
+  op_maxu:;
+    registers[ins->rd] = registers[ins->rs1] > registers[ins->rs2] ? registers[ins->rs1] : registers[ins->rs2];
+    NEXT();
+  op_rol:;
+    registers[ins->rd] = rv_rol(registers[ins->rs1], registers[ins->rs2]);
+    NEXT();
+  op_ror:;
+    registers[ins->rd] = rv_ror(registers[ins->rs1], registers[ins->rs2]);
+    NEXT();
+  op_rori:;
+    registers[ins->rd] = rv_ror(registers[ins->rs1], ins->imm);
+    NEXT();
+  op_orc_b:;
+    registers[ins->rd] = rv_orc_b(registers[ins->rs1]);
+    NEXT();
+  op_rev8:;
+    registers[ins->rd] = rv_rev8(registers[ins->rs1]);
+    NEXT();
+  op_bclr:;
+    registers[ins->rd] = registers[ins->rs1] & ~(1u << (registers[ins->rs2] & 0x1F));
+    NEXT();
+  op_bclri:;
+    registers[ins->rd] = registers[ins->rs1] & ~(1u << ins->imm);
+    NEXT();
+  op_bext:;
+    registers[ins->rd] = (registers[ins->rs1] >> (registers[ins->rs2] & 0x1F)) & 1;
+    NEXT();
+  op_bexti:;
+    registers[ins->rd] = (registers[ins->rs1] >> ins->imm) & 1;
+    NEXT();
+  op_binv:;
+    registers[ins->rd] = registers[ins->rs1] ^ (1u << (registers[ins->rs2] & 0x1F));
+    NEXT();
+  op_binvi:;
+    registers[ins->rd] = registers[ins->rs1] ^ (1u << ins->imm);
+    NEXT();
+  op_bset:;
+    registers[ins->rd] = registers[ins->rs1] | (1u << (registers[ins->rs2] & 0x1F));
+    NEXT();
+  op_bseti:;
+    registers[ins->rd] = registers[ins->rs1] | (1u << ins->imm);
+    NEXT();
+  }
+
+#define BRANCH(cond)                                                                                                                       \
+  if (cond) {                                                                                                                              \
+    const uint32_t target = ins->imm;                                                                                                      \
+    if (__builtin_expect(target >= cache_bytes || (target & 1), 0)) {                                                                      \
+      goto bad_jump;                                                                                                                       \
+    }                                                                                                                                      \
+    JUMP(target);                                                                                                                          \
+  }                                                                                                                                        \
+  NEXT();
+
+  {
+  op_beq:;
+    BRANCH(registers[ins->rs1] == registers[ins->rs2]);
+  op_bne:;
+    BRANCH(registers[ins->rs1] != registers[ins->rs2]);
+  op_blt:;
+    BRANCH((int32_t)registers[ins->rs1] < (int32_t)registers[ins->rs2]);
+  op_bge:;
+    BRANCH((int32_t)registers[ins->rs1] >= (int32_t)registers[ins->rs2]);
+  op_bltu:;
+    BRANCH(registers[ins->rs1] < registers[ins->rs2]);
+  op_bgeu:;
+    BRANCH(registers[ins->rs1] >= registers[ins->rs2]);
+  }
+  {
+  op_jal:;
+    const uint32_t target = ins->imm;
+    registers[ins->rd] = NEXT_PC;
+    registers[0] = 0;
+    if (__builtin_expect(target >= cache_bytes || (target & 1), 0)) {
+      goto bad_jump;
+    }
+    JUMP(target);
+  }
+  {
+  op_jalr:;
+    const uint32_t target = (registers[ins->rs1] + ins->imm) & 0xFFFFFFFE;
+    registers[ins->rd] = NEXT_PC;
+    registers[0] = 0;
+    if (__builtin_expect(target >= cache_bytes, 0)) {
+#if USE_PRINT
+      fprintf(stderr, "bad jalr at pc %0X (instruction %X) new address 0x%0X\n", CUR_PC, *(uint32_t *)(program + CUR_PC), target);
+#endif
+      exit_loop(ERR_INVALID_MEMORY_ACCESS);
+    }
+    JUMP(target);
+  }
+  {
+  bad_jump:;
+    const uint32_t target = ins->imm;
+#if USE_PRINT
+    fprintf(stderr, "bad jump at pc %0X (instruction %X) target 0x%0X\n", CUR_PC, *(uint32_t *)(program + CUR_PC), target);
+#endif
+    exit_loop((target & 1) ? ERR_MISALIGNED_MEMORY_ACCESS : ERR_INVALID_MEMORY_ACCESS);
+  }
+  {
+  op_ebreak:;
+#if USE_PRINT
+    fprintf(stderr, "ebreak, exiting\n");
+#endif
+    exit_loop(ERR_EBREAK);
+  }
+  {
+  op_wfi:;
+#if USE_PRINT
+    fprintf(stderr, "wfi instruction, exiting\n");
+#endif
+    exit_loop(ERR_WFI);
+  }
+  {
+  op_ecall:;
+    uint32_t a0 = registers[10]; // argument
+    uint32_t a7 = registers[17]; // function
+    switch (a7) {
+    case SYS_print_mem_access:
+      mem_write_intercept = a0;
+      break;
+    case 93: {
+      // exit
+      uint8_t is_test = a0 & 1;
+      uint32_t exit_code = a0 >> 1;
+      if (is_test && a0) {
+#if USE_PRINT
+        fprintf(stderr, "*** FAILED *** (tohost = %d)\n", exit_code);
+#endif
+      }
+      vm_console_flush(files->console);
+#if USE_PRINT
+      printf("exit code %d\n", exit_code);
+#endif
+      exit_loop(exit_code);
+    } break;
+    case 94: {
+      // exit_group of a Linux program, the status as it is
+      vm_console_flush(files->console);
+#if USE_PRINT
+      printf("exit code %d\n", a0 & 0xFF);
+#endif
+      exit_loop(a0 & 0xFF);
+    } break;
+    default:
+      break;
+    }
+    uint32_t user_handled = 0;
+    if (user_syscall_handler) {
+      uint32_t sres = user_syscall_handler(&user_handled, a7, registers[10], registers[11], registers[12], registers[13], registers[14],
+                                           registers[15], registers[16], wmem);
+      if (user_handled == 1) {
+        registers[10] = sres;
+      } else if (user_handled == 2) {
+        exit_loop(0);
+      }
+    }
+    if (user_handled == 0) {
+      registers[10] = syscall_handler(files, a7, registers[10], registers[11], registers[12], registers[13], registers[14],
+                                      registers[15], registers[16], wmem);
+    }
+    NEXT();
+  }
+  {
+  op_csrrs:;
+    uint32_t val = registers[ins->rd];
+    switch (ins->imm) {
+    case 0xc01: // time
+      val = get_cycles() - start_time;
+      break;
+    case 0xc81: // timeh
+      val = (get_cycles() - start_time) >> 32;
+      break;
+    case 0xF14: // mhartid (Hardware thread ID.)
+    case 0x300: // mstatus (Machine status register.)
+    case 0x305: // mtvec (Machine trap-handler base address.)
+      val = 0;
+      break;
+    case 0xb00: // mcycle (Machine cycle counter.)
+      val = get_cycles();
+      break;
+    case 0xB80: // mcycleh
+      val = get_cycles() >> 32;
+      break;
+    case 0xb02: // minstret (Machine instructions-retired counter.)
+      val = instret;
+      break;
+    case 0xB82: // minstreth
+      val = instret >> 32;
+      break;
+    case 0x008: // vstart, vector instructions always run to the end
+      val = 0;
+      break;
+    case 0xC20: // vl
+      val = vec.vl;
+      break;
+    case 0xC21: // vtype
+      val = vec.vtype;
+      break;
+    case 0xC22: // vlenb
+      val = RV_VLENB;
+      break;
+    default:
+      break;
+    }
+    registers[ins->rd] = val;
+    NEXT();
+  }
+
+// F and D operands, a single reads as the canonical NaN unless it is NaN-boxed
+#define FS1 fp_s(fregs[ins->rs1])
+#define FS2 fp_s(fregs[ins->rs2])
+#define FS3 fp_s(fregs[ins->imm >> 8])
+#define FD1 fp_d(fregs[ins->rs1])
+#define FD2 fp_d(fregs[ins->rs2])
+#define FD3 fp_d(fregs[ins->imm >> 8])
+
+// r = expr in the instruction's rounding mode. The host already rounds by frm,
+// a static mode is set around expr, whose operands are read after the switch
+#define FP_ROUNDED(r, expr)                                                                                                                \
+  if (__builtin_expect((ins->imm & 7) == RV_RM_DYN, 1)) {                                                                                  \
+    r = (expr);                                                                                                                            \
+  } else {                                                                                                                                 \
+    fesetround(fp_host_round(ins->imm & 7));                                                                                               \
+    FP_FENCE(fregs);                                                                                                                       \
+    FP_FENCE(registers);                                                                                                                   \
+    r = (expr);                                                                                                                            \
+    FP_FENCE(r);                                                                                                                           \
+    fesetround(fp_host_round(frm));                                                                                                        \
+  }
+
+#define FP_OP_S(label, expr)                                                                                                               \
+  label:;                                                                                                                                  \
+  {                                                                                                                                        \
+    float r;                                                                                                                               \
+    FP_ROUNDED(r, expr);                                                                                                                   \
+    fregs[ins->rd] = fp_result_s(r);                                                                                                       \
+    NEXT();                                                                                                                                \
+  }
+
+#define FP_OP_D(label, expr)                                                                                                               \
+  label:;                                                                                                                                  \
+  {                                                                                                                                        \
+    double r;                                                                                                                              \
+    FP_ROUNDED(r, expr);                                                                                                                   \
+    fregs[ins->rd] = fp_result_d(r);                                                                                                       \
+    NEXT();                                                                                                                                \
+  }
+
+// F and D instructions that write an integer register, which may be x0
+#define FP_TO_X(label, expr)                                                                                                               \
+  label:;                                                                                                                                  \
+  registers[ins->rd] = (expr);                                                                                                             \
+  registers[0] = 0;                                                                                                                        \
+  NEXT();
+
+// the rounding mode of fcvt to integers
+#define FP_RM (((ins->imm & 7) == RV_RM_DYN) ? frm : (uint32_t)(ins->imm & 7))
+
+#define FP_LOAD_ADDR(addr, width)                                                                                                          \
+  const uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;                                                                     \
+  if (__builtin_expect(addr > work_mem_size - width, 0)) {                                                                                 \
+    goto bad_load;                                                                                                                         \
+  }
+
+  {
+  op_flw:;
+    FP_LOAD_ADDR(addr, 4);
+    fregs[ins->rd] = FP_BOX | *(uint32_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  op_fld:;
+    FP_LOAD_ADDR(addr, 8);
+    fregs[ins->rd] = *(uint64_t *)(wmem + addr);
+    NEXT();
+  }
+
+#define FP_STORE_ADDR(addr, width)                                                                                                         \
+  const uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;                                                                     \
+  if (__builtin_expect(addr > work_mem_size - width, 0)) {                                                                                 \
+    goto bad_store;                                                                                                                        \
+  }                                                                                                                                        \
+  INVALIDATE(addr);
+
+  {
+  op_fsw:;
+    FP_STORE_ADDR(addr, 4);
+    *(uint32_t *)(wmem + addr) = (uint32_t)fregs[ins->rs2];
+    NEXT();
+  }
+  {
+  op_fsd:;
+    FP_STORE_ADDR(addr, 8);
+    INVALIDATE(addr + 4);
+    *(uint64_t *)(wmem + addr) = fregs[ins->rs2];
+    NEXT();
+  }
+
+  FP_OP_S(op_fmadd_s, fmaf(FS1, FS2, FS3))
+  FP_OP_S(op_fmsub_s, fmaf(FS1, FS2, -FS3))
+  FP_OP_S(op_fnmsub_s, fmaf(-FS1, FS2, FS3))
+  FP_OP_S(op_fnmadd_s, fmaf(-FS1, FS2, -FS3))
+  FP_OP_D(op_fmadd_d, fma(FD1, FD2, FD3))
+  FP_OP_D(op_fmsub_d, fma(FD1, FD2, -FD3))
+  FP_OP_D(op_fnmsub_d, fma(-FD1, FD2, FD3))
+  FP_OP_D(op_fnmadd_d, fma(-FD1, FD2, -FD3))
+  FP_OP_S(op_fadd_s, FS1 + FS2)
+  FP_OP_S(op_fsub_s, FS1 - FS2)
+  FP_OP_S(op_fmul_s, FS1 * FS2)
+  FP_OP_S(op_fdiv_s, FS1 / FS2)
+  FP_OP_S(op_fsqrt_s, sqrtf(FS1))
+  FP_OP_D(op_fadd_d, FD1 + FD2)
+  FP_OP_D(op_fsub_d, FD1 - FD2)
+  FP_OP_D(op_fmul_d, FD1 * FD2)
+  FP_OP_D(op_fdiv_d, FD1 / FD2)
+  FP_OP_D(op_fsqrt_d, sqrt(FD1))
+  FP_OP_S(op_fcvt_s_w, (float)(int32_t)registers[ins->rs1])
+  FP_OP_S(op_fcvt_s_wu, (float)registers[ins->rs1])
+  FP_OP_D(op_fcvt_d_w, (double)(int32_t)registers[ins->rs1])
+  FP_OP_D(op_fcvt_d_wu, (double)registers[ins->rs1])
+  FP_OP_S(op_fcvt_s_d, (float)FD1)
+  FP_OP_D(op_fcvt_d_s, (double)FS1)
+  FP_TO_X(op_fcvt_w_s, fp_to_int(FS1, FP_RM, 0, &fflags))
+  FP_TO_X(op_fcvt_wu_s, fp_to_int(FS1, FP_RM, 1, &fflags))
+  FP_TO_X(op_fcvt_w_d, fp_to_int(FD1, FP_RM, 0, &fflags))
+  FP_TO_X(op_fcvt_wu_d, fp_to_int(FD1, FP_RM, 1, &fflags))
+  FP_TO_X(op_fmv_x_w, (uint32_t)fregs[ins->rs1])
+  FP_TO_X(op_feq_s, FS1 == FS2)
+  FP_TO_X(op_flt_s, FS1 < FS2)
+  FP_TO_X(op_fle_s, FS1 <= FS2)
+  FP_TO_X(op_fclass_s, fp_class(fp_unbox(fregs[ins->rs1]), 8, 23))
+  FP_TO_X(op_feq_d, FD1 == FD2)
+  FP_TO_X(op_flt_d, FD1 < FD2)
+  FP_TO_X(op_fle_d, FD1 <= FD2)
+  FP_TO_X(op_fclass_d, fp_class(fregs[ins->rs1], 11, 52))
+
+  // sign injection, min and max work on the bits and keep NaN payloads
+  {
+  op_fsgnj_s:;
+    fregs[ins->rd] = FP_BOX | (fp_unbox(fregs[ins->rs1]) & 0x7FFFFFFF) | (fp_unbox(fregs[ins->rs2]) & 0x80000000);
+    NEXT();
+  op_fsgnjn_s:;
+    fregs[ins->rd] = FP_BOX | (fp_unbox(fregs[ins->rs1]) & 0x7FFFFFFF) | (~fp_unbox(fregs[ins->rs2]) & 0x80000000);
+    NEXT();
+  op_fsgnjx_s:;
+    fregs[ins->rd] = FP_BOX | (fp_unbox(fregs[ins->rs1]) ^ (fp_unbox(fregs[ins->rs2]) & 0x80000000));
+    NEXT();
+  op_fmin_s:;
+    fregs[ins->rd] = fp_min_max_s(fregs[ins->rs1], fregs[ins->rs2], 0, &fflags);
+    NEXT();
+  op_fmax_s:;
+    fregs[ins->rd] = fp_min_max_s(fregs[ins->rs1], fregs[ins->rs2], 1, &fflags);
+    NEXT();
+  op_fsgnj_d:;
+    fregs[ins->rd] = (fregs[ins->rs1] & ~(1ull << 63)) | (fregs[ins->rs2] & (1ull << 63));
+    NEXT();
+  op_fsgnjn_d:;
+    fregs[ins->rd] = (fregs[ins->rs1] & ~(1ull << 63)) | (~fregs[ins->rs2] & (1ull << 63));
+    NEXT();
+  op_fsgnjx_d:;
+    fregs[ins->rd] = fregs[ins->rs1] ^ (fregs[ins->rs2] & (1ull << 63));
+    NEXT();
+  op_fmin_d:;
+    fregs[ins->rd] = fp_min_max_d(fregs[ins->rs1], fregs[ins->rs2], 0, &fflags);
+    NEXT();
+  op_fmax_d:;
+    fregs[ins->rd] = fp_min_max_d(fregs[ins->rs1], fregs[ins->rs2], 1, &fflags);
+    NEXT();
+  op_fmv_w_x:;
+    fregs[ins->rd] = FP_BOX | registers[ins->rs1];
+    NEXT();
+  }
+  {
+  op_fcsr:;
+    fflags |= fp_host_flags();
+    const uint32_t csr = ins->imm & 0xFFF;
+    const uint32_t old = csr == 1 ? fflags : (csr == 2 ? frm : (frm << 5 | fflags));
+    // funct3 bit 2 is the immediate form
+    const uint32_t src = (ins->imm >> 14) & 1 ? ins->rs1 : registers[ins->rs1];
+    uint32_t val = old & ~src; // csrrc
+    if (((ins->imm >> 12) & 3) == 1) {
+      val = src; // csrrw
+    } else if (((ins->imm >> 12) & 3) == 2) {
+      val = old | src; // csrrs
+    }
+    if (csr == 2) {
+      frm = val & 7;
+    } else {
+      fflags = val & 0x1F;
+      if (csr == 3) {
+        frm = (val >> 5) & 7;
+      }
+    }
+    feclearexcept(FE_ALL_EXCEPT);
+    fesetround(fp_host_round(frm));
+    registers[ins->rd] = old;
+    registers[0] = 0;
+    NEXT();
+  }
+
+  // V, the elements are done by riscv-vm-vector.c
+  {
+  op_vsetvli:;
+    // rs1 x0 asks for VLMAX, or to keep vl when rd is x0 too
+    const uint32_t avl = ins->rs1 ? registers[ins->rs1] : (ins->rd ? UINT32_MAX : vec.vl);
+    registers[ins->rd] = rv_vsetvl(&vec, avl, ins->imm);
+    registers[0] = 0;
+    NEXT();
+  }
+  {
+  op_vsetivli:;
+    registers[ins->rd] = rv_vsetvl(&vec, ins->rs1, ins->imm);
+    registers[0] = 0;
+    NEXT();
+  }
+  {
+  op_vsetvl:;
+    const uint32_t avl = ins->rs1 ? registers[ins->rs1] : (ins->rd ? UINT32_MAX : vec.vl);
+    registers[ins->rd] = rv_vsetvl(&vec, avl, registers[ins->rs2]);
+    registers[0] = 0;
+    NEXT();
+  }
+  {
+    int store;
+    uint32_t stride;
+  op_vle:;
+    store = 0;
+    stride = ins->imm & 0xF;
+    goto vector_access;
+  op_vlse:;
+    store = 0;
+    stride = registers[ins->rs2];
+    goto vector_access;
+  op_vse:;
+    store = 1;
+    stride = ins->imm & 0xF;
+    goto vector_access;
+  op_vsse:;
+    store = 1;
+    stride = registers[ins->rs2];
+  vector_access:;
+    uint32_t lo, hi;
+    const int r = rv_vector_access(&vec, wmem, work_mem_size, store, ins->rd, registers[ins->rs1], stride, ins->imm & 0xF,
+                                   !(ins->imm & 0x10), &lo, &hi);
+    if (__builtin_expect(r == RV_VECTOR_FAULT, 0)) {
+#if USE_PRINT
+      fprintf(stderr, "vector %s went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", store ? "store" : "load", CUR_PC,
+              registers[ins->rs1] & 0x7FFFFFFF, *(uint32_t *)(program + CUR_PC));
+#endif
+      exit_loop(ERR_INVALID_MEMORY_ACCESS);
+    }
+    if (__builtin_expect(r != RV_VECTOR_OK, 0)) {
+      goto uo;
+    }
+    // a store into decoded instructions drops them, a halfword at a time
+    for (uint32_t addr = lo; addr < hi && addr < cache_bytes; addr += 2) {
+      INVALIDATE(addr);
+    }
+    NEXT();
+  }
+  {
+  op_vmv_x_s:;
+    if (rv_vector_x_s(&vec, ins->rs2, &registers[ins->rd]) != RV_VECTOR_OK) {
+      goto uo;
+    }
+    registers[0] = 0;
+    NEXT();
+  }
+  {
+  op_vop:;
+    if (rv_vector_op(&vec, ins->imm, ins->rd, ins->rs1, ins->rs2, registers[ins->rs1]) != RV_VECTOR_OK) {
+      goto uo;
+    }
+    NEXT();
+  }
+
+vm_exit:;
+  {
+    vm_console_flush(files->console);
+    fesetenv(&host_fenv);
+    const uint32_t pc = CUR_PC;
+    memcpy(initial_registers, registers, REG_MEM_SIZE);
+    *pcp_out = pc;
+    free(records);
+    const uint64_t mcycle_val = instret;
+    const uint64_t duration = get_cycles() - start_time;
+    const double speed = (double)mcycle_val / ((double)duration / 1e9);
+    printf("system exit mcycle=%" PRIu64 " dur %" PRIu64 " speed is %g ops/sec (%f "
+           "nanosec/inst)\n",
+           mcycle_val, duration, speed, ((double)duration / 1.0) / (double)mcycle_val);
+  }
+  return res;
+}
@@ -0,0 +1,737 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-decode.h"
+#include "riscv-vm-optimized-1.h"
+
+#include "cycle-counter.h"
+
+// Basic block engine. Guest code is split into basic blocks (ending at a
+// branch, jal, jalr or system instruction) the first time it runs. Blocks are
+// cached by guest PC and a whole block runs per dispatch, so instret, PC
+// validity and the exit checks are done once per block instead of once per
+// instruction. A block remembers the blocks it left to, so once they are
+// linked the jump from one block into the next only loads that pointer and
+// comes back to the lookup when a link is missing.
+
+static const int VM_MEMORY = 1048576 * 32;
+
+static const size_t work_mem_size = VM_MEMORY * 1; // size of memory to allocate
+
+// longest straight-line run kept in one block
+#define MAX_BLOCK_LEN 64
+
+typedef struct {
+  void *handler; // label inside riscv_vm_main_loop_6
+  int32_t imm;   // ready to use: absolute target for branches/jal, pc + imm for auipc
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+} decoded_insn_t;
+
+typedef struct block_s {
+  struct block_s *next_alloc; // all blocks, for flushing
+  struct block_s *succ[2];    // links, 1 is a taken branch or the last jalr target, 0 every other way out
+  uint32_t start_pc;
+  uint32_t len; // guest instructions, insns has one more record if the block just falls through
+  decoded_insn_t insns[];
+} block_t;
+
+static int riscv_vm_main_loop_6(uint8_t *initial_registers, uint8_t *wmem, uint32_t program_len, uint32_t *pcp_out,
+                                syscall_handler_t user_syscall_handler, vm_files_t *files);
+
+int riscv_vm_run_optimized_6(uint8_t *registers, const vm_image_t *image, syscall_handler_t user_syscall_handler) {
+  const uint32_t program_len = vm_image_end(image);
+
+#if USE_PRINT
+  printf("Starting VM... work mem size %zu program len %d\n", work_mem_size, program_len);
+#endif
+  if (program_len > work_mem_size) {
+#if USE_PRINT
+    fprintf(stderr, "Program too long for memory, program size %d memory size %zu\n", program_len, work_mem_size);
+#endif
+    return ERR_OUT_OF_MEM;
+  }
+  init_counter();
+  uint8_t *wmem = vm_mem_alloc(work_mem_size);
+  if (wmem == NULL) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+    return ERR_OUT_OF_MEM;
+  }
+  int res = vm_image_load(wmem, work_mem_size, image);
+  if (res) {
+    vm_mem_free(wmem, work_mem_size);
+    return res;
+  }
+  uint32_t pcp = image->entry & 0x7FFFFFFF;
+  vm_files_t files = {0};
+  files.user_syscall_handler = user_syscall_handler;
+  const uint32_t sp = vm_linux_init(&files, wmem, work_mem_size, image);
+  if (!registers) {
+    registers = malloc(REG_MEM_SIZE);
+    if (registers == NULL) {
+#if USE_PRINT
+      fprintf(stderr, "Memory allocation failed\n");
+#endif
+      vm_mem_free(wmem, work_mem_size);
+      return ERR_OUT_OF_MEM;
+    }
+    memset(registers, 0, REG_MEM_SIZE);
+    ((uint32_t *)registers)[2] = sp;
+  }
+#if PRINT_REGISTERS
+  dump_registers(registers);
+#endif
+  vm_mark_started();
+  res = riscv_vm_main_loop_6(registers, wmem, program_len, &pcp, user_syscall_handler, &files);
+  vm_files_close(&files);
+#if PRINT_REGISTERS
+  dump_registers(registers);
+#endif
+#if USE_PRINT
+  printf("Final PC: %04X\n", pcp);
+#endif
+  vm_mem_free(wmem, work_mem_size);
+  return res;
+}
+
+#define exit_loop(ec)                                                                                                                      \
+  do {                                                                                                                                     \
+    res = (ec);                                                                                                                            \
+    goto vm_exit;                                                                                                                          \
+  } while (0)
+
+#define CUR_PC (blk->start_pc + ((uint32_t)(ins - blk->insns) << 2))
+
+// next record of the same block, no accounting until the block ends
+#define NEXT()                                                                                                                             \
+  do {                                                                                                                                     \
+    ins++;                                                                                                                                 \
+    goto *ins->handler;                                                                                                                    \
+  } while (0)
+
+// leave the block through link k, pc is checked by the dispatcher the first
+// time and the block it finds is linked in
+#define END_BLOCK(k, target)                                                                                                               \
+  do {                                                                                                                                     \
+    block_t *const next = blk->succ[k];                                                                                                    \
+    if (__builtin_expect(next != NULL, 1)) {                                                                                               \
+      ENTER_BLOCK(next);                                                                                                                   \
+    }                                                                                                                                      \
+    pc = (target);                                                                                                                         \
+    link = &blk->succ[k];                                                                                                                  \
+    goto dispatch;                                                                                                                         \
+  } while (0)
+
+#define ENTER_BLOCK(b)                                                                                                                     \
+  do {                                                                                                                                     \
+    blk = (b);                                                                                                                             \
+    instret += blk->len;                                                                                                                   \
+    ins = blk->insns;                                                                                                                      \
+    goto *ins->handler;                                                                                                                    \
+  } while (0)
+
+// every handler keeps its own dispatch jump, merged tails share one and predict worse
+__attribute__((optimize("no-crossjumping"))) static int riscv_vm_main_loop_6(uint8_t *initial_registers, uint8_t *wmem, uint32_t program_len, uint32_t *pcp_out,
+                                syscall_handler_t user_syscall_handler, vm_files_t *files) {
+  const uint64_t start_time = get_cycles();
+  uint32_t registers[32];
+  uint8_t *program = wmem;
+  uint64_t instret = 0;
+  int res = 0;
+  uint32_t mem_write_intercept = 0;
+  memcpy(registers, initial_registers, REG_MEM_SIZE);
+  registers[0] = 0;
+
+  static void *op_table[RV_OP_COUNT] = {
+      [RV_OP_INVALID] = &&uo,        [RV_OP_NOP] = &&op_nop,       [RV_OP_LB] = &&op_load_lb,     [RV_OP_LH] = &&op_load_lh,
+      [RV_OP_LW] = &&op_load_lw,     [RV_OP_LBU] = &&op_load_lbu,  [RV_OP_LHU] = &&op_load_lhu,   [RV_OP_SB] = &&op_store_sb,
+      [RV_OP_SH] = &&op_store_sh,    [RV_OP_SW] = &&op_store_sw,   [RV_OP_ADDI] = &&op_addi,      [RV_OP_SLTI] = &&op_slti,
+      [RV_OP_SLTIU] = &&op_sltiu,    [RV_OP_XORI] = &&op_xori,     [RV_OP_ORI] = &&op_ori,        [RV_OP_ANDI] = &&op_andi,
+      [RV_OP_SLLI] = &&op_slli,      [RV_OP_SRLI] = &&op_srli,     [RV_OP_SRAI] = &&op_srai,      [RV_OP_LUI] = &&op_lui,
+      [RV_OP_AUIPC] = &&op_auipc,    [RV_OP_ADD] = &&op_add,       [RV_OP_SUB] = &&op_sub,        [RV_OP_SLL] = &&op_sll,
+      [RV_OP_SLT] = &&op_slt,        [RV_OP_SLTU] = &&op_sltu,     [RV_OP_XOR] = &&op_xor,        [RV_OP_SRL] = &&op_srl,
+      [RV_OP_SRA] = &&op_sra,        [RV_OP_OR] = &&op_or,         [RV_OP_AND] = &&op_and,        [RV_OP_MUL] = &&op_mul,
+      [RV_OP_MULH] = &&op_mulh,      [RV_OP_MULHSU] = &&op_mulhsu, [RV_OP_MULHU] = &&op_mulhu,    [RV_OP_DIV] = &&op_div,
+      [RV_OP_DIVU] = &&op_divu,      [RV_OP_REM] = &&op_rem,       [RV_OP_REMU] = &&op_remu,      [RV_OP_BEQ] = &&op_beq,
+      [RV_OP_BNE] = &&op_bne,        [RV_OP_BLT] = &&op_blt,       [RV_OP_BGE] = &&op_bge,        [RV_OP_BLTU] = &&op_bltu,
+      [RV_OP_BGEU] = &&op_bgeu,      [RV_OP_JAL] = &&op_jal,       [RV_OP_JALR] = &&op_jalr,      [RV_OP_ECALL] = &&op_ecall,
+      [RV_OP_EBREAK] = &&op_ebreak,  [RV_OP_WFI] = &&op_wfi,       [RV_OP_CSRRS] = &&op_csrrs};
+
+  // guest words are only looked up by block start, code_mark flags words that
+  // belong to some translated block so stores into them can flush the cache
+  const uint32_t cache_len = (program_len + 3) >> 2;
+  const uint32_t cache_bytes = cache_len << 2;
+  block_t **block_map = calloc(cache_len + 1, sizeof(block_t *));
+  uint8_t *code_mark = calloc(cache_len + 1, 1);
+  block_t *all_blocks = NULL;
+  if (block_map == NULL || code_mark == NULL) {
+#if USE_PRINT
+    fprintf(stderr, "Memory allocation failed\n");
+#endif
+    free(block_map);
+    free(code_mark);
+    return ERR_OUT_OF_MEM;
+  }
+
+  uint32_t pc = *pcp_out;
+  block_t *blk = NULL;
+  decoded_insn_t *ins = NULL;
+  // where to link the block dispatch finds, NULL if nothing is waiting for it
+  block_t **link = NULL;
+
+dispatch:;
+  blk = NULL;
+  if (__builtin_expect(pc >= cache_bytes || (pc & 3), 0)) {
+    goto bad_pc;
+  }
+  blk = block_map[pc >> 2];
+  if (__builtin_expect(blk == NULL, 0)) {
+    goto build_block;
+  }
+run_block:;
+  if (link) {
+    *link = blk;
+    link = NULL;
+  }
+  ENTER_BLOCK(blk);
+
+  {
+  build_block:;
+    rv_insn_t d[MAX_BLOCK_LEN];
+    uint32_t n = 0;
+    while (n < MAX_BLOCK_LEN && pc + (n << 2) < cache_bytes) {
+      rv_decode(*(uint32_t *)(program + pc + (n << 2)), &d[n]);
+      if (rv_op_ends_block(d[n++].op)) {
+        break;
+      }
+    }
+    const int falls_through = !rv_op_ends_block(d[n - 1].op);
+    blk = malloc(sizeof(block_t) + (n + falls_through) * sizeof(decoded_insn_t));
+    if (blk == NULL) {
+#if USE_PRINT
+      fprintf(stderr, "Memory allocation failed\n");
+#endif
+      exit_loop(ERR_OUT_OF_MEM);
+    }
+    blk->next_alloc = all_blocks;
+    all_blocks = blk;
+    blk->succ[0] = NULL;
+    blk->succ[1] = NULL;
+    blk->start_pc = pc;
+    blk->len = n;
+    for (uint32_t i = 0; i < n; i++) {
+      const uint32_t ipc = pc + (i << 2);
+      decoded_insn_t *r = &blk->insns[i];
+#if LOG_TRACE
+      printf("decode PC: 0x%04X inst 0x%08X %s\n", ipc, *(uint32_t *)(program + ipc), rv_op_names[d[i].op]);
+#endif
+      r->handler = op_table[d[i].op];
+      r->rd = d[i].rd;
+      r->rs1 = d[i].rs1;
+      r->rs2 = d[i].rs2;
+      r->imm = d[i].imm;
+      switch (d[i].op) {
+      case RV_OP_AUIPC:
+      case RV_OP_BEQ:
+      case RV_OP_BNE:
+      case RV_OP_BLT:
+      case RV_OP_BGE:
+      case RV_OP_BLTU:
+      case RV_OP_BGEU:
+      case RV_OP_JAL:
+        r->imm = ipc + d[i].imm;
+        break;
+      default:
+        break;
+      }
+      code_mark[ipc >> 2] = 1;
+    }
+    if (falls_through) {
+      blk->insns[n].handler = &&op_fallthrough;
+      blk->insns[n].imm = pc + (n << 2);
+    }
+    block_map[pc >> 2] = blk;
+    goto run_block;
+  }
+  {
+  bad_pc:;
+#if USE_PRINT
+    fprintf(stderr, "pc 0x%X is misaligned or beyond the program (program len %d)\n", pc, program_len);
+#endif
+    exit_loop((pc & 3) ? ERR_MISALIGNED_MEMORY_ACCESS : ERR_INVALID_MEMORY_ACCESS);
+  }
+  {
+  op_fallthrough:;
+    END_BLOCK(0, (uint32_t)ins->imm);
+  }
+  {
+  code_written:;
+    // the rest of the block may be stale, stop right after the store
+    instret -= blk->len - 1 - (uint32_t)(ins - blk->insns);
+    pc = CUR_PC + 4;
+    while (all_blocks) {
+      block_t *next = all_blocks->next_alloc;
+      free(all_blocks);
+      all_blocks = next;
+    }
+    memset(block_map, 0, (cache_len + 1) * sizeof(block_t *));
+    memset(code_mark, 0, cache_len + 1);
+    link = NULL;
+    goto dispatch;
+  }
+  {
+  uo:;
+#if USE_PRINT
+    fprintf(stderr, "Unimplemented or invalid opcode 0x%02X at PC 0x%02X\n", *(uint32_t *)(program + CUR_PC) & 0x7F, CUR_PC);
+#endif
+    exit_loop(ERR_UNIMPLEMENTED_OPCODE);
+  }
+  {
+  op_nop:;
+    NEXT();
+  }
+
+#define LOAD_ADDR(addr, width)                                                                                                             \
+  uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;                                                                           \
+  if (__builtin_expect(addr > work_mem_size - width, 0)) {                                                                                 \
+    goto mmio_load;                                                                                                                        \
+  }
+
+  {
+  op_load_lb:;
+    LOAD_ADDR(addr, 1);
+    registers[ins->rd] = (int8_t)wmem[addr];
+    NEXT();
+  }
+  {
+  op_load_lh:;
+    LOAD_ADDR(addr, 2);
+    registers[ins->rd] = *(int16_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  op_load_lw:;
+    LOAD_ADDR(addr, 4);
+    registers[ins->rd] = *(uint32_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  op_load_lbu:;
+    LOAD_ADDR(addr, 1);
+    registers[ins->rd] = wmem[addr];
+    NEXT();
+  }
+  {
+  op_load_lhu:;
+    LOAD_ADDR(addr, 2);
+    registers[ins->rd] = *(uint16_t *)(wmem + addr);
+    NEXT();
+  }
+  {
+  mmio_load:;
+    const uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;
+    if (addr - VM_BLK_BASE < VM_BLK_SIZE && vm_files_blk(files)) {
+      registers[ins->rd] = vm_blk_load(files->blk, addr - VM_BLK_BASE);
+      NEXT();
+    }
+#if USE_PRINT
+    fprintf(stderr, "load went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", CUR_PC, addr,
+            *(uint32_t *)(program + CUR_PC));
+#endif
+    exit_loop(ERR_INVALID_MEMORY_ACCESS);
+  }
+
+#if EMULATE_UART_OUT && USE_PRINT
+#define STORE_UART(addr, v2)                                                                                                               \
+  if (addr == UART_OUT_REGISTER) {                                                                                                         \
+    vm_console_putc(vm_files_console(files), (uint8_t)v2);                                                                                 \
+    NEXT();                                                                                                                                \
+  }
+#elif EMULATE_UART_OUT
+#define STORE_UART(addr, v2)                                                                                                               \
+  if (addr == UART_OUT_REGISTER) {                                                                                                         \
+    NEXT();                                                                                                                                \
+  }
+#else
+#define STORE_UART(addr, v2)
+#endif
+
+#if USE_TOHOST_SYSCALL
+#define STORE_TOHOST(addr, v2)                                                                                                             \
+  if (__builtin_expect(addr == tohost, 0)) {                                                                                               \
+    goto store_tohost;                                                                                                                     \
+  }
+#else
+#define STORE_TOHOST(addr, v2)
+#endif
+
+#define STORE_ADDR(addr, v2, width)                                                                                                        \
+  const uint32_t v2 = registers[ins->rs2];                                                                                                 \
+  uint32_t addr = registers[ins->rs1] + ins->imm;                                                                                          \
+  if (__builtin_expect(mem_write_intercept != 0, 0) && addr == mem_write_intercept) {                                                      \
+    printf("MEM_INTERCEPT: op_store addr 0x%x v2 %d (0x%x) PC 0x%x\n", addr, v2, v2, CUR_PC);                                              \
+  }                                                                                                                                        \
+  STORE_UART(addr, v2);                                                                                                                    \
+  addr &= 0x7FFFFFFF;                                                                                                                      \
+  if (__builtin_expect(addr > work_mem_size - width, 0)) {                                                                                 \
+    goto mmio_store;                                                                                                                       \
+  }                                                                                                                                        \
+  STORE_TOHOST(addr, v2);
+
+// stores into translated code throw the block cache away
+#define CHECK_CODE_WRITE(addr)                                                                                                             \
+  if (__builtin_expect((addr) < cache_bytes, 0) && (code_mark[(addr) >> 2] | code_mark[((addr) + 3) >> 2])) {                              \
+    goto code_written;                                                                                                                     \
+  }
+
+  {
+  op_store_sb:;
+    STORE_ADDR(addr, v2, 1);
+    wmem[addr] = (uint8_t)v2;
+    CHECK_CODE_WRITE(addr);
+    NEXT();
+  }
+  {
+  op_store_sh:;
+    STORE_ADDR(addr, v2, 2);
+    *(uint16_t *)(wmem + addr) = (uint16_t)v2;
+    CHECK_CODE_WRITE(addr);
+    NEXT();
+  }
+  {
+  op_store_sw:;
+    STORE_ADDR(addr, v2, 4);
+    *(uint32_t *)(wmem + addr) = v2;
+    CHECK_CODE_WRITE(addr);
+    NEXT();
+  }
+  {
+  mmio_store:;
+    const uint32_t addr = (registers[ins->rs1] + ins->imm) & 0x7FFFFFFF;
+    if (addr - VM_BLK_BASE < VM_BLK_SIZE && vm_files_blk(files)) {
+      vm_blk_store(files->blk, wmem, work_mem_size, addr - VM_BLK_BASE, registers[ins->rs2]);
+      NEXT();
+    }
+#if USE_PRINT
+    fprintf(stderr, "store went beyond allocated memory pc %X (addr %0X) (instruction %X)\n", CUR_PC, addr,
+            *(uint32_t *)(program + CUR_PC));
+#endif
+    exit_loop(ERR_INVALID_MEMORY_ACCESS);
+  }
+#if USE_TOHOST_SYSCALL
+  {
+  store_tohost:;
+    // used by benchmarks in https://github.com/riscv-software-src/riscv-tests
+    uint32_t from_virt = registers[ins->rs2];
+    const uint32_t v2 = from_virt;
+    uint8_t is_exit = from_virt & 1;
+    if (is_exit) {
+      exit_loop(from_virt >> 1);
+    }
+    from_virt = vm_tohost_syscall(vm_files_console(files), wmem, files->layout.mem_size, v2);
+    if (from_virt != SYS_write) {
+#if USE_PRINT
+      fprintf(stderr, "unimplemented magic syscall %d\n", from_virt);
+#endif
+      exit_loop(ERR_UNIMPLEMENTED_MAGIC_SYSCALL);
+    }
+    wmem[fromhost] = 1;
+    NEXT();
+  }
+#endif
+
+  {
+  op_addi:;
+    registers[ins->rd] = registers[ins->rs1] + ins->imm;
+    NEXT();
+  op_slti:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] < ins->imm ? 1 : 0;
+    NEXT();
+  op_sltiu:;
+    registers[ins->rd] = registers[ins->rs1] < (uint32_t)ins->imm ? 1 : 0;
+    NEXT();
+  op_xori:;
+    registers[ins->rd] = registers[ins->rs1] ^ ins->imm;
+    NEXT();
+  op_ori:;
+    registers[ins->rd] = registers[ins->rs1] | ins->imm;
+    NEXT();
+  op_andi:;
+    registers[ins->rd] = registers[ins->rs1] & ins->imm;
+    NEXT();
+  op_slli:;
+    registers[ins->rd] = registers[ins->rs1] << ins->imm;
+    NEXT();
+  op_srli:;
+    registers[ins->rd] = registers[ins->rs1] >> ins->imm;
+    NEXT();
+  op_srai:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] >> ins->imm;
+    NEXT();
+  op_lui:;
+    registers[ins->rd] = ins->imm;
+    NEXT();
+  op_auipc:;
+    registers[ins->rd] = ins->imm;
+    NEXT();
+  }
+  {
+  op_add:;
+    registers[ins->rd] = registers[ins->rs1] + registers[ins->rs2];
+    NEXT();
+  op_sub:;
+    registers[ins->rd] = registers[ins->rs1] - registers[ins->rs2];
+    NEXT();
+  op_sll:;
+    registers[ins->rd] = registers[ins->rs1] << (registers[ins->rs2] & 0x1F);
+    NEXT();
+  op_slt:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] < (int32_t)registers[ins->rs2] ? 1 : 0;
+    NEXT();
+  op_sltu:;
+    registers[ins->rd] = registers[ins->rs1] < registers[ins->rs2] ? 1 : 0;
+    NEXT();
+  op_xor:;
+    registers[ins->rd] = registers[ins->rs1] ^ registers[ins->rs2];
+    NEXT();
+  op_srl:;
+    registers[ins->rd] = registers[ins->rs1] >> (registers[ins->rs2] & 0x1F);
+    NEXT();
+  op_sra:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] >> (registers[ins->rs2] & 0x1F);
+    NEXT();
+  op_or:;
+    registers[ins->rd] = registers[ins->rs1] | registers[ins->rs2];
+    NEXT();
+  op_and:;
+    registers[ins->rd] = registers[ins->rs1] & registers[ins->rs2];
+    NEXT();
+  op_mul:;
+    registers[ins->rd] = (int32_t)registers[ins->rs1] * (int32_t)registers[ins->rs2];
+    NEXT();
+  op_mulh:;
+    registers[ins->rd] = ((int64_t)(int32_t)registers[ins->rs1] * (int64_t)(int32_t)registers[ins->rs2]) >> 32;
+    NEXT();
+  op_mulhsu:;
+    registers[ins->rd] = ((uint64_t)((int64_t)(int32_t)registers[ins->rs1] * (uint64_t)registers[ins->rs2])) >> 32;
+    NEXT();
+  op_mulhu:;
+    registers[ins->rd] = ((uint64_t)registers[ins->rs1] * (uint64_t)registers[ins->rs2]) >> 32;
+    NEXT();
+  }
+  {
+  op_div:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    if (v2 == 0) {
+      registers[ins->rd] = 0xFFFFFFFF;
+    } else if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+      // integer overflow
+      registers[ins->rd] = v1;
+    } else {
+      registers[ins->rd] = (int32_t)v1 / (int32_t)v2;
+    }
+    NEXT();
+  }
+  {
+  op_divu:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    registers[ins->rd] = v2 == 0 ? 0xFFFFFFFF : v1 / v2;
+    NEXT();
+  }
+  {
+  op_rem:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    if (v2 == 0) {
+      registers[ins->rd] = v1;
+    } else if (v1 == INT_MIN_HEX && (int32_t)v2 == -1) {
+      // integer overflow
+      registers[ins->rd] = 0;
+    } else {
+      registers[ins->rd] = (int32_t)v1 % (int32_t)v2;
+    }
+    NEXT();
+  }
+  {
+  op_remu:;
+    const uint32_t v1 = registers[ins->rs1];
+    const uint32_t v2 = registers[ins->rs2];
+    registers[ins->rd] = v2 == 0 ? v1 : v1 % v2;
+    NEXT();
+  }
+
+#define BRANCH(cond)                                                                                                                       \
+  do {                                                                                                                                     \
+    if (cond) {                                                                                                                            \
+      END_BLOCK(1, (uint32_t)ins->imm);                                                                                                    \
+    }                                                                                                                                      \
+    END_BLOCK(0, CUR_PC + 4);                                                                                                              \
+  } while (0)
+
+  {
+  op_beq:;
+    BRANCH(registers[ins->rs1] == registers[ins->rs2]);
+  op_bne:;
+    BRANCH(registers[ins->rs1] != registers[ins->rs2]);
+  op_blt:;
+    BRANCH((int32_t)registers[ins->rs1] < (int32_t)registers[ins->rs2]);
+  op_bge:;
+    BRANCH((int32_t)registers[ins->rs1] >= (int32_t)registers[ins->rs2]);
+  op_bltu:;
+    BRANCH(registers[ins->rs1] < registers[ins->rs2]);
+  op_bgeu:;
+    BRANCH(registers[ins->rs1] >= registers[ins->rs2]);
+  }
+  {
+  op_jal:;
+    registers[ins->rd] = CUR_PC + 4;
+    registers[0] = 0;
+    END_BLOCK(0, (uint32_t)ins->imm);
+  }
+  {
+  op_jalr:;
+    const uint32_t target = (registers[ins->rs1] + ins->imm) & 0xFFFFFFFE;
+    registers[ins->rd] = CUR_PC + 4;
+    registers[0] = 0;
+    // the link only holds the last target, a return to another caller relinks it
+    block_t *const last = blk->succ[1];
+    if (__builtin_expect(last != NULL && last->start_pc == target, 1)) {
+      ENTER_BLOCK(last);
+    }
+    pc = target;
+    link = &blk->succ[1];
+    goto dispatch;
+  }
+  {
+  op_ebreak:;
+#if USE_PRINT
+    fprintf(stderr, "ebreak, exiting\n");
+#endif
+    exit_loop(ERR_EBREAK);
+  }
+  {
+  op_wfi:;
+#if USE_PRINT
+    fprintf(stderr, "wfi instruction, exiting\n");
+#endif
+    exit_loop(ERR_WFI);
+  }
+  {
+  op_ecall:;
+    uint32_t a0 = registers[10]; // argument
+    uint32_t a7 = registers[17]; // function
+    switch (a7) {
+    case SYS_print_mem_access:
+      mem_write_intercept = a0;
+      break;
+    case 93: {
+      // exit
+      uint8_t is_test = a0 & 1;
+      uint32_t exit_code = a0 >> 1;
+      if (is_test && a0) {
+#if USE_PRINT
+        fprintf(stderr, "*** FAILED *** (tohost = %d)\n", exit_code);
+#endif
+      }
+      vm_console_flush(files->console);
+#if USE_PRINT
+      printf("exit code %d\n", exit_code);
+#endif
+      exit_loop(exit_code);
+    } break;
+    case 94: {
+      // exit_group of a Linux program, the status as it is
+      vm_console_flush(files->console);
+#if USE_PRINT
+      printf("exit code %d\n", a0 & 0xFF);
+#endif
+      exit_loop(a0 & 0xFF);
+    } break;
+    default:
+      break;
+    }
+    uint32_t user_handled = 0;
+    if (user_syscall_handler) {
+      uint32_t sres = user_syscall_handler(&user_handled, a7, registers[10], registers[11], registers[12], registers[13], registers[14],
+                                           registers[15], registers[16], wmem);
+      if (user_handled == 1) {
+        registers[10] = sres;
+      } else if (user_handled == 2) {
+        exit_loop(0);
+      }
+    }
+    if (user_handled == 0) {
+      registers[10] = syscall_handler(files, a7, registers[10], registers[11], registers[12], registers[13], registers[14],
+                                      registers[15], registers[16], wmem);
+    }
+    END_BLOCK(0, CUR_PC + 4);
+  }
+  {
+  op_csrrs:;
+    uint32_t val = registers[ins->rd];
+    switch (ins->imm) {
+    case 0xc01: // time
+      val = get_cycles() - start_time;
+      break;
+    case 0xc81: // timeh
+      val = (get_cycles() - start_time) >> 32;
+      break;
+    case 0xF14: // mhartid (Hardware thread ID.)
+    case 0x300: // mstatus (Machine status register.)
+    case 0x305: // mtvec (Machine trap-handler base address.)
+      val = 0;
+      break;
+    case 0xb00: // mcycle (Machine cycle counter.)
+      val = get_cycles();
+      break;
+    case 0xB80: // mcycleh
+      val = get_cycles() >> 32;
+      break;
+    case 0xb02: // minstret (Machine instructions-retired counter.)
+      val = instret;
+      break;
+    case 0xB82: // minstreth
+      val = instret >> 32;
+      break;
+    default:
+      break;
+    }
+    registers[ins->rd] = val;
+    END_BLOCK(0, CUR_PC + 4);
+  }
+
+vm_exit:;
+  {
+    vm_console_flush(files->console);
+    if (blk) {
+      // the block was counted as a whole when it was entered
+      instret -= blk->len - 1 - (uint32_t)(ins - blk->insns);
+      pc = CUR_PC;
+    }
+    memcpy(initial_registers, registers, REG_MEM_SIZE);
+    *pcp_out = pc;
+    while (all_blocks) {
+      block_t *next = all_blocks->next_alloc;
+      free(all_blocks);
+      all_blocks = next;
+    }
+    free(block_map);
+    free(code_mark);
+    const uint64_t mcycle_val = instret;
+    const uint64_t duration = get_cycles() - start_time;
+    const double speed = (double)mcycle_val / ((double)duration / 1e9);
+    printf("system exit mcycle=%" PRIu64 " dur %" PRIu64 " speed is %g ops/sec (%f "
+           "nanosec/inst)\n",
+           mcycle_val, duration, speed, ((double)duration / 1.0) / (double)mcycle_val);
+  }
+  return res;
+}
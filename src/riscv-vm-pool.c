@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-context.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
+
+// Contexts of a pool are clones of its template, their RAM is a private
+// mapping of the snapshot file. A page the guest wrote has become an
+// anonymous copy; MADV_DONTNEED drops it and the mapping reads the snapshot
+// again. The kernel only walks the page tables that are populated, so a
+// reset costs what the run touched rather than the size of the RAM; finding
+// the written pages first through /proc/self/pagemap took 40 times longer
+// than that walk.
+
+struct riscv_vm_pool {
+  pthread_mutex_t lock;
+  riscv_vm_t *template;
+  riscv_vm_pool_stats_t stats;
+  riscv_vm_t *idle[];
+};
+
+static uint64_t pool_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+riscv_vm_pool_t *riscv_vm_pool_create(riscv_vm_t *vm, uint32_t size) {
+  if (vm->snapshot_fd < 0 && riscv_vm_snapshot(vm)) {
+    riscv_vm_destroy(vm);
+    return NULL;
+  }
+  riscv_vm_pool_t *pool = calloc(1, sizeof(riscv_vm_pool_t) + size * sizeof(riscv_vm_t *));
+  if (pool == NULL) {
+    riscv_vm_destroy(vm);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->template = vm;
+  pool->stats.size = size;
+  return pool;
+}
+
+riscv_vm_t *riscv_vm_pool_get(riscv_vm_pool_t *pool) {
+  riscv_vm_t *vm = NULL;
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.gets++;
+  if (pool->stats.idle) {
+    vm = pool->idle[--pool->stats.idle];
+    pool->stats.reuses++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return vm ? vm : riscv_vm_clone(pool->template);
+}
+
+void riscv_vm_pool_put(riscv_vm_pool_t *pool, riscv_vm_t *vm) {
+  const uint64_t start = pool_ns();
+  // first, the queue's poller writes to wmem until it stops
+  vm_files_close(&vm->files);
+  // files the run mapped would come back from MADV_DONTNEED instead of the snapshot's pages
+  vm_linux_unmap_files(&vm->files, vm->wmem);
+  madvise(vm->wmem, vm->mem_size, MADV_DONTNEED);
+  const riscv_vm_t *t = pool->template;
+  memcpy(vm->registers, t->registers, sizeof(vm->registers));
+  vm->pc = t->pc;
+  vm->instret = t->instret;
+  vm->start_time = 0;
+  vm->cpu_ns = 0;
+  vm->files.fd_in = t->files.fd_in;
+  vm_files_reopen_fds(&vm->files, &t->files);
+  vm->files.layout = t->files.layout;
+  const uint64_t reset_ns = pool_ns() - start;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.resets++;
+  pool->stats.reset_ns += reset_ns;
+  if (pool->stats.idle < pool->stats.size) {
+    pool->idle[pool->stats.idle++] = vm;
+    vm = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  riscv_vm_destroy(vm);
+}
+
+void riscv_vm_pool_stats(riscv_vm_pool_t *pool, riscv_vm_pool_stats_t *stats) {
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void riscv_vm_pool_destroy(riscv_vm_pool_t *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < pool->stats.idle; i++) {
+    riscv_vm_destroy(pool->idle[i]);
+  }
+  riscv_vm_destroy(pool->template);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
@@ -15,7 +15,6 @@ static const int REG_MEM_SIZE = 32 * 4;
 // io devices
 static const uint32_t UART_OUT_REGISTER = 0x10000000;
 
-static const size_t alignment = 64;
 static const size_t work_mem_size = VM_MEMORY * 2; // size of memory to allocate
 
 static const int ERR_OUT_OF_MEM = 124;
@@ -25,16 +24,19 @@ static const uint32_t tohost = 0x1000;
 const uint32_t fromhost = 0x1040;
 
 static int riscv_vm_main_loop(uint8_t *wmem, uint32_t program_len);
+// riscv-vm-common.c
+uint8_t *vm_mem_alloc(size_t size);
+void vm_mem_free(uint8_t *mem, size_t size);
+void vm_mark_started(void);
 
 int riscv_vm_run(uint8_t *registers, uint8_t *program, uint32_t program_len,
                  uint8_t *data, uint32_t data_len, uint32_t data_offset) {
-  uint8_t *wmem = aligned_alloc(alignment, work_mem_size);
+  uint8_t *wmem = vm_mem_alloc(work_mem_size);
   if (wmem == NULL) {
     // Handle allocation failure
     perror("Memory allocation failed");
     return ERR_OUT_OF_MEM;
   }
-  memset(wmem, 0, work_mem_size);
   if (registers) {
     memcpy(wmem, registers, REG_MEM_SIZE);
   }
@@ -51,8 +53,9 @@ int riscv_vm_run(uint8_t *registers, uint8_t *program, uint32_t program_len,
     memcpy(prog_start + data_offset, data, data_len);
   }
 
+  vm_mark_started();
   int res = riscv_vm_main_loop(wmem, program_len);
-  free(wmem);
+  vm_mem_free(wmem, work_mem_size);
   return res;
 }
 // 0x10_00_00_00
@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-context.h"
+#include "riscv-vm-io.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
+
+// Guests waiting for a thread are in one FIFO run queue. A worker takes the
+// guest at the front, runs it for a timeslice and puts it back at the end
+// if it is not done, so nobody waits for more than one slice of every other
+// guest.
+//
+// A guest's read, open and file writes do not hold its worker: they go to
+// an io_uring and the worker moves on to the next guest. The completion
+// thread puts the result into a0 and queues the guest again. Without
+// io_uring the calls are made on the worker.
+
+// requests queued for the kernel at a time, and guests with a request in
+// flight (each has at most one); more are made on the worker
+#define SCHED_IO_ENTRIES 256
+#define SCHED_IO_IN_FLIGHT 4096
+
+typedef struct sched_entry {
+  struct sched_entry *next;
+  riscv_vm_t *vm;
+  riscv_vm_done_t done;
+  void *arg;
+} sched_entry_t;
+
+typedef struct {
+  riscv_vm_sched_t *sched;
+  uint32_t id;
+  pthread_t thread;
+} sched_worker_t;
+
+struct riscv_vm_sched {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // the queue got a guest, or stop was set
+  pthread_cond_t idle; // pending dropped to 0
+  sched_entry_t *head, *tail;
+  uint64_t pending; // guests added and not done yet
+  int stop;
+  uint64_t timeslice;
+  vm_io_t *io;
+  pthread_t reactor; // takes the completions from io
+  uint32_t nthreads;
+  sched_worker_t workers[];
+};
+
+static void sched_push(riscv_vm_sched_t *s, sched_entry_t *e) {
+  e->next = NULL;
+  if (s->tail) {
+    s->tail->next = e;
+  } else {
+    s->head = e;
+  }
+  s->tail = e;
+  pthread_cond_signal(&s->work);
+}
+
+// starts the guest's syscall on the ring and returns 1, or makes it here and returns 0 when the ring is full
+// or its buffer is not guest memory or its fd not open, which the synchronous call fails as it always does
+static int sched_syscall(riscv_vm_sched_t *s, sched_entry_t *e) {
+  riscv_vm_t *vm = e->vm;
+  uint32_t *r = vm->registers;
+  const uint32_t nr = r[17];
+  int res = -1;
+  if (nr == SYS_read || nr == SYS_write) {
+    uint8_t *buf = vm_guest_buf(&vm->files, vm->wmem, r[11], r[12]);
+    const int fd = vm_files_host_fd(&vm->files, r[10]);
+    if (buf && fd >= 0) {
+      res = nr == SYS_read ? vm_io_read(s->io, fd, buf, r[12], (uintptr_t)e) : vm_io_write(s->io, fd, buf, r[12], (uintptr_t)e);
+    }
+  } else if (nr == SYS_open) {
+    const char *path = vm_guest_str(&vm->files, vm->wmem, r[10]);
+    if (path) {
+      res = vm_io_open(s->io, path, r[11], r[12], (uintptr_t)e);
+    }
+  }
+  if (res == 0) {
+    return 1;
+  }
+  r[10] = syscall_handler(&vm->files, nr, r[10], r[11], r[12], r[13], r[14], r[15], r[16], vm->wmem);
+  return 0;
+}
+
+static void *sched_reactor(void *arg) {
+  riscv_vm_sched_t *s = (riscv_vm_sched_t *)arg;
+  for (;;) {
+    uint64_t user_data;
+    int32_t res;
+    vm_io_wait(s->io, &user_data, &res);
+    sched_entry_t *e = (sched_entry_t *)(uintptr_t)user_data;
+    if (e == NULL) {
+      return NULL;
+    }
+    // the same as the synchronous calls return: -errno for write, -1 for the legacy read and open
+    uint32_t *r = e->vm->registers;
+    if (r[17] == SYS_open && res >= 0) {
+      res = vm_files_add_fd(&e->vm->files, res);
+    }
+    r[10] = res < 0 && r[17] != SYS_write ? (uint32_t)-1 : (uint32_t)res;
+    pthread_mutex_lock(&s->lock);
+    sched_push(s, e);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+static void *sched_worker(void *arg) {
+  sched_worker_t *w = (sched_worker_t *)arg;
+  riscv_vm_sched_t *s = w->sched;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (s->head == NULL && !s->stop) {
+      pthread_cond_wait(&s->work, &s->lock);
+    }
+    sched_entry_t *e = s->head;
+    if (e == NULL) {
+      break;
+    }
+    s->head = e->next;
+    if (s->head == NULL) {
+      s->tail = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    riscv_vm_set_budget(e->vm, s->timeslice);
+    e->vm->async_syscalls = s->io != NULL;
+    const int res = riscv_vm_execute(e->vm);
+    if (res == VM_EXIT_SYSCALL) {
+      const int started = sched_syscall(s, e);
+      pthread_mutex_lock(&s->lock);
+      if (!started) {
+        sched_push(s, e);
+      }
+      continue;
+    }
+    if (res == RISCV_VM_YIELD || res == RISCV_VM_SNAPSHOT) {
+      pthread_mutex_lock(&s->lock);
+      sched_push(s, e);
+      continue;
+    }
+    riscv_vm_set_budget(e->vm, 0);
+    e->vm->async_syscalls = 0;
+    e->done(e->vm, res, w->id, e->arg);
+    free(e);
+    pthread_mutex_lock(&s->lock);
+    if (--s->pending == 0) {
+      pthread_cond_broadcast(&s->idle);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+riscv_vm_sched_t *riscv_vm_sched_create(uint32_t nthreads, uint64_t timeslice) {
+  if (nthreads == 0) {
+    nthreads = 1;
+  }
+  riscv_vm_sched_t *s = calloc(1, sizeof(riscv_vm_sched_t) + nthreads * sizeof(sched_worker_t));
+  if (s == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->idle, NULL);
+  s->timeslice = timeslice;
+  s->io = vm_io_create(SCHED_IO_ENTRIES, SCHED_IO_IN_FLIGHT);
+  if (s->io && pthread_create(&s->reactor, NULL, sched_reactor, s)) {
+    vm_io_destroy(s->io);
+    s->io = NULL;
+  }
+  for (; s->nthreads < nthreads; s->nthreads++) {
+    sched_worker_t *w = &s->workers[s->nthreads];
+    w->sched = s;
+    w->id = s->nthreads;
+    if (pthread_create(&w->thread, NULL, sched_worker, w)) {
+      break;
+    }
+  }
+  if (s->nthreads == 0) {
+    riscv_vm_sched_destroy(s);
+    return NULL;
+  }
+  return s;
+}
+
+void riscv_vm_sched_add(riscv_vm_sched_t *sched, riscv_vm_t *vm, riscv_vm_done_t done, void *arg) {
+  sched_entry_t *e = malloc(sizeof(sched_entry_t));
+  if (e == NULL) {
+    done(vm, ERR_OUT_OF_MEM, 0, arg);
+    return;
+  }
+  e->vm = vm;
+  e->done = done;
+  e->arg = arg;
+  pthread_mutex_lock(&sched->lock);
+  sched->pending++;
+  sched_push(sched, e);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void riscv_vm_sched_wait(riscv_vm_sched_t *sched) {
+  pthread_mutex_lock(&sched->lock);
+  while (sched->pending) {
+    pthread_cond_wait(&sched->idle, &sched->lock);
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void riscv_vm_sched_destroy(riscv_vm_sched_t *sched) {
+  if (sched == NULL) {
+    return;
+  }
+  riscv_vm_sched_wait(sched);
+  pthread_mutex_lock(&sched->lock);
+  sched->stop = 1;
+  pthread_cond_broadcast(&sched->work);
+  pthread_mutex_unlock(&sched->lock);
+  for (uint32_t i = 0; i < sched->nthreads; i++) {
+    pthread_join(sched->workers[i].thread, NULL);
+  }
+  if (sched->io) {
+    // nothing is in flight once every guest is done, the empty completion stops the reactor
+    while (vm_io_nop(sched->io, 0)) {
+    }
+    pthread_join(sched->reactor, NULL);
+    vm_io_destroy(sched->io);
+  }
+  pthread_cond_destroy(&sched->idle);
+  pthread_cond_destroy(&sched->work);
+  pthread_mutex_destroy(&sched->lock);
+  free(sched);
+}
@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-context.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
+
+// Every hart is a context of its own with the boot context's wmem, so the
+// engine runs it like any other; only the machine they point to is shared.
+// A hart runs in timeslices and looks at the stop flag between them, which
+// keeps the check off the engine's loops. wfi returns to here and the hart
+// sleeps on the machine's condition variable until a store to its msip.
+
+// instructions a hart runs before it checks whether another hart exited
+#define SMP_SLICE 65536
+
+static void smp_stop(vm_machine_t *m, int exit_code) {
+  pthread_mutex_lock(&m->lock);
+  if (!m->stop) {
+    m->exit_code = exit_code;
+    __atomic_store_n(&m->stop, 1, __ATOMIC_RELEASE);
+  }
+  pthread_cond_broadcast(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+}
+
+static void smp_hart_run(riscv_vm_t *vm) {
+  vm_machine_t *m = vm->machine;
+  riscv_vm_set_budget(vm, SMP_SLICE);
+  while (!__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE)) {
+    const int res = riscv_vm_execute(vm);
+    if (res == VM_EXIT_WFI) {
+      pthread_mutex_lock(&m->lock);
+      while (!__atomic_load_n(&m->msip[vm->hartid], __ATOMIC_ACQUIRE) && !m->stop) {
+        pthread_cond_wait(&m->wake, &m->lock);
+      }
+      pthread_mutex_unlock(&m->lock);
+    } else if (res != RISCV_VM_YIELD && res != RISCV_VM_SNAPSHOT) {
+      smp_stop(m, res);
+    }
+  }
+  riscv_vm_set_budget(vm, 0);
+}
+
+static void *smp_hart_thread(void *arg) {
+  smp_hart_run((riscv_vm_t *)arg);
+  return NULL;
+}
+
+uint32_t vm_clint_load(riscv_vm_t *vm, uint32_t addr) {
+  const uint32_t offset = addr - CLINT_BASE;
+  const vm_machine_t *m = vm->machine;
+  if (m == NULL || offset / 4 >= m->nharts) {
+    return 0;
+  }
+  return __atomic_load_n(&m->msip[offset / 4], __ATOMIC_ACQUIRE);
+}
+
+void vm_clint_store(riscv_vm_t *vm, uint32_t addr, uint32_t value) {
+  const uint32_t offset = addr - CLINT_BASE;
+  vm_machine_t *m = vm->machine;
+  if (m == NULL || offset / 4 >= m->nharts) {
+    return;
+  }
+  __atomic_store_n(&m->msip[offset / 4], value & 1, __ATOMIC_RELEASE);
+  if (value & 1) {
+    pthread_mutex_lock(&m->lock);
+    pthread_cond_broadcast(&m->wake);
+    pthread_mutex_unlock(&m->lock);
+  }
+}
+
+int riscv_vm_execute_smp(riscv_vm_t *vm, uint32_t nharts) {
+  if (nharts <= 1) {
+    return riscv_vm_execute(vm);
+  }
+  if (nharts > RISCV_VM_MAX_HARTS) {
+    return ERR_OUT_OF_MEM;
+  }
+  vm_machine_t m;
+  memset(&m, 0, sizeof(m));
+  pthread_mutex_init(&m.lock, NULL);
+  pthread_cond_init(&m.wake, NULL);
+  m.nharts = nharts;
+  m.blk = vm_files_blk(&vm->files);
+
+  riscv_vm_t *harts[RISCV_VM_MAX_HARTS];
+  pthread_t threads[RISCV_VM_MAX_HARTS];
+  uint32_t started = 1;
+  vm->machine = &m;
+  // one brk and one set of mmap'd pages for the memory they share
+  vm->files.shared_layout = &vm->files.layout;
+  vm->files.layout_lock = &m.lock;
+  for (; started < nharts; started++) {
+    riscv_vm_t *h = malloc(sizeof(riscv_vm_t));
+    if (h == NULL) {
+      smp_stop(&m, ERR_OUT_OF_MEM);
+      break;
+    }
+    *h = *vm;
+    memset(h->files.fopened, 0, sizeof(h->files.fopened));
+    vm_files_dup_fds(&h->files, &vm->files); // the fds open when it starts, closed with its files
+    h->files.console = NULL; // a console of its own, one thread appends to a console
+    h->files.ioqueue = NULL;
+    h->files.ioqueue_console = NULL;
+    h->files.blk = NULL; // the machine's, see vm_context_blk
+    h->snapshot_fd = -1;
+    h->start_time = 0;
+    h->cpu_ns = 0;
+    h->hartid = started;
+    harts[started] = h;
+    if (pthread_create(&threads[started], NULL, smp_hart_thread, h)) {
+      free(h);
+      smp_stop(&m, ERR_OUT_OF_MEM);
+      break;
+    }
+  }
+  smp_hart_run(vm);
+  for (uint32_t i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    vm_files_close(&harts[i]->files);
+    free(harts[i]);
+  }
+  vm->machine = NULL;
+  vm->files.shared_layout = NULL;
+  vm->files.layout_lock = NULL;
+  pthread_cond_destroy(&m.wake);
+  pthread_mutex_destroy(&m.lock);
+  return m.exit_code;
+}
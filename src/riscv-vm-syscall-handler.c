@@ -1,12 +1,21 @@
 
 
 #include "riscv-vm-optimized-1.h"
+#include "riscv-vm-common.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
 
 #define SYS_write 64
 #define SYS_exit 93
@@ -20,28 +29,910 @@
 #define SYS_read 107
 #define SYS_close 108
 #define SYS_lseek 109
+#define SYS_ioqueue_setup 110
+#define SYS_ioqueue_enter 111
+
+// the RV32 Linux numbers, NR_ as the custom calls above have the SYS_ names
+#define NR_ioctl 29
+#define NR_openat 56
+#define NR_close 57
+#define NR_llseek 62
+#define NR_read 63
+#define NR_readv 65
+#define NR_writev 66
+#define NR_fstat 80
+#define NR_set_tid_address 96
+#define NR_clock_gettime 113
+#define NR_rt_sigaction 134
+#define NR_rt_sigprocmask 135
+#define NR_gettimeofday 169
+#define NR_getpid 172
+#define NR_gettid 178
+#define NR_brk 214
+#define NR_munmap 215
+#define NR_mmap2 222
+#define NR_mprotect 226
+#define NR_madvise 233
+#define NR_statx 291
+#define NR_clock_gettime64 403
+
+// guest open and mmap flags, asm-generic values
+#define LINUX_O_CREAT 0100
+#define LINUX_O_EXCL 0200
+#define LINUX_O_NOCTTY 0400
+#define LINUX_O_TRUNC 01000
+#define LINUX_O_APPEND 02000
+#define LINUX_O_NONBLOCK 04000
+#define LINUX_O_DIRECTORY 0200000
+#define LINUX_O_NOFOLLOW 0400000
+#define LINUX_O_CLOEXEC 02000000
+#define LINUX_AT_FDCWD -100
+#define LINUX_AT_SYMLINK_NOFOLLOW 0x100
+#define LINUX_AT_EMPTY_PATH 0x1000
+#define LINUX_MAP_FIXED 0x10
+#define LINUX_MAP_ANONYMOUS 0x20
+
+#define LINUX_IOV_MAX 1024
+
+// auxiliary vector keys
+#define AT_NULL 0
+#define AT_PHDR 3
+#define AT_PHENT 4
+#define AT_PHNUM 5
+#define AT_PAGESZ 6
+#define AT_ENTRY 9
+#define AT_RANDOM 25
+
+void vm_files_close(vm_files_t *files) {
+  // what is still queued may write to the files and the console
+  vm_ioqueue_destroy(files->ioqueue);
+  files->ioqueue = NULL;
+  vm_console_destroy(files->ioqueue_console);
+  files->ioqueue_console = NULL;
+  for (int i = 0; i < VM_MAX_FILES; i++) {
+    if (files->fopened[i]) {
+      fclose(files->fopened[i]);
+      files->fopened[i] = NULL;
+    }
+  }
+  for (int i = 3; i < VM_MAX_FDS; i++) {
+    if (files->fds[i]) {
+      close(files->fds[i] - 1);
+      files->fds[i] = 0;
+    }
+  }
+  vm_console_destroy(files->console);
+  files->console = NULL;
+  vm_blk_destroy(files->blk);
+  files->blk = NULL;
+}
+
+vm_console_t *vm_files_console(vm_files_t *files) {
+  if (files->console == NULL) {
+    files->console = vm_console_create(STDOUT_FILENO, NULL);
+  }
+  return files->console;
+}
+
+int vm_files_add_fd(vm_files_t *files, int host_fd) {
+  for (int i = 3; i < VM_MAX_FDS; i++) {
+    if (files->fds[i] == 0) {
+      files->fds[i] = host_fd + 1;
+      return i;
+    }
+  }
+  close(host_fd);
+  return -1;
+}
 
-#define MAX_FILES 128
+int vm_files_host_fd(const vm_files_t *files, uint32_t fd) {
+  if (fd < 3) {
+    return fd == 0 ? files->fd_in : (int)fd;
+  }
+  return fd < VM_MAX_FDS ? files->fds[fd] - 1 : -1;
+}
 
-static FILE *fopened[MAX_FILES];
-static int opened[MAX_FILES];
+void vm_files_dup_fds(vm_files_t *to, const vm_files_t *from) {
+  for (int i = 3; i < VM_MAX_FDS; i++) {
+    to->fds[i] = from->fds[i] ? dup(from->fds[i] - 1) + 1 : 0;
+  }
+}
 
-// Static initialization function
-void init_function(void) __attribute__((constructor));
-void init_function(void) {
-  memset(fopened, 0, sizeof(fopened));
-  memset(opened, 0, sizeof(opened));
+// a new open file description of host fd fd at its offset, a dup when the file cannot be opened again
+static int reopen_fd(int fd) {
+  int copy = -1;
+#if defined(__linux__)
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0) {
+    copy = open(path, flags | O_CLOEXEC);
+  }
+  if (copy >= 0) {
+    const off_t at = lseek(fd, 0, SEEK_CUR);
+    if (at >= 0) {
+      lseek(copy, at, SEEK_SET);
+    }
+  }
+#endif
+  return copy >= 0 ? copy : dup(fd);
+}
+
+void vm_files_reopen_fds(vm_files_t *to, const vm_files_t *from) {
+  for (int i = 3; i < VM_MAX_FDS; i++) {
+    to->fds[i] = from->fds[i] ? reopen_fd(from->fds[i] - 1) + 1 : 0;
+  }
+}
+
+// closes guest fd fd if the guest opened it, the host's stdio stays open under the guest's 0 to 2
+static int close_fd(vm_files_t *files, uint32_t fd) {
+  if (fd < 3) {
+    return 0;
+  }
+  const int host_fd = vm_files_host_fd(files, fd);
+  if (host_fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+  files->fds[fd] = 0;
+  return close(host_fd);
+}
+
+vm_blk_t *vm_files_blk(vm_files_t *files) {
+  if (files->blk == NULL) {
+    files->blk = vm_blk_create_default();
+  }
+  return files->blk;
 }
 
 struct guest_stat {
   uint32_t st_size; /* [XSI] file size, in bytes */
 };
 
-uint32_t syscall_handler(uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
-                         uint32_t arg3, uint32_t arg4 __attribute__((unused)),
-                         uint32_t arg5 __attribute__((unused)),
-                         uint32_t arg6 __attribute__((unused)),
-                         uint32_t arg7 __attribute__((unused)), void *wmem) {
+// struct kernel_stat of newlib for fstat, 64 bit times as time_t is
+struct guest_kernel_stat {
+  uint64_t st_dev;
+  uint64_t st_ino;
+  uint32_t st_mode;
+  uint32_t st_nlink;
+  uint32_t st_uid;
+  uint32_t st_gid;
+  uint64_t st_rdev;
+  uint64_t pad1;
+  int64_t st_size;
+  int32_t st_blksize;
+  int32_t pad2;
+  int64_t st_blocks;
+  int64_t st_atim[2]; // tv_sec, tv_nsec in the low half
+  int64_t st_mtim[2];
+  int64_t st_ctim[2];
+  int32_t reserved[2];
+};
+_Static_assert(sizeof(struct guest_kernel_stat) == 128, "guest struct kernel_stat layout");
+
+struct guest_statx_timestamp {
+  int64_t tv_sec;
+  uint32_t tv_nsec;
+  int32_t reserved;
+};
+
+struct guest_statx {
+  uint32_t stx_mask;
+  uint32_t stx_blksize;
+  uint64_t stx_attributes;
+  uint32_t stx_nlink;
+  uint32_t stx_uid;
+  uint32_t stx_gid;
+  uint16_t stx_mode;
+  uint16_t spare0;
+  uint64_t stx_ino;
+  uint64_t stx_size;
+  uint64_t stx_blocks;
+  uint64_t stx_attributes_mask;
+  struct guest_statx_timestamp stx_atime, stx_btime, stx_ctime, stx_mtime;
+  uint32_t stx_rdev_major;
+  uint32_t stx_rdev_minor;
+  uint32_t stx_dev_major;
+  uint32_t stx_dev_minor;
+  uint64_t spare2[14];
+};
+_Static_assert(sizeof(struct guest_statx) == 256, "guest struct statx layout");
+
+// time64 timespec and timeval, the second field is a long padded to 8 bytes
+struct guest_timespec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+};
+
+struct guest_iovec {
+  uint32_t base;
+  uint32_t len;
+};
+
+#if defined(__APPLE__)
+#define ST_NSEC(st, t) ((st)->st_##t##timespec.tv_nsec)
+#else
+#define ST_NSEC(st, t) ((st)->st_##t##tim.tv_nsec)
+#endif
+
+// -e as the guest sees it, Linux hosts have the same errno values
+static uint32_t linux_err(int e) {
+#if !defined(__linux__)
+  switch (e) {
+  case EAGAIN:
+    e = 11;
+    break;
+  case ENOTTY:
+    e = 25;
+    break;
+  case ENAMETOOLONG:
+    e = 36;
+    break;
+  case ENOSYS:
+    e = 38;
+    break;
+  case ENOTEMPTY:
+    e = 39;
+    break;
+  case ELOOP:
+    e = 40;
+    break;
+  case EOVERFLOW:
+    e = 75;
+    break;
+  default:
+    // 1 to 34 are the same on the BSDs
+    e = e <= 34 ? e : 5;
+    break;
+  }
+#endif
+  return (uint32_t)-e;
+}
+
+// len bytes at guest address addr in mem_size bytes of wmem, NULL when they are not all in it
+static uint8_t *guest_buf(void *wmem, uint32_t mem_size, uint32_t addr, uint32_t len) {
+  addr &= 0x7FFFFFFF;
+  if (addr > mem_size || len > mem_size - addr) {
+    return NULL;
+  }
+  return (uint8_t *)wmem + addr;
+}
+
+uint8_t *vm_guest_buf(const vm_files_t *files, void *wmem, uint32_t addr, uint32_t len) {
+  return guest_buf(wmem, files->layout.mem_size, addr, len);
+}
+
+const char *vm_guest_str(const vm_files_t *files, void *wmem, uint32_t addr) {
+  addr &= 0x7FFFFFFF;
+  const uint32_t mem_size = files->layout.mem_size;
+  if (addr >= mem_size || memchr((uint8_t *)wmem + addr, 0, mem_size - addr) == NULL) {
+    return NULL;
+  }
+  return (const char *)wmem + addr;
+}
+
+uint32_t vm_tohost_syscall(vm_console_t *console, uint8_t *wmem, uint32_t mem_size, uint32_t magic) {
+  // uint64_t magic_mem[8] of riscv-tests: the syscall number, then its arguments a0, a1, a2
+  const uint8_t *m = guest_buf(wmem, mem_size, magic, 8 * sizeof(uint64_t));
+  if (m == NULL) {
+    return SYS_write;
+  }
+  const uint32_t nr = *(const uint32_t *)m;
+  if (nr == SYS_write) {
+    const uint32_t str_ptr = *(const uint32_t *)(m + 16);
+    const uint32_t str_len = *(const uint32_t *)(m + 24);
+    const uint8_t *str = guest_buf(wmem, mem_size, str_ptr, str_len);
+    if (str) {
+      vm_console_write(console, str, str_len);
+    }
+  }
+  return nr;
+}
+
+// a dirfd the guest has not opened is -1, which fails relative paths with EBADF as Linux does
+static int host_dirfd(const vm_files_t *files, uint32_t dirfd) {
+  return (int32_t)dirfd == LINUX_AT_FDCWD ? AT_FDCWD : vm_files_host_fd(files, dirfd);
+}
+
+static int host_open_flags(uint32_t flags) {
+  static const struct {
+    uint32_t guest;
+    int host;
+  } map[] = {
+      {LINUX_O_CREAT, O_CREAT},         {LINUX_O_EXCL, O_EXCL},           {LINUX_O_NOCTTY, O_NOCTTY},
+      {LINUX_O_TRUNC, O_TRUNC},         {LINUX_O_APPEND, O_APPEND},       {LINUX_O_NONBLOCK, O_NONBLOCK},
+      {LINUX_O_DIRECTORY, O_DIRECTORY}, {LINUX_O_NOFOLLOW, O_NOFOLLOW},   {LINUX_O_CLOEXEC, O_CLOEXEC},
+  };
+  int host = flags & O_ACCMODE;
+  for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+    if (flags & map[i].guest) {
+      host |= map[i].host;
+    }
+  }
+  return host;
+}
+
+static void put_kernel_stat(struct guest_kernel_stat *gs, const struct stat *st) {
+  memset(gs, 0, sizeof(*gs));
+  gs->st_dev = st->st_dev;
+  gs->st_ino = st->st_ino;
+  gs->st_mode = st->st_mode;
+  gs->st_nlink = st->st_nlink;
+  gs->st_uid = st->st_uid;
+  gs->st_gid = st->st_gid;
+  gs->st_rdev = st->st_rdev;
+  gs->st_size = st->st_size;
+  gs->st_blksize = st->st_blksize;
+  gs->st_blocks = st->st_blocks;
+  gs->st_atim[0] = st->st_atime;
+  gs->st_atim[1] = ST_NSEC(st, a);
+  gs->st_mtim[0] = st->st_mtime;
+  gs->st_mtim[1] = ST_NSEC(st, m);
+  gs->st_ctim[0] = st->st_ctime;
+  gs->st_ctim[1] = ST_NSEC(st, c);
+}
+
+static void put_statx(struct guest_statx *gx, const struct stat *st) {
+  memset(gx, 0, sizeof(*gx));
+  gx->stx_mask = 0x7FF; // STATX_BASIC_STATS
+  gx->stx_blksize = st->st_blksize;
+  gx->stx_nlink = st->st_nlink;
+  gx->stx_uid = st->st_uid;
+  gx->stx_gid = st->st_gid;
+  gx->stx_mode = st->st_mode;
+  gx->stx_ino = st->st_ino;
+  gx->stx_size = st->st_size;
+  gx->stx_blocks = st->st_blocks;
+  gx->stx_atime.tv_sec = st->st_atime;
+  gx->stx_atime.tv_nsec = ST_NSEC(st, a);
+  gx->stx_ctime.tv_sec = st->st_ctime;
+  gx->stx_ctime.tv_nsec = ST_NSEC(st, c);
+  gx->stx_mtime.tv_sec = st->st_mtime;
+  gx->stx_mtime.tv_nsec = ST_NSEC(st, m);
+  gx->stx_rdev_major = major(st->st_rdev);
+  gx->stx_rdev_minor = minor(st->st_rdev);
+  gx->stx_dev_major = major(st->st_dev);
+  gx->stx_dev_minor = minor(st->st_dev);
+}
+
+static uint32_t page_up(uint32_t addr) {
+  return (addr + VM_LINUX_PAGE - 1) & ~(uint32_t)(VM_LINUX_PAGE - 1);
+}
+
+uint32_t vm_linux_init(vm_files_t *files, uint8_t *wmem, uint32_t mem_size, const vm_image_t *image) {
+  vm_linux_layout_t *l = &files->layout;
+  memset(l, 0, sizeof(*l));
+  uint32_t end = 0;
+  for (uint32_t i = 0; i < image->nsegments; i++) {
+    const vm_segment_t *seg = &image->segments[i];
+    const uint32_t seg_end = (seg->vaddr & 0x7FFFFFFF) + seg->memsz;
+    end = seg_end > end ? seg_end : end;
+  }
+  if (mem_size < 2 * VM_LINUX_STACK_SIZE || page_up(end) > mem_size - VM_LINUX_STACK_SIZE) {
+    return 0;
+  }
+  l->mem_size = mem_size;
+  l->brk_start = l->brk = page_up(end);
+  l->map_end = l->map_low = mem_size - VM_LINUX_STACK_SIZE;
+
+  // argv[0] and the AT_RANDOM bytes on top, fixed so that runs repeat
+  static const char name[16] = "riscv-vm";
+  static const uint8_t random[16] = {0x3b, 0x9a, 0xca, 0x07, 0x5f, 0x21, 0xe8, 0x90,
+                                     0x44, 0xd1, 0x6c, 0x2e, 0xb7, 0x13, 0x8f, 0x65};
+  const uint32_t name_at = mem_size - 16;
+  const uint32_t random_at = mem_size - 32;
+  memcpy(wmem + name_at, name, 16);
+  memcpy(wmem + random_at, random, 16);
+  // argc, argv, the empty envp and the auxiliary vector
+  uint32_t words[32];
+  uint32_t n = 0;
+  words[n++] = 1;
+  words[n++] = name_at;
+  words[n++] = 0;
+  words[n++] = 0;
+  if (image->phdr) {
+    words[n++] = AT_PHDR;
+    words[n++] = image->phdr;
+    words[n++] = AT_PHENT;
+    words[n++] = 32; // sizeof(Elf32_Phdr)
+    words[n++] = AT_PHNUM;
+    words[n++] = image->phnum;
+  }
+  words[n++] = AT_PAGESZ;
+  words[n++] = VM_LINUX_PAGE;
+  words[n++] = AT_ENTRY;
+  words[n++] = image->entry;
+  words[n++] = AT_RANDOM;
+  words[n++] = random_at;
+  words[n++] = AT_NULL;
+  words[n++] = 0;
+  const uint32_t sp = (random_at - n * 4) & ~15u;
+  memcpy(wmem + sp, words, n * 4);
+  return sp;
+}
+
+static int page_bit(const uint8_t *bits, uint32_t i) {
+  return (bits[i >> 3] >> (i & 7)) & 1;
+}
+
+static void page_set(uint8_t *bits, uint32_t i, int on) {
+  bits[i >> 3] = (uint8_t)((bits[i >> 3] & ~(1u << (i & 7))) | (uint32_t)on << (i & 7));
+}
+
+// index of the page at addr, counted down from map_end
+static uint32_t page_index(const vm_linux_layout_t *l, uint32_t addr) {
+  return (l->map_end - addr) / VM_LINUX_PAGE - 1;
+}
+
+static uint32_t page_addr(const vm_linux_layout_t *l, uint32_t i) {
+  return l->map_end - (i + 1) * VM_LINUX_PAGE;
+}
+
+// pages mmap may use now, down to the heap
+static uint32_t map_pages(const vm_linux_layout_t *l) {
+  const uint32_t pages = (l->map_end - page_up(l->brk)) / VM_LINUX_PAGE;
+  return pages < VM_LINUX_MAP_PAGES ? pages : VM_LINUX_MAP_PAGES;
+}
+
+static void update_map_low(vm_linux_layout_t *l) {
+  uint32_t i = VM_LINUX_MAP_PAGES;
+  while (i > 0 && !page_bit(l->mapped, i - 1)) {
+    i--;
+  }
+  l->map_low = l->map_end - i * VM_LINUX_PAGE;
+}
+
+// maps page i of wmem back the way it was before a file was mapped there: from mem_fd (host fd + 1) at the same
+// offset, or anonymous memory when it is 0. Returns whether the page may hold something other than zeros.
+static int restore_page(vm_linux_layout_t *l, int mem_fd, uint8_t *wmem, uint32_t i) {
+  const uint32_t addr = page_addr(l, i);
+  page_set(l->from_file, i, 0);
+  if (mem_fd) {
+    mmap(wmem + addr, VM_LINUX_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, mem_fd - 1, addr);
+    return 1;
+  }
+  mmap(wmem + addr, VM_LINUX_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  return 0;
+}
+
+// gives back the mapped ones of pages [first, last] zeroed, the ones from a file are mapped as they were before it
+static void release_pages(vm_linux_layout_t *l, int mem_fd, uint8_t *wmem, uint32_t first, uint32_t last) {
+  for (uint32_t i = first; i <= last; i++) {
+    if (page_bit(l->from_file, i) ? restore_page(l, mem_fd, wmem, i) : page_bit(l->mapped, i)) {
+      memset(wmem + page_addr(l, i), 0, VM_LINUX_PAGE);
+    }
+    page_set(l->mapped, i, 0);
+  }
+}
+
+void vm_linux_unmap_files(vm_files_t *files, uint8_t *wmem) {
+  vm_linux_layout_t *l = &files->layout;
+  for (uint32_t i = 0; i < VM_LINUX_MAP_PAGES; i++) {
+    if (page_bit(l->from_file, i)) {
+      restore_page(l, files->mem_fd, wmem, i);
+    }
+  }
+}
+
+// len bytes of fd from off into the zeroed guest pages at start: the whole pages of the file are mapped from
+// it copy-on-write, the partial one at its end is read in and the pages past it stay zero
+static uint32_t map_file(vm_linux_layout_t *l, uint8_t *wmem, uint32_t start, uint32_t len, int fd, off_t off) {
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return linux_err(errno);
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return linux_err(ENODEV);
+  }
+  const uint32_t bytes = st.st_size <= off ? 0 : (uint64_t)(st.st_size - off) < len ? (uint32_t)(st.st_size - off) : len;
+  uint32_t mapped = bytes & ~(uint32_t)(VM_LINUX_PAGE - 1);
+  if (mapped == 0 || sysconf(_SC_PAGESIZE) != VM_LINUX_PAGE ||
+      mmap(wmem + start, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off) == MAP_FAILED) {
+    mapped = 0;
+  }
+  for (uint32_t a = start; a < start + mapped; a += VM_LINUX_PAGE) {
+    page_set(l->from_file, page_index(l, a), 1);
+  }
+  for (uint32_t done = mapped; done < bytes;) {
+    const ssize_t n = pread(fd, wmem + start + done, bytes - done, off + done);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return linux_err(n < 0 ? errno : EIO);
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static uint32_t linux_mmap(vm_files_t *files, vm_linux_layout_t *l, uint8_t *wmem, uint32_t addr, uint32_t len, uint32_t flags,
+                           uint32_t fd, uint32_t pgoff) {
+  if (len == 0 || len > l->map_end) {
+    return linux_err(len ? ENOMEM : EINVAL);
+  }
+  const int host_fd = (flags & LINUX_MAP_ANONYMOUS) ? -1 : vm_files_host_fd(files, fd);
+  if (!(flags & LINUX_MAP_ANONYMOUS) && host_fd < 0) {
+    return linux_err(EBADF);
+  }
+  const uint32_t npages = page_up(len) / VM_LINUX_PAGE;
+  const uint32_t avail = map_pages(l);
+  uint32_t bottom; // index of the lowest page of the mapping
+  if (flags & LINUX_MAP_FIXED) {
+    addr &= 0x7FFFFFFF;
+    if (addr & (VM_LINUX_PAGE - 1)) {
+      return linux_err(EINVAL);
+    }
+    if (addr >= l->map_end || addr < l->map_end - avail * VM_LINUX_PAGE || npages > page_index(l, addr) + 1) {
+      return linux_err(ENOMEM);
+    }
+    bottom = page_index(l, addr);
+    release_pages(l, files->mem_fd, wmem, bottom + 1 - npages, bottom);
+  } else {
+    // first fit from the top
+    uint32_t run = 0;
+    for (bottom = 0; bottom < avail && run < npages; bottom++) {
+      run = page_bit(l->mapped, bottom) ? 0 : run + 1;
+    }
+    if (run < npages) {
+      return linux_err(ENOMEM);
+    }
+    bottom--;
+  }
+  for (uint32_t i = bottom + 1 - npages; i <= bottom; i++) {
+    page_set(l->mapped, i, 1);
+  }
+  const uint32_t start = page_addr(l, bottom);
+  l->map_low = start < l->map_low ? start : l->map_low;
+  if (!(flags & LINUX_MAP_ANONYMOUS)) {
+    // MAP_SHARED ones are private copies as well, the guest's writes never reach the file
+    const uint32_t res = map_file(l, wmem, start, len, host_fd, (off_t)pgoff * VM_LINUX_PAGE);
+    if (res) {
+      release_pages(l, files->mem_fd, wmem, bottom + 1 - npages, bottom);
+      update_map_low(l);
+      return res;
+    }
+  }
+  return start;
+}
+
+static uint32_t linux_munmap(vm_linux_layout_t *l, int mem_fd, uint8_t *wmem, uint32_t addr, uint32_t len) {
+  addr &= 0x7FFFFFFF;
+  if ((addr & (VM_LINUX_PAGE - 1)) || len == 0) {
+    return linux_err(EINVAL);
+  }
+  const uint32_t from = addr > l->map_low ? addr : l->map_low;
+  if (from >= l->map_end) {
+    return 0;
+  }
+  const uint32_t end = len > l->map_end - from ? l->map_end : addr + page_up(len);
+  if (from < end) {
+    release_pages(l, mem_fd, wmem, page_index(l, end - VM_LINUX_PAGE), page_index(l, from));
+    update_map_low(l);
+  }
+  return 0;
+}
+
+static uint32_t linux_brk(vm_linux_layout_t *l, uint8_t *wmem, uint32_t addr) {
+  addr &= 0x7FFFFFFF;
+  // Linux leaves brk as it is when it can not move it, and says where it is
+  if (addr >= l->brk_start && addr <= l->map_low) {
+    if (addr < l->brk) {
+      memset(wmem + addr, 0, l->brk - addr);
+    }
+    l->brk = addr;
+  }
+  return l->brk;
+}
+
+// the console fd 1 goes to, NULL for the one of files (see files_syscall)
+static vm_console_t *out_console(vm_files_t *files, vm_console_t *console) { return console ? console : vm_files_console(files); }
+
+// readv and writev with the host iovecs of the guest's, -errno when one is outside of memory
+static uint32_t linux_rw_vec(vm_files_t *files, vm_console_t *console, void *wmem, int write_, uint32_t fd, uint32_t iov_at,
+                             uint32_t iovcnt) {
+  const struct guest_iovec *giov = (const struct guest_iovec *)vm_guest_buf(files, wmem, iov_at, iovcnt * sizeof(struct guest_iovec));
+  if (iovcnt > LINUX_IOV_MAX) {
+    return linux_err(EINVAL);
+  }
+  if (giov == NULL) {
+    return linux_err(EFAULT);
+  }
+  struct iovec iov[LINUX_IOV_MAX];
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < iovcnt; i++) {
+    iov[i].iov_base = vm_guest_buf(files, wmem, giov[i].base, giov[i].len);
+    iov[i].iov_len = giov[i].len;
+    if (iov[i].iov_base == NULL) {
+      return linux_err(EFAULT);
+    }
+    total += giov[i].len;
+  }
+  if (write_ && fd == 1) {
+    for (uint32_t i = 0; i < iovcnt; i++) {
+      vm_console_write(out_console(files, console), iov[i].iov_base, iov[i].iov_len);
+    }
+    return total;
+  }
+  if (!write_ && fd == 0) {
+    vm_console_flush(console ? console : files->console);
+  }
+  const ssize_t res = write_ ? writev(vm_files_host_fd(files, fd), iov, iovcnt) : readv(vm_files_host_fd(files, fd), iov, iovcnt);
+  return res < 0 ? linux_err(errno) : (uint32_t)res;
+}
+
+static uint32_t linux_clock_gettime(vm_files_t *files, void *wmem, uint32_t clock, uint32_t ts_at) {
+  struct guest_timespec *gts = (struct guest_timespec *)vm_guest_buf(files, wmem, ts_at, sizeof(struct guest_timespec));
+  clockid_t id;
+  switch (clock) {
+  case 0: // REALTIME
+  case 5: // REALTIME_COARSE
+    id = CLOCK_REALTIME;
+    break;
+  case 1: // MONOTONIC
+  case 4: // MONOTONIC_RAW
+  case 6: // MONOTONIC_COARSE
+  case 7: // BOOTTIME
+    id = CLOCK_MONOTONIC;
+    break;
+  case 2:
+    id = CLOCK_PROCESS_CPUTIME_ID;
+    break;
+  case 3:
+    id = CLOCK_THREAD_CPUTIME_ID;
+    break;
+  default:
+    return linux_err(EINVAL);
+  }
+  if (gts == NULL) {
+    return linux_err(EFAULT);
+  }
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  gts->tv_sec = ts.tv_sec;
+  gts->tv_nsec = ts.tv_nsec;
+  return 0;
+}
+
+// the Linux calls, syscall_handler takes the custom ones first
+static uint32_t linux_syscall(vm_files_t *files, vm_console_t *console, uint32_t nr, uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                              uint32_t arg4, uint32_t arg5, uint32_t arg6, void *wmem) {
+  switch (nr) {
+  case NR_openat: {
+    const char *path = vm_guest_str(files, wmem, arg2);
+    if (path == NULL) {
+      return linux_err(EFAULT);
+    }
+    const int fd = openat(host_dirfd(files, arg1), path, host_open_flags(arg3), (mode_t)arg4);
+    if (fd < 0) {
+      return linux_err(errno);
+    }
+    const int gfd = vm_files_add_fd(files, fd);
+    return gfd < 0 ? linux_err(EMFILE) : (uint32_t)gfd;
+  }
+  case NR_close:
+    return close_fd(files, arg1) ? linux_err(errno) : 0;
+  case NR_llseek: {
+    uint8_t *result = vm_guest_buf(files, wmem, arg4, 8);
+    if (result == NULL) {
+      return linux_err(EFAULT);
+    }
+    const off_t off = lseek(vm_files_host_fd(files, arg1), (off_t)(int64_t)((uint64_t)arg2 << 32 | arg3), (int)arg5);
+    if (off < 0) {
+      return linux_err(errno);
+    }
+    *(int64_t *)result = off;
+    return 0;
+  }
+  case NR_read: {
+    uint8_t *buf = vm_guest_buf(files, wmem, arg2, arg3);
+    if (buf == NULL) {
+      return linux_err(EFAULT);
+    }
+    if (arg1 == 0) {
+      // a prompt goes out before the read waits for the answer
+      vm_console_flush(console ? console : files->console);
+    }
+    const ssize_t res = read(vm_files_host_fd(files, arg1), buf, arg3);
+    return res < 0 ? linux_err(errno) : (uint32_t)res;
+  }
+  case NR_readv:
+  case NR_writev:
+    return linux_rw_vec(files, console, wmem, nr == NR_writev, arg1, arg2, arg3);
+  case NR_fstat: {
+    struct guest_kernel_stat *gs = (struct guest_kernel_stat *)vm_guest_buf(files, wmem, arg2, sizeof(struct guest_kernel_stat));
+    struct stat st;
+    if (gs == NULL) {
+      return linux_err(EFAULT);
+    }
+    if (fstat(vm_files_host_fd(files, arg1), &st)) {
+      return linux_err(errno);
+    }
+    put_kernel_stat(gs, &st);
+    return 0;
+  }
+  case NR_statx: {
+    const char *path = vm_guest_str(files, wmem, arg2);
+    struct guest_statx *gx = (struct guest_statx *)vm_guest_buf(files, wmem, arg5, sizeof(struct guest_statx));
+    struct stat st;
+    if (path == NULL || gx == NULL) {
+      return linux_err(EFAULT);
+    }
+    int res;
+    if (path[0] == '\0' && (arg3 & LINUX_AT_EMPTY_PATH)) {
+      res = (int32_t)arg1 == LINUX_AT_FDCWD ? stat(".", &st) : fstat(vm_files_host_fd(files, arg1), &st);
+    } else {
+      res = fstatat(host_dirfd(files, arg1), path, &st, (arg3 & LINUX_AT_SYMLINK_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0);
+    }
+    if (res) {
+      return linux_err(errno);
+    }
+    put_statx(gx, &st);
+    return 0;
+  }
+  case NR_clock_gettime:
+  case NR_clock_gettime64:
+    return linux_clock_gettime(files, wmem, arg1, arg2);
+  case NR_gettimeofday: {
+    struct guest_timespec *tv = (struct guest_timespec *)vm_guest_buf(files, wmem, arg1, sizeof(struct guest_timespec));
+    if (tv == NULL) {
+      return linux_err(EFAULT);
+    }
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    tv->tv_sec = t.tv_sec;
+    tv->tv_nsec = t.tv_usec;
+    return 0;
+  }
+  case NR_brk:
+  case NR_mmap2:
+  case NR_munmap: {
+    // the harts of a machine hand out pages of the same memory
+    vm_linux_layout_t *l = files->shared_layout ? files->shared_layout : &files->layout;
+    if (files->layout_lock) {
+      pthread_mutex_lock(files->layout_lock);
+    }
+    const uint32_t res = nr == NR_brk     ? linux_brk(l, wmem, arg1)
+                         : nr == NR_mmap2 ? linux_mmap(files, l, wmem, arg1, arg2, arg4, arg5, arg6)
+                                          : linux_munmap(l, files->mem_fd, wmem, arg1, arg2);
+    if (files->layout_lock) {
+      pthread_mutex_unlock(files->layout_lock);
+    }
+    return res;
+  }
+  case NR_mprotect:
+  case NR_madvise:
+  case NR_rt_sigaction:
+  case NR_rt_sigprocmask:
+    // guest memory has no protections and there are no signals to deliver
+    return 0;
+  case NR_ioctl:
+    // no terminals, stdio of the guest buffers fully
+    return linux_err(ENOTTY);
+  case NR_set_tid_address:
+  case NR_getpid:
+  case NR_gettid:
+    return 1;
+  default:
+    return linux_err(ENOSYS);
+  }
+}
+
+// writes to one fd queued one after the other, in one writev. Returns how
+// many it made, 0 when the first buffer is not guest memory
+static uint32_t ioqueue_writev(vm_files_t *files, void *wmem, const vm_ioqueue_sqe_t *sqes, uint32_t n, uint32_t *res) {
+  struct iovec iov[LINUX_IOV_MAX];
+  uint32_t count = 0;
+  for (; count < n && count < LINUX_IOV_MAX && sqes[count].nr == SYS_write && sqes[count].args[0] == sqes[0].args[0]; count++) {
+    iov[count].iov_base = vm_guest_buf(files, wmem, sqes[count].args[1], sqes[count].args[2]);
+    iov[count].iov_len = sqes[count].args[2];
+    if (iov[count].iov_base == NULL) {
+      break;
+    }
+  }
+  if (count == 0) {
+    return 0;
+  }
+  ssize_t written = writev(vm_files_host_fd(files, sqes[0].args[0]), iov, count);
+  if (written < 0) {
+    res[0] = linux_err(errno);
+    return 1;
+  }
+  // a short write completes the writes it got to, the rest go again
+  uint32_t i = 0;
+  for (; i < count && (size_t)written >= iov[i].iov_len; i++) {
+    res[i] = iov[i].iov_len;
+    written -= iov[i].iov_len;
+  }
+  if (i == 0 || (i < count && written > 0)) {
+    res[i++] = (uint32_t)written;
+  }
+  return i;
+}
+
+static uint32_t files_syscall(vm_files_t *files, vm_console_t *console, uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
+                              uint32_t arg3, uint32_t arg4, uint32_t arg5, uint32_t arg6, uint32_t arg7, void *wmem);
+
+// queued syscalls, made as the engines make an ecall. Those of a polling
+// queue run on its thread with the queue locked, and syscall_handler takes
+// the lock for the guest's ecalls. They skip the user handler, which the
+// engine calls without the lock, and write fd 1 to a console of their own,
+// the one of files takes the UART's writes
+static uint32_t ioqueue_run(void *arg, void *wmem, const vm_ioqueue_sqe_t *sqes, uint32_t n, uint32_t *res) {
+  vm_files_t *files = arg;
+  const uint32_t nr = sqes[0].nr;
+  const uint32_t *args = sqes[0].args;
+  if (nr == SYS_ioqueue_setup || nr == SYS_ioqueue_enter) {
+    res[0] = linux_err(EINVAL);
+    return 1;
+  }
+  if (files->user_syscall_handler && files->ioqueue_console == NULL) {
+    uint32_t handled = 0;
+    res[0] = files->user_syscall_handler(&handled, nr, args[0], args[1], args[2], args[3], args[4], args[5], 0, wmem);
+    if (handled) {
+      return 1;
+    }
+  } else if (nr == SYS_write && args[0] != 1 && n > 1 && sqes[1].nr == SYS_write && sqes[1].args[0] == args[0]) {
+    // the console buffers fd 1 already
+    const uint32_t done = ioqueue_writev(files, wmem, sqes, n, res);
+    if (done) {
+      return done;
+    }
+  }
+  res[0] = files_syscall(files, files->ioqueue_console, nr, args[0], args[1], args[2], args[3], args[4], args[5], 0, wmem);
+  return 1;
+}
+
+static uint32_t ioqueue_setup(vm_files_t *files, void *wmem, uint32_t ring_at, uint32_t entries, uint32_t flags) {
+  if (ring_at == 0) {
+    vm_ioqueue_destroy(files->ioqueue);
+    files->ioqueue = NULL;
+    vm_console_destroy(files->ioqueue_console);
+    files->ioqueue_console = NULL;
+    return 0;
+  }
+  if (files->ioqueue) {
+    return linux_err(EBUSY);
+  }
+  if (entries == 0 || entries > VM_IOQUEUE_MAX_ENTRIES || (entries & (entries - 1)) || (ring_at & 3) || (flags & ~VM_IOQUEUE_POLL)) {
+    return linux_err(EINVAL);
+  }
+  uint8_t *ring = vm_guest_buf(files, wmem, ring_at, vm_ioqueue_size(entries));
+  if (ring == NULL) {
+    return linux_err(EFAULT);
+  }
+  if (flags & VM_IOQUEUE_POLL) {
+    files->ioqueue_console = vm_console_create(STDOUT_FILENO, NULL);
+    if (files->ioqueue_console == NULL) {
+      return linux_err(ENOMEM);
+    }
+  }
+  files->ioqueue = vm_ioqueue_create(ring, entries, flags, ioqueue_run, files, wmem);
+  if (files->ioqueue == NULL) {
+    vm_console_destroy(files->ioqueue_console);
+    files->ioqueue_console = NULL;
+    return linux_err(ENOMEM);
+  }
+  return 0;
+}
+
+uint32_t syscall_handler(vm_files_t *files, uint32_t syscall_number, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                         uint32_t arg5, uint32_t arg6, uint32_t arg7, void *wmem) {
+  // ecalls wait for a polling queue's entries, SYS_ioqueue_* lock it themselves
+  if (files->ioqueue_console && syscall_number != SYS_ioqueue_setup && syscall_number != SYS_ioqueue_enter) {
+    vm_ioqueue_lock(files->ioqueue);
+    const uint32_t res = files_syscall(files, NULL, syscall_number, arg1, arg2, arg3, arg4, arg5, arg6, arg7, wmem);
+    vm_ioqueue_unlock(files->ioqueue);
+    return res;
+  }
+  return files_syscall(files, NULL, syscall_number, arg1, arg2, arg3, arg4, arg5, arg6, arg7, wmem);
+}
+
+// the syscalls, fd 1 goes to console or, when it is NULL, to the console of files
+static uint32_t files_syscall(vm_files_t *files, vm_console_t *console, uint32_t syscall_number,
+                              uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                              uint32_t arg4, uint32_t arg5, uint32_t arg6,
+                              uint32_t arg7 __attribute__((unused)), void *wmem) {
 #if LOG_TRACE
   printf("syscall_handler: syscall_number=%d, arg1=%d, arg2=%d, arg3=%d, "
          "arg4=%d, arg5=%d, arg6=%d arg7=%d\n",
@@ -50,55 +941,66 @@ uint32_t syscall_handler(uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
   switch (syscall_number) {
   case SYS_write: // write
   {
-    if (arg1 == 1 || arg1 == 2) {
-      int res = write(arg1, wmem + arg2, arg3);
-      //   printf("--> write result %d\n", res);
-      if (arg1) {
-        fflush(stdout);
-      } else {
-        fflush(stderr);
-      }
-      //   for (int i = 0; i < (int)arg3; i++) {
-      //     printf("%c", ((char *)wmem)[arg2 + i]);
-      //   }
-      return (uint32_t)res;
+    const uint8_t *buf = vm_guest_buf(files, wmem, arg2, arg3);
+    if (buf == NULL) {
+      return linux_err(EFAULT);
     }
-  } break;
+    if (arg1 == 1) {
+      // buffered in the console, its writer thread makes the write(2)s
+      vm_console_write(out_console(files, console), buf, arg3);
+      return arg3;
+    }
+    const ssize_t res = write(vm_files_host_fd(files, arg1), buf, arg3);
+    return res < 0 ? linux_err(errno) : (uint32_t)res;
+  }
   case SYS_access: {
-    char *path = (char *)wmem + arg1;
+    const char *path = vm_guest_str(files, wmem, arg1);
+    if (path == NULL) {
+      return (uint32_t)-1;
+    }
     int res = access(path, arg2);
     printf("--> access result path %s mode %d result %d\n", path, arg2, res);
     return (uint32_t)res;
   } break;
   case SYS_fopen: {
-    FILE *res = fopen((char *)wmem + arg1, (char *)wmem + arg2);
+    const char *path = vm_guest_str(files, wmem, arg1);
+    const char *mode = vm_guest_str(files, wmem, arg2);
+    if (path == NULL || mode == NULL) {
+      return 0;
+    }
+    FILE *res = fopen(path, mode);
     if (res == NULL) {
-      printf("--> fopen '%s' result NULL\n", (char *)wmem + arg1);
+      printf("--> fopen '%s' result NULL\n", path);
       return 0;
     }
     int ind = 3;
-    for (; ind < MAX_FILES && fopened[ind]; ind++)
+    for (; ind < VM_MAX_FILES && files->fopened[ind]; ind++)
       ;
-    if (ind == MAX_FILES) {
-      printf("--> no more file descriptors '%s'\n", (char *)wmem + arg1);
+    if (ind == VM_MAX_FILES) {
+      printf("--> no more file descriptors '%s'\n", path);
       return 0;
     }
-    fopened[ind] = res;
+    files->fopened[ind] = res;
     return ind;
   }
   case SYS_fscanf: {
-    FILE *f = fopened[arg1];
+    FILE *f = arg1 < VM_MAX_FILES ? files->fopened[arg1] : NULL;
     if (f == NULL) {
       printf("--> fscanf file descriptor %d not open\n", arg1);
       return (uint32_t)EOF;
     }
-    int res = fscanf(f, (char *)wmem + arg2, (char *)wmem + arg3,
-                     (char *)wmem + arg4);
+    const char *format = vm_guest_str(files, wmem, arg2);
+    if (format == NULL) {
+      return (uint32_t)EOF;
+    }
+    // the format says which are used and how much they take, a word each is
+    // checked and one outside guest RAM is NULL
+    int res = fscanf(f, format, vm_guest_buf(files, wmem, arg3, sizeof(uint32_t)), vm_guest_buf(files, wmem, arg4, sizeof(uint32_t)));
     // printf("--> fscanf result %d\n", res);
     return (uint32_t)res;
   }
   case SYS_feof: {
-    FILE *f = fopened[arg1];
+    FILE *f = arg1 < VM_MAX_FILES ? files->fopened[arg1] : NULL;
     if (f == NULL) {
       printf("--> feof file descriptor %d not open\n", arg1);
       return (uint32_t)EOF;
@@ -108,54 +1010,70 @@ uint32_t syscall_handler(uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
     return (uint32_t)res;
   }
   case SYS_fclose: {
-    FILE *f = fopened[arg1];
+    FILE *f = arg1 < VM_MAX_FILES ? files->fopened[arg1] : NULL;
     if (f == NULL) {
       printf("--> fclose file descriptor %d not open\n", arg1);
       return (uint32_t)EOF;
     }
     int res = fclose(f);
     // printf("--> fclose result %d\n", res);
-    fopened[arg1] = NULL;
+    files->fopened[arg1] = NULL;
     return (uint32_t)res;
   } break;
   case SYS_open: {
-    char *path = (char *)wmem + arg1;
-    int res = open(path, arg2, arg3);
+    const char *path = vm_guest_str(files, wmem, arg1);
+    int res = path ? open(path, arg2, arg3) : -1;
+    if (res >= 0) {
+      res = vm_files_add_fd(files, res);
+    }
     // printf("--> open result path %s mode %d result %d\n", path, arg2, res);
     return (uint32_t)res;
   } break;
   case SYS_fstat: {
     struct stat host_stat;
-    int res = fstat(arg1, &host_stat);
+    int res = fstat(vm_files_host_fd(files, arg1), &host_stat);
     if (res != 0) {
       printf("--> fstat fd %d result %d\n", arg1, res);
       return (uint32_t)res;
     }
 
-    struct guest_stat *gs = (struct guest_stat *)((uint8_t *)wmem + arg2);
+    struct guest_stat *gs = (struct guest_stat *)vm_guest_buf(files, wmem, arg2, sizeof(struct guest_stat));
+    if (gs == NULL) {
+      return (uint32_t)-1;
+    }
     gs->st_size = host_stat.st_size;
     // printf("VM: --> fstat fd %d result %d size %lld\n", arg1, res, host_stat.st_size);
     return (uint32_t)res;
   } break;
   case SYS_read: {
-    int res = read(arg1, wmem + arg2, arg3);
+    uint8_t *buf = vm_guest_buf(files, wmem, arg2, arg3);
+    int res = buf ? read(vm_files_host_fd(files, arg1), buf, arg3) : -1;
     // printf("--> read result %d\n", res);
     return (uint32_t)res;
   } break;
   case SYS_close: {
-    int res = close(arg1);
+    int res = close_fd(files, arg1);
     // printf("--> close result %d\n", res);
     return (uint32_t)res;
   } break;
   case SYS_lseek: {
-    int res = lseek(arg1, (off_t)arg2, arg3);
+    int res = lseek(vm_files_host_fd(files, arg1), (off_t)arg2, arg3);
     // printf("HOST --> lseek result %d\n", res);
     return (uint32_t)res;
   } break;
 
+  case SYS_ioqueue_setup:
+    return ioqueue_setup(files, wmem, arg1, arg2, arg3);
+  case SYS_ioqueue_enter:
+    return files->ioqueue ? vm_ioqueue_enter(files->ioqueue) : linux_err(EINVAL);
+
+  case SYS_print_mem_access:
+  case SYS_snapshot:
+    // the engines took them
+    return 0;
   default:
     break;
   }
 
-  return 0;
+  return linux_syscall(files, console, syscall_number, arg1, arg2, arg3, arg4, arg5, arg6, wmem);
 }
@@ -0,0 +1,253 @@
+// The op-v kernel of one SEW for riscv-vm-vector.c, which includes this once
+// per SEW with VT the element type, VS its signed type and VKERNEL the name.
+// rv_vector_op has checked the form and the register groups.
+
+VECTOR_KERNEL static void VKERNEL(rv_vector_t *vec, uint32_t funct6, uint32_t funct3, int masked, uint32_t vd, uint32_t vs1,
+                                  uint32_t vs2, uint32_t x) {
+  // N is the elements of a group of 8 registers, the most vl can be
+  enum { SEW = sizeof(VT) * 8, N = RV_VLEN * 8 / SEW };
+  const uint32_t vl = vec->vl;
+  const int opm = funct3 == OPMVV || funct3 == OPMVX;
+  VT *const d = (VT *)(vec->v + vd * RV_VLENB);
+  const VT *const a = (const VT *)(vec->v + vs2 * RV_VLENB);
+  const VT *b = (const VT *)(vec->v + vs1 * RV_VLENB);
+  VT splat[N];
+  VT r[N];
+
+  if (funct3 == OPIVX || funct3 == OPIVI || funct3 == OPMVX) {
+    // the shifts take the immediate unsigned
+    const int shift = funct6 == 0x25 || funct6 == 0x28 || funct6 == 0x29;
+    const VT s = (VT)(funct3 != OPIVI ? x : (shift ? vs1 : (uint32_t)((int32_t)(vs1 << 27) >> 27)));
+    for (uint32_t i = 0; i < vl; i++) {
+      splat[i] = s;
+    }
+    b = splat;
+  }
+
+  if (opm && funct6 < 8) {
+    // reductions into element 0 of vd, from element 0 of vs1 and the active elements of vs2
+    static const VT identity[8] = {0, (VT)-1, 0, 0, (VT)-1, (VT)-1 >> 1, 0, (VT)((VT)-1 >> 1) + 1};
+    const VT *e = a;
+    if (masked) {
+      for (uint32_t i = 0; i < vl; i++) {
+        r[i] = mask_bit(vec, i) ? a[i] : identity[funct6];
+      }
+      e = r;
+    }
+    VT acc = b[0];
+    VS sacc = (VS)acc;
+    switch (funct6) {
+    case 0x00:
+      for (uint32_t i = 0; i < vl; i++) {
+        acc += e[i];
+      }
+      break;
+    case 0x01:
+      for (uint32_t i = 0; i < vl; i++) {
+        acc &= e[i];
+      }
+      break;
+    case 0x02:
+      for (uint32_t i = 0; i < vl; i++) {
+        acc |= e[i];
+      }
+      break;
+    case 0x03:
+      for (uint32_t i = 0; i < vl; i++) {
+        acc ^= e[i];
+      }
+      break;
+    case 0x04:
+      for (uint32_t i = 0; i < vl; i++) {
+        acc = e[i] < acc ? e[i] : acc;
+      }
+      break;
+    case 0x05:
+      for (uint32_t i = 0; i < vl; i++) {
+        sacc = (VS)e[i] < sacc ? (VS)e[i] : sacc;
+      }
+      acc = (VT)sacc;
+      break;
+    case 0x06:
+      for (uint32_t i = 0; i < vl; i++) {
+        acc = e[i] > acc ? e[i] : acc;
+      }
+      break;
+    default:
+      for (uint32_t i = 0; i < vl; i++) {
+        sacc = (VS)e[i] > sacc ? (VS)e[i] : sacc;
+      }
+      acc = (VT)sacc;
+      break;
+    }
+    if (vl) {
+      d[0] = acc;
+    }
+    return;
+  }
+  if (opm && funct6 == 0x10) {
+    // vmv.s.x
+    if (vl) {
+      d[0] = (VT)x;
+    }
+    return;
+  }
+
+// r[i] = expr for the vl elements, x2 of vs2, x1 of vs1 or the scalar and xd of vd, widened to 32 bits
+#define VEACH(expr)                                                                                                                        \
+  for (uint32_t i = 0; i < vl; i++) {                                                                                                      \
+    const uint32_t x2 = a[i];                                                                                                              \
+    const uint32_t x1 = b[i];                                                                                                              \
+    r[i] = (VT)(expr);                                                                                                                     \
+  }
+#define VEACH_D(expr)                                                                                                                      \
+  for (uint32_t i = 0; i < vl; i++) {                                                                                                      \
+    const uint32_t x2 = a[i];                                                                                                              \
+    const uint32_t x1 = b[i];                                                                                                              \
+    const uint32_t xd = d[i];                                                                                                              \
+    r[i] = (VT)(expr);                                                                                                                     \
+  }
+
+  int compare = 0;
+  switch (funct6 | opm << 6) {
+  case 0x00:
+    VEACH(x2 + x1);
+    break;
+  case 0x02:
+    VEACH(x2 - x1);
+    break;
+  case 0x03:
+    VEACH(x1 - x2);
+    break;
+  case 0x04:
+    VEACH(x2 < x1 ? x2 : x1);
+    break;
+  case 0x05:
+    VEACH((VS)x2 < (VS)x1 ? x2 : x1);
+    break;
+  case 0x06:
+    VEACH(x2 > x1 ? x2 : x1);
+    break;
+  case 0x07:
+    VEACH((VS)x2 > (VS)x1 ? x2 : x1);
+    break;
+  case 0x09:
+    VEACH(x2 & x1);
+    break;
+  case 0x0A:
+    VEACH(x2 | x1);
+    break;
+  case 0x0B:
+    VEACH(x2 ^ x1);
+    break;
+  case 0x17:
+    // vmerge under a mask, vmv.v without one, both write every element
+    if (masked) {
+      VEACH(mask_bit(vec, i) ? x1 : x2);
+      masked = 0;
+    } else {
+      memcpy(r, b, vl * sizeof(VT));
+    }
+    break;
+  case 0x18:
+    VEACH(x2 == x1);
+    compare = 1;
+    break;
+  case 0x19:
+    VEACH(x2 != x1);
+    compare = 1;
+    break;
+  case 0x1A:
+    VEACH(x2 < x1);
+    compare = 1;
+    break;
+  case 0x1B:
+    VEACH((VS)x2 < (VS)x1);
+    compare = 1;
+    break;
+  case 0x1C:
+    VEACH(x2 <= x1);
+    compare = 1;
+    break;
+  case 0x1D:
+    VEACH((VS)x2 <= (VS)x1);
+    compare = 1;
+    break;
+  case 0x1E:
+    VEACH(x2 > x1);
+    compare = 1;
+    break;
+  case 0x1F:
+    VEACH((VS)x2 > (VS)x1);
+    compare = 1;
+    break;
+  case 0x25:
+    VEACH(x2 << (x1 & (SEW - 1)));
+    break;
+  case 0x28:
+    VEACH(x2 >> (x1 & (SEW - 1)));
+    break;
+  case 0x29:
+    VEACH((VS)x2 >> (x1 & (SEW - 1)));
+    break;
+  // op-m, a divisor of 0 and the signed overflow give what div and rem do
+  case 0x60:
+    VEACH(x1 ? x2 / x1 : (uint32_t)-1);
+    break;
+  case 0x61:
+    VEACH(x1 == 0 ? (uint32_t)-1 : ((VS)x1 == -1 ? -x2 : (uint32_t)((VS)x2 / (VS)x1)));
+    break;
+  case 0x62:
+    VEACH(x1 ? x2 % x1 : x2);
+    break;
+  case 0x63:
+    VEACH(x1 == 0 ? x2 : ((VS)x1 == -1 ? 0 : (uint32_t)((VS)x2 % (VS)x1)));
+    break;
+  case 0x64:
+    VEACH(((uint64_t)x2 * x1) >> SEW);
+    break;
+  case 0x65:
+    VEACH(x2 * x1);
+    break;
+  case 0x66:
+    VEACH((uint64_t)((int64_t)(VS)x2 * (int64_t)x1) >> SEW);
+    break;
+  case 0x67:
+    VEACH((uint64_t)((int64_t)(VS)x2 * (VS)x1) >> SEW);
+    break;
+  case 0x69:
+    VEACH_D(x1 * xd + x2);
+    break;
+  case 0x6B:
+    VEACH_D(x2 - x1 * xd);
+    break;
+  case 0x6D:
+    VEACH_D(x1 * x2 + xd);
+    break;
+  default:
+    VEACH_D(xd - x1 * x2);
+    break;
+  }
+#undef VEACH
+#undef VEACH_D
+
+  if (compare) {
+    // one bit per element in vd, built aside as v0 may be both the mask and vd
+    uint8_t bits[RV_VLENB];
+    memcpy(bits, d, RV_VLENB);
+    for (uint32_t i = 0; i < vl; i++) {
+      if (!masked || mask_bit(vec, i)) {
+        bits[i >> 3] = (uint8_t)((bits[i >> 3] & ~(1u << (i & 7))) | r[i] << (i & 7));
+      }
+    }
+    memcpy(d, bits, RV_VLENB);
+  } else if (!masked) {
+    memcpy(d, r, vl * sizeof(VT));
+  } else {
+    for (uint32_t i = 0; i < vl; i++) {
+      if (mask_bit(vec, i)) {
+        d[i] = r[i];
+      }
+    }
+  }
+}
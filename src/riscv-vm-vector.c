@@ -0,0 +1,244 @@
+#include <string.h>
+
+#include "riscv-vm-vector.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+// an SSE2 and an AVX2 build of each kernel, the loader picks the one for the host
+#define VECTOR_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_KERNEL
+#endif
+
+// views of the register bytes as elements
+typedef uint16_t rv_u16 __attribute__((may_alias));
+typedef uint32_t rv_u32 __attribute__((may_alias));
+
+// op-v funct3
+#define OPIVV 0
+#define OPMVV 2
+#define OPIVI 3
+#define OPIVX 4
+#define OPMVX 6
+
+#define F(f3) (1 << (f3))
+
+// the funct3 forms each implemented funct6 has, op-i and op-m ones do not share funct3 values
+static const uint8_t op_forms[64] = {
+    [0x00] = F(OPIVV) | F(OPIVX) | F(OPIVI) | F(OPMVV),            // vadd, vredsum
+    [0x01] = F(OPMVV),                                             // vredand
+    [0x02] = F(OPIVV) | F(OPIVX) | F(OPMVV),                       // vsub, vredor
+    [0x03] = F(OPIVX) | F(OPIVI) | F(OPMVV),                       // vrsub, vredxor
+    [0x04] = F(OPIVV) | F(OPIVX) | F(OPMVV),                       // vminu, vredminu
+    [0x05] = F(OPIVV) | F(OPIVX) | F(OPMVV),                       // vmin, vredmin
+    [0x06] = F(OPIVV) | F(OPIVX) | F(OPMVV),                       // vmaxu, vredmaxu
+    [0x07] = F(OPIVV) | F(OPIVX) | F(OPMVV),                       // vmax, vredmax
+    [0x09] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vand
+    [0x0A] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vor
+    [0x0B] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vxor
+    [0x10] = F(OPMVX),                                             // vmv.s.x
+    [0x17] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vmerge, vmv.v
+    [0x18] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vmseq
+    [0x19] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vmsne
+    [0x1A] = F(OPIVV) | F(OPIVX),                                  // vmsltu
+    [0x1B] = F(OPIVV) | F(OPIVX),                                  // vmslt
+    [0x1C] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vmsleu
+    [0x1D] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vmsle
+    [0x1E] = F(OPIVX) | F(OPIVI),                                  // vmsgtu
+    [0x1F] = F(OPIVX) | F(OPIVI),                                  // vmsgt
+    [0x20] = F(OPMVV) | F(OPMVX),                                  // vdivu
+    [0x21] = F(OPMVV) | F(OPMVX),                                  // vdiv
+    [0x22] = F(OPMVV) | F(OPMVX),                                  // vremu
+    [0x23] = F(OPMVV) | F(OPMVX),                                  // vrem
+    [0x24] = F(OPMVV) | F(OPMVX),                                  // vmulhu
+    [0x25] = F(OPIVV) | F(OPIVX) | F(OPIVI) | F(OPMVV) | F(OPMVX), // vsll, vmul
+    [0x26] = F(OPMVV) | F(OPMVX),                                  // vmulhsu
+    [0x27] = F(OPMVV) | F(OPMVX),                                  // vmulh
+    [0x28] = F(OPIVV) | F(OPIVX) | F(OPIVI),                       // vsrl
+    [0x29] = F(OPIVV) | F(OPIVX) | F(OPIVI) | F(OPMVV) | F(OPMVX), // vsra, vmadd
+    [0x2B] = F(OPMVV) | F(OPMVX),                                  // vnmsub
+    [0x2D] = F(OPMVV) | F(OPMVX),                                  // vmacc
+    [0x2F] = F(OPMVV) | F(OPMVX),                                  // vnmsac
+};
+
+static uint32_t vtype_sew(uint32_t vtype) {
+  return 8u << ((vtype >> 3) & 7);
+}
+
+// registers in a group, 1 for the fractional LMULs
+static uint32_t vtype_regs(uint32_t vtype) {
+  const uint32_t vlmul = vtype & 7;
+  return vlmul < 4 ? 1u << vlmul : 1;
+}
+
+static uint32_t vtype_vlmax(uint32_t vtype) {
+  const uint32_t vlmul = vtype & 7;
+  const uint32_t per_reg = RV_VLEN / vtype_sew(vtype);
+  return vlmul < 4 ? per_reg << vlmul : per_reg >> (8 - vlmul);
+}
+
+// a group of regs registers can start at register r
+static int group_ok(uint32_t r, uint32_t regs) {
+  return (r & (regs - 1)) == 0 && r + regs <= 32;
+}
+
+static inline int mask_bit(const rv_vector_t *vec, uint32_t i) {
+  return (vec->v[i >> 3] >> (i & 7)) & 1;
+}
+
+#define VT uint8_t
+#define VS int8_t
+#define VKERNEL vop_8
+#include "riscv-vm-vector-kernel.h"
+#undef VT
+#undef VS
+#undef VKERNEL
+
+#define VT rv_u16
+#define VS int16_t
+#define VKERNEL vop_16
+#include "riscv-vm-vector-kernel.h"
+#undef VT
+#undef VS
+#undef VKERNEL
+
+#define VT rv_u32
+#define VS int32_t
+#define VKERNEL vop_32
+#include "riscv-vm-vector-kernel.h"
+#undef VT
+#undef VS
+#undef VKERNEL
+
+void rv_vector_init(rv_vector_t *vec) {
+  memset(vec, 0, sizeof(*vec));
+  vec->vtype = RV_VTYPE_VILL;
+}
+
+uint32_t rv_vsetvl(rv_vector_t *vec, uint32_t avl, uint32_t vtype) {
+  const uint32_t vsew = (vtype >> 3) & 7;
+  const uint32_t vlmul = vtype & 7;
+  // SEW up to ELEN, LMUL from 1/4 with SEW <= LMUL * ELEN, and nothing above vma
+  if (vsew > 2 || vlmul == 4 || (vtype >> 8) || (vlmul > 4 && (8u << vsew) > (32u >> (8 - vlmul)))) {
+    vec->vtype = RV_VTYPE_VILL;
+    vec->vl = 0;
+    return 0;
+  }
+  const uint32_t vlmax = vtype_vlmax(vtype);
+  vec->vtype = vtype;
+  vec->vl = avl < vlmax ? avl : vlmax;
+  return vec->vl;
+}
+
+int rv_vector_access(rv_vector_t *vec, uint8_t *mem, uint32_t mem_size, int store, uint32_t vd, uint32_t addr, uint32_t stride,
+                     uint32_t eew_bytes, int masked, uint32_t *lo, uint32_t *hi) {
+  if (vec->vtype & RV_VTYPE_VILL) {
+    return RV_VECTOR_ILLEGAL;
+  }
+  // the group is EMUL = EEW / SEW * LMUL registers
+  const uint32_t group_bytes = vtype_vlmax(vec->vtype) * eew_bytes;
+  const uint32_t regs = group_bytes > RV_VLENB ? group_bytes / RV_VLENB : 1;
+  if (regs > 8 || !group_ok(vd, regs) || (masked && vd == 0 && !store)) {
+    return RV_VECTOR_ILLEGAL;
+  }
+  uint8_t *const r = vec->v + vd * RV_VLENB;
+  const uint32_t vl = vec->vl;
+  *lo = *hi = 0;
+  if (vl == 0) {
+    return RV_VECTOR_OK;
+  }
+  addr &= 0x7FFFFFFF;
+  if (!masked && stride == eew_bytes) {
+    // unit stride, one copy
+    const uint32_t len = vl * eew_bytes;
+    if (addr > mem_size || len > mem_size - addr) {
+      return RV_VECTOR_FAULT;
+    }
+    if (store) {
+      memcpy(mem + addr, r, len);
+      *lo = addr;
+      *hi = addr + len;
+    } else {
+      memcpy(r, mem + addr, len);
+    }
+    return RV_VECTOR_OK;
+  }
+  uint32_t low = UINT32_MAX;
+  uint32_t high = 0;
+  for (uint32_t i = 0; i < vl; i++) {
+    if (masked && !mask_bit(vec, i)) {
+      continue;
+    }
+    const uint32_t a = (addr + i * stride) & 0x7FFFFFFF;
+    if (a > mem_size - eew_bytes) {
+      return RV_VECTOR_FAULT;
+    }
+    if (store) {
+      memcpy(mem + a, r + i * eew_bytes, eew_bytes);
+      low = a < low ? a : low;
+      high = a + eew_bytes > high ? a + eew_bytes : high;
+    } else {
+      memcpy(r + i * eew_bytes, mem + a, eew_bytes);
+    }
+  }
+  if (high) {
+    *lo = low;
+    *hi = high;
+  }
+  return RV_VECTOR_OK;
+}
+
+int rv_vector_op(rv_vector_t *vec, uint32_t fn, uint32_t vd, uint32_t vs1, uint32_t vs2, uint32_t x) {
+  const uint32_t funct6 = fn & 0x3F;
+  const uint32_t funct3 = (fn >> 6) & 7;
+  const int masked = !(fn >> 9);
+  if ((vec->vtype & RV_VTYPE_VILL) || !(op_forms[funct6] & F(funct3))) {
+    return RV_VECTOR_ILLEGAL;
+  }
+  const uint32_t regs = vtype_regs(vec->vtype);
+  const int opm = funct3 == OPMVV || funct3 == OPMVX;
+  // reductions and vmv.s.x write one register, compares a mask register
+  const int single_vd = opm && (funct6 < 8 || funct6 == 0x10);
+  const int mask_vd = !opm && funct6 >= 0x18 && funct6 <= 0x1F;
+  if (!single_vd && !mask_vd && (!group_ok(vd, regs) || (masked && vd == 0))) {
+    return RV_VECTOR_ILLEGAL;
+  }
+  if (opm && funct6 == 0x10) {
+    if (vs2) {
+      return RV_VECTOR_ILLEGAL;
+    }
+  } else if (!group_ok(vs2, regs) || (funct6 == 0x17 && !masked && vs2)) {
+    return RV_VECTOR_ILLEGAL;
+  }
+  if ((funct3 == OPIVV || funct3 == OPMVV) && !(opm && funct6 < 8) && !group_ok(vs1, regs)) {
+    return RV_VECTOR_ILLEGAL;
+  }
+  switch (vtype_sew(vec->vtype)) {
+  case 8:
+    vop_8(vec, funct6, funct3, masked, vd, vs1, vs2, x);
+    break;
+  case 16:
+    vop_16(vec, funct6, funct3, masked, vd, vs1, vs2, x);
+    break;
+  default:
+    vop_32(vec, funct6, funct3, masked, vd, vs1, vs2, x);
+    break;
+  }
+  return RV_VECTOR_OK;
+}
+
+int rv_vector_x_s(const rv_vector_t *vec, uint32_t vs2, uint32_t *x) {
+  const uint8_t *const e = vec->v + vs2 * RV_VLENB;
+  switch (vec->vtype & RV_VTYPE_VILL ? 0 : vtype_sew(vec->vtype)) {
+  case 8:
+    *x = (uint32_t)(int8_t)e[0];
+    return RV_VECTOR_OK;
+  case 16:
+    *x = (uint32_t)(int16_t) * (const rv_u16 *)e;
+    return RV_VECTOR_OK;
+  case 32:
+    *x = *(const rv_u32 *)e;
+    return RV_VECTOR_OK;
+  default:
+    return RV_VECTOR_ILLEGAL;
+  }
+}
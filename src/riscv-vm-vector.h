@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+  The vector extension for the engines that execute it, the integer part of
+  RVV 1.0 with ELEN 32 (Zve32x): vsetvl*, unit-stride and strided loads and
+  stores of 8, 16 and 32 bit elements, integer arithmetic, compares into
+  masks and reductions, all maskable. Each instruction is one call, its
+  elements are done by a loop over host arrays the compiler vectorizes,
+  with an AVX2 build of the loops picked at run time where the host has it.
+  Tails and inactive elements are left undisturbed.
+ */
+
+// bits in a vector register, 128 or 256
+#ifndef RV_VLEN
+#define RV_VLEN 128
+#endif
+#define RV_VLENB (RV_VLEN / 8)
+
+#define RV_VTYPE_VILL 0x80000000u
+
+// rv_vector_* results
+#define RV_VECTOR_OK 0
+#define RV_VECTOR_ILLEGAL 1 // not an instruction here, or vtype is vill
+#define RV_VECTOR_FAULT 2   // an element is outside of memory
+
+typedef struct {
+  // register i is v[i * RV_VLENB], a group of registers is contiguous
+  uint8_t v[32 * RV_VLENB] __attribute__((aligned(32)));
+  uint32_t vl;
+  uint32_t vtype;
+} rv_vector_t;
+
+// vtype vill and vl 0 as after reset, registers 0
+void rv_vector_init(rv_vector_t *vec);
+
+// vsetvl* with the avl it resolved to, returns the new vl
+uint32_t rv_vsetvl(rv_vector_t *vec, uint32_t avl, uint32_t vtype);
+
+// vle/vlse (store 0) and vse/vsse of vd from addr + i * stride for the vl elements of eew_bytes,
+// addresses are masked to 31 bits as for scalar accesses. A store sets *lo and *hi to the bytes it wrote.
+int rv_vector_access(rv_vector_t *vec, uint8_t *mem, uint32_t mem_size, int store, uint32_t vd, uint32_t addr, uint32_t stride,
+                     uint32_t eew_bytes, int masked, uint32_t *lo, uint32_t *hi);
+
+// an op-v instruction decoded as RV_OP_VOP, x is the value of its scalar register
+int rv_vector_op(rv_vector_t *vec, uint32_t fn, uint32_t vd, uint32_t vs1, uint32_t vs2, uint32_t x);
+
+// vmv.x.s, sets *x to element 0 of vs2 sign extended
+int rv_vector_x_s(const rv_vector_t *vec, uint32_t vs2, uint32_t *x);
@@ -0,0 +1,386 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Minimal x86-64 machine code emitter for the JIT engines. Only the encodings
+// the translators need are here, operands are 32 bit unless the name says
+// otherwise.
+
+enum { X64_RAX = 0, X64_RCX, X64_RDX, X64_RBX, X64_RSP, X64_RBP, X64_RSI, X64_RDI, X64_R8, X64_R9, X64_R10, X64_R11, X64_R12, X64_R13, X64_R14, X64_R15 };
+
+// condition codes, low nibble of jcc/setcc
+enum { X64_CC_B = 0x2, X64_CC_AE = 0x3, X64_CC_E = 0x4, X64_CC_NE = 0x5, X64_CC_L = 0xC, X64_CC_GE = 0xD };
+
+// alu group numbers (/n of 0x81) and the matching reg, r/m opcodes
+enum { X64_ADD = 0, X64_OR = 1, X64_AND = 4, X64_SUB = 5, X64_XOR = 6, X64_CMP = 7 };
+
+// p is where the code runs, the bytes are written w bytes from there (the
+// JIT's code cache is executable and writable at different addresses)
+typedef struct {
+  uint8_t *p;
+  ptrdiff_t w;
+} x64_buf_t;
+
+static inline void x64_u8(x64_buf_t *b, uint8_t v) { b->p++[b->w] = v; }
+
+static inline void x64_u32(x64_buf_t *b, uint32_t v) {
+  memcpy(b->p + b->w, &v, 4);
+  b->p += 4;
+}
+
+static inline void x64_u64(x64_buf_t *b, uint64_t v) {
+  memcpy(b->p + b->w, &v, 8);
+  b->p += 8;
+}
+
+static inline void x64_rex(x64_buf_t *b, int w, int reg, int index, int base) {
+  uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+  if (rex != 0x40) {
+    x64_u8(b, rex);
+  }
+}
+
+// ModRM (+SIB, +disp) for [base + disp]
+static inline void x64_modrm_mem(x64_buf_t *b, int reg, int base, int32_t disp) {
+  const int mod = (disp == 0 && (base & 7) != X64_RBP) ? 0 : (disp >= -128 && disp <= 127 ? 1 : 2);
+  x64_u8(b, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == X64_RSP) {
+    x64_u8(b, 0x24);
+  }
+  if (mod == 1) {
+    x64_u8(b, (uint8_t)disp);
+  } else if (mod == 2) {
+    x64_u32(b, (uint32_t)disp);
+  }
+}
+
+// ModRM + SIB for [base + index * scale]
+static inline void x64_modrm_sib(x64_buf_t *b, int reg, int base, int index, int scale_log2) {
+  const int need_disp = (base & 7) == X64_RBP;
+  x64_u8(b, ((need_disp ? 1 : 0) << 6) | ((reg & 7) << 3) | 4);
+  x64_u8(b, (scale_log2 << 6) | ((index & 7) << 3) | (base & 7));
+  if (need_disp) {
+    x64_u8(b, 0);
+  }
+}
+
+static inline void x64_modrm_reg(x64_buf_t *b, int reg, int rm) { x64_u8(b, 0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+// mov r32, [base + disp]
+static inline void x64_load32(x64_buf_t *b, int reg, int base, int32_t disp) {
+  x64_rex(b, 0, reg, 0, base);
+  x64_u8(b, 0x8B);
+  x64_modrm_mem(b, reg, base, disp);
+}
+
+// mov r64, [base + disp]
+static inline void x64_load64(x64_buf_t *b, int reg, int base, int32_t disp) {
+  x64_rex(b, 1, reg, 0, base);
+  x64_u8(b, 0x8B);
+  x64_modrm_mem(b, reg, base, disp);
+}
+
+// mov [base + disp], r32
+static inline void x64_store32(x64_buf_t *b, int base, int32_t disp, int reg) {
+  x64_rex(b, 0, reg, 0, base);
+  x64_u8(b, 0x89);
+  x64_modrm_mem(b, reg, base, disp);
+}
+
+// mov [base + disp], r64
+static inline void x64_store64(x64_buf_t *b, int base, int32_t disp, int reg) {
+  x64_rex(b, 1, reg, 0, base);
+  x64_u8(b, 0x89);
+  x64_modrm_mem(b, reg, base, disp);
+}
+
+// mov dword [base + disp], imm32
+static inline void x64_store_imm32(x64_buf_t *b, int base, int32_t disp, uint32_t imm) {
+  x64_rex(b, 0, 0, 0, base);
+  x64_u8(b, 0xC7);
+  x64_modrm_mem(b, 0, base, disp);
+  x64_u32(b, imm);
+}
+
+// <alu> r32, [base + disp]
+static inline void x64_alu_load32(x64_buf_t *b, int alu, int reg, int base, int32_t disp) {
+  x64_rex(b, 0, reg, 0, base);
+  x64_u8(b, (alu << 3) | 3);
+  x64_modrm_mem(b, reg, base, disp);
+}
+
+// <alu> r32, r32
+static inline void x64_alu_reg32(x64_buf_t *b, int alu, int dst, int src) {
+  x64_rex(b, 0, src, 0, dst);
+  x64_u8(b, (alu << 3) | 1);
+  x64_modrm_reg(b, src, dst);
+}
+
+// <alu> r32, imm32
+static inline void x64_alu_imm32(x64_buf_t *b, int alu, int reg, uint32_t imm) {
+  x64_rex(b, 0, 0, 0, reg);
+  if ((int32_t)imm >= -128 && (int32_t)imm <= 127) {
+    x64_u8(b, 0x83);
+    x64_modrm_reg(b, alu, reg);
+    x64_u8(b, (uint8_t)imm);
+  } else {
+    x64_u8(b, 0x81);
+    x64_modrm_reg(b, alu, reg);
+    x64_u32(b, imm);
+  }
+}
+
+// <alu> r64, imm32
+static inline void x64_alu_imm64(x64_buf_t *b, int alu, int reg, uint32_t imm) {
+  x64_rex(b, 1, 0, 0, reg);
+  x64_u8(b, 0x81);
+  x64_modrm_reg(b, alu, reg);
+  x64_u32(b, imm);
+}
+
+// add qword [base + disp], imm32
+static inline void x64_add_mem64_imm32(x64_buf_t *b, int base, int32_t disp, uint32_t imm) {
+  x64_rex(b, 1, 0, 0, base);
+  x64_u8(b, 0x81);
+  x64_modrm_mem(b, 0, base, disp);
+  x64_u32(b, imm);
+}
+
+// sub qword [base + disp], imm32
+static inline void x64_sub_mem64_imm32(x64_buf_t *b, int base, int32_t disp, uint32_t imm) {
+  x64_rex(b, 1, 0, 0, base);
+  x64_u8(b, 0x81);
+  x64_modrm_mem(b, 5, base, disp);
+  x64_u32(b, imm);
+}
+
+// mov r32, r32
+static inline void x64_mov_reg32(x64_buf_t *b, int dst, int src) {
+  x64_rex(b, 0, src, 0, dst);
+  x64_u8(b, 0x89);
+  x64_modrm_reg(b, src, dst);
+}
+
+// mov r64, r64
+static inline void x64_mov_reg64(x64_buf_t *b, int dst, int src) {
+  x64_rex(b, 1, src, 0, dst);
+  x64_u8(b, 0x89);
+  x64_modrm_reg(b, src, dst);
+}
+
+// mov r32, imm32
+static inline void x64_mov_imm32(x64_buf_t *b, int reg, uint32_t imm) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xB8 | (reg & 7));
+  x64_u32(b, imm);
+}
+
+// mov r64, imm64
+static inline void x64_mov_imm64(x64_buf_t *b, int reg, uint64_t imm) {
+  x64_rex(b, 1, 0, 0, reg);
+  x64_u8(b, 0xB8 | (reg & 7));
+  x64_u64(b, imm);
+}
+
+// shl/shr/sar r32, imm8 (ext 4/5/7)
+static inline void x64_shift_imm(x64_buf_t *b, int ext, int reg, uint8_t imm) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xC1);
+  x64_modrm_reg(b, ext, reg);
+  x64_u8(b, imm);
+}
+
+// shl/shr/sar r32, cl (ext 4/5/7)
+static inline void x64_shift_cl(x64_buf_t *b, int ext, int reg) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xD3);
+  x64_modrm_reg(b, ext, reg);
+}
+
+// shift r64 by imm8 (ext 4/5/7)
+static inline void x64_shift64_imm(x64_buf_t *b, int ext, int reg, uint8_t imm) {
+  x64_rex(b, 1, 0, 0, reg);
+  x64_u8(b, 0xC1);
+  x64_modrm_reg(b, ext, reg);
+  x64_u8(b, imm);
+}
+
+// imul r32, r32
+static inline void x64_imul_reg32(x64_buf_t *b, int dst, int src) {
+  x64_rex(b, 0, dst, 0, src);
+  x64_u8(b, 0x0F);
+  x64_u8(b, 0xAF);
+  x64_modrm_reg(b, dst, src);
+}
+
+// imul r64, r64
+static inline void x64_imul_reg64(x64_buf_t *b, int dst, int src) {
+  x64_rex(b, 1, dst, 0, src);
+  x64_u8(b, 0x0F);
+  x64_u8(b, 0xAF);
+  x64_modrm_reg(b, dst, src);
+}
+
+// movsxd r64, [base + disp]
+static inline void x64_load32_sx64(x64_buf_t *b, int reg, int base, int32_t disp) {
+  x64_rex(b, 1, reg, 0, base);
+  x64_u8(b, 0x63);
+  x64_modrm_mem(b, reg, base, disp);
+}
+
+// movsxd r64, r32
+static inline void x64_movsx64_reg32(x64_buf_t *b, int dst, int src) {
+  x64_rex(b, 1, dst, 0, src);
+  x64_u8(b, 0x63);
+  x64_modrm_reg(b, dst, src);
+}
+
+// sub dword [rip + target], imm8
+static inline void x64_sub_rip32_imm8(x64_buf_t *b, const uint8_t *target, int8_t imm) {
+  x64_u8(b, 0x83);
+  x64_u8(b, 0x2D);
+  x64_u32(b, (uint32_t)(int32_t)(target - (b->p + 5)));
+  x64_u8(b, (uint8_t)imm);
+}
+
+// setcc r8, then movzx r32, r8 (reg must be one of eax..ebx)
+static inline void x64_setcc_zx(x64_buf_t *b, int cc, int reg) {
+  x64_u8(b, 0x0F);
+  x64_u8(b, 0x90 | cc);
+  x64_modrm_reg(b, 0, reg);
+  x64_u8(b, 0x0F);
+  x64_u8(b, 0xB6);
+  x64_modrm_reg(b, reg, reg);
+}
+
+// test r32, r32
+static inline void x64_test_reg32(x64_buf_t *b, int a, int c) {
+  x64_rex(b, 0, c, 0, a);
+  x64_u8(b, 0x85);
+  x64_modrm_reg(b, c, a);
+}
+
+// test r64, r64
+static inline void x64_test_reg64(x64_buf_t *b, int a, int c) {
+  x64_rex(b, 1, c, 0, a);
+  x64_u8(b, 0x85);
+  x64_modrm_reg(b, c, a);
+}
+
+// test r32, imm32
+static inline void x64_test_imm32(x64_buf_t *b, int reg, uint32_t imm) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xF7);
+  x64_modrm_reg(b, 0, reg);
+  x64_u32(b, imm);
+}
+
+// cdq; idiv r32 / xor edx, edx; div r32
+static inline void x64_idiv32(x64_buf_t *b, int reg) {
+  x64_u8(b, 0x99);
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xF7);
+  x64_modrm_reg(b, 7, reg);
+}
+
+static inline void x64_div32(x64_buf_t *b, int reg) {
+  x64_alu_reg32(b, X64_XOR, X64_RDX, X64_RDX);
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xF7);
+  x64_modrm_reg(b, 6, reg);
+}
+
+// guest memory access [base + index], width 1/2/4, sign extending loads when sx
+static inline void x64_load_mem_idx(x64_buf_t *b, int reg, int base, int index, int width, int sx) {
+  x64_rex(b, 0, reg, index, base);
+  if (width == 4) {
+    x64_u8(b, 0x8B);
+  } else {
+    x64_u8(b, 0x0F);
+    x64_u8(b, (sx ? 0xBE : 0xB6) | (width == 2 ? 1 : 0));
+  }
+  x64_modrm_sib(b, reg, base, index, 0);
+}
+
+static inline void x64_store_mem_idx(x64_buf_t *b, int base, int index, int reg, int width) {
+  if (width == 2) {
+    x64_u8(b, 0x66);
+  }
+  x64_rex(b, 0, reg, index, base);
+  x64_u8(b, width == 1 ? 0x88 : 0x89);
+  x64_modrm_sib(b, reg, base, index, 0);
+}
+
+// movzx r32, word [base + index]
+static inline void x64_load16_zx_idx(x64_buf_t *b, int reg, int base, int index) { x64_load_mem_idx(b, reg, base, index, 2, 0); }
+
+// mov r64, [base + index * 2]
+static inline void x64_load64_idx2(x64_buf_t *b, int reg, int base, int index) {
+  x64_rex(b, 1, reg, index, base);
+  x64_u8(b, 0x8B);
+  x64_modrm_sib(b, reg, base, index, 1);
+}
+
+static inline void x64_push(x64_buf_t *b, int reg) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0x50 | (reg & 7));
+}
+
+static inline void x64_pop(x64_buf_t *b, int reg) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0x58 | (reg & 7));
+}
+
+static inline void x64_ret(x64_buf_t *b) { x64_u8(b, 0xC3); }
+
+// jmp reg64
+static inline void x64_jmp_reg(x64_buf_t *b, int reg) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xFF);
+  x64_modrm_reg(b, 4, reg);
+}
+
+// call reg64
+static inline void x64_call_reg(x64_buf_t *b, int reg) {
+  x64_rex(b, 0, 0, 0, reg);
+  x64_u8(b, 0xFF);
+  x64_modrm_reg(b, 2, reg);
+}
+
+// jmp rel32 / jcc rel32, return the address of the rel32 field for patching
+static inline uint8_t *x64_jmp32(x64_buf_t *b) {
+  x64_u8(b, 0xE9);
+  uint8_t *at = b->p;
+  x64_u32(b, 0);
+  return at;
+}
+
+static inline uint8_t *x64_jcc32(x64_buf_t *b, int cc) {
+  x64_u8(b, 0x0F);
+  x64_u8(b, 0x80 | cc);
+  uint8_t *at = b->p;
+  x64_u32(b, 0);
+  return at;
+}
+
+// short forms for jumps inside one instruction
+static inline uint8_t *x64_jmp8(x64_buf_t *b) {
+  x64_u8(b, 0xEB);
+  x64_u8(b, 0);
+  return b->p - 1;
+}
+
+static inline uint8_t *x64_jcc8(x64_buf_t *b, int cc) {
+  x64_u8(b, 0x70 | cc);
+  x64_u8(b, 0);
+  return b->p - 1;
+}
+
+static inline void x64_patch32(const x64_buf_t *b, uint8_t *at, const uint8_t *target) {
+  int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(at + b->w, &rel, 4);
+}
+
+static inline void x64_patch8(const x64_buf_t *b, uint8_t *at, const uint8_t *target) { at[b->w] = (uint8_t)(int8_t)(target - (at + 1)); }
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "riscv-vm-optimized-1.h"
+
+// The embedding API: VM contexts on the riscv_vm_run_optimized_4 engine, the
+// fork server and pool built on their snapshots, the M:N scheduler and the
+// multi-hart run. riscv-vm-optimized-1.h has the one-shot run functions of
+// every engine and the syscall layer they share.
+
+typedef struct riscv_vm riscv_vm_t;
+
+/**
+  VM context for the riscv_vm_run_optimized_4 interpreter. It owns the
+  registers, guest memory, counters and the files the guest opened, nothing
+  is shared between contexts, so several can run in one process, each on its
+  own thread.
+
+  riscv_vm_create returns NULL when out of memory. riscv_vm_load places the
+  program into the fresh context's memory and sets the pc to its entry,
+  riscv_vm_execute runs it until it exits. Both return 0 or an ERR_* code,
+  riscv_vm_execute the guest's exit code like the run functions.
+ */
+riscv_vm_t *riscv_vm_create(syscall_handler_t user_syscall_handler);
+int riscv_vm_load(riscv_vm_t *vm, const vm_image_t *image);
+int riscv_vm_execute(riscv_vm_t *vm);
+void riscv_vm_destroy(riscv_vm_t *vm);
+
+// the 32 guest registers, can be set before riscv_vm_execute and read after it
+uint32_t *riscv_vm_registers(riscv_vm_t *vm);
+// guest pc, where the program stopped after riscv_vm_execute
+uint32_t riscv_vm_pc(const riscv_vm_t *vm);
+// instructions retired by riscv_vm_execute
+uint64_t riscv_vm_instret(const riscv_vm_t *vm);
+// the guest's standard input, a host fd the caller keeps open until riscv_vm_destroy
+void riscv_vm_set_input(riscv_vm_t *vm, int fd);
+
+// riscv_vm_execute result when the guest made the SYS_snapshot ecall, executing again resumes it
+#define RISCV_VM_SNAPSHOT (-1)
+// riscv_vm_execute result when the riscv_vm_set_budget timeslice ran out, executing again resumes it
+#define RISCV_VM_YIELD (-2)
+
+// riscv_vm_execute returns RISCV_VM_YIELD after about this many instructions, 0 (the default) runs to the end
+void riscv_vm_set_budget(riscv_vm_t *vm, uint64_t instructions);
+// host CPU time the context spent in riscv_vm_execute
+uint64_t riscv_vm_cpu_ns(const riscv_vm_t *vm);
+
+/**
+  Fork server. A guest marks the end of its initialization with the
+  SYS_snapshot ecall, riscv_vm_execute then returns RISCV_VM_SNAPSHOT with the
+  pc past the ecall. riscv_vm_snapshot freezes that state: guest RAM is copied
+  into an anonymous host file, leaving out pages that are still zero.
+  riscv_vm_clone returns a new context that starts there, its RAM is a
+  private mapping of that file, so creating one costs a mmap and it copies
+  only the pages it writes. A clone gets the snapshot's input fd, shared
+  with the snapshot and every other clone, and the files the guest had open,
+  each opened again at the snapshot's offset so that clones do not move each
+  other's file positions (a file that cannot be opened again, like a socket,
+  is dup'd and its position shared). Nothing else is shared.
+  riscv_vm_snapshot returns 0 or ERR_OUT_OF_MEM, riscv_vm_clone NULL when out
+  of memory or vm was not snapshotted.
+ */
+int riscv_vm_snapshot(riscv_vm_t *vm);
+riscv_vm_t *riscv_vm_clone(const riscv_vm_t *vm);
+
+typedef struct riscv_vm_pool riscv_vm_pool_t;
+
+typedef struct {
+  uint32_t size;     // contexts kept for reuse
+  uint32_t idle;     // of those, waiting in the pool now
+  uint64_t gets;     // riscv_vm_pool_get calls
+  uint64_t reuses;   // gets served by a reset context instead of a new clone
+  uint64_t resets;   // contexts reset by riscv_vm_pool_put
+  uint64_t reset_ns; // time spent resetting
+} riscv_vm_pool_stats_t;
+
+/**
+  Pool of contexts for running the same program many times. It takes over vm
+  (snapshotting it first if the guest did not) and hands out clones of it.
+  riscv_vm_pool_put resets a context to the snapshot by dropping the pages
+  the run wrote, which is far cheaper than a fresh context's RAM, and keeps
+  up to size of them for later gets. The pool can be used from
+  several threads. riscv_vm_pool_create returns NULL when out of memory
+  (vm is destroyed then), riscv_vm_pool_get when no context can be cloned.
+ */
+riscv_vm_pool_t *riscv_vm_pool_create(riscv_vm_t *vm, uint32_t size);
+riscv_vm_t *riscv_vm_pool_get(riscv_vm_pool_t *pool);
+void riscv_vm_pool_put(riscv_vm_pool_t *pool, riscv_vm_t *vm);
+void riscv_vm_pool_stats(riscv_vm_pool_t *pool, riscv_vm_pool_stats_t *stats);
+// destroys the pool's contexts, the ones that are out must have been put back
+void riscv_vm_pool_destroy(riscv_vm_pool_t *pool);
+
+typedef struct riscv_vm_sched riscv_vm_sched_t;
+
+// called on the worker thread when a guest finished, the callee owns vm again
+typedef void (*riscv_vm_done_t)(riscv_vm_t *vm, int exit_code, uint32_t worker, void *arg);
+
+/**
+  M:N scheduler: runs any number of contexts on nthreads host threads. Every
+  guest gets timeslice instructions (see riscv_vm_set_budget) and goes back
+  to the end of a single run queue when it used them up, so the guests get
+  the CPU in turns of equal instruction counts. riscv_vm_sched_add queues a
+  loaded context and returns at once, done is called when it exits.
+  riscv_vm_sched_wait returns when every guest added so far is done.
+  riscv_vm_sched_create returns NULL when out of memory or no thread could
+  be started.
+ */
+riscv_vm_sched_t *riscv_vm_sched_create(uint32_t nthreads, uint64_t timeslice);
+void riscv_vm_sched_add(riscv_vm_sched_t *sched, riscv_vm_t *vm, riscv_vm_done_t done, void *arg);
+void riscv_vm_sched_wait(riscv_vm_sched_t *sched);
+// waits for the queued guests and stops the threads
+void riscv_vm_sched_destroy(riscv_vm_sched_t *sched);
+
+// most harts riscv_vm_execute_smp runs
+#define RISCV_VM_MAX_HARTS 64
+
+/**
+  Multi-hart run: the loaded program starts on nharts harts at once, all at
+  the context's pc with its registers, each hart on its own host thread and
+  with its own mhartid; hart 0 runs on the calling thread. The harts share
+  the context's RAM, the A extension and FENCE keep the usual RISC-V memory
+  model guarantees across them. A store of 1 to the CLINT msip word of a
+  hart (CLINT_BASE + 4 * hartid) wakes it from wfi, the guest clears it
+  again with a store of 0. The run ends when any hart exits, the others stop
+  within a few thousand instructions; the result is that hart's exit code.
+  Files a hart opens are its own. nharts above RISCV_VM_MAX_HARTS is
+  ERR_OUT_OF_MEM, like failing to start a thread.
+ */
+int riscv_vm_execute_smp(riscv_vm_t *vm, uint32_t nharts);
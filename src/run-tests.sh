@@ -1,9 +1,43 @@
 #!/bin/bash
+# usage: ./run-tests.sh [engine flag, -opt4 by default] [-j threads]
+# -aot translates every test with rv2c and runs the compiled program instead
+# -j runs each suite as one runelf -j batch, on the -opt4 interpreter only
+ENGINE="${1:--opt4}"
+JOBS=""
+if [[ "$2" == "-j" ]]; then
+    JOBS="${3:-$(nproc)}"
+fi
 make runelf
+if [[ "$ENGINE" == "-aot" ]]; then
+    make rv2c
+fi
+if [[ "$ENGINE" == "-jit-cp" ]]; then
+    # a stencil that does not parse turns -jit-cp into -jit
+    ./runelf -jit-cp-check || { echo "Some -jit-cp stencils do not parse"; exit 1; }
+    echo "All -jit-cp stencils parsed."
+fi
+
+run_test() {
+    if [[ "$ENGINE" == "-aot" ]]; then
+        ./rv2c "$1" aot-test.c && gcc -O2 -I. -o aot-test aot-test.c riscv-vm-aot-runtime.c riscv-vm-decode.c \
+            riscv-vm-syscall-handler.c riscv-vm-common.c riscv-vm-console.c riscv-vm-ioqueue.c riscv-vm-blk.c && ./aot-test
+    else
+        ./runelf "$1" "$ENGINE"
+    fi
+}
 
 # Define the target directory
 TARGET_DIR="../compiled-tests"
 
+if [[ -n "$JOBS" ]]; then
+    for suite in rv32ui rv32um; do
+        echo "Running ${suite^^} tests"
+        ./runelf -j "$JOBS" "$ENGINE" $(ls "$TARGET_DIR"/$suite-p-* | grep -v '\.dump$') || exit 1
+        echo "All ${suite^^} tests passed."
+    done
+    exit 0
+fi
+
 echo "Running RV32UI tests"
 for file in "$TARGET_DIR"/rv32ui-p-*; do
     # Check if the current item is a file without an extension
@@ -17,7 +51,7 @@ for file in "$TARGET_DIR"/rv32ui-p-*; do
     echo "Executing file: $file"
     
     # Run the `runelf` program with the current file
-    ./runelf "$file" -opt4
+    run_test "$file"
     
     # Check the exit status of `runelf`
     if [[ $? -ne 0 ]]; then
@@ -41,7 +75,7 @@ for file in "$TARGET_DIR"/rv32um-p-*; do
     echo "Executing file: $file"
     
     # Run the `runelf` program with the current file
-    ./runelf "$file" -opt4
+    run_test "$file"
     
     # Check the exit status of `runelf`
     if [[ $? -ne 0 ]]; then
@@ -51,3 +85,61 @@ for file in "$TARGET_DIR"/rv32um-p-*; do
 done
 
 echo "All RV32UM tests passed."
+
+# The VM's own guests, built from the sources next to them (see the Makefile
+# there): name, the engines that have what it tests, then runelf's other
+# arguments. -aot runs only the ones that need none. EXPECT_EXIT is the exit
+# code the VM has to stop the guest with, 0 unless set.
+run_own_test() {
+    local file="$TARGET_DIR/$1"
+    local engines="$2"
+    shift 2
+    if [[ " $engines " != *" $ENGINE "* ]] || [[ "$ENGINE" == "-aot" && $# -gt 0 ]]; then
+        echo "Skipping file: $file"
+        return
+    fi
+    echo "Executing file: $file"
+    if [[ "$ENGINE" == "-aot" ]]; then
+        run_test "$file"
+    else
+        ./runelf "$ENGINE" "$file" "$@"
+    fi
+    if [[ $? -ne ${EXPECT_EXIT:-0} ]]; then
+        echo "Execution failed for file: $file"
+        exit 1
+    fi
+}
+
+ALL_ENGINES="-opt4 -opt5 -opt6 -jit -jit-cp -jit2 -aot"
+
+echo "Running RVVM tests"
+run_own_test rvvm-snapshot "$ALL_ENGINES"
+run_own_test rvvm-snapshot "-opt4" -j 2 -inputs /dev/null /dev/null /dev/null /dev/null
+run_own_test rvvm-pool "$ALL_ENGINES"
+run_own_test rvvm-pool "-opt4" -j 1 -inputs /dev/null /dev/null /dev/null /dev/null
+run_own_test rvvm-slice "$ALL_ENGINES"
+run_own_test rvvm-slice "-opt4" -j 1 -slice 100 "$TARGET_DIR/rvvm-slice"
+run_own_test rvvm-smp "-opt4" -harts 2
+run_own_test rvvm-rvc "-opt5"
+run_own_test rvvm-fd "-opt5"
+run_own_test rvvm-zb "-opt4 -opt5"
+run_own_test rvvm-v "-opt5"
+run_own_test rvvm-linux "$ALL_ENGINES"
+run_own_test rvvm-mmap "$ALL_ENGINES"
+run_own_test rvvm-ioqueue "$ALL_ENGINES"
+BLK_ENGINES="-opt4 -opt5 -opt6 -jit -jit-cp -jit2"
+if [[ " $BLK_ENGINES " == *" $ENGINE "* ]]; then
+    # rvvm-blk writes to its disk, a scratch image with the pattern it reads:
+    # 128 sectors, byte j of sector s is (s + j) & 0xff
+    BLK_IMAGE=$(mktemp)
+    trap 'rm -f "$BLK_IMAGE"' EXIT
+    awk 'BEGIN { for (s = 0; s < 128; s++) { for (j = 0; j < 512; j++) printf "\\0%03o", (s + j) % 256; printf "\n" } }' |
+        while read -r sector; do printf '%b' "$sector"; done > "$BLK_IMAGE"
+fi
+run_own_test rvvm-blk "$BLK_ENGINES" -disk "$BLK_IMAGE"
+# accesses past guest RAM stop the guest with ERR_INVALID_MEMORY_ACCESS, from the guard pages of -opt to -opt4
+EXPECT_EXIT=122 run_own_test rvvm-guard-load "-opt -opt2 -opt3 $ALL_ENGINES"
+EXPECT_EXIT=122 run_own_test rvvm-guard-store "-opt -opt2 -opt3 $ALL_ENGINES"
+EXPECT_EXIT=122 run_own_test rvvm-guard-fetch "-opt -opt2 -opt3 $ALL_ENGINES"
+echo "All RVVM tests passed."
+rm -f aot-test aot-test.c
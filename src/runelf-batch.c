@@ -0,0 +1,345 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv-vm-common.h"
+#include "riscv-vm-optimized-1.h"
+#include "riscv-vm.h"
+#include "runelf-lib.h"
+
+// runelf -j: every job runs in a riscv_vm_t of its own on a pool of host
+// threads. The jobs are dealt out to the workers' deques up front in
+// contiguous runs; a worker takes jobs from the back of its own deque and,
+// once that is empty, steals from the front of the others', so a few long
+// programs don't leave the rest of the pool idle.
+//
+// When every job runs the same program on a different input, the first job
+// runs alone until the program makes the SYS_snapshot ecall, and all jobs
+// then start from that state instead of redoing the initialization. A
+// program that exits before it gets there has finished the first job, the
+// others run from the start. Either way the jobs take their contexts from a
+// riscv_vm_pool_t, one per thread, that is reset between jobs.
+//
+// With a timeslice the jobs go to a riscv_vm_sched_t instead, which shares
+// the threads between all of them; up to BATCH_MAX_LIVE are in it at a
+// time, each one that finishes lets the next job in.
+
+// jobs in the scheduler at once, each holds an input fd and a context
+#define BATCH_MAX_LIVE 512
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t front, back; // jobs[front, back) are still queued
+} batch_deque_t;
+
+typedef struct batch batch_t;
+
+// a job while it is in the scheduler
+typedef struct {
+  batch_t *batch;
+  uint32_t job;
+  int input_fd;
+  uint64_t start_ns;
+} batch_slot_t;
+
+struct batch {
+  batch_job_t *jobs;
+  uint32_t njobs;
+  uint32_t nworkers;
+  batch_deque_t *deques;
+  riscv_vm_pool_t *pool; // the jobs' contexts when they all run the same program
+  riscv_vm_sched_t *sched;
+  batch_slot_t *slots;
+  uint32_t next_job; // the next one to give to sched
+};
+
+typedef struct {
+  batch_t *batch;
+  uint32_t id;
+  pthread_t thread;
+} batch_worker_t;
+
+static uint64_t batch_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static int batch_pop(batch_deque_t *d, uint32_t *job) {
+  int res = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->front < d->back) {
+    *job = --d->back;
+    res = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return res;
+}
+
+static int batch_steal(batch_deque_t *d, uint32_t *job) {
+  int res = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->front < d->back) {
+    *job = d->front++;
+    res = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return res;
+}
+
+// a context with the program loaded, NULL when it could not be
+static riscv_vm_t *batch_load(const char *elf) {
+  int fd = open(elf, O_RDONLY);
+  if (fd < 0) {
+    perror(elf);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Elf32_Ehdr)) {
+    fprintf(stderr, "%s: not an ELF file\n", elf);
+    close(fd);
+    return NULL;
+  }
+  void *file_data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file_data == MAP_FAILED) {
+    perror(elf);
+    close(fd);
+    return NULL;
+  }
+  const unsigned char *e_ident = (const unsigned char *)file_data;
+  vm_image_t image;
+  riscv_vm_t *vm = NULL;
+  if (memcmp(e_ident, ELFMAG, SELFMAG) != 0 || e_ident[EI_CLASS] != ELFCLASS32) {
+    fprintf(stderr, "%s: not a 32 bit ELF file\n", elf);
+  } else if (elf32_load_image(file_data, st.st_size, fd, &image) == 0 && (vm = riscv_vm_create(0)) != NULL && riscv_vm_load(vm, &image)) {
+    riscv_vm_destroy(vm);
+    vm = NULL;
+  }
+  // the context's memory maps the pages it needs on its own
+  munmap(file_data, st.st_size);
+  close(fd);
+  return vm;
+}
+
+// the job's input as vm's stdin, returns the fd to close after the run, -1 if there is none or -2 when it can't be opened
+static int batch_open_input(riscv_vm_t *vm, const batch_job_t *job) {
+  if (job->input == NULL) {
+    return -1;
+  }
+  const int fd = open(job->input, O_RDONLY);
+  if (fd < 0) {
+    perror(job->input);
+    return -2;
+  }
+  riscv_vm_set_input(vm, fd);
+  return fd;
+}
+
+// a context for the job, NULL when it could not get one
+static riscv_vm_t *batch_get(batch_t *b, const batch_job_t *job) {
+  return b->pool ? riscv_vm_pool_get(b->pool) : batch_load(job->elf);
+}
+
+// records the results and gives vm back
+static void batch_finish(batch_t *b, riscv_vm_t *vm, batch_job_t *job, int input_fd) {
+  job->instret = riscv_vm_instret(vm);
+  job->cpu_ns = riscv_vm_cpu_ns(vm);
+  if (input_fd >= 0) {
+    riscv_vm_set_input(vm, 0);
+    close(input_fd);
+  }
+  if (b->pool) {
+    riscv_vm_pool_put(b->pool, vm);
+  } else {
+    riscv_vm_destroy(vm);
+  }
+}
+
+static void batch_run_job(batch_t *b, batch_job_t *job) {
+  const uint64_t start = batch_ns();
+  riscv_vm_t *vm = batch_get(b, job);
+  const int input_fd = vm ? batch_open_input(vm, job) : -2;
+  job->exit_code = 1;
+  if (input_fd != -2) {
+    do {
+      job->exit_code = riscv_vm_execute(vm);
+    } while (job->exit_code == RISCV_VM_SNAPSHOT);
+  }
+  if (vm) {
+    batch_finish(b, vm, job, input_fd);
+  }
+  job->run_ns = batch_ns() - start;
+}
+
+static void *batch_worker(void *arg) {
+  batch_worker_t *w = (batch_worker_t *)arg;
+  batch_t *b = w->batch;
+  for (;;) {
+    uint32_t job;
+    int found = batch_pop(&b->deques[w->id], &job);
+    // nothing is ever pushed after the start, so one empty pass over the victims means everything is taken
+    for (uint32_t i = 1; !found && i < b->nworkers; i++) {
+      found = batch_steal(&b->deques[(w->id + i) % b->nworkers], &job);
+    }
+    if (!found) {
+      return NULL;
+    }
+    b->jobs[job].worker = w->id;
+    batch_run_job(b, &b->jobs[job]);
+  }
+}
+
+static void batch_admit(batch_t *b);
+
+static void batch_job_done(riscv_vm_t *vm, int exit_code, uint32_t worker, void *arg) {
+  batch_slot_t *slot = (batch_slot_t *)arg;
+  batch_t *b = slot->batch;
+  batch_job_t *job = &b->jobs[slot->job];
+  job->exit_code = exit_code;
+  job->worker = worker;
+  batch_finish(b, vm, job, slot->input_fd);
+  job->run_ns = batch_ns() - slot->start_ns;
+  batch_admit(b);
+}
+
+// gives the next job that can be started to the scheduler, if there is one left
+static void batch_admit(batch_t *b) {
+  for (;;) {
+    const uint32_t i = __atomic_fetch_add(&b->next_job, 1, __ATOMIC_RELAXED);
+    if (i >= b->njobs) {
+      return;
+    }
+    batch_job_t *job = &b->jobs[i];
+    batch_slot_t *slot = &b->slots[i];
+    slot->batch = b;
+    slot->job = i;
+    slot->start_ns = batch_ns();
+    riscv_vm_t *vm = batch_get(b, job);
+    slot->input_fd = vm ? batch_open_input(vm, job) : -2;
+    if (slot->input_fd != -2) {
+      riscv_vm_sched_add(b->sched, vm, batch_job_done, slot);
+      return;
+    }
+    if (vm) {
+      batch_finish(b, vm, job, -1);
+    }
+    job->exit_code = 1;
+    job->run_ns = batch_ns() - slot->start_ns;
+  }
+}
+
+// runs the first job until the snapshot ecall and sets up a pool of pool_size, returns the number of jobs that are done
+static uint32_t batch_warm_up(batch_t *b, uint32_t pool_size, uint64_t *snapshot_instret) {
+  for (uint32_t i = 1; i < b->njobs; i++) {
+    if (b->jobs[i].input == NULL || strcmp(b->jobs[i].elf, b->jobs[0].elf) != 0) {
+      return 0;
+    }
+  }
+  batch_job_t *job = &b->jobs[0];
+  const uint64_t start = batch_ns();
+  riscv_vm_t *vm = batch_load(job->elf);
+  if (vm == NULL) {
+    return 0;
+  }
+  const int input_fd = batch_open_input(vm, job);
+  job->exit_code = input_fd == -2 ? 1 : riscv_vm_execute(vm);
+  if (input_fd >= 0) {
+    riscv_vm_set_input(vm, 0);
+    close(input_fd);
+  }
+  job->run_ns = batch_ns() - start;
+  uint32_t done = 0;
+  if (job->exit_code == RISCV_VM_SNAPSHOT) {
+    *snapshot_instret = riscv_vm_instret(vm);
+  } else {
+    job->instret = riscv_vm_instret(vm);
+    job->cpu_ns = riscv_vm_cpu_ns(vm);
+    riscv_vm_destroy(vm);
+    done = 1;
+    if ((vm = batch_load(job->elf)) == NULL) {
+      return done;
+    }
+  }
+  b->pool = riscv_vm_pool_create(vm, pool_size);
+  return done;
+}
+
+// the jobs from first on, dealt to the workers' deques
+static void batch_steal_run(batch_t *b, uint32_t first) {
+  batch_worker_t *workers = calloc(b->nworkers, sizeof(batch_worker_t));
+  b->deques = calloc(b->nworkers, sizeof(batch_deque_t));
+  if (workers == NULL || b->deques == NULL) {
+    // one thread then, taking the jobs in order
+    for (uint32_t i = first; i < b->njobs; i++) {
+      batch_run_job(b, &b->jobs[i]);
+    }
+    free(workers);
+    free(b->deques);
+    return;
+  }
+  const uint32_t n = b->njobs - first;
+  for (uint32_t i = 0; i < b->nworkers; i++) {
+    pthread_mutex_init(&b->deques[i].lock, NULL);
+    b->deques[i].front = first + (uint64_t)n * i / b->nworkers;
+    b->deques[i].back = first + (uint64_t)n * (i + 1) / b->nworkers;
+    workers[i].batch = b;
+    workers[i].id = i;
+  }
+  // worker 0 is this thread
+  uint32_t started = 1;
+  for (; started < b->nworkers; started++) {
+    if (pthread_create(&workers[started].thread, NULL, batch_worker, &workers[started])) {
+      break;
+    }
+  }
+  batch_worker(&workers[0]);
+  for (uint32_t i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  for (uint32_t i = 0; i < b->nworkers; i++) {
+    pthread_mutex_destroy(&b->deques[i].lock);
+  }
+  free(b->deques);
+  free(workers);
+}
+
+int run_batch(batch_job_t *jobs, uint32_t njobs, uint32_t nthreads, uint64_t timeslice, uint64_t *snapshot_instret,
+              riscv_vm_pool_stats_t *pool_stats) {
+  if (nthreads == 0) {
+    nthreads = 1;
+  }
+  if (nthreads > njobs) {
+    nthreads = njobs;
+  }
+  batch_t b = {.jobs = jobs, .njobs = njobs, .nworkers = nthreads};
+  *snapshot_instret = 0;
+  // as many contexts as there are jobs running at a time
+  const uint32_t pool_size = timeslice ? BATCH_MAX_LIVE : nthreads;
+  const uint32_t done = njobs > 1 ? batch_warm_up(&b, pool_size, snapshot_instret) : 0;
+  int res = 0;
+  if (timeslice == 0) {
+    batch_steal_run(&b, done);
+  } else if ((b.slots = calloc(njobs, sizeof(batch_slot_t))) == NULL ||
+             (b.sched = riscv_vm_sched_create(nthreads, timeslice)) == NULL) {
+    res = ERR_OUT_OF_MEM;
+  } else {
+    b.next_job = done;
+    for (uint32_t i = 0; i < BATCH_MAX_LIVE; i++) {
+      batch_admit(&b);
+    }
+    riscv_vm_sched_destroy(b.sched);
+  }
+  free(b.slots);
+  memset(pool_stats, 0, sizeof(*pool_stats));
+  if (b.pool) {
+    riscv_vm_pool_stats(b.pool, pool_stats);
+    riscv_vm_pool_destroy(b.pool);
+  }
+  return res;
+}
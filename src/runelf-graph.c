@@ -21,6 +21,8 @@
 #include "runelf-lib.h"
 
 static void *file_data;
+static int file_fd = -1;
+static size_t file_size = 0;
 
 /*
 int app_proc(app_t *app, void *user_data) {
@@ -146,7 +148,7 @@ int app_proc(app_t *app, void *user_data) {
     palette[i] = i | (i << 8) | (i << 16) | 0xff000000;
   }
   app_screenmode(app, APP_SCREENMODE_WINDOW);
-  int exit_code = run_elf32v2(file_data, 0, 4, graph_syscall_handler);
+  int exit_code = run_elf32v2(file_data, file_size, file_fd, 0, 4, 1, graph_syscall_handler);
   // int exit_code = run_elf32v2(file_data, 0, 4, 0);
   return exit_code;
 }
@@ -183,6 +185,8 @@ int main(int argc, char **argv) {
   }
 
   file_data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  file_fd = fd;
+  file_size = st.st_size;
   if (file_data == MAP_FAILED) {
     perror("Error mapping file");
     close(fd);
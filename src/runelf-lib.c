@@ -1,5 +1,6 @@
 
 #include "runelf-lib.h"
+#include "riscv-vm-common.h"
 #include "riscv-vm-optimized-1.h"
 #include "riscv-vm-portable.h"
 #include <stdio.h>
@@ -17,21 +18,11 @@ char *get_machine_name(uint16_t machine) {
   }
 }
 
-int run_elf32v2(void *file_data, int verbose, int use_optimized, syscall_handler_t user_syscall_handler) {
+void elf32_get_image(void *file_data, uint8_t **image, uint32_t *image_len) {
   Elf32_Ehdr *ehdr = (Elf32_Ehdr *)file_data;
   Elf32_Phdr *phdr = (Elf32_Phdr *)((char *)file_data + ehdr->e_phoff);
-  // Elf32_Shdr *shdr = (Elf32_Shdr *)((char *)file_data + ehdr->e_shoff);
-  // char *strtab = (char *)file_data + shdr[ehdr->e_shstrndx].sh_offset;
   uint8_t *text = 0;
   uint32_t text_len = 0;
-  if (verbose) {
-    printf("Architecture: %s\n", get_machine_name(ehdr->e_machine));
-    printf("Number of sections: %d\n", ehdr->e_shnum);
-    printf("Entry: 0x%x\n\n", ehdr->e_entry);
-
-    // Print Program Headers
-    printf("\nProgram Headers (%d):\n", ehdr->e_phnum);
-  }
   for (int i = 0; i < ehdr->e_phnum; i++) {
     if (phdr[i].p_type == PT_LOAD) {
       if (text == 0) {
@@ -46,14 +37,98 @@ int run_elf32v2(void *file_data, int verbose, int use_optimized, syscall_handler
       }
     }
   }
+  *image = text;
+  *image_len = text_len;
+}
+
+int elf32_load_image(void *file_data, size_t file_size, int fd, vm_image_t *image) {
+  Elf32_Ehdr *ehdr = (Elf32_Ehdr *)file_data;
+  // 64 bit sums, the 32 bit fields can't wrap them
+  if (file_size < sizeof(Elf32_Ehdr) || (uint64_t)ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf32_Phdr) > file_size) {
+    fprintf(stderr, "Program headers past the end of the file\n");
+    return -1;
+  }
+  Elf32_Phdr *phdr = (Elf32_Phdr *)((char *)file_data + ehdr->e_phoff);
+  image->fd = fd;
+  image->entry = ehdr->e_entry;
+  image->phdr = 0;
+  image->nsegments = 0;
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdr[i].p_type != PT_LOAD || phdr[i].p_memsz == 0) {
+      continue;
+    }
+    if (image->nsegments == VM_MAX_SEGMENTS) {
+      fprintf(stderr, "Too many PT_LOAD segments (max %d)\n", VM_MAX_SEGMENTS);
+      return -1;
+    }
+    if ((uint64_t)phdr[i].p_offset + phdr[i].p_filesz > file_size) {
+      fprintf(stderr, "PT_LOAD segment %d past the end of the file\n", i);
+      return -1;
+    }
+    vm_segment_t *seg = &image->segments[image->nsegments++];
+    seg->data = (uint8_t *)file_data + phdr[i].p_offset;
+    seg->offset = phdr[i].p_offset;
+    seg->vaddr = phdr[i].p_vaddr;
+    seg->filesz = phdr[i].p_filesz;
+    seg->memsz = phdr[i].p_memsz;
+    if (ehdr->e_phoff >= phdr[i].p_offset && ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf32_Phdr) <= phdr[i].p_offset + phdr[i].p_filesz) {
+      image->phdr = phdr[i].p_vaddr + (ehdr->e_phoff - phdr[i].p_offset);
+    }
+  }
+  image->phnum = image->phdr ? ehdr->e_phnum : 0;
+  return 0;
+}
+
+int run_elf32v2(void *file_data, size_t file_size, int fd, int verbose, int use_optimized, uint32_t nharts, syscall_handler_t user_syscall_handler) {
+  Elf32_Ehdr *ehdr = (Elf32_Ehdr *)file_data;
+  // Elf32_Shdr *shdr = (Elf32_Shdr *)((char *)file_data + ehdr->e_shoff);
+  // char *strtab = (char *)file_data + shdr[ehdr->e_shstrndx].sh_offset;
+  uint8_t *text = 0;
+  uint32_t text_len = 0;
+  if (verbose) {
+    printf("Architecture: %s\n", get_machine_name(ehdr->e_machine));
+    printf("Number of sections: %d\n", ehdr->e_shnum);
+    printf("Entry: 0x%x\n\n", ehdr->e_entry);
+
+    // Print Program Headers
+    printf("\nProgram Headers (%d):\n", ehdr->e_phnum);
+  }
+  vm_image_t image;
+  if (elf32_load_image(file_data, file_size, fd, &image)) {
+    return ERR_OUT_OF_MEM;
+  }
   if (use_optimized == 1) {
-    return riscv_vm_run_optimized_1(NULL, text, text_len);
+    return riscv_vm_run_optimized_1(NULL, &image);
   } else if (use_optimized == 2) {
-    return riscv_vm_run_optimized_2(NULL, text, text_len);
+    return riscv_vm_run_optimized_2(NULL, &image);
   } else if (use_optimized == 3) {
-    return riscv_vm_run_optimized_3(NULL, text, text_len);
+    return riscv_vm_run_optimized_3(NULL, &image);
   } else if (use_optimized == 4) {
-    return riscv_vm_run_optimized_4(NULL, text, text_len, user_syscall_handler);
+    riscv_vm_t *vm = riscv_vm_create(user_syscall_handler);
+    if (vm == NULL) {
+      return ERR_OUT_OF_MEM;
+    }
+    int res = riscv_vm_load(vm, &image);
+    if (res == 0) {
+      // nothing forks from here, a snapshot request only pauses the run
+      do {
+        res = riscv_vm_execute_smp(vm, nharts);
+      } while (res == RISCV_VM_SNAPSHOT);
+    }
+    riscv_vm_destroy(vm);
+    return res;
+  } else if (use_optimized == 5) {
+    return riscv_vm_run_optimized_5(NULL, &image, user_syscall_handler);
+  } else if (use_optimized == 6) {
+    return riscv_vm_run_optimized_6(NULL, &image, user_syscall_handler);
+  } else if (use_optimized == 7) { // -jit
+    return riscv_vm_run_jit(NULL, &image, user_syscall_handler);
+  } else if (use_optimized == 8) { // -jit-cp
+    return riscv_vm_run_jit_cp(NULL, &image, user_syscall_handler);
+  } else if (use_optimized == 9) { // -jit2
+    return riscv_vm_run_jit2(NULL, &image, user_syscall_handler);
   }
+  // the portable VM only runs the flat image
+  elf32_get_image(file_data, &text, &text_len);
   return riscv_vm_run(NULL, text, text_len, 0, 0, 0);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 
 #include <inttypes.h>
-#include "riscv-vm-optimized-1.h"
+#include <stddef.h>
+#include "riscv-vm.h"
 
 /* ELF Definitions */
 #define EI_NIDENT 16
@@ -139,5 +140,30 @@ typedef struct {
   uint64_t sh_entsize;
 } Elf64_Shdr;
 
-int run_elf32v2(void *file_data, int verbose, int use_optimized, syscall_handler_t user_syscall_handler);
+// guest image as the VM sees it: the PT_LOAD segments from the first one's file offset, guest pc 0 is its first byte
+void elf32_get_image(void *file_data, uint8_t **image, uint32_t *image_len);
+// PT_LOAD segments at their p_vaddr, starting at e_entry; fd is the file mapped at file_data, or -1 to copy the segments.
+// Returns -1 if the program headers or a segment's file bytes are not inside the file_size bytes at file_data.
+int elf32_load_image(void *file_data, size_t file_size, int fd, vm_image_t *image);
+// nharts above 1 runs -opt4 with riscv_vm_execute_smp, the other engines only have one hart
+int run_elf32v2(void *file_data, size_t file_size, int fd, int verbose, int use_optimized, uint32_t nharts, syscall_handler_t user_syscall_handler);
 char *get_machine_name(uint16_t machine);
+
+// one program of a runelf -j batch, the results are filled in by run_batch
+typedef struct {
+  const char *elf;
+  const char *input; // file the guest reads as its stdin, NULL for the host's
+  int exit_code;
+  uint64_t instret;
+  uint64_t cpu_ns; // host CPU time of the guest
+  uint64_t run_ns; // wall time from its start to its exit
+  uint32_t worker; // the thread it finished on
+} batch_job_t;
+
+// Runs every job in its own riscv_vm_t on nthreads work-stealing host threads, returns 0 or ERR_OUT_OF_MEM.
+// With a timeslice (in instructions) the jobs share the threads through a riscv_vm_sched_t instead.
+// When the jobs are one program on many inputs they run on a pool of reset contexts, *pool_stats is its
+// counters (all 0 otherwise). If the program made the SYS_snapshot ecall, the jobs all started from there
+// and *snapshot_instret is the instructions it took to get there, 0 otherwise.
+int run_batch(batch_job_t *jobs, uint32_t njobs, uint32_t nthreads, uint64_t timeslice, uint64_t *snapshot_instret,
+              riscv_vm_pool_stats_t *pool_stats);
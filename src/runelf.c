@@ -8,10 +8,13 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "runelf-lib.h"
+#include "riscv-vm-common.h"
 #include "riscv-vm-portable.h"
 
 void print_section_flags(uint64_t flags) {
@@ -205,14 +208,159 @@ void process_elf64(void *file_data) {
   }
 }
 
+static uint64_t run_start_ns = 0;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// peak resident set of the process, ru_maxrss is in bytes on macOS
+static long max_rss_kib(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+// -stats, registered with atexit since some engines exit() when the guest does
+static void print_run_stats(void) {
+  const uint64_t end_ns = monotonic_ns();
+  const uint64_t started_ns = vm_started_ns ? vm_started_ns : end_ns;
+  fflush(stdout);
+  fprintf(stderr, "stats: startup %.3f ms, run %.3f ms, max rss %ld KiB\n", (started_ns - run_start_ns) / 1e6,
+          (end_ns - started_ns) / 1e6, max_rss_kib());
+}
+
+// -j: the batch's programs all run on the -opt4 interpreter, each in a VM context of its own
+static int run_batch_main(int argc, char *argv[], int nthreads, uint64_t timeslice, int nfiles, int inputs_index, int stats) {
+  const int ninputs = inputs_index ? argc - inputs_index : 0;
+  const int njobs = ninputs ? ninputs : nfiles;
+  if (njobs == 0 || (ninputs && nfiles != 1)) {
+    fprintf(stderr, "-j needs ELF files, or one ELF file and -inputs\n");
+    return 1;
+  }
+  batch_job_t *jobs = calloc(njobs, sizeof(batch_job_t));
+  if (jobs == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  int n = 0;
+  const int args_end = inputs_index ? inputs_index - 1 : argc;
+  for (int i = 1; i < args_end; i++) {
+    if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-slice") == 0 || strcmp(argv[i], "-console") == 0 ||
+        strcmp(argv[i], "-disk") == 0) {
+      i++;
+    } else if (argv[i][0] == '-') {
+      if (strcmp(argv[i], "-opt4") != 0 && strcmp(argv[i], "-stats") != 0) {
+        fprintf(stderr, "%s: -j runs every program on -opt4\n", argv[i]);
+        free(jobs);
+        return 1;
+      }
+    } else if (ninputs) {
+      for (int k = 0; k < ninputs; k++) {
+        jobs[k].elf = argv[i];
+        jobs[k].input = argv[inputs_index + k];
+      }
+    } else {
+      jobs[n++].elf = argv[i];
+    }
+  }
+  run_start_ns = monotonic_ns();
+  uint64_t snapshot_instret;
+  riscv_vm_pool_stats_t pool_stats;
+  if (run_batch(jobs, njobs, nthreads, timeslice, &snapshot_instret, &pool_stats)) {
+    fprintf(stderr, "Memory allocation failed\n");
+    free(jobs);
+    return 1;
+  }
+  const uint64_t wall_ns = monotonic_ns() - run_start_ns;
+  fflush(stdout);
+  int failed = 0;
+  uint64_t total_ns = 0;
+  uint64_t cpu_ns = 0;
+  for (int i = 0; i < njobs; i++) {
+    const batch_job_t *j = &jobs[i];
+    printf("%s%s%s: exit %d, instret %" PRIu64 ", cpu %.3f ms, %.3f ms on thread %u\n", j->elf, j->input ? " < " : "",
+           j->input ? j->input : "", j->exit_code, j->instret, j->cpu_ns / 1e6, j->run_ns / 1e6, j->worker);
+    failed += j->exit_code != 0;
+    total_ns += j->run_ns;
+    cpu_ns += j->cpu_ns;
+  }
+  printf("%d jobs on %d threads, %d failed, wall %.3f ms, run %.3f ms, cpu %.3f ms\n", njobs, nthreads < njobs ? nthreads : njobs,
+         failed, wall_ns / 1e6, total_ns / 1e6, cpu_ns / 1e6);
+  if (snapshot_instret) {
+    printf("jobs started from a snapshot after %" PRIu64 " instructions\n", snapshot_instret);
+  }
+  if (stats) {
+    fflush(stdout);
+    fprintf(stderr, "stats: max rss %ld KiB\n", max_rss_kib());
+    if (pool_stats.size) {
+      fprintf(stderr, "stats: pool of %u, %" PRIu64 " gets, %" PRIu64 " reuses, %" PRIu64 " resets, %.3f us per reset\n", pool_stats.size,
+              pool_stats.gets, pool_stats.reuses, pool_stats.resets, pool_stats.resets ? pool_stats.reset_ns / 1e3 / pool_stats.resets : 0.0);
+    }
+  }
+  free(jobs);
+  return failed != 0;
+}
+
 int main(int argc, char *argv[]) {
   int use_optimized = 0;
   int verbose = 0;
+  int stats = 0;
   int file_index = 1;
-  if (argc < 2 || argc > 4) {
-    fprintf(stderr, "Usage: [-opt] [-verbose] %s <elf-file>\n", argv[0]);
+  int nthreads = 0;
+  uint64_t timeslice = 0;
+  int nfiles = 0;
+  int inputs_index = 0;
+  int nharts = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-harts") == 0 && i + 1 < argc) {
+      nharts = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-slice") == 0 && i + 1 < argc) {
+      timeslice = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-console") == 0 && i + 1 < argc) {
+      vm_console_config_t console;
+      if (vm_console_parse_config(argv[++i], &console) != 0) {
+        fprintf(stderr, "-console: line, size:<bytes> or time:<ms>, not %s\n", argv[i]);
+        return 1;
+      }
+      vm_console_set_default_config(&console);
+    } else if (strcmp(argv[i], "-disk") == 0 && i + 1 < argc) {
+      if (vm_blk_set_default_image(argv[++i]) != 0) {
+        fprintf(stderr, "-disk: can't open or map the image %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-inputs") == 0) {
+      inputs_index = i + 1;
+      break;
+    } else if (strcmp(argv[i], "-stats") == 0) {
+      stats = 1;
+    } else if (strcmp(argv[i], "-jit-cp-check") == 0) {
+      return riscv_vm_jit_cp_check() != 0;
+    } else if (argv[i][0] != '-') {
+      nfiles++;
+    }
+  }
+  if (argc < 2 || (nthreads <= 0 && argc > 11)) {
+    fprintf(stderr,
+            "Usage: [-opt|-opt2|-opt3|-opt4|-opt5|-opt6|-jit|-jit-cp|-jit2] [-verbose] [-stats] [-harts <n>]\n"
+            "       [-console line|size:<bytes>|time:<ms>] [-disk <image>] %s <elf-file>\n"
+            "       [-stats] [-slice <instructions>] [-console ...] [-disk <image>] %s -j <threads>\n"
+            "       <elf-file>... | <elf-file> -inputs <input-file>...\n"
+            "       %s -jit-cp-check\n",
+            argv[0], argv[0], argv[0]);
     return 1;
   }
+  if (nthreads > 0) {
+    return run_batch_main(argc, argv, nthreads, timeslice, nfiles, inputs_index, stats);
+  }
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-opt") == 0) {
       use_optimized = 1;
@@ -222,12 +370,36 @@ int main(int argc, char *argv[]) {
       use_optimized = 3;
     } else if (strcmp(argv[i], "-opt4") == 0) {
       use_optimized = 4;
+    } else if (strcmp(argv[i], "-opt5") == 0) {
+      use_optimized = 5;
+    } else if (strcmp(argv[i], "-opt6") == 0) {
+      use_optimized = 6;
+    } else if (strcmp(argv[i], "-jit") == 0) {
+      use_optimized = 7;
+    } else if (strcmp(argv[i], "-jit-cp") == 0) {
+      use_optimized = 8;
+    } else if (strcmp(argv[i], "-jit2") == 0) {
+      use_optimized = 9;
     } else if (strcmp(argv[i], "-verbose") == 0) {
       verbose = 1;
+    } else if (strcmp(argv[i], "-stats") == 0) {
+      stats = 1;
+    } else if (strcmp(argv[i], "-harts") == 0 || strcmp(argv[i], "-slice") == 0 || strcmp(argv[i], "-console") == 0 ||
+               strcmp(argv[i], "-disk") == 0) {
+      i++;
     } else {
       file_index = i;
     }
   }
+  if (nharts != 1 && use_optimized != 4) {
+    fprintf(stderr, "-harts: only -opt4 runs more than one hart\n");
+    return 1;
+  }
+  // the library runs the JIT instead, which would pass for this one
+  if (use_optimized == 8 && riscv_vm_jit_cp_check() != 0) {
+    fprintf(stderr, "-jit-cp: some stencils do not parse\n");
+    return 1;
+  }
   printf("Loading file %s\n", argv[file_index]);
   int fd = open(argv[file_index], O_RDONLY);
   if (fd < 0) {
@@ -262,10 +434,14 @@ int main(int argc, char *argv[]) {
   }
 
   int exit_code = 0;
+  if (stats) {
+    run_start_ns = monotonic_ns();
+    atexit(print_run_stats);
+  }
   if (e_ident[EI_CLASS] == ELFCLASS32) {
     // process_elf32(file_data);
     // run_elf32(file_data);
-    exit_code = run_elf32v2(file_data, verbose, use_optimized, 0);
+    exit_code = run_elf32v2(file_data, st.st_size, fd, verbose, use_optimized, nharts, 0);
   } else if (e_ident[EI_CLASS] == ELFCLASS64) {
     // process_elf64(file_data);
     fprintf(stderr, "Can't run 64 bit programs\n");
@@ -0,0 +1,349 @@
+// Ahead-of-time translator: RV32IM ELF in, C source out. The output has one
+// function per guest basic block and links against riscv-vm-aot-runtime.c:
+//
+//   ./rv2c ../benchmarks/towers.riscv towers-aot.c
+//   gcc -O2 -I. -o towers-aot towers-aot.c riscv-vm-aot-runtime.c riscv-vm-decode.c riscv-vm-syscall-handler.c riscv-vm-common.c riscv-vm-console.c riscv-vm-ioqueue.c riscv-vm-blk.c
+//
+// Code is translated at the guest addresses of its segments. Block leaders
+// are the entry point, static branch and jal targets and every
+// instruction after a control transfer (return addresses). jalr targets are
+// looked up at run time in a table of all blocks, pcs without a block are
+// interpreted by the runtime.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "riscv-vm-decode.h"
+#include "runelf-lib.h"
+
+typedef struct {
+  const vm_image_t *elf;
+  uint8_t *image; // guest memory up to the end of the last segment
+  uint32_t words;
+  uint8_t *is_code;   // per word, inside an executable segment
+  uint8_t *is_leader; // per word, a block starts here
+  rv_insn_t *insns;
+} rv2c_t;
+
+// executed by the runtime's interpreter, never part of a block
+static int interp_only(uint8_t op) { return op == RV_OP_INVALID || op == RV_OP_EBREAK || op == RV_OP_WFI; }
+
+static int has_block(const rv2c_t *t, uint32_t pc) {
+  return !(pc & 3) && (pc >> 2) < t->words && t->is_leader[pc >> 2] && !interp_only(t->insns[pc >> 2].op);
+}
+
+static void mark_leader(rv2c_t *t, uint32_t pc) {
+  if (!(pc & 3) && (pc >> 2) < t->words && t->is_code[pc >> 2]) {
+    t->is_leader[pc >> 2] = 1;
+  }
+}
+
+static void find_leaders(rv2c_t *t) {
+  mark_leader(t, t->elf->entry & 0x7FFFFFFF);
+  for (uint32_t w = 0; w < t->words; w++) {
+    if (!t->is_code[w]) {
+      continue;
+    }
+    const rv_insn_t *in = &t->insns[w];
+    const uint32_t pc = w << 2;
+    if (in->op >= RV_OP_BEQ && in->op <= RV_OP_JAL) {
+      mark_leader(t, pc + in->imm);
+    }
+    if (rv_op_ends_block(in->op)) {
+      mark_leader(t, pc + 4);
+    }
+  }
+}
+
+// direct successor of a block
+static void emit_goto(FILE *out, const rv2c_t *t, uint32_t target) {
+  if (has_block(t, target)) {
+    fprintf(out, "AOT_GOTO(b_%x, 0x%x);", target, target);
+  } else {
+    fprintf(out, "return 0x%x;", target);
+  }
+}
+
+static void emit_block(FILE *out, const rv2c_t *t, uint32_t start) {
+  uint32_t n = 0;
+  for (uint32_t w = start >> 2; w < t->words && t->is_code[w]; w++) {
+    if (interp_only(t->insns[w].op) || (n > 0 && t->is_leader[w])) {
+      break;
+    }
+    n++;
+    if (rv_op_ends_block(t->insns[w].op)) {
+      break;
+    }
+  }
+  fprintf(out, "static uint32_t b_%x(aot_state_t *s) {\n", start);
+  fprintf(out, "  uint32_t *r = s->regs;\n  uint8_t *m = s->wmem;\n  (void)r;\n  (void)m;\n");
+  fprintf(out, "  s->instret += %u;\n", n);
+  static const char *const alu_imm[RV_OP_COUNT] = {[RV_OP_ADDI] = "+", [RV_OP_XORI] = "^", [RV_OP_ORI] = "|", [RV_OP_ANDI] = "&",
+                                                   [RV_OP_SLLI] = "<<", [RV_OP_SRLI] = ">>"};
+  static const char *const alu_reg[RV_OP_COUNT] = {[RV_OP_ADD] = "+", [RV_OP_SUB] = "-", [RV_OP_XOR] = "^",
+                                                   [RV_OP_OR] = "|",  [RV_OP_AND] = "&", [RV_OP_MUL] = "*"};
+  static const char *const branch_cond[RV_OP_COUNT] = {
+      [RV_OP_BEQ] = "r[%d] == r[%d]",                   [RV_OP_BNE] = "r[%d] != r[%d]", [RV_OP_BLT] = "(int32_t)r[%d] < (int32_t)r[%d]",
+      [RV_OP_BGE] = "(int32_t)r[%d] >= (int32_t)r[%d]", [RV_OP_BLTU] = "r[%d] < r[%d]", [RV_OP_BGEU] = "r[%d] >= r[%d]"};
+  for (uint32_t i = 0; i < n; i++) {
+    const uint32_t pc = start + (i << 2);
+    const rv_insn_t *in = &t->insns[pc >> 2];
+    const uint32_t uncount = n - 1 - i;
+    const uint32_t imm = in->imm;
+    fprintf(out, "  ");
+    switch (in->op) {
+    case RV_OP_NOP:
+      fprintf(out, "// nop");
+      break;
+    case RV_OP_LB:
+    case RV_OP_LH:
+    case RV_OP_LW:
+    case RV_OP_LBU:
+    case RV_OP_LHU:
+      fprintf(out, "r[%d] = aot_%s(s, m, r[%d] + 0x%xu, 0x%x, %u);", in->rd, rv_op_names[in->op], in->rs1, imm, pc, uncount);
+      break;
+    case RV_OP_SB:
+    case RV_OP_SH:
+    case RV_OP_SW:
+      fprintf(out, "aot_%s(s, m, r[%d] + 0x%xu, r[%d], 0x%x, %u);", rv_op_names[in->op], in->rs1, imm, in->rs2, pc, uncount);
+      break;
+    case RV_OP_ADDI:
+    case RV_OP_XORI:
+    case RV_OP_ORI:
+    case RV_OP_ANDI:
+    case RV_OP_SLLI:
+    case RV_OP_SRLI:
+      fprintf(out, "r[%d] = r[%d] %s 0x%xu;", in->rd, in->rs1, alu_imm[in->op], imm);
+      break;
+    case RV_OP_SRAI:
+      fprintf(out, "r[%d] = (int32_t)r[%d] >> %u;", in->rd, in->rs1, imm);
+      break;
+    case RV_OP_SLTI:
+      fprintf(out, "r[%d] = (int32_t)r[%d] < %d;", in->rd, in->rs1, (int32_t)imm);
+      break;
+    case RV_OP_SLTIU:
+      fprintf(out, "r[%d] = r[%d] < 0x%xu;", in->rd, in->rs1, imm);
+      break;
+    case RV_OP_LUI:
+      fprintf(out, "r[%d] = 0x%xu;", in->rd, imm);
+      break;
+    case RV_OP_AUIPC:
+      fprintf(out, "r[%d] = 0x%xu;", in->rd, pc + imm);
+      break;
+    case RV_OP_ADD:
+    case RV_OP_SUB:
+    case RV_OP_XOR:
+    case RV_OP_OR:
+    case RV_OP_AND:
+    case RV_OP_MUL:
+      fprintf(out, "r[%d] = r[%d] %s r[%d];", in->rd, in->rs1, alu_reg[in->op], in->rs2);
+      break;
+    case RV_OP_SLL:
+      fprintf(out, "r[%d] = r[%d] << (r[%d] & 0x1F);", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_SRL:
+      fprintf(out, "r[%d] = r[%d] >> (r[%d] & 0x1F);", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_SRA:
+      fprintf(out, "r[%d] = (int32_t)r[%d] >> (r[%d] & 0x1F);", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_SLT:
+      fprintf(out, "r[%d] = (int32_t)r[%d] < (int32_t)r[%d];", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_SLTU:
+      fprintf(out, "r[%d] = r[%d] < r[%d];", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_MULH:
+      fprintf(out, "r[%d] = ((int64_t)(int32_t)r[%d] * (int64_t)(int32_t)r[%d]) >> 32;", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_MULHSU:
+      fprintf(out, "r[%d] = ((uint64_t)((int64_t)(int32_t)r[%d] * (uint64_t)r[%d])) >> 32;", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_MULHU:
+      fprintf(out, "r[%d] = ((uint64_t)r[%d] * (uint64_t)r[%d]) >> 32;", in->rd, in->rs1, in->rs2);
+      break;
+    case RV_OP_DIV:
+    case RV_OP_DIVU:
+    case RV_OP_REM:
+    case RV_OP_REMU:
+      fprintf(out, "r[%d] = aot_%s(r[%d], r[%d]);", in->rd, rv_op_names[in->op], in->rs1, in->rs2);
+      break;
+    case RV_OP_BEQ:
+    case RV_OP_BNE:
+    case RV_OP_BLT:
+    case RV_OP_BGE:
+    case RV_OP_BLTU:
+    case RV_OP_BGEU:
+      fprintf(out, "if (");
+      fprintf(out, branch_cond[in->op], in->rs1, in->rs2);
+      fprintf(out, ") {\n    ");
+      emit_goto(out, t, pc + imm);
+      fprintf(out, "\n  }");
+      break;
+    case RV_OP_JAL:
+      if (in->rd) {
+        fprintf(out, "r[%d] = 0x%xu;\n  ", in->rd, pc + 4);
+      }
+      emit_goto(out, t, pc + imm);
+      break;
+    case RV_OP_JALR:
+      fprintf(out, "{\n    const uint32_t target = (r[%d] + 0x%xu) & 0xFFFFFFFE;\n", in->rs1, imm);
+      if (in->rd) {
+        fprintf(out, "    r[%d] = 0x%xu;\n", in->rd, pc + 4);
+      }
+      fprintf(out, "    return target;\n  }");
+      break;
+    case RV_OP_ECALL:
+      fprintf(out, "aot_ecall(s, 0x%x, %u);", pc, uncount);
+      break;
+    case RV_OP_CSRRS:
+      fprintf(out, "r[%d] = aot_csrrs(s, 0x%x, r[%d]);", in->rd, imm, in->rd);
+      break;
+    default:
+      break;
+    }
+    fprintf(out, "\n");
+  }
+  const rv_insn_t *last = &t->insns[(start >> 2) + n - 1];
+  if (last->op != RV_OP_JAL && last->op != RV_OP_JALR) {
+    fprintf(out, "  ");
+    emit_goto(out, t, start + (n << 2));
+    fprintf(out, "\n");
+  }
+  fprintf(out, "}\n\n");
+}
+
+static int translate(rv2c_t *t, FILE *out) {
+  int nblocks = 0;
+  fprintf(out, "// generated by rv2c, do not edit\n\n#include \"riscv-vm-aot.h\"\n\n");
+  // a guest loop that jumps to itself is a tail call to itself
+  fprintf(out, "#pragma GCC diagnostic ignored \"-Winfinite-recursion\"\n\n");
+  for (uint32_t w = 0; w < t->words; w++) {
+    if (has_block(t, w << 2)) {
+      fprintf(out, "static uint32_t b_%x(aot_state_t *s);\n", w << 2);
+      nblocks++;
+    }
+  }
+  fprintf(out, "\n");
+  for (uint32_t w = 0; w < t->words; w++) {
+    if (has_block(t, w << 2)) {
+      emit_block(out, t, w << 2);
+    }
+  }
+  fprintf(out, "static const aot_block_t aot_blocks[%u] = {\n", t->words);
+  for (uint32_t w = 0; w < t->words; w++) {
+    if (has_block(t, w << 2)) {
+      fprintf(out, "    [0x%x] = b_%x,\n", w, w << 2);
+    }
+  }
+  fprintf(out, "};\n\n");
+  // the segments as the image was loaded, so the runtime sets the program up like the interpreters do
+  const vm_image_t *elf = t->elf;
+  for (uint32_t i = 0; i < elf->nsegments; i++) {
+    const vm_segment_t *seg = &elf->segments[i];
+    if (seg->filesz == 0) {
+      continue;
+    }
+    fprintf(out, "static const uint8_t aot_segment_%u[%u] = {", i, seg->filesz);
+    for (uint32_t j = 0; j < seg->filesz; j++) {
+      fprintf(out, "%s0x%02x,", (j % 16) ? " " : "\n    ", seg->data[j]);
+    }
+    fprintf(out, "\n};\n");
+  }
+  fprintf(out, "\nstatic const vm_image_t aot_image = {\n    .fd = -1,\n    .entry = 0x%x,\n    .phdr = 0x%x,\n    .phnum = %u,\n",
+          elf->entry, elf->phdr, elf->phnum);
+  fprintf(out, "    .nsegments = %u,\n    .segments = {\n", elf->nsegments);
+  for (uint32_t i = 0; i < elf->nsegments; i++) {
+    const vm_segment_t *seg = &elf->segments[i];
+    if (seg->filesz) {
+      fprintf(out, "        {aot_segment_%u, 0, 0x%x, %u, %u},\n", i, seg->vaddr, seg->filesz, seg->memsz);
+    } else {
+      fprintf(out, "        {NULL, 0, 0x%x, 0, %u},\n", seg->vaddr, seg->memsz);
+    }
+  }
+  fprintf(out, "    }};\n\nint main(void) { return aot_main(&aot_image, aot_blocks, %u); }\n", t->words);
+  return nblocks;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <elf-file> <output.c>\n", argv[0]);
+    return 1;
+  }
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror("Error opening file");
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("Error getting file size");
+    close(fd);
+    return 1;
+  }
+  void *file_data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file_data == MAP_FAILED) {
+    perror("Error mapping file");
+    return 1;
+  }
+  unsigned char *e_ident = (unsigned char *)file_data;
+  if (memcmp(e_ident, ELFMAG, SELFMAG) != 0 || e_ident[EI_CLASS] != ELFCLASS32) {
+    fprintf(stderr, "Not a 32 bit ELF file\n");
+    return 1;
+  }
+
+  vm_image_t elf;
+  if (elf32_load_image(file_data, st.st_size, -1, &elf)) {
+    return 1;
+  }
+  const uint32_t image_len = vm_image_end(&elf);
+  rv2c_t t = {0};
+  t.elf = &elf;
+  t.words = (image_len + 3) / 4;
+  t.image = calloc(t.words, 4);
+  t.is_code = calloc(t.words, 1);
+  t.is_leader = calloc(t.words, 1);
+  t.insns = calloc(t.words, sizeof(rv_insn_t));
+  if (t.image == NULL || t.is_code == NULL || t.is_leader == NULL || t.insns == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < elf.nsegments; i++) {
+    memcpy(t.image + (elf.segments[i].vaddr & 0x7FFFFFFF), elf.segments[i].data, elf.segments[i].filesz);
+  }
+
+  // only executable segments are translated
+  Elf32_Ehdr *ehdr = (Elf32_Ehdr *)file_data;
+  Elf32_Phdr *phdr = (Elf32_Phdr *)((char *)file_data + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdr[i].p_type == PT_LOAD && (phdr[i].p_flags & PF_X)) {
+      const uint32_t from = (phdr[i].p_vaddr & 0x7FFFFFFF) / 4;
+      const uint32_t to = ((phdr[i].p_vaddr & 0x7FFFFFFF) + phdr[i].p_filesz) / 4;
+      for (uint32_t w = from; w < to && w < t.words; w++) {
+        t.is_code[w] = 1;
+      }
+    }
+  }
+  for (uint32_t w = 0; w < t.words; w++) {
+    rv_decode(*(uint32_t *)(t.image + w * 4), &t.insns[w]);
+  }
+  find_leaders(&t);
+
+  FILE *out = fopen(argv[2], "w");
+  if (out == NULL) {
+    perror("Error creating output file");
+    return 1;
+  }
+  const int nblocks = translate(&t, out);
+  fclose(out);
+  printf("%s: %d blocks, %u bytes of guest image -> %s\n", argv[1], nblocks, image_len, argv[2]);
+  munmap(file_data, st.st_size);
+  return 0;
+}